@@ -0,0 +1,404 @@
+#include "func.h"
+#include <ctype.h>
+#include <stdatomic.h>
+#include <strings.h>
+
+// Batch mode: runs commands given on the command line, or a whole script of
+// them from a file or stdin, against one load of the service table. Every
+// command reports an exit status (0 = success, 1 = negative result such as
+// a missing service or a failed action, 2 = usage error); a script goes on
+// past failures and reports the status of each command on stderr.
+
+#define BATCH_MAX_ARGS 64
+#define BATCH_MAX_LINE 4096
+
+enum { BATCH_OK = 0, BATCH_FAILED = 1, BATCH_USAGE = 2 };
+
+typedef struct BatchCommand {
+    const char* name;
+    int min_args;
+    int max_args;           // -1 = no limit
+    int needs_services;     // Load the service table before running
+    int lock_free;          // Runs without the write lock: reads only the published
+                            // snapshot, or locks for itself
+    const char* usage;
+    int (*run)(int argc, char** argv);
+} BatchCommand;
+
+static atomic_int services_loaded = 0;   // Set by whichever daemon worker loads first
+static atomic_int stale_ok = 0;          // --stale-ok: answer from saved state while it reconciles
+
+// Bring the service table up to date with the system. Returns 0, 1 if
+// some sources could not be listed (their units keep their last known
+// state), or -1 if none could.
+int batch_refresh_services() {
+    ServiceChangeSet changes = {0};
+    int result = refresh_services_from_system(&changes);
+    int partial = changes.failed_sources != 0;
+
+    report_failed_sources(stderr, changes.failed_sources);
+    free_change_set(&changes);
+    if (result < 0) {
+        fprintf(stderr, "Failed to load services.\n");
+        return -1;
+    }
+    services_loaded = 1;
+    return partial;
+}
+
+// Load the service table from the state file, so commands are answered
+// from it while it is stale. If reconcile is set it is brought up to date
+// in the background; otherwise the caller refreshes it. Returns 0, or -1
+// if there is no usable state file.
+int batch_load_saved_services(int reconcile) {
+    if (state_file_load(state_file_path()) < 0) return -1;
+    if (reconcile && state_file_reconcile_start() < 0) return -1;
+    services_loaded = 1;
+    return 0;
+}
+
+// Load and index the services once for the whole batch. One-shot commands
+// act on what they report, so they refresh from the system; saved state is
+// used only when --stale-ok asks for it.
+static int ensure_services_loaded() {
+    if (services_loaded) return 0;
+    if (stale_ok && batch_load_saved_services(1) == 0) return 0;
+    return batch_refresh_services() < 0 ? -1 : 0;
+}
+
+// Note on stderr that results come from saved state not yet reconciled
+static void warn_if_stale() {
+    time_t since = state_file_stale_since();
+    if (since == 0) return;
+
+    char when[32];
+    fprintf(stderr, "Note: showing state saved at %s; reconciling with the system in the background.\n",
+            format_timestamp(since, when, sizeof(when)));
+}
+
+static int run_refresh(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    return batch_refresh_services() == 0 ? BATCH_OK : BATCH_FAILED;
+}
+
+static int run_list(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    display_all_services();
+    return BATCH_OK;
+}
+
+static int run_search(int argc, char** argv) {
+    (void)argc;
+    return search_service_by_name(argv[1]) ? BATCH_OK : BATCH_FAILED;
+}
+
+// Exit status follows grep: 1 when nothing matched
+static int run_filter(int argc, char** argv) {
+    int source = -1;
+    if (argc > 2 && (source = source_find(argv[2])) < 0) {
+        fprintf(stderr, "Unknown source '%s'\n", argv[2]);
+        return BATCH_USAGE;
+    }
+    if (strcasecmp(argv[1], "flapping") == 0) {
+        return display_flapping_services(source) > 0 ? BATCH_OK : BATCH_FAILED;
+    }
+    for (int status = 0; status < STATUS_COUNT; status++) {
+        if (strcasecmp(argv[1], status_to_string((ServiceStatus)status)) == 0) {
+            return filter_services((ServiceStatus)status, source) > 0 ? BATCH_OK : BATCH_FAILED;
+        }
+    }
+    fprintf(stderr, "Unknown status '%s'\n", argv[1]);
+    return BATCH_USAGE;
+}
+
+static int run_query(int argc, char** argv) {
+    char text[BATCH_MAX_LINE];
+    size_t used = 0;
+
+    text[0] = '\0';
+    for (int i = 1; i < argc && used < sizeof(text); i++) {
+        used += snprintf(text + used, sizeof(text) - used, "%s%s", i > 1 ? " " : "", argv[i]);
+    }
+
+    int count = query_services(text);
+    return count < 0 ? BATCH_USAGE : count > 0 ? BATCH_OK : BATCH_FAILED;
+}
+
+static int run_control(int argc, char** argv, ControlAction action) {
+    return control_services((const char* const*)argv + 1, argc - 1, action) > 0 ? BATCH_FAILED : BATCH_OK;
+}
+
+static int run_start(int argc, char** argv) { return run_control(argc, argv, CONTROL_START); }
+static int run_stop(int argc, char** argv) { return run_control(argc, argv, CONTROL_STOP); }
+static int run_restart(int argc, char** argv) { return run_control(argc, argv, CONTROL_RESTART); }
+
+// Succeeds when no unit has failed, so it can serve as a health check
+static int run_detect(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    return detect_failed_services() == 0 ? BATCH_OK : BATCH_FAILED;
+}
+
+static int run_process_failed(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    return process_failed_services() == 0 ? BATCH_OK : BATCH_FAILED;
+}
+
+static int run_logs(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    display_logs();
+    return BATCH_OK;
+}
+
+static int run_history(int argc, char** argv) {
+    display_journal_history(argv[1], argc > 2 ? atoi(argv[2]) : 24);
+    return BATCH_OK;
+}
+
+static int run_processes(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    list_all_processes();
+    return BATCH_OK;
+}
+
+static int run_top(int argc, char** argv) {
+    ProcessSortKey key;
+    if (strcmp(argv[1], "cpu") == 0) {
+        key = PROCESS_SORT_CPU;
+    } else if (strcmp(argv[1], "memory") == 0) {
+        key = PROCESS_SORT_RSS;
+    } else {
+        fprintf(stderr, "Sort key must be 'cpu' or 'memory'\n");
+        return BATCH_USAGE;
+    }
+    list_top_processes(key, argc > 2 ? atoi(argv[2]) : 10);
+    return BATCH_OK;
+}
+
+// The waves a restart of the named units would run in
+static int run_deps(int argc, char** argv) {
+    depgraph_display_plan((const char* const*)argv + 1, argc - 1);
+    return BATCH_OK;
+}
+
+// Prometheus text, whatever the output format
+static int run_metrics(int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    return metrics_write_prometheus(stdout) == 0 ? BATCH_OK : BATCH_FAILED;
+}
+
+static const BatchCommand batch_commands[] = {
+    { "refresh", 0, 0, 0, 1, "refresh", run_refresh },
+    { "list", 0, 0, 1, 1, "list", run_list },
+    { "search", 1, 1, 1, 1, "search NAME", run_search },
+    { "filter", 1, 2, 1, 1, "filter STATUS|flapping [SOURCE]", run_filter },
+    { "query", 1, -1, 1, 0, "query TERM...", run_query },
+    { "start", 1, -1, 1, 0, "start NAME...", run_start },
+    { "stop", 1, -1, 1, 0, "stop NAME...", run_stop },
+    { "restart", 1, -1, 1, 0, "restart NAME...", run_restart },
+    { "detect", 0, 0, 1, 0, "detect", run_detect },
+    { "process-failed", 0, 0, 1, 0, "process-failed", run_process_failed },
+    { "deps", 1, -1, 0, 1, "deps NAME...", run_deps },
+    { "logs", 0, 0, 0, 0, "logs", run_logs },
+    { "history", 1, 2, 0, 0, "history NAME [HOURS]", run_history },
+    { "processes", 0, 0, 0, 0, "processes", run_processes },
+    { "top", 1, 2, 0, 0, "top cpu|memory [COUNT]", run_top },
+    { "metrics", 0, 0, 0, 0, "metrics", run_metrics },
+};
+
+#define BATCH_COMMAND_COUNT (int)(sizeof(batch_commands) / sizeof(batch_commands[0]))
+
+void batch_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--format table|json|csv] [--offset N] [--limit N] [--stale-ok] COMMAND [ARGS...]\n",
+            program);
+    fprintf(stderr, "       %s [options] script [FILE]   (commands one per line; FILE or - for stdin)\n", program);
+    fprintf(stderr, "       %s daemon [--socket PATH]    (serve commands over a Unix socket)\n", program);
+    fprintf(stderr, "       %s [options] client [--socket PATH] COMMAND [ARGS...] | script [FILE]\n", program);
+    fprintf(stderr, "Commands:\n");
+    for (int i = 0; i < BATCH_COMMAND_COUNT; i++) {
+        fprintf(stderr, "  %s\n", batch_commands[i].usage);
+    }
+}
+
+// Run one command. Returns its exit status.
+int batch_run_command(int argc, char** argv) {
+    if (argc == 0) return BATCH_USAGE;
+
+    for (int i = 0; i < BATCH_COMMAND_COUNT; i++) {
+        const BatchCommand* command = &batch_commands[i];
+        if (strcmp(argv[0], command->name) != 0) continue;
+
+        int args = argc - 1;
+        if (args < command->min_args || (command->max_args >= 0 && args > command->max_args)) {
+            fprintf(stderr, "Usage: %s\n", command->usage);
+            return BATCH_USAGE;
+        }
+        if (command->needs_services) {
+            if (ensure_services_loaded() < 0) return BATCH_FAILED;
+            warn_if_stale();
+        }
+
+        if (!command->lock_free) service_lock();
+        int status = command->run(argc, argv);
+        if (!command->lock_free) service_unlock();
+        fflush(stdout);
+        return status;
+    }
+
+    fprintf(stderr, "Unknown command '%s'\n", argv[0]);
+    return BATCH_USAGE;
+}
+
+// Split a script line into words in place. Words may be quoted with ' or ";
+// a # outside quotes starts a comment. Returns the word count.
+int batch_split_words(char* line, char** words, int max) {
+    int count = 0;
+    char* read = line;
+
+    while (*read) {
+        while (isspace((unsigned char)*read)) read++;
+        if (*read == '\0' || *read == '#') break;
+        if (count == max) return -1;
+
+        char* write = read;
+        words[count++] = write;
+        char quote = 0;
+        while (*read && (quote || !isspace((unsigned char)*read))) {
+            if (quote && *read == quote) {
+                quote = 0;
+            } else if (!quote && (*read == '"' || *read == '\'')) {
+                quote = *read;
+            } else {
+                *write++ = *read;
+            }
+            read++;
+        }
+        if (*read) read++;
+        *write = '\0';
+    }
+    return count;
+}
+
+// Run every command in script, reporting each status on stderr. Returns 0
+// if all of them succeeded, else 1.
+int batch_run_script(FILE* script) {
+    char line[BATCH_MAX_LINE];
+    char* words[BATCH_MAX_ARGS];
+    int line_number = 0, commands = 0, failed = 0;
+
+    while (fgets(line, sizeof(line), script)) {
+        line_number++;
+        line[strcspn(line, "\n")] = '\0';
+
+        int count = batch_split_words(line, words, BATCH_MAX_ARGS);
+        if (count == 0) continue;
+
+        int status = count < 0 ? BATCH_USAGE : batch_run_command(count, words);
+        if (count < 0) fprintf(stderr, "Too many arguments\n");
+
+        commands++;
+        if (status != BATCH_OK) failed++;
+        fprintf(stderr, "[%d] %s: exit %d\n", line_number, count > 0 ? words[0] : "?", status);
+    }
+
+    fprintf(stderr, "%d commands, %d succeeded, %d failed\n", commands, commands - failed, failed);
+    return failed ? BATCH_FAILED : BATCH_OK;
+}
+
+// Apply leading --format/--offset/--limit options to output_options, and
+// --stale-ok, which lets commands answer from the state file until it has
+// been reconciled. *index is advanced past them. Returns 0, or -1 on a bad
+// option.
+int batch_parse_options(int argc, char** argv, int* index) {
+    int i = *index;
+
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--stale-ok") == 0) {
+            stale_ok = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Option %s needs a value\n", argv[i]);
+            return -1;
+        }
+        if (strcmp(argv[i], "--format") == 0) {
+            if (output_format_from_string(argv[++i], &output_options.format) < 0) {
+                fprintf(stderr, "Unknown output format '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--offset") == 0) {
+            output_options.offset = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--limit") == 0) {
+            output_options.limit = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    *index = i;
+    return 0;
+}
+
+// Socket path after an optional --socket PATH at argv[*index]
+static const char* socket_option(int argc, char** argv, int* index) {
+    if (*index + 1 < argc && strcmp(argv[*index], "--socket") == 0) {
+        *index += 2;
+        return argv[*index - 1];
+    }
+    return daemon_socket_path();
+}
+
+// Entry point for non-interactive use: options, then a command, a script,
+// the daemon or a client of it
+int batch_main(int argc, char** argv) {
+    int i = 1;
+
+    if (batch_parse_options(argc, argv, &i) < 0) {
+        batch_usage(argv[0]);
+        return BATCH_USAGE;
+    }
+
+    if (i >= argc || strcmp(argv[i], "help") == 0) {
+        batch_usage(argv[0]);
+        return i >= argc ? BATCH_USAGE : BATCH_OK;
+    }
+
+    if (strcmp(argv[i], "daemon") == 0) {
+        i++;
+        const char* path = socket_option(argc, argv, &i);
+        return daemon_main(path) == 0 ? BATCH_OK : BATCH_FAILED;
+    }
+    if (strcmp(argv[i], "client") == 0) {
+        i++;
+        const char* path = socket_option(argc, argv, &i);
+        if (i >= argc) {
+            batch_usage(argv[0]);
+            return BATCH_USAGE;
+        }
+        return client_main(path, argc - i, argv + i);
+    }
+
+    int status;
+    if (strcmp(argv[i], "script") == 0) {
+        const char* path = i + 1 < argc ? argv[i + 1] : "-";
+        FILE* script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+        if (script == NULL) {
+            perror("Failed to open script");
+            return BATCH_USAGE;
+        }
+        status = batch_run_script(script);
+        if (script != stdin) fclose(script);
+    } else {
+        status = batch_run_command(argc - i, argv + i);
+    }
+
+    // Report what the background reconciliation of saved state changed
+    state_file_reconcile_finish(stderr, 1);
+    return status;
+}
@@ -0,0 +1,474 @@
+#include "func.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Benchmark suite for the service table hot paths. Each run generates
+// synthetic `systemctl list-units` output for a range of unit counts, both in
+// the sorted order systemctl uses and shuffled, and times:
+//
+//   parse            reconcile_services() into an empty table (initial load)
+//   refresh          reconcile_services() again over an unchanged listing
+//   insert           add_service_to_list() for every unit (table + index)
+//   search           index_find() for every unit, in shuffled order
+//   add_log_entry    one event per unit (journal disabled, so in memory only)
+//   filter           filter_services_by_status() for every status
+//   free_memory      tearing the whole table down
+//   tokenize         unit_tokenizer_next() over the listing, no table work
+//   tokenize_legacy  the line-copy + sscanf parser the tokenizer replaced
+//   state_save       state_file_write() of the loaded table
+//   first_query      from an empty table to one snapshot lookup via the listing
+//   first_query_saved  the same via state_file_load() of the saved state
+//
+// Output produced by the code under test goes to /dev/null. Results are
+// printed on stderr and written as JSON to the report file, one record per
+// (benchmark, units, order) with the best and median time over the repeats.
+//
+// `service_bench generate COUNT [sorted|shuffled] [SEED]` prints a listing
+// instead, for use as a fixture by a stand-in systemctl.
+
+#define BENCH_DEFAULT_REPEAT 3
+#define BENCH_DEFAULT_SEED 0x5eed1234u
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_REPEAT 64
+#define BENCH_MAX_UNITS 10000000
+#define BENCH_DEFAULT_REPORT "bench_report.json"
+
+static const int default_sizes[] = { 1000, 10000, 100000, 200000 };
+
+enum {
+    BENCH_PARSE,
+    BENCH_REFRESH,
+    BENCH_INSERT,
+    BENCH_SEARCH,
+    BENCH_ADD_LOG,
+    BENCH_FILTER,
+    BENCH_FREE,
+    BENCH_TOKENIZE,
+    BENCH_TOKENIZE_LEGACY,
+    BENCH_STATE_SAVE,
+    BENCH_FIRST_QUERY,
+    BENCH_FIRST_QUERY_SAVED,
+    BENCH_COUNT
+};
+
+static const char* bench_names[BENCH_COUNT] = {
+    "parse", "refresh", "insert", "search", "add_log_entry", "filter", "free_memory",
+    "tokenize", "tokenize_legacy", "state_save", "first_query", "first_query_saved"
+};
+
+// Scratch state file for the state_save and first_query_saved runs
+static char state_path[4096];
+
+// One generated listing: the systemctl output and the unit names in the
+// order they appear in it (without the .service suffix)
+typedef struct UnitFixture {
+    ExecBuffer listing;
+    char** names;
+    int count;
+} UnitFixture;
+
+// Word stems for unit names, so names share prefixes like real ones do
+static const char* name_stems[] = {
+    "accounts-daemon-", "apache2-", "containerd-", "cron-", "dbus-", "docker-",
+    "getty@tty", "networkd-dispatcher-", "nginx-", "postgresql@14-main-",
+    "ssh-", "systemd-journald-", "systemd-logind-", "systemd-udevd-", "user@",
+    "worker-queue-"
+};
+
+#define STEM_COUNT (int)(sizeof(name_stems) / sizeof(name_stems[0]))
+
+// Load/active/sub columns with the share of units (in percent) given each
+static const struct {
+    const char* states;
+    int percent;
+} state_mix[] = {
+    { "loaded    active   running", 55 },
+    { "loaded    active   exited ", 20 },
+    { "loaded    inactive dead   ", 17 },
+    { "loaded    activating start", 1 },
+    { "loaded    failed   failed ", 5 },
+    { "not-found inactive dead   ", 2 },
+};
+
+#define STATE_MIX_COUNT (int)(sizeof(state_mix) / sizeof(state_mix[0]))
+
+static unsigned int rng_state;
+
+// xorshift32; deterministic for a given seed so runs are comparable
+static unsigned int next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static const char* pick_states() {
+    int roll = (int)(next_random() % 100);
+    for (int i = 0; i < STATE_MIX_COUNT; i++) {
+        if (roll < state_mix[i].percent) return state_mix[i].states;
+        roll -= state_mix[i].percent;
+    }
+    return state_mix[0].states;
+}
+
+static void fixture_free(UnitFixture* fixture) {
+    for (int i = 0; i < fixture->count; i++) free(fixture->names[i]);
+    free(fixture->names);
+    exec_buffer_free(&fixture->listing);
+    memset(fixture, 0, sizeof(*fixture));
+}
+
+// Generate count units, sorted by name or shuffled. Returns 0, or -1 on
+// allocation failure.
+static int fixture_generate(UnitFixture* fixture, int count, int shuffled, unsigned int seed) {
+    char line[512];
+
+    memset(fixture, 0, sizeof(*fixture));
+    rng_state = seed ? seed : BENCH_DEFAULT_SEED;
+
+    fixture->names = (char**)calloc(count, sizeof(char*));
+    if (fixture->names == NULL) goto fail;
+    for (int i = 0; i < count; i++) {
+        char name[MAX_SERVICE_NAME];
+        snprintf(name, sizeof(name), "%s%07d", name_stems[i % STEM_COUNT], i / STEM_COUNT);
+        fixture->names[i] = strdup(name);
+        if (fixture->names[i] == NULL) goto fail;
+        fixture->count++;
+    }
+
+    qsort(fixture->names, count, sizeof(char*), compare_names);
+    if (shuffled) {
+        for (int i = count - 1; i > 0; i--) {
+            int j = (int)(next_random() % (unsigned int)(i + 1));
+            char* swap = fixture->names[i];
+            fixture->names[i] = fixture->names[j];
+            fixture->names[j] = swap;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(line, sizeof(line), "  %s.service %s Synthetic unit %d\n",
+                              fixture->names[i], pick_states(), i);
+        if (exec_buffer_append(&fixture->listing, line, length) < 0) goto fail;
+    }
+    return 0;
+
+fail:
+    printf("Memory allocation failed!\n");
+    fixture_free(fixture);
+    return -1;
+}
+
+// Reference copy of the parser reconcile_services() used before the
+// tokenizer, kept to measure against.
+
+// Copy the next line of [*cursor, end) into line (truncated to size - 1
+// characters) and advance past it. Returns 0 once the input is exhausted.
+static int next_line(const char** cursor, const char* end, char* line, size_t size) {
+    if (*cursor >= end) return 0;
+    
+    const char* newline = memchr(*cursor, '\n', end - *cursor);
+    const char* stop = newline ? newline : end;
+    size_t length = stop - *cursor;
+    if (length > size - 1) length = size - 1;
+    
+    memcpy(line, *cursor, length);
+    line[length] = '\0';
+    *cursor = newline ? newline + 1 : end;
+    return 1;
+}
+
+// Parse one line of systemctl output into a unit name and status
+static int parse_unit_line(const char* line, char* service_name, ServiceStatus* status) {
+    char load_state[64], active_state[64], sub_state[64];
+    
+    // Parse systemctl output format: UNIT LOAD ACTIVE SUB DESCRIPTION
+    int parsed = sscanf(line, "%255s %63s %63s %63s", 
+                       service_name, load_state, active_state, sub_state);
+    if (parsed < 4) return 0;
+    
+    // Remove .service suffix if present
+    char* dot = strstr(service_name, ".service");
+    if (dot) *dot = '\0';
+    
+    // Use the active state and sub-state for more accurate status
+    if (strcmp(active_state, "active") == 0) {
+        if (strcmp(sub_state, "running") == 0) {
+            *status = STATUS_RUNNING;
+        } else {
+            *status = STATUS_ACTIVE;
+        }
+    } else if (strcmp(active_state, "inactive") == 0) {
+        *status = STATUS_INACTIVE;
+    } else if (strcmp(active_state, "failed") == 0) {
+        *status = STATUS_FAILED;
+    } else {
+        *status = string_to_status(sub_state); // Fallback to string parsing
+    }
+    
+    return 1;
+}
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Status checksums of both parsers over a listing, so neither loop can be
+// optimized away and a disagreement between them shows up
+static unsigned long tokenize_checksum(const ExecBuffer* listing) {
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
+    unsigned long sum = 0;
+
+    unit_tokenizer_init(&tokenizer, listing->data, listing->length);
+    while (unit_tokenizer_next(&tokenizer, &unit)) sum = sum * 31 + unit.status + unit.name_length;
+    return sum;
+}
+
+static unsigned long legacy_checksum(const ExecBuffer* listing) {
+    const char* cursor = listing->data;
+    const char* end = listing->data + listing->length;
+    char line[1024];
+    char service_name[MAX_SERVICE_NAME];
+    ServiceStatus status;
+    unsigned long sum = 0;
+
+    while (next_line(&cursor, end, line, sizeof(line))) {
+        if (parse_unit_line(line, service_name, &status)) sum = sum * 31 + status + strlen(service_name);
+    }
+    return sum;
+}
+
+// Time every benchmark once over fixture, adding one sample to each
+static void run_once(const UnitFixture* fixture, uint64_t samples[BENCH_COUNT]) {
+    uint64_t start;
+
+    free_memory();
+    start = now_ns();
+    reconcile_services(fixture->listing.data, fixture->listing.length, NULL);
+    samples[BENCH_PARSE] = now_ns() - start;
+
+    start = now_ns();
+    reconcile_services(fixture->listing.data, fixture->listing.length, NULL);
+    samples[BENCH_REFRESH] = now_ns() - start;
+
+    // Look units up in an order unrelated to the one they were added in
+    int step = fixture->count > 1 ? 7919 % fixture->count : 0;
+    if (step == 0) step = 1;
+    int found = 0;
+    start = now_ns();
+    for (int i = 0, at = 0; i < fixture->count; i++, at = (at + step) % fixture->count) {
+        if (index_find(&service_index, fixture->names[at]) != NULL) found++;
+    }
+    samples[BENCH_SEARCH] = now_ns() - start;
+    if (found != fixture->count) {
+        fprintf(stderr, "search found %d of %d units\n", found, fixture->count);
+    }
+
+    start = now_ns();
+    for (int i = 0; i < fixture->count; i++) {
+        add_log_entry(fixture->names[i], (LogAction)(i % ACTION_COUNT));
+    }
+    fflush(stdout);
+    samples[BENCH_ADD_LOG] = now_ns() - start;
+
+    snapshot_publish();
+    start = now_ns();
+    for (int status = 0; status < STATUS_COUNT; status++) {
+        filter_services_by_status((ServiceStatus)status);
+    }
+    fflush(stdout);
+    samples[BENCH_FILTER] = now_ns() - start;
+
+    start = now_ns();
+    free_memory();
+    samples[BENCH_FREE] = now_ns() - start;
+
+    start = now_ns();
+    unsigned long tokenized = tokenize_checksum(&fixture->listing);
+    samples[BENCH_TOKENIZE] = now_ns() - start;
+
+    start = now_ns();
+    unsigned long legacy = legacy_checksum(&fixture->listing);
+    samples[BENCH_TOKENIZE_LEGACY] = now_ns() - start;
+    if (tokenized != legacy) fprintf(stderr, "tokenizer and legacy parser disagree\n");
+
+    // Table and index inserts alone, without parsing the listing
+    start = now_ns();
+    for (int i = 0; i < fixture->count; i++) {
+        add_service_to_list(fixture->names[i], STATUS_RUNNING, 0);
+    }
+    samples[BENCH_INSERT] = now_ns() - start;
+    free_memory();
+
+    // Time to first query: what a fresh launch does before it can answer
+    // a lookup, enumerating the listing or mapping the saved state
+    const char* probe = fixture->names[fixture->count / 2];
+    start = now_ns();
+    reconcile_services(fixture->listing.data, fixture->listing.length, NULL);
+    snapshot_publish();
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    found = snapshot_find(snapshot, probe) != NULL;
+    snapshot_unpin(snapshot);
+    samples[BENCH_FIRST_QUERY] = now_ns() - start;
+
+    start = now_ns();
+    if (state_file_write(state_path) < 0) fprintf(stderr, "state_save failed\n");
+    samples[BENCH_STATE_SAVE] = now_ns() - start;
+    free_memory();
+
+    start = now_ns();
+    int loaded = state_file_load(state_path);
+    snapshot = snapshot_pin();
+    found += snapshot_find(snapshot, probe) != NULL;
+    snapshot_unpin(snapshot);
+    samples[BENCH_FIRST_QUERY_SAVED] = now_ns() - start;
+    if (found != 2 || loaded != fixture->count) {
+        fprintf(stderr, "first query found %d of 2, state load restored %d of %d units\n",
+                found, loaded, fixture->count);
+    }
+    free_memory();
+}
+
+// Parse a comma-separated list of unit counts. Returns how many, or -1.
+static int parse_sizes(const char* text, int* sizes) {
+    int count = 0;
+    char* end;
+
+    while (*text) {
+        long value = strtol(text, &end, 10);
+        if (end == text || value < 1 || value > BENCH_MAX_UNITS || count == BENCH_MAX_SIZES) return -1;
+        sizes[count++] = (int)value;
+        text = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') return -1;
+    }
+    return count;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--report FILE|-] [--sizes N[,N...]] [--repeat N] [--seed N]\n", program);
+    fprintf(stderr, "       %s generate COUNT [sorted|shuffled] [SEED]\n", program);
+}
+
+// Print a generated listing on stdout
+static int generate_main(int argc, char** argv) {
+    int count = argc > 2 ? atoi(argv[2]) : 0;
+    int shuffled = argc > 3 && strcmp(argv[3], "shuffled") == 0;
+    unsigned int seed = argc > 4 ? (unsigned int)strtoul(argv[4], NULL, 0) : BENCH_DEFAULT_SEED;
+    UnitFixture fixture;
+
+    if (count < 1 || count > BENCH_MAX_UNITS || (argc > 3 && !shuffled && strcmp(argv[3], "sorted") != 0)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (fixture_generate(&fixture, count, shuffled, seed) < 0) return 1;
+    fwrite(fixture.listing.data, 1, fixture.listing.length, stdout);
+    fixture_free(&fixture);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* report_path = BENCH_DEFAULT_REPORT;
+    int sizes[BENCH_MAX_SIZES];
+    int size_count = (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+    int repeat = BENCH_DEFAULT_REPEAT;
+    unsigned int seed = BENCH_DEFAULT_SEED;
+
+    if (argc > 1 && strcmp(argv[1], "generate") == 0) return generate_main(argc, argv);
+    journal_disable(&service_journal);
+
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        if (strcmp(argv[i], "--report") == 0) {
+            report_path = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0) {
+            size_count = parse_sizes(argv[++i], sizes);
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+        } else {
+            size_count = -1;
+        }
+        if (size_count < 0 || repeat < 1 || repeat > BENCH_MAX_REPEAT) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    const char* temp_dir = getenv("TMPDIR");
+    snprintf(state_path, sizeof(state_path), "%s/service_bench.%d.state",
+             temp_dir && *temp_dir ? temp_dir : "/tmp", (int)getpid());
+
+    // Keep the real stdout for a "-" report and silence everything else
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (report_fd < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("Failed to redirect output");
+        return 1;
+    }
+    close(null_fd);
+
+    FILE* report = strcmp(report_path, "-") == 0 ? fdopen(report_fd, "w") : fopen(report_path, "w");
+    if (report == NULL) {
+        perror("Failed to open report");
+        return 1;
+    }
+
+    fprintf(report, "{\"suite\":\"service_bench\",\"time\":%lld,\"repeat\":%d,\"seed\":%u,\"results\":[",
+            (long long)time(NULL), repeat, seed);
+    fprintf(stderr, "%-16s %9s %-8s %14s %14s %10s\n", "BENCHMARK", "UNITS", "ORDER", "BEST NS", "MEDIAN NS", "NS/OP");
+
+    int first = 1;
+    for (int s = 0; s < size_count; s++) {
+        for (int shuffled = 0; shuffled <= 1; shuffled++) {
+            UnitFixture fixture;
+            uint64_t samples[BENCH_COUNT][BENCH_MAX_REPEAT];
+            uint64_t once[BENCH_COUNT];
+
+            if (fixture_generate(&fixture, sizes[s], shuffled, seed) < 0) return 1;
+            for (int r = 0; r < repeat; r++) {
+                run_once(&fixture, once);
+                for (int b = 0; b < BENCH_COUNT; b++) samples[b][r] = once[b];
+            }
+
+            const char* order = shuffled ? "shuffled" : "sorted";
+            for (int b = 0; b < BENCH_COUNT; b++) {
+                qsort(samples[b], repeat, sizeof(uint64_t), compare_u64);
+                uint64_t best = samples[b][0], median = samples[b][repeat / 2];
+                double per_op = (double)best / fixture.count;
+
+                fprintf(report, "%s\n{\"benchmark\":\"%s\",\"units\":%d,\"order\":\"%s\",\"ops\":%d,"
+                        "\"best_ns\":%llu,\"median_ns\":%llu,\"ns_per_op\":%.2f}",
+                        first ? "" : ",", bench_names[b], fixture.count, order, fixture.count,
+                        (unsigned long long)best, (unsigned long long)median, per_op);
+                fprintf(stderr, "%-16s %9d %-8s %14llu %14llu %10.1f\n", bench_names[b], fixture.count,
+                        order, (unsigned long long)best, (unsigned long long)median, per_op);
+                first = 0;
+            }
+            fixture_free(&fixture);
+        }
+    }
+    fprintf(report, "\n]}\n");
+    unlink(state_path);
+
+    int failed = fclose(report) != 0;
+    if (failed) perror("Failed to write report");
+    if (report_fd >= 0 && strcmp(report_path, "-") != 0) close(report_fd);
+    return failed;
+}
@@ -0,0 +1,290 @@
+#include "func.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// Control engine: runs batches of systemctl start/stop/restart jobs with at
+// most control_concurrency children in flight. Children are watched through
+// pidfds where the kernel has them (falling back to short waitpid polls),
+// and a job that outlives control_timeout is sent SIGTERM and then SIGKILL.
+// control_batch_run_ordered() runs a batch as dependency-ordered waves.
+
+#define CONTROL_KILL_GRACE 5        // Seconds between SIGTERM and SIGKILL
+#define CONTROL_POLL_MS 50          // Poll interval when pidfds are unavailable
+
+int control_concurrency = 4;
+int control_timeout = 90;
+
+const char* control_action_to_string(ControlAction action) {
+    switch (action) {
+        case CONTROL_START: return "start";
+        case CONTROL_STOP: return "stop";
+        case CONTROL_RESTART: return "restart";
+        default: return "unknown";
+    }
+}
+
+// Apply $SERVICE_CONTROL_WORKERS / $SERVICE_CONTROL_TIMEOUT if set
+void control_configure_from_env() {
+    const char* workers = getenv("SERVICE_CONTROL_WORKERS");
+    const char* timeout = getenv("SERVICE_CONTROL_TIMEOUT");
+
+    if (workers && atoi(workers) > 0) control_concurrency = atoi(workers);
+    if (timeout && atoi(timeout) > 0) control_timeout = atoi(timeout);
+}
+
+// Queue a job; context is handed back untouched to the completion callback
+int control_batch_add(ControlBatch* batch, const char* service_name, ControlAction action, void* context) {
+    if (batch->count == batch->capacity) {
+        int new_capacity = batch->capacity ? batch->capacity * 2 : 16;
+        ControlJob* grown = (ControlJob*)realloc(batch->jobs, new_capacity * sizeof(ControlJob));
+        if (grown == NULL) {
+            printf("Memory allocation failed!\n");
+            return -1;
+        }
+        batch->jobs = grown;
+        batch->capacity = new_capacity;
+    }
+
+    ControlJob* job = &batch->jobs[batch->count++];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->service_name, sizeof(job->service_name), "%s", service_name);
+    job->action = action;
+    job->context = context;
+    job->pid = -1;
+    job->pidfd = -1;
+    return 0;
+}
+
+void control_batch_free(ControlBatch* batch) {
+    free(batch->jobs);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Spawn systemctl for one job
+static int launch_job(ControlJob* job) {
+    char unit[MAX_SERVICE_NAME + 16];
+    const char* name;
+    int source = source_of_unit(job->service_name, &name);
+    snprintf(unit, sizeof(unit), "%s.service", name);
+
+    // Sent to the manager the unit was listed from
+    const char* args[] = { control_action_to_string(job->action), unit, NULL };
+    const char* argv[8];
+    if (source < 0 || source_command(source, argv, 8, args) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pid_t pid;
+    if (exec_spawn(argv, NULL, &pid) < 0) return -1;
+
+    job->pid = pid;
+    job->started = time(NULL);
+    job->started_ns = metrics_now();
+    job->deadline = job->started + control_timeout;
+#ifdef SYS_pidfd_open
+    job->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    return 0;
+}
+
+// Count a finished job and time it by action
+static void record_job(const ControlJob* job) {
+    static const MetricLatency latencies[] = { LATENCY_CONTROL_START, LATENCY_CONTROL_STOP, LATENCY_CONTROL_RESTART };
+
+    metrics_count(METRIC_CONTROL_JOBS, 1);
+    if (!job->succeeded) metrics_count(METRIC_CONTROL_FAILURES, 1);
+    metrics_observe_since(latencies[job->action], job->started_ns);
+}
+
+// Reap a job if it has exited. Returns 1 when the job is finished.
+static int reap_job(ControlJob* job) {
+    int status;
+    pid_t result = waitpid(job->pid, &status, WNOHANG);
+
+    if (result == 0) return 0;
+    if (result < 0 && errno == EINTR) return 0;
+
+    if (result == job->pid && WIFEXITED(status)) {
+        job->exit_code = WEXITSTATUS(status);
+    } else {
+        job->exit_code = -1;
+    }
+    job->succeeded = !job->timed_out && job->exit_code == 0;
+
+    if (job->pidfd >= 0) close(job->pidfd);
+    job->pidfd = -1;
+    return 1;
+}
+
+// Enforce the job deadline: SIGTERM first, SIGKILL after the grace period
+static void check_deadline(ControlJob* job, time_t now) {
+    if (now < job->deadline) return;
+
+    if (!job->timed_out) {
+        job->timed_out = 1;
+        kill(job->pid, SIGTERM);
+        job->deadline = now + CONTROL_KILL_GRACE;
+    } else {
+        kill(job->pid, SIGKILL);
+        job->deadline = now + CONTROL_KILL_GRACE;
+    }
+}
+
+// Run every job in the batch, calling done as each one finishes.
+// Returns the number of jobs that failed.
+int control_batch_run(ControlBatch* batch, ControlDone done, void* context) {
+    int limit = control_concurrency > 0 ? control_concurrency : 1;
+    int* running = (int*)malloc(limit * sizeof(int));
+    struct pollfd* fds = (struct pollfd*)malloc(limit * sizeof(struct pollfd));
+    int running_count = 0, next = 0, failures = 0;
+
+    if (running == NULL || fds == NULL) {
+        printf("Memory allocation failed!\n");
+        free(running);
+        free(fds);
+        return batch->count;
+    }
+
+    while (next < batch->count || running_count > 0) {
+        // Fill free slots
+        while (running_count < limit && next < batch->count) {
+            ControlJob* job = &batch->jobs[next];
+            if (launch_job(job) < 0) {
+                perror("Failed to launch systemctl");
+                job->exit_code = -1;
+                failures++;
+                record_job(job);
+                done(job, context);
+            } else {
+                running[running_count++] = next;
+            }
+            next++;
+        }
+        if (running_count == 0) continue;
+
+        // Sleep until a child exits or the nearest deadline passes
+        time_t now = time(NULL);
+        time_t nearest = batch->jobs[running[0]].deadline;
+        int nfds = 0, all_pidfds = 1;
+        for (int i = 0; i < running_count; i++) {
+            ControlJob* job = &batch->jobs[running[i]];
+            if (job->deadline < nearest) nearest = job->deadline;
+            if (job->pidfd >= 0) {
+                fds[nfds].fd = job->pidfd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            } else {
+                all_pidfds = 0;
+            }
+        }
+
+        int wait_ms = nearest > now ? (int)(nearest - now) * 1000 : 0;
+        if (!all_pidfds && wait_ms > CONTROL_POLL_MS) wait_ms = CONTROL_POLL_MS;
+        poll(nfds ? fds : NULL, nfds, wait_ms);
+
+        // Collect finished jobs and enforce deadlines
+        now = time(NULL);
+        for (int i = 0; i < running_count; ) {
+            ControlJob* job = &batch->jobs[running[i]];
+            if (reap_job(job)) {
+                if (!job->succeeded) failures++;
+                record_job(job);
+                done(job, context);
+                running[i] = running[--running_count];
+            } else {
+                check_deadline(job, now);
+                i++;
+            }
+        }
+    }
+
+    free(running);
+    free(fds);
+    return failures;
+}
+
+// Index of a failed or cancelled unit that job i of batch Requires= from
+// an earlier wave, or -1
+static int failed_requirement(const ControlBatch* batch, const DependencyPlan* plan, int i) {
+    for (int r = plan->required_first[i]; r < plan->required_first[i + 1]; r++) {
+        int j = plan->required[r];
+        if (plan->wave[j] < plan->wave[i] && !batch->jobs[j].succeeded) return j;
+    }
+    return -1;
+}
+
+// Run the batch in dependency order: units are grouped into waves (see
+// depgraph_plan()) and each wave runs as its own batch, control_concurrency
+// jobs at a time, once the previous wave has finished. Stops run the waves
+// in reverse so dependents go down first. A start or restart whose
+// Requires= dependency failed or was cancelled is cancelled itself and
+// reported through done with cancelled_by set. Returns the number of jobs
+// that failed or were cancelled.
+int control_batch_run_ordered(ControlBatch* batch, ControlDone done, void* context) {
+    DependencyPlan plan;
+    const char** names;
+
+    if (batch->count < 2) return control_batch_run(batch, done, context);
+
+    names = (const char**)malloc(batch->count * sizeof(char*));
+    if (names == NULL) return control_batch_run(batch, done, context);
+    for (int i = 0; i < batch->count; i++) names[i] = batch->jobs[i].service_name;
+    int planned = depgraph_plan(names, batch->count, &plan);
+    free(names);
+
+    // Without an order there is nothing to wait for
+    if (planned < 0 || plan.waves <= 1) {
+        if (planned == 0) depgraph_plan_free(&plan);
+        return control_batch_run(batch, done, context);
+    }
+
+    ControlBatch wave_batch = {0};
+    int* members = (int*)malloc(batch->count * sizeof(int));
+    int reverse = batch->jobs[0].action == CONTROL_STOP;
+    int failures = 0;
+
+    if (members == NULL) {
+        printf("Memory allocation failed!\n");
+        depgraph_plan_free(&plan);
+        return control_batch_run(batch, done, context);
+    }
+
+    for (int step = 0; step < plan.waves; step++) {
+        int wave = reverse ? plan.waves - 1 - step : step;
+        int member_count = 0;
+
+        wave_batch.count = 0;
+        for (int i = 0; i < batch->count; i++) {
+            if (plan.wave[i] != wave) continue;
+
+            ControlJob* job = &batch->jobs[i];
+            int blocker = reverse ? -1 : failed_requirement(batch, &plan, i);
+            if (blocker >= 0) {
+                job->cancelled_by = batch->jobs[blocker].service_name;
+                job->exit_code = -1;
+                failures++;
+                metrics_count(METRIC_CONTROL_CANCELLED, 1);
+                done(job, context);
+            } else if (control_batch_add(&wave_batch, job->service_name, job->action, job->context) == 0) {
+                members[member_count++] = i;
+            } else {
+                job->exit_code = -1;
+                failures++;
+                done(job, context);
+            }
+        }
+        if (wave_batch.count == 0) continue;
+
+        failures += control_batch_run(&wave_batch, done, context);
+        for (int k = 0; k < member_count; k++) batch->jobs[members[k]] = wave_batch.jobs[k];
+    }
+
+    free(members);
+    control_batch_free(&wave_batch);
+    depgraph_plan_free(&plan);
+    return failures;
+}
@@ -0,0 +1,789 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+// Daemon mode: keeps the service table, event log and failed queue resident
+// and answers batch commands over a Unix socket, so many clients share one
+// table that is kept current from change events instead of each running
+// its own systemctl enumeration. The protocol is line based:
+//
+//   request:   one line holding a batch command, optionally preceded by
+//              --format/--offset/--limit, e.g. "--format json filter failed"
+//   response:  "<exit status> <body length>\n" followed by the body bytes
+//
+// Requests on a connection are answered strictly in order, so a client may
+// pipeline as many as it likes before reading any responses.
+//
+// The epoll thread only moves bytes. Requests run on a small pool of
+// worker threads and are answered when they finish, so a slow restart or
+// deps query never holds up other clients, and refreshes run on the
+// background refresher thread, so lookups and filters, which read the
+// published snapshot, are answered at once even while a long enumeration
+// is in progress. Each worker captures its request's stdout and stderr
+// separately; anything printed by other threads goes to the daemon's own
+// output.
+
+#define DAEMON_MAX_REQUEST 4096
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_MAX_PENDING (1024 * 1024)    // Stop reading requests past this much unsent output
+#define DAEMON_BACKLOG 64
+#define DAEMON_SETTLE_MS 100
+#define DAEMON_REFRESH_INTERVAL 30          // Backstop refresh even without change events
+#define DAEMON_WORKERS 4
+
+// Fixed epoll tags; client slot i is tagged EVENT_CLIENT + i
+enum { EVENT_LISTEN, EVENT_SOURCE, EVENT_SETTLE, EVENT_TICK, EVENT_SIGNAL, EVENT_REFRESHED, EVENT_DONE, EVENT_CLIENT };
+
+typedef struct DaemonClient {
+    int fd;                 // -1 = free slot
+    int eof;                // Peer has finished sending
+    int busy;               // A request from this client is with the workers
+    unsigned int serial;    // Tells this connection apart from earlier ones in the slot
+    ExecBuffer in;          // Received bytes not yet answered
+    ExecBuffer out;         // Responses waiting to be sent
+    size_t sent;            // Bytes of out already sent
+} DaemonClient;
+
+// A request handed to the workers. Slot -1 is the daemon's own follow-up
+// work after a refresh.
+typedef struct DaemonJob {
+    struct DaemonJob* next;
+    int slot;
+    unsigned int serial;
+    int status;
+    ExecBuffer body;        // Captured stdout and stderr
+    char line[];
+} DaemonJob;
+
+typedef struct Daemon {
+    int epoll_fd;
+    int done_fd;            // Signalled when a job lands on done
+    int stdout_fd;          // The daemon's own stdout and stderr
+    int stderr_fd;
+    FILE* saved_stdout;     // The streams replaced by the capture streams
+    FILE* saved_stderr;
+    OutputOptions default_options;
+    DaemonClient* clients;
+    int client_capacity;
+    unsigned int next_serial;
+    int refresh_busy;       // Refresh follow-up job queued or running
+    int refresh_pending;    // Another refresh finished meanwhile
+
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_ready;
+    DaemonJob* queued;      // FIFO of jobs waiting for a worker
+    DaemonJob* queued_tail;
+    DaemonJob* done;        // Finished jobs for the epoll thread
+    int stopping;
+    pthread_t workers[DAEMON_WORKERS];
+    int worker_count;
+} Daemon;
+
+// The capture buffer of the request this thread is running, if any
+static __thread ExecBuffer* request_output = NULL;
+static __thread int request_output_failed = 0;
+
+// $SERVICE_DAEMON_SOCKET, or service_monitor.sock in the working directory
+const char* daemon_socket_path() {
+    const char* path = getenv("SERVICE_DAEMON_SOCKET");
+    return path && *path ? path : "service_monitor.sock";
+}
+
+static int socket_address(const char* path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// Listen on path. A socket file left behind by a daemon that has gone away
+// is replaced; one that still accepts connections is not.
+static int open_listener(const char* path) {
+    struct sockaddr_un address;
+    if (socket_address(path, &address) < 0) return -1;
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0) {
+        int live = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+        close(probe);
+        if (live) {
+            printf("A daemon is already listening on %s\n", path);
+            return -1;
+        }
+    }
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(fd, DAEMON_BACKLOG) != 0) {
+        perror("Failed to listen on daemon socket");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int watch(Daemon* daemon, int fd, uint32_t events, uint32_t tag, int op) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u32 = tag;
+    return epoll_ctl(daemon->epoll_fd, op, fd, &event);
+}
+
+static void close_client(Daemon* daemon, int slot) {
+    DaemonClient* client = &daemon->clients[slot];
+    epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    client->busy = 0;
+    client->in.length = client->out.length = client->sent = 0;
+}
+
+static void accept_clients(Daemon* daemon, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) return;
+
+        int slot = 0;
+        while (slot < daemon->client_capacity && daemon->clients[slot].fd >= 0) slot++;
+        if (slot == daemon->client_capacity) {
+            int new_capacity = daemon->client_capacity ? daemon->client_capacity * 2 : 16;
+            DaemonClient* grown = (DaemonClient*)realloc(daemon->clients, new_capacity * sizeof(DaemonClient));
+            if (grown == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(grown + daemon->client_capacity, 0,
+                   (new_capacity - daemon->client_capacity) * sizeof(DaemonClient));
+            for (int i = daemon->client_capacity; i < new_capacity; i++) grown[i].fd = -1;
+            daemon->clients = grown;
+            daemon->client_capacity = new_capacity;
+        }
+
+        DaemonClient* client = &daemon->clients[slot];
+        client->fd = fd;
+        client->eof = 0;
+        client->busy = 0;
+        client->serial = ++daemon->next_serial;
+        client->sent = 0;
+        watch(daemon, fd, EPOLLIN, EVENT_CLIENT + slot, EPOLL_CTL_ADD);
+    }
+}
+
+static void write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        size -= written;
+    }
+}
+
+// Write callback of the daemon's stdout and stderr: into the running
+// request's response on a worker, to the daemon's own descriptor otherwise
+static ssize_t capture_write(void* cookie, const char* data, size_t size) {
+    if (request_output != NULL) {
+        if (!request_output_failed && exec_buffer_append(request_output, data, size) < 0) {
+            request_output_failed = 1;
+        }
+    } else {
+        write_all(*(int*)cookie, data, size);
+    }
+    return size;
+}
+
+// Unbuffered, so nothing one thread prints can sit in a buffer another
+// thread's output is then written through
+static FILE* open_capture_stream(int* fd) {
+    cookie_io_functions_t functions = { NULL, capture_write, NULL, NULL };
+    FILE* stream = fopencookie(fd, "w", functions);
+    if (stream != NULL) setvbuf(stream, NULL, _IONBF, 0);
+    return stream;
+}
+
+// Run one request, capturing what it prints as the response body. If the
+// capture runs out of memory the request fails rather than send a partial
+// body.
+static void run_request(Daemon* daemon, DaemonJob* job) {
+    char* words[DAEMON_MAX_ARGS];
+
+    output_options = daemon->default_options;
+    request_output = &job->body;
+    request_output_failed = 0;
+
+    int status = 0;
+    int index = 0;
+    int count = batch_split_words(job->line, words, DAEMON_MAX_ARGS);
+    if (count < 0) {
+        fprintf(stderr, "Too many arguments\n");
+        status = 2;
+    } else if (count > 0) {
+        if (batch_parse_options(count, words, &index) < 0) {
+            status = 2;
+        } else if (index == count) {
+            fprintf(stderr, "Missing command\n");
+            status = 2;
+        } else {
+            status = batch_run_command(count - index, words + index);
+        }
+    }
+
+    request_output = NULL;
+    job->status = status;
+    if (request_output_failed) {
+        const char* message = "Response too large to capture\n";
+        job->status = 1;
+        job->body.length = 0;
+        exec_buffer_append(&job->body, message, strlen(message));
+    }
+}
+
+// Follow-up to a background refresh: failed units are queued and the
+// metrics and state file brought up to date, off the epoll thread. Sources
+// that could not be listed are reported in the daemon's own output.
+static void run_refreshed() {
+    ServiceChangeSet changes = {0};
+
+    snapshot_refresher_take(&changes);
+    report_failed_sources(stdout, changes.failed_sources);
+    service_lock();
+    monitor_queue_failed(&changes);
+    service_unlock();
+    free_change_set(&changes);
+    metrics_export();
+    state_file_checkpoint(0);
+}
+
+static void* worker_main(void* arg) {
+    Daemon* daemon = (Daemon*)arg;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&daemon->jobs_lock);
+    for (;;) {
+        while (daemon->queued == NULL && !daemon->stopping) {
+            pthread_cond_wait(&daemon->jobs_ready, &daemon->jobs_lock);
+        }
+        if (daemon->stopping) break;
+
+        DaemonJob* job = daemon->queued;
+        daemon->queued = job->next;
+        if (daemon->queued == NULL) daemon->queued_tail = NULL;
+        pthread_mutex_unlock(&daemon->jobs_lock);
+
+        if (job->slot < 0) {
+            run_refreshed();
+        } else {
+            run_request(daemon, job);
+        }
+
+        pthread_mutex_lock(&daemon->jobs_lock);
+        job->next = daemon->done;
+        daemon->done = job;
+        if (write(daemon->done_fd, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero; the epoll thread will wake anyway
+        }
+    }
+    pthread_mutex_unlock(&daemon->jobs_lock);
+    render_free();
+    return NULL;
+}
+
+static int queue_job(Daemon* daemon, int slot, unsigned int serial, const char* line, size_t length) {
+    DaemonJob* job = (DaemonJob*)malloc(sizeof(DaemonJob) + length + 1);
+    if (job == NULL) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+    memset(job, 0, sizeof(*job));
+    job->slot = slot;
+    job->serial = serial;
+    memcpy(job->line, line, length);
+    job->line[length] = '\0';
+
+    pthread_mutex_lock(&daemon->jobs_lock);
+    if (daemon->queued_tail) {
+        daemon->queued_tail->next = job;
+    } else {
+        daemon->queued = job;
+    }
+    daemon->queued_tail = job;
+    pthread_cond_signal(&daemon->jobs_ready);
+    pthread_mutex_unlock(&daemon->jobs_lock);
+    return 0;
+}
+
+static void free_jobs(DaemonJob* job) {
+    while (job) {
+        DaemonJob* next = job->next;
+        exec_buffer_free(&job->body);
+        free(job);
+        job = next;
+    }
+}
+
+static void queue_refreshed(Daemon* daemon) {
+    if (daemon->refresh_busy) {
+        daemon->refresh_pending = 1;
+        return;
+    }
+    if (queue_job(daemon, -1, 0, "", 0) == 0) daemon->refresh_busy = 1;
+}
+
+// Hand the client's next whole request to the workers, one at a time so
+// responses go out in request order. Returns -1 if the client must be
+// dropped for sending an overlong request.
+static int dispatch_request(Daemon* daemon, int slot) {
+    DaemonClient* client = &daemon->clients[slot];
+    if (client->busy) return 0;
+
+    char* newline = memchr(client->in.data, '\n', client->in.length);
+    if (newline == NULL) return client->in.length > DAEMON_MAX_REQUEST ? -1 : 0;
+
+    size_t length = newline - client->in.data;
+    if (length > DAEMON_MAX_REQUEST) return -1;
+    if (queue_job(daemon, slot, client->serial, client->in.data, length) < 0) return -1;
+    client->busy = 1;
+
+    memmove(client->in.data, newline + 1, client->in.length - length - 1);
+    client->in.length -= length + 1;
+    return 0;
+}
+
+// Send as much queued output as the socket takes. Returns -1 if the
+// connection has failed.
+static int flush_client(DaemonClient* client) {
+    while (client->sent < client->out.length) {
+        ssize_t written = send(client->fd, client->out.data + client->sent,
+                               client->out.length - client->sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && errno == EAGAIN) return 0;
+        if (written <= 0) return -1;
+        client->sent += written;
+    }
+    client->out.length = client->sent = 0;
+    return 0;
+}
+
+// Handle readiness on a client (events is 0 after one of its requests
+// finished): read requests, pass the next one to the workers, send what we
+// can and pick the events to wait for next
+static void service_client(Daemon* daemon, int slot, uint32_t events) {
+    DaemonClient* client = &daemon->clients[slot];
+
+    if ((events & EPOLLIN) && !client->eof) {
+        char chunk[16384];
+        for (;;) {
+            ssize_t got = read(client->fd, chunk, sizeof(chunk));
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && errno == EAGAIN) break;
+            if (got <= 0) {
+                client->eof = 1;
+                break;
+            }
+            if (exec_buffer_append(&client->in, chunk, got) < 0) {
+                close_client(daemon, slot);
+                return;
+            }
+            if (client->in.length > DAEMON_MAX_PENDING) break;
+        }
+    }
+
+    if (dispatch_request(daemon, slot) < 0 ||
+        (events & (EPOLLHUP | EPOLLERR)) || flush_client(client) < 0) {
+        close_client(daemon, slot);
+        return;
+    }
+
+    int pending = client->out.length > client->sent;
+    if (client->eof && !pending && !client->busy) {
+        close_client(daemon, slot);
+        return;
+    }
+
+    // Stop reading once unanswered requests or unsent responses pile up
+    uint32_t want = 0;
+    if (!client->eof && client->in.length <= DAEMON_MAX_PENDING &&
+        client->out.length - client->sent <= DAEMON_MAX_PENDING) want |= EPOLLIN;
+    if (pending) want |= EPOLLOUT;
+    watch(daemon, client->fd, want, EVENT_CLIENT + slot, EPOLL_CTL_MOD);
+}
+
+// Frame each finished request onto its client. Results for connections
+// that have since closed are dropped.
+static void finish_jobs(Daemon* daemon) {
+    pthread_mutex_lock(&daemon->jobs_lock);
+    DaemonJob* jobs = daemon->done;
+    daemon->done = NULL;
+    pthread_mutex_unlock(&daemon->jobs_lock);
+
+    for (DaemonJob* job = jobs; job; job = job->next) {
+        if (job->slot < 0) {
+            daemon->refresh_busy = 0;
+            if (daemon->refresh_pending) {
+                daemon->refresh_pending = 0;
+                queue_refreshed(daemon);
+            }
+            continue;
+        }
+
+        DaemonClient* client = &daemon->clients[job->slot];
+        if (client->fd < 0 || client->serial != job->serial) continue;
+        client->busy = 0;
+
+        char header[64];
+        int header_length = snprintf(header, sizeof(header), "%d %zu\n", job->status, job->body.length);
+        if (exec_buffer_append(&client->out, header, header_length) < 0 ||
+            (job->body.length > 0 && exec_buffer_append(&client->out, job->body.data, job->body.length) < 0)) {
+            close_client(daemon, job->slot);
+            continue;
+        }
+        service_client(daemon, job->slot, 0);
+    }
+    free_jobs(jobs);
+}
+
+// Serve requests on socket_path until SIGINT or SIGTERM. The table is
+// loaded once and then refreshed on unit change events, with a periodic
+// full refresh as a backstop. Returns 0 on a clean shutdown.
+int daemon_main(const char* socket_path) {
+    Daemon daemon;
+    MonitorSource source;
+    int result = -1;
+
+    memset(&daemon, 0, sizeof(daemon));
+    int listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) return -1;
+
+    pthread_mutex_init(&daemon.jobs_lock, NULL);
+    pthread_cond_init(&daemon.jobs_ready, NULL);
+    daemon.default_options = output_options;
+    int have_source = monitor_source_open_default(&source) == 0;
+    daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    daemon.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    daemon.stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    daemon.stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    int settle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    int tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    int refreshed_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (daemon.epoll_fd < 0 || daemon.done_fd < 0 || daemon.stdout_fd < 0 || daemon.stderr_fd < 0 ||
+        settle_fd < 0 || tick_fd < 0 || signal_fd < 0 || refreshed_fd < 0) {
+        perror("Failed to set up daemon");
+        goto cleanup;
+    }
+
+    // From here on stdout and stderr are the capture streams
+    FILE* capture_stdout = open_capture_stream(&daemon.stdout_fd);
+    FILE* capture_stderr = open_capture_stream(&daemon.stderr_fd);
+    if (capture_stdout == NULL || capture_stderr == NULL) {
+        perror("Failed to set up daemon");
+        if (capture_stdout) fclose(capture_stdout);
+        if (capture_stderr) fclose(capture_stderr);
+        goto cleanup;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    daemon.saved_stdout = stdout;
+    daemon.saved_stderr = stderr;
+    stdout = capture_stdout;
+    stderr = capture_stderr;
+
+    // Saved state is served until the first refresh has reconciled it
+    int saved = batch_load_saved_services(0) == 0;
+    if ((!saved && batch_refresh_services() < 0) || snapshot_refresher_start(refreshed_fd) < 0) goto cleanup;
+    if (saved) snapshot_refresher_request();
+
+    for (; daemon.worker_count < DAEMON_WORKERS; daemon.worker_count++) {
+        if (pthread_create(&daemon.workers[daemon.worker_count], NULL, worker_main, &daemon) != 0) break;
+    }
+    if (daemon.worker_count == 0) {
+        printf("Failed to start daemon workers\n");
+        goto cleanup;
+    }
+
+    watch(&daemon, listen_fd, EPOLLIN, EVENT_LISTEN, EPOLL_CTL_ADD);
+    watch(&daemon, settle_fd, EPOLLIN, EVENT_SETTLE, EPOLL_CTL_ADD);
+    watch(&daemon, tick_fd, EPOLLIN, EVENT_TICK, EPOLL_CTL_ADD);
+    watch(&daemon, signal_fd, EPOLLIN, EVENT_SIGNAL, EPOLL_CTL_ADD);
+    watch(&daemon, refreshed_fd, EPOLLIN, EVENT_REFRESHED, EPOLL_CTL_ADD);
+    watch(&daemon, daemon.done_fd, EPOLLIN, EVENT_DONE, EPOLL_CTL_ADD);
+    if (have_source) watch(&daemon, source.fd, EPOLLIN, EVENT_SOURCE, EPOLL_CTL_ADD);
+    monitor_arm_timer(tick_fd, DAEMON_REFRESH_INTERVAL * 1000L, 1);
+
+    printf("Daemon serving %d services on %s (%s events)\n", service_table.live, socket_path,
+           have_source ? source.name : "no");
+
+    int running = 1;
+    while (running) {
+        struct epoll_event events[32];
+        int ready = epoll_wait(daemon.epoll_fd, events, 32, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Daemon failed");
+            break;
+        }
+
+        int refresh = 0;
+        for (int i = 0; i < ready; i++) {
+            uint32_t tag = events[i].data.u32;
+            uint64_t expirations;
+
+            if (tag >= EVENT_CLIENT) {
+                service_client(&daemon, (int)(tag - EVENT_CLIENT), events[i].events);
+                continue;
+            }
+            switch (tag) {
+                case EVENT_LISTEN:
+                    accept_clients(&daemon, listen_fd);
+                    break;
+                case EVENT_SOURCE:
+                    if (monitor_source_drain(&source) < 0) {
+                        epoll_ctl(daemon.epoll_fd, EPOLL_CTL_DEL, source.fd, NULL);
+                    }
+                    monitor_arm_settle(settle_fd, DAEMON_SETTLE_MS);
+                    break;
+                case EVENT_SETTLE:
+                    if (read(settle_fd, &expirations, sizeof(expirations)) > 0) refresh = 1;
+                    break;
+                case EVENT_TICK:
+                    if (read(tick_fd, &expirations, sizeof(expirations)) > 0) refresh = 1;
+                    break;
+                case EVENT_SIGNAL: {
+                    struct signalfd_siginfo info;
+                    if (read(signal_fd, &info, sizeof(info)) > 0) running = 0;
+                    break;
+                }
+                case EVENT_REFRESHED:
+                    if (read(refreshed_fd, &expirations, sizeof(expirations)) > 0) queue_refreshed(&daemon);
+                    break;
+                case EVENT_DONE:
+                    if (read(daemon.done_fd, &expirations, sizeof(expirations)) > 0) finish_jobs(&daemon);
+                    break;
+            }
+        }
+
+        if (running && refresh) snapshot_refresher_request();
+    }
+
+    printf("Daemon stopped.\n");
+    result = 0;
+
+cleanup:
+    pthread_mutex_lock(&daemon.jobs_lock);
+    daemon.stopping = 1;
+    pthread_cond_broadcast(&daemon.jobs_ready);
+    pthread_mutex_unlock(&daemon.jobs_lock);
+    for (int i = 0; i < daemon.worker_count; i++) pthread_join(daemon.workers[i], NULL);
+    free_jobs(daemon.queued);
+    free_jobs(daemon.done);
+    snapshot_refresher_stop();
+    if (daemon.saved_stdout) {
+        fclose(stdout);
+        fclose(stderr);
+        stdout = daemon.saved_stdout;
+        stderr = daemon.saved_stderr;
+    }
+    for (int i = 0; i < daemon.client_capacity; i++) {
+        if (daemon.clients[i].fd >= 0) close_client(&daemon, i);
+        exec_buffer_free(&daemon.clients[i].in);
+        exec_buffer_free(&daemon.clients[i].out);
+    }
+    free(daemon.clients);
+    if (have_source) monitor_source_close(&source);
+    if (refreshed_fd >= 0) close(refreshed_fd);
+    if (signal_fd >= 0) close(signal_fd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (tick_fd >= 0) close(tick_fd);
+    if (settle_fd >= 0) close(settle_fd);
+    if (daemon.stderr_fd >= 0) close(daemon.stderr_fd);
+    if (daemon.stdout_fd >= 0) close(daemon.stdout_fd);
+    if (daemon.done_fd >= 0) close(daemon.done_fd);
+    if (daemon.epoll_fd >= 0) close(daemon.epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_cond_destroy(&daemon.jobs_ready);
+    pthread_mutex_destroy(&daemon.jobs_lock);
+    return result;
+}
+
+// A script line sent to the daemon, for reporting its status
+typedef struct ClientRequest {
+    int line;
+    char command[32];
+} ClientRequest;
+
+// Append word to a request line, quoted if the daemon would otherwise
+// split it
+static int append_word(ExecBuffer* request, const char* word) {
+    const char* quote = strpbrk(word, " \t#\"'") == NULL ? "" : strchr(word, '"') ? "'" : "\"";
+    if (request->length > 0 && exec_buffer_append(request, " ", 1) < 0) return -1;
+    if (exec_buffer_append(request, quote, strlen(quote)) < 0) return -1;
+    if (exec_buffer_append(request, word, strlen(word)) < 0) return -1;
+    return exec_buffer_append(request, quote, strlen(quote));
+}
+
+// Prefix carrying this process's output options to the daemon
+static int append_options(ExecBuffer* request) {
+    char options[128];
+    int length = snprintf(options, sizeof(options), "--format %s --offset %d --limit %d",
+                          output_format_to_string(output_options.format),
+                          output_options.offset, output_options.limit);
+    return exec_buffer_append(request, options, length);
+}
+
+// Client side of the daemon: send one command (or every line of a script)
+// and print the responses as they arrive. Requests are pipelined: they are
+// all written while responses are being read. Returns the command's exit
+// status, or for a script 0 if every command succeeded and 1 otherwise.
+int client_main(const char* socket_path, int argc, char** argv) {
+    ExecBuffer requests = {0}, line = {0}, responses = {0};
+    ClientRequest* sent_requests = NULL;
+    int request_count = 0, request_capacity = 0;
+    int script = strcmp(argv[0], "script") == 0;
+    int result = 2;
+
+    // Build the whole request stream up front
+    if (script) {
+        const char* path = argc > 1 ? argv[1] : "-";
+        FILE* input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+        char text[DAEMON_MAX_REQUEST];
+        int line_number = 0;
+
+        if (input == NULL) {
+            perror("Failed to open script");
+            return 2;
+        }
+        while (fgets(text, sizeof(text), input)) {
+            line_number++;
+            text[strcspn(text, "\n")] = '\0';
+            const char* start = text + strspn(text, " \t");
+            if (*start == '\0' || *start == '#') continue;
+
+            if (request_count == request_capacity) {
+                request_capacity = request_capacity ? request_capacity * 2 : 64;
+                ClientRequest* grown = (ClientRequest*)realloc(sent_requests, request_capacity * sizeof(ClientRequest));
+                if (grown == NULL) break;
+                sent_requests = grown;
+            }
+            ClientRequest* request = &sent_requests[request_count++];
+            request->line = line_number;
+            snprintf(request->command, sizeof(request->command), "%.*s", (int)strcspn(start, " \t"), start);
+            line.length = 0;
+            append_options(&line);
+            exec_buffer_append(&line, " ", 1);
+            exec_buffer_append(&line, start, strlen(start));
+            exec_buffer_append(&line, "\n", 1);
+            exec_buffer_append(&requests, line.data, line.length);
+        }
+        if (input != stdin) fclose(input);
+    } else {
+        append_options(&requests);
+        for (int i = 0; i < argc; i++) append_word(&requests, argv[i]);
+        exec_buffer_append(&requests, "\n", 1);
+        request_count = 1;
+    }
+
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || socket_address(socket_path, &address) < 0 ||
+        connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot reach daemon on %s: %s\n", socket_path, strerror(errno));
+        goto cleanup;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    size_t sent = 0;
+    int answered = 0, failed = 0, last_status = 0;
+    fflush(stdout);
+
+    while (answered < request_count) {
+        struct pollfd pfd = { fd, POLLIN | (sent < requests.length ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if ((pfd.revents & POLLOUT) && sent < requests.length) {
+            ssize_t written = send(fd, requests.data + sent, requests.length - sent, MSG_NOSIGNAL);
+            if (written > 0) sent += written;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            char chunk[65536];
+            ssize_t got = read(fd, chunk, sizeof(chunk));
+            if (got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (got <= 0) {
+                fprintf(stderr, "Daemon closed the connection\n");
+                break;
+            }
+            exec_buffer_append(&responses, chunk, got);
+        }
+
+        // Print every complete response
+        size_t consumed = 0;
+        for (;;) {
+            char* newline = memchr(responses.data + consumed, '\n', responses.length - consumed);
+            int status;
+            long long length;
+            if (newline == NULL || sscanf(responses.data + consumed, "%d %lld", &status, &length) != 2) break;
+
+            size_t body = newline - responses.data + 1;
+            if (responses.length - body < (size_t)length) break;
+
+            for (size_t done = 0; done < (size_t)length; ) {
+                ssize_t written = write(STDOUT_FILENO, responses.data + body + done, length - done);
+                if (written <= 0) break;
+                done += written;
+            }
+            consumed = body + length;
+
+            if (script) fprintf(stderr, "[%d] %s: exit %d\n", sent_requests[answered].line,
+                                sent_requests[answered].command, status);
+            if (status != 0) failed++;
+            last_status = status;
+            answered++;
+        }
+        memmove(responses.data, responses.data + consumed, responses.length - consumed);
+        responses.length -= consumed;
+    }
+
+    if (answered == request_count) {
+        if (script) {
+            fprintf(stderr, "%d commands, %d succeeded, %d failed\n", answered, answered - failed, failed);
+            result = failed ? 1 : 0;
+        } else {
+            result = last_status;
+        }
+    }
+
+cleanup:
+    if (fd >= 0) close(fd);
+    free(sent_requests);
+    exec_buffer_free(&requests);
+    exec_buffer_free(&line);
+    exec_buffer_free(&responses);
+    return result;
+}
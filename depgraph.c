@@ -0,0 +1,472 @@
+#include "func.h"
+#include <pthread.h>
+
+// Unit dependency graph: for every unit, the units it must be (re)started
+// after, read from `systemctl show -p Id,Requires,After` or from the
+// fixture named by $SERVICE_DEPENDENCY_FIXTURE (the same key=value blocks,
+// with unit names as the table spells them). As in systemd, only After=
+// orders a unit after the target. Requires= does not order anything; it is
+// kept so that a failed target ordered before its dependent cancels it.
+//
+// Nodes are fetched lazily, only for the units being planned, and cached.
+// A node is fetched again once it is older than DEPGRAPH_MAX_AGE or after
+// depgraph_invalidate(), which the refresh calls for units that appear or
+// disappear. Only .service targets are kept, so ordering through targets
+// and sockets is not followed. The graph has its own lock and name pool so
+// planning never needs the service lock, and the lock is never held while
+// systemctl runs.
+
+#define DEPGRAPH_MAX_AGE 300        // Seconds a fetched node stays valid
+#define DEPGRAPH_PROPERTIES "Id,Requires,After"
+
+#define EDGE_REQUIRES 1             // Edge kinds, combined when both are listed
+#define EDGE_AFTER 2
+
+typedef struct DependencyNode {
+    uint32_t* edges;        // Name ids this unit Requires= or is ordered after
+    uint8_t* kinds;         // Per edge: EDGE_* bits
+    int edge_count;
+    int edge_capacity;
+    time_t loaded;          // 0 = never fetched, or invalidated
+} DependencyNode;
+
+static StringPool graph_names = {0};
+static DependencyNode* graph_nodes = NULL;     // Indexed by name id
+static int graph_capacity = 0;
+static pthread_mutex_t graph_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Node for a name, creating it if needed. Returns NULL on allocation failure.
+static DependencyNode* node_for(const char* name, size_t length, uint32_t* id_out) {
+    uint32_t id = intern_bytes(&graph_names, name, length);
+    if (id == STRING_ID_NONE) return NULL;
+
+    if ((int)id >= graph_capacity) {
+        int new_capacity = graph_capacity ? graph_capacity * 2 : 256;
+        while (new_capacity <= (int)id) new_capacity *= 2;
+        DependencyNode* grown = (DependencyNode*)realloc(graph_nodes, new_capacity * sizeof(DependencyNode));
+        if (grown == NULL) return NULL;
+        memset(grown + graph_capacity, 0, (new_capacity - graph_capacity) * sizeof(DependencyNode));
+        graph_nodes = grown;
+        graph_capacity = new_capacity;
+    }
+    if (id_out) *id_out = id;
+    return &graph_nodes[id];
+}
+
+static void add_edge(DependencyNode* node, uint32_t target, int kind) {
+    for (int i = 0; i < node->edge_count; i++) {
+        if (node->edges[i] == target) {
+            node->kinds[i] |= (uint8_t)kind;
+            return;
+        }
+    }
+
+    if (node->edge_count == node->edge_capacity) {
+        int new_capacity = node->edge_capacity ? node->edge_capacity * 2 : 8;
+        uint32_t* edges = (uint32_t*)realloc(node->edges, new_capacity * sizeof(uint32_t));
+        if (edges == NULL) return;
+        node->edges = edges;
+        uint8_t* kinds = (uint8_t*)realloc(node->kinds, new_capacity * sizeof(uint8_t));
+        if (kinds == NULL) return;
+        node->kinds = kinds;
+        node->edge_capacity = new_capacity;
+    }
+    node->edges[node->edge_count] = target;
+    node->kinds[node->edge_count++] = (uint8_t)kind;
+}
+
+// Table name of a .service unit of source ("db.service" -> "db" or
+// "web1/db"). Returns its length, or -1 for other unit types.
+static int service_name_of(int source, const char* unit, size_t length, char* out) {
+    if (length <= 8 || memcmp(unit + length - 8, ".service", 8) != 0) return -1;
+    return source_qualify(source, unit, length - 8, out, MAX_SERVICE_NAME);
+}
+
+// One "key=value" property block of systemctl show output, as spans into it
+typedef struct ShowBlock {
+    const char* id;
+    size_t id_length;
+    const char* lists[2];   // Requires, After
+    size_t lengths[2];
+} ShowBlock;
+
+static void commit_block(const ShowBlock* block, int source, time_t now) {
+    static const int kinds[2] = { EDGE_REQUIRES, EDGE_AFTER };
+    char name[MAX_SERVICE_NAME];
+    uint32_t id;
+
+    if (block->id == NULL) return;
+    int name_length = service_name_of(source, block->id, block->id_length, name);
+    if (name_length <= 0 || node_for(name, name_length, &id) == NULL) return;
+
+    graph_nodes[id].edge_count = 0;
+    for (int i = 0; i < 2; i++) {
+        if (block->lists[i] == NULL) continue;
+        // Interning targets can grow graph_nodes, so pass the node by id
+        const char* list = block->lists[i];
+        const char* end = list + block->lengths[i];
+        while (list < end) {
+            while (list < end && *list == ' ') list++;
+            const char* word = list;
+            while (list < end && *list != ' ') list++;
+
+            char target_name[MAX_SERVICE_NAME];
+            uint32_t target;
+            int target_length = service_name_of(source, word, list - word, target_name);
+            if (target_length <= 0 || node_for(target_name, target_length, &target) == NULL) continue;
+            if (target != id) add_edge(&graph_nodes[id], target, kinds[i]);
+        }
+    }
+    graph_nodes[id].loaded = now;
+}
+
+// Store every block of systemctl show output; names belong to source
+static void parse_show_output(int source, const char* data, size_t length, time_t now) {
+    static const char* keys[2] = { "Requires=", "After=" };
+    const char* end = data + length;
+    ShowBlock block;
+
+    memset(&block, 0, sizeof(block));
+    while (data < end) {
+        const char* line_end = memchr(data, '\n', end - data);
+        if (line_end == NULL) line_end = end;
+        size_t line_length = line_end - data;
+
+        if (line_length == 0) {
+            commit_block(&block, source, now);
+            memset(&block, 0, sizeof(block));
+        } else if (line_length > 3 && strncmp(data, "Id=", 3) == 0) {
+            block.id = data + 3;
+            block.id_length = line_length - 3;
+        } else {
+            for (int i = 0; i < 2; i++) {
+                size_t key_length = strlen(keys[i]);
+                if (line_length >= key_length && strncmp(data, keys[i], key_length) == 0) {
+                    block.lists[i] = data + key_length;
+                    block.lengths[i] = line_length - key_length;
+                }
+            }
+        }
+        data = line_end + 1;
+    }
+    commit_block(&block, source, now);
+}
+
+static int node_is_fresh(const char* name, time_t now) {
+    uint32_t id;
+    DependencyNode* node = node_for(name, strlen(name), &id);
+    return node == NULL || (node->loaded != 0 && now - node->loaded <= DEPGRAPH_MAX_AGE);
+}
+
+// Read the fixture into output. Returns 0, or -1 if it cannot be read.
+static int read_fixture(const char* path, ExecBuffer* output) {
+    FILE* file = fopen(path, "r");
+    char chunk[8192];
+    size_t got;
+
+    if (file == NULL) {
+        perror("Failed to open dependency fixture");
+        return -1;
+    }
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (exec_buffer_append(output, chunk, got) < 0) break;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Fetch every named unit whose node is missing or stale: one systemctl show
+// per source, all sources at once. Units that were asked for but not
+// described count as fetched with no dependencies. graph_lock is taken only
+// to find the stale nodes and to store the results, so a refresh calling
+// depgraph_invalidate() under the service lock never waits on systemctl.
+static void fetch_nodes(const char* const names[], int count) {
+    const char* fixture = getenv("SERVICE_DEPENDENCY_FIXTURE");
+    time_t now = time(NULL);
+    int sources = source_count();
+    int pending[SOURCE_MAX] = {0};
+    int total = 0;
+    uint8_t* stale = (uint8_t*)malloc(count);
+
+    if (stale == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+
+    pthread_mutex_lock(&graph_lock);
+    for (int i = 0; i < count; i++) {
+        const char* unit;
+        int source = source_of_unit(names[i], &unit);
+        stale[i] = source >= 0 && !node_is_fresh(names[i], now);
+        if (stale[i]) {
+            pending[source]++;
+            total++;
+        }
+    }
+    pthread_mutex_unlock(&graph_lock);
+    if (total == 0) {
+        free(stale);
+        return;
+    }
+
+    ExecBuffer outputs[SOURCE_MAX];
+    int ids[SOURCE_MAX], codes[SOURCE_MAX], spawned = 0;
+    int fetched[SOURCE_MAX] = {0};
+
+    memset(outputs, 0, sizeof(outputs));
+    if (fixture && *fixture) {
+        if (read_fixture(fixture, &outputs[0]) == 0) {
+            ids[0] = 0;
+            codes[0] = 0;
+            spawned = 1;
+            for (int source = 0; source < sources; source++) fetched[source] = 1;
+        }
+    } else {
+        // Arguments: show -p PROPERTIES -- units..., behind each source's
+        // command and scope options
+        char (*units)[MAX_SERVICE_NAME + 16] = malloc(total * sizeof(*units));
+        const char** args = (const char**)malloc(sources * (total + 5) * sizeof(char*));
+        const char** argv = (const char**)malloc(sources * (total + 8) * sizeof(char*));
+        const char* const* argvs[SOURCE_MAX];
+        int next_unit = 0;
+
+        if (units == NULL || args == NULL || argv == NULL) {
+            printf("Memory allocation failed!\n");
+            free(units);
+            free(args);
+            free(argv);
+            free(stale);
+            return;
+        }
+
+        for (int source = 0; source < sources; source++) {
+            if (pending[source] == 0) continue;
+            const char** source_args = args + source * (total + 5);
+            const char** source_argv = argv + source * (total + 8);
+            int arg_count = 0;
+
+            source_args[arg_count++] = "show";
+            source_args[arg_count++] = "-p";
+            source_args[arg_count++] = DEPGRAPH_PROPERTIES;
+            source_args[arg_count++] = "--";
+            for (int i = 0; i < count; i++) {
+                const char* unit;
+                if (!stale[i] || source_of_unit(names[i], &unit) != source) continue;
+                snprintf(units[next_unit], sizeof(units[next_unit]), "%s.service", unit);
+                source_args[arg_count++] = units[next_unit++];
+            }
+            source_args[arg_count] = NULL;
+
+            if (source_command(source, source_argv, total + 8, source_args) < 0) continue;
+            argvs[spawned] = source_argv;
+            ids[spawned++] = source;
+        }
+
+        exec_capture_all(argvs, outputs, codes, spawned, COMMAND_TIMEOUT);
+        for (int i = 0; i < spawned; i++) {
+            if (codes[i] != 0) {
+                printf("Failed to read unit dependencies from source '%s'.\n", source_name(ids[i]));
+                continue;
+            }
+            fetched[ids[i]] = 1;
+        }
+        free(units);
+        free(args);
+        free(argv);
+    }
+
+    pthread_mutex_lock(&graph_lock);
+    for (int i = 0; i < spawned; i++) {
+        if (codes[i] == 0) parse_show_output(ids[i], outputs[i].data ? outputs[i].data : "", outputs[i].length, now);
+    }
+    for (int i = 0; i < count; i++) {
+        const char* unit;
+        uint32_t id;
+        if (stale[i] && fetched[source_of_unit(names[i], &unit)] && !node_is_fresh(names[i], now) &&
+            node_for(names[i], strlen(names[i]), &id) != NULL) {
+            graph_nodes[id].edge_count = 0;
+            graph_nodes[id].loaded = now;
+        }
+    }
+    pthread_mutex_unlock(&graph_lock);
+
+    for (int source = 0; source < SOURCE_MAX; source++) exec_buffer_free(&outputs[source]);
+    free(stale);
+}
+
+// Plan (re)starts of the named units as waves: every unit runs in a later
+// wave than the units it is ordered after, so each wave can run in
+// parallel. Units caught in an ordering cycle share one final wave.
+// Returns 0, or -1 if the plan could not be built.
+int depgraph_plan(const char* const names[], int count, DependencyPlan* plan) {
+    memset(plan, 0, sizeof(*plan));
+    plan->count = count;
+    if (count == 0) return 0;
+
+    fetch_nodes(names, count);
+    pthread_mutex_lock(&graph_lock);
+
+    uint32_t* ids = (uint32_t*)malloc(count * sizeof(uint32_t));
+    for (int i = 0; ids != NULL && i < count; i++) {
+        if (node_for(names[i], strlen(names[i]), &ids[i]) == NULL) {
+            free(ids);
+            ids = NULL;
+        }
+    }
+    int* position = ids ? (int*)malloc(graph_names.count * sizeof(int)) : NULL;
+    int* predecessor_first = (int*)calloc(count + 1, sizeof(int));
+    int* successor_first = (int*)calloc(count + 1, sizeof(int));
+    int* indegree = (int*)calloc(count, sizeof(int));
+    int* order = (int*)malloc(count * sizeof(int));
+    int* predecessors = NULL;
+    int* successors = NULL;
+    plan->wave = (int*)calloc(count, sizeof(int));
+    plan->required_first = (int*)calloc(count + 1, sizeof(int));
+
+    if (position != NULL) {
+        for (int i = 0; i < graph_names.count; i++) position[i] = -1;
+        for (int i = 0; i < count; i++) position[ids[i]] = i;
+
+        // Count in-set edges, then list them: After= ones as predecessors,
+        // Requires= ones in the plan for cancellation
+        int edges = 0;
+        for (int i = 0; i < count; i++) {
+            const DependencyNode* node = &graph_nodes[ids[i]];
+            for (int e = 0; e < node->edge_count; e++) {
+                int j = position[node->edges[e]];
+                if (j >= 0 && j != i) edges++;
+            }
+        }
+        predecessors = (int*)malloc((edges ? edges : 1) * sizeof(int));
+        successors = (int*)malloc((edges ? edges : 1) * sizeof(int));
+        plan->required = (int*)malloc((edges ? edges : 1) * sizeof(int));
+    }
+
+    if (position == NULL || predecessor_first == NULL || successor_first == NULL || indegree == NULL ||
+        order == NULL || predecessors == NULL || successors == NULL || plan->wave == NULL ||
+        plan->required_first == NULL || plan->required == NULL) {
+        pthread_mutex_unlock(&graph_lock);
+        printf("Memory allocation failed!\n");
+        free(ids);
+        free(position);
+        free(predecessor_first);
+        free(successor_first);
+        free(indegree);
+        free(order);
+        free(predecessors);
+        free(successors);
+        depgraph_plan_free(plan);
+        return -1;
+    }
+
+    int used = 0, required_used = 0;
+    for (int i = 0; i < count; i++) {
+        const DependencyNode* node = &graph_nodes[ids[i]];
+        predecessor_first[i] = used;
+        plan->required_first[i] = required_used;
+        for (int e = 0; e < node->edge_count; e++) {
+            int j = position[node->edges[e]];
+            if (j < 0 || j == i) continue;
+            if (node->kinds[e] & EDGE_AFTER) {
+                predecessors[used++] = j;
+                successor_first[j + 1]++;
+            }
+            if (node->kinds[e] & EDGE_REQUIRES) plan->required[required_used++] = j;
+        }
+        indegree[i] = used - predecessor_first[i];
+    }
+    predecessor_first[count] = used;
+    plan->required_first[count] = required_used;
+    pthread_mutex_unlock(&graph_lock);
+
+    // Invert the predecessor lists into successor lists, using order as
+    // each unit's fill cursor
+    for (int i = 0; i < count; i++) successor_first[i + 1] += successor_first[i];
+    for (int i = 0; i < count; i++) order[i] = successor_first[i];
+    for (int i = 0; i < count; i++) {
+        for (int p = predecessor_first[i]; p < predecessor_first[i + 1]; p++) {
+            successors[order[predecessors[p]]++] = i;
+        }
+    }
+
+    // Kahn's algorithm, placing each unit one wave after its latest predecessor
+    int head = 0, tail = 0;
+    for (int i = 0; i < count; i++) {
+        if (indegree[i] == 0) order[tail++] = i;
+    }
+    while (head < tail) {
+        int i = order[head++];
+        if (plan->wave[i] + 1 > plan->waves) plan->waves = plan->wave[i] + 1;
+        for (int s = successor_first[i]; s < successor_first[i + 1]; s++) {
+            int k = successors[s];
+            if (plan->wave[k] < plan->wave[i] + 1) plan->wave[k] = plan->wave[i] + 1;
+            if (--indegree[k] == 0) order[tail++] = k;
+        }
+    }
+    if (tail < count) {
+        printf("Dependency cycle among %d units; they will run together.\n", count - tail);
+        for (int i = 0; i < count; i++) {
+            if (indegree[i] > 0) plan->wave[i] = plan->waves;
+        }
+        plan->waves++;
+    }
+
+    free(ids);
+    free(position);
+    free(predecessor_first);
+    free(successor_first);
+    free(indegree);
+    free(order);
+    free(predecessors);
+    free(successors);
+    return 0;
+}
+
+void depgraph_plan_free(DependencyPlan* plan) {
+    free(plan->wave);
+    free(plan->required_first);
+    free(plan->required);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Forget a unit's cached dependencies, e.g. when it appears or disappears.
+// Units the graph has never seen cost only a lookup.
+void depgraph_invalidate(const char* name) {
+    pthread_mutex_lock(&graph_lock);
+    uint32_t id = string_pool_find(&graph_names, name);
+    if (id != STRING_ID_NONE) graph_nodes[id].loaded = 0;
+    pthread_mutex_unlock(&graph_lock);
+}
+
+// Print the waves the named units would be (re)started in
+void depgraph_display_plan(const char* const names[], int count) {
+    DependencyPlan plan;
+    if (depgraph_plan(names, count, &plan) < 0) return;
+
+    printf("\n=== Restart Plan: %d units in %d waves ===\n", count, plan.waves);
+    for (int wave = 0; wave < plan.waves; wave++) {
+        printf("Wave %d:\n", wave + 1);
+        for (int i = 0; i < count; i++) {
+            if (plan.wave[i] != wave) continue;
+            printf("  %s", names[i]);
+            for (int r = plan.required_first[i]; r < plan.required_first[i + 1]; r++) {
+                printf("%s%s", r == plan.required_first[i] ? " (requires " : ", ", names[plan.required[r]]);
+            }
+            printf("%s\n", plan.required_first[i] < plan.required_first[i + 1] ? ")" : "");
+        }
+    }
+    depgraph_plan_free(&plan);
+}
+
+void depgraph_free() {
+    pthread_mutex_lock(&graph_lock);
+    for (int i = 0; i < graph_capacity; i++) {
+        free(graph_nodes[i].edges);
+        free(graph_nodes[i].kinds);
+    }
+    free(graph_nodes);
+    graph_nodes = NULL;
+    graph_capacity = 0;
+    string_pool_free(&graph_names);
+    pthread_mutex_unlock(&graph_lock);
+}
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+// Exec layer: every subprocess is started with posix_spawnp (which glibc
+// implements with vfork-style clone) from an argv array, never through
+// /bin/sh, so unit names are passed verbatim and no extra shell process is
+// created. Output is read straight from a pipe into a reusable buffer.
+
+#define EXEC_READ_CHUNK 65536
+
+extern char** environ;
+
+// Spawn argv[0] from PATH. If stdout_fd is not NULL the child's stdout is a
+// pipe whose read end is stored there; otherwise stdout is inherited.
+// Returns 0 and sets *pid on success, -1 on failure.
+int exec_spawn(const char* const argv[], int* stdout_fd, pid_t* pid) {
+    posix_spawn_file_actions_t actions;
+    int pipe_fds[2] = { -1, -1 };
+
+    if (stdout_fd != NULL) {
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (stdout_fd != NULL) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    }
+
+    int result = posix_spawnp(pid, argv[0], &actions, NULL, (char* const*)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (stdout_fd != NULL) {
+        close(pipe_fds[1]);
+        if (result != 0) {
+            close(pipe_fds[0]);
+        } else {
+            *stdout_fd = pipe_fds[0];
+        }
+    }
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for a child and turn its status into an exit code (-1 if it did not
+// exit normally)
+int exec_wait(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Make room for at least extra more bytes
+static int buffer_reserve(ExecBuffer* buffer, size_t extra) {
+    if (buffer->length + extra + 1 <= buffer->capacity) return 0;
+
+    size_t new_capacity = buffer->capacity ? buffer->capacity : EXEC_READ_CHUNK;
+    while (buffer->length + extra + 1 > new_capacity) new_capacity *= 2;
+
+    char* grown = (char*)realloc(buffer->data, new_capacity);
+    if (grown == NULL) return -1;
+    buffer->data = grown;
+    buffer->capacity = new_capacity;
+    return 0;
+}
+
+// Run argv and collect its stdout into out (replacing previous contents,
+// always NUL-terminated). The child is killed if it runs longer than
+// timeout_seconds (0 = no limit). Returns the exit code, or -1 on spawn
+// failure, timeout or abnormal exit.
+int exec_capture(const char* const argv[], ExecBuffer* out, int timeout_seconds) {
+    int exit_code;
+    exec_capture_all(&argv, out, &exit_code, 1, timeout_seconds);
+    return exit_code;
+}
+
+// Run count commands side by side, collecting the stdout of argvs[i] into
+// outs[i] and its exit code (as exec_capture returns it) into
+// exit_codes[i]. All children share one deadline and one poll loop, so the
+// whole call takes about as long as the slowest command. Returns the
+// number of commands that exited with status 0.
+int exec_capture_all(const char* const* argvs[], ExecBuffer outs[], int exit_codes[], int count,
+                     int timeout_seconds) {
+    if (count <= 0) return 0;
+
+    struct pollfd pfds[count];
+    pid_t pids[count];
+    int open_fds = 0;
+
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = -1;
+        pfds[i].events = POLLIN;
+        pids[i] = -1;
+        exit_codes[i] = -1;
+        outs[i].length = 0;
+        if (buffer_reserve(&outs[i], 0) < 0) continue;
+        outs[i].data[0] = '\0';
+        if (exec_spawn(argvs[i], &pfds[i].fd, &pids[i]) < 0) {
+            pfds[i].fd = -1;
+            pids[i] = -1;
+            continue;
+        }
+        open_fds++;
+    }
+
+    time_t deadline = timeout_seconds > 0 ? time(NULL) + timeout_seconds : 0;
+
+    while (open_fds > 0) {
+        int wait_ms = -1;
+        if (deadline) {
+            time_t now = time(NULL);
+            if (now >= deadline) break;     // Still-open children are killed below
+            wait_ms = (int)(deadline - now) * 1000;
+        }
+
+        int ready = poll(pfds, count, wait_ms);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready <= 0) continue;
+
+        for (int i = 0; i < count; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) continue;
+
+            ssize_t got = -1;
+            if (buffer_reserve(&outs[i], EXEC_READ_CHUNK) == 0) {
+                got = read(pfds[i].fd, outs[i].data + outs[i].length, outs[i].capacity - outs[i].length - 1);
+                if (got < 0 && errno == EINTR) continue;
+            }
+            if (got <= 0) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;    // poll ignores negative descriptors
+                open_fds--;
+                continue;
+            }
+            outs[i].length += got;
+            outs[i].data[outs[i].length] = '\0';
+        }
+    }
+
+    int succeeded = 0;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] < 0) continue;
+        int killed = pfds[i].fd >= 0;
+        if (killed) {
+            close(pfds[i].fd);
+            kill(pids[i], SIGKILL);
+        }
+        int exit_code = exec_wait(pids[i]);
+        exit_codes[i] = killed ? -1 : exit_code;
+        if (exit_codes[i] == 0) succeeded++;
+    }
+    return succeeded;
+}
+
+// Append length bytes to the buffer, keeping it NUL-terminated
+int exec_buffer_append(ExecBuffer* buffer, const void* data, size_t length) {
+    if (buffer_reserve(buffer, length) < 0) return -1;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+    return 0;
+}
+
+void exec_buffer_free(ExecBuffer* buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
@@ -0,0 +1,255 @@
+#include "func.h"
+#include <pthread.h>
+
+// Flap detection: every service that has failed or been restarted gets a
+// ring of FLAP_BUCKETS time buckets covering the last flap_window seconds.
+// Recording an event touches one bucket (a bucket whose epoch has passed
+// is reset on reuse), and reading the window sums the fixed-size ring, so
+// both are O(1) per service.
+//
+// The counters feed a restart circuit breaker. It opens when a service
+// fails flap_threshold times within the window; while it is open automatic
+// restarts are held back. After flap_cooldown seconds it half-opens and
+// lets one trial restart through: success closes it, and any failure while
+// it is half-open, the trial's or another, opens it again. The only other
+// way out of half-open is the service recovering by itself. Failures are
+// entries into FAILED and failed restart attempts.
+//
+// Thresholds come from $SERVICE_FLAP_WINDOW, $SERVICE_FLAP_THRESHOLD and
+// $SERVICE_FLAP_COOLDOWN. Records are indexed by service_names id and have
+// their own lock, since restarts finish on the remediator thread.
+
+#define FLAP_BUCKETS 10
+
+typedef struct FlapBucket {
+    uint32_t epoch;         // time / bucket width when the counts were started
+    uint16_t failures;
+    uint16_t restarts;
+} FlapBucket;
+
+typedef struct FlapRecord {
+    FlapBucket buckets[FLAP_BUCKETS];
+    BreakerState state;
+    time_t opened_at;
+    int trial_running;      // Half-open trial restart in progress
+    int reported;           // Suppression reported since the breaker opened
+} FlapRecord;
+
+int flap_window = 300;
+int flap_threshold = 5;
+int flap_cooldown = 300;
+
+static FlapRecord** flap_records = NULL;   // Indexed by name id, NULL until needed
+static int flap_capacity = 0;
+static pthread_mutex_t flap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* breaker_state_to_string(BreakerState state) {
+    switch (state) {
+        case BREAKER_CLOSED: return "closed";
+        case BREAKER_OPEN: return "open";
+        case BREAKER_HALF_OPEN: return "half-open";
+        default: return "unknown";
+    }
+}
+
+// Apply $SERVICE_FLAP_WINDOW / $SERVICE_FLAP_THRESHOLD / $SERVICE_FLAP_COOLDOWN if set
+void flap_configure_from_env() {
+    const char* window = getenv("SERVICE_FLAP_WINDOW");
+    const char* threshold = getenv("SERVICE_FLAP_THRESHOLD");
+    const char* cooldown = getenv("SERVICE_FLAP_COOLDOWN");
+
+    if (window && atoi(window) > 0) flap_window = atoi(window);
+    if (threshold && atoi(threshold) > 0) flap_threshold = atoi(threshold);
+    if (cooldown && atoi(cooldown) > 0) flap_cooldown = atoi(cooldown);
+}
+
+static uint32_t current_epoch(time_t now) {
+    int width = flap_window / FLAP_BUCKETS;
+    return (uint32_t)(now / (width > 0 ? width : 1));
+}
+
+// Record for a name id; created if create is set, else NULL when absent
+static FlapRecord* record_for(uint32_t name_id, int create) {
+    if (name_id == STRING_ID_NONE) return NULL;
+    if ((int)name_id < flap_capacity && flap_records[name_id] != NULL) return flap_records[name_id];
+    if (!create) return NULL;
+
+    if ((int)name_id >= flap_capacity) {
+        int new_capacity = flap_capacity ? flap_capacity * 2 : 256;
+        while (new_capacity <= (int)name_id) new_capacity *= 2;
+        FlapRecord** grown = (FlapRecord**)realloc(flap_records, new_capacity * sizeof(FlapRecord*));
+        if (grown == NULL) return NULL;
+        memset(grown + flap_capacity, 0, (new_capacity - flap_capacity) * sizeof(FlapRecord*));
+        flap_records = grown;
+        flap_capacity = new_capacity;
+    }
+    flap_records[name_id] = (FlapRecord*)calloc(1, sizeof(FlapRecord));
+    return flap_records[name_id];
+}
+
+// Bucket for now, reset if it still holds an older epoch's counts
+static FlapBucket* current_bucket(FlapRecord* record, time_t now) {
+    uint32_t epoch = current_epoch(now);
+    FlapBucket* bucket = &record->buckets[epoch % FLAP_BUCKETS];
+    if (bucket->epoch != epoch) {
+        bucket->epoch = epoch;
+        bucket->failures = 0;
+        bucket->restarts = 0;
+    }
+    return bucket;
+}
+
+static void window_counts(const FlapRecord* record, time_t now, int* failures, int* restarts) {
+    uint32_t epoch = current_epoch(now);
+    *failures = *restarts = 0;
+    for (int i = 0; i < FLAP_BUCKETS; i++) {
+        const FlapBucket* bucket = &record->buckets[i];
+        if (bucket->epoch <= epoch && epoch - bucket->epoch < FLAP_BUCKETS) {
+            *failures += bucket->failures;
+            *restarts += bucket->restarts;
+        }
+    }
+}
+
+// Move the breaker along with time: open -> half-open after the cooldown.
+// Time alone never closes it; that takes a successful trial or a recovery.
+static void advance(FlapRecord* record, time_t now) {
+    if (record->state == BREAKER_OPEN && now >= record->opened_at + flap_cooldown) {
+        record->state = BREAKER_HALF_OPEN;
+        record->trial_running = 0;
+    }
+}
+
+static void open_breaker(FlapRecord* record, time_t now) {
+    record->state = BREAKER_OPEN;
+    record->opened_at = now;
+    record->trial_running = 0;
+    record->reported = 0;
+}
+
+static void add_failure(FlapRecord* record, time_t now) {
+    FlapBucket* bucket = current_bucket(record, now);
+    if (bucket->failures < UINT16_MAX) bucket->failures++;
+
+    advance(record, now);
+    if (record->state == BREAKER_HALF_OPEN) {
+        open_breaker(record, now);
+    } else if (record->state == BREAKER_CLOSED) {
+        int failures, restarts;
+        window_counts(record, now, &failures, &restarts);
+        if (failures >= flap_threshold) open_breaker(record, now);
+    }
+}
+
+// A service entered FAILED
+void flap_record_failure(uint32_t name_id, time_t now) {
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 1);
+    if (record) add_failure(record, now);
+    pthread_mutex_unlock(&flap_lock);
+}
+
+// A service left FAILED: a half-open breaker closes
+void flap_record_recovery(uint32_t name_id, time_t now) {
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 0);
+    if (record) {
+        advance(record, now);
+        if (record->state == BREAKER_HALF_OPEN) record->state = BREAKER_CLOSED;
+    }
+    pthread_mutex_unlock(&flap_lock);
+}
+
+// A restart of the service finished; a failed one also counts as a
+// failure. A successful half-open trial closes the breaker.
+void flap_record_restart(uint32_t name_id, int succeeded, time_t now) {
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 1);
+    if (record) {
+        FlapBucket* bucket = current_bucket(record, now);
+        if (bucket->restarts < UINT16_MAX) bucket->restarts++;
+        int trial = record->trial_running;
+        record->trial_running = 0;
+        if (!succeeded) {
+            add_failure(record, now);
+        } else {
+            advance(record, now);
+            if (trial && record->state == BREAKER_HALF_OPEN) record->state = BREAKER_CLOSED;
+        }
+    }
+    pthread_mutex_unlock(&flap_lock);
+}
+
+// Ask whether an automatic restart may run now. Returns 0 if it may (a
+// half-open breaker lets this one through as its trial), otherwise the
+// seconds to hold it back. *first_hold is set on the first refusal since
+// the breaker opened, so callers report it once.
+time_t flap_hold_restart(uint32_t name_id, time_t now, int* first_hold) {
+    time_t hold = 0;
+
+    *first_hold = 0;
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 0);
+    if (record) {
+        advance(record, now);
+        if (record->state == BREAKER_OPEN) {
+            hold = record->opened_at + flap_cooldown - now;
+            *first_hold = !record->reported;
+            record->reported = 1;
+        } else if (record->state == BREAKER_HALF_OPEN) {
+            if (record->trial_running) {
+                hold = FAILED_RETRY_BASE;
+            } else {
+                record->trial_running = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&flap_lock);
+
+    if (hold > 0) metrics_count(METRIC_RESTARTS_SUPPRESSED, 1);
+    return hold;
+}
+
+// An allowed trial restart did not run (e.g. it was cancelled)
+void flap_release_trial(uint32_t name_id) {
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 0);
+    if (record) record->trial_running = 0;
+    pthread_mutex_unlock(&flap_lock);
+}
+
+// Breaker state and window counts of a service. Returns 1 if it has a
+// record, 0 if it has neither failed nor been restarted.
+int flap_status(uint32_t name_id, time_t now, FlapStatus* status) {
+    memset(status, 0, sizeof(*status));
+    pthread_mutex_lock(&flap_lock);
+    FlapRecord* record = record_for(name_id, 0);
+    if (record) {
+        advance(record, now);
+        status->state = record->state;
+        window_counts(record, now, &status->failures, &status->restarts);
+        if (record->state == BREAKER_OPEN) status->half_open_at = record->opened_at + flap_cooldown;
+    }
+    pthread_mutex_unlock(&flap_lock);
+    return record != NULL;
+}
+
+// Drop the record of a name id that has left the pool, before the id is
+// reused for another service
+void flap_forget(uint32_t name_id) {
+    pthread_mutex_lock(&flap_lock);
+    if ((int)name_id < flap_capacity) {
+        free(flap_records[name_id]);
+        flap_records[name_id] = NULL;
+    }
+    pthread_mutex_unlock(&flap_lock);
+}
+
+void flap_free() {
+    pthread_mutex_lock(&flap_lock);
+    for (int i = 0; i < flap_capacity; i++) free(flap_records[i]);
+    free(flap_records);
+    flap_records = NULL;
+    flap_capacity = 0;
+    pthread_mutex_unlock(&flap_lock);
+}
@@ -1,475 +1,1244 @@
 #include "func.h"
+#include <pthread.h>
 
 // Global variables definition
 Service* service_list = NULL;
-LogEntry* log_stack = NULL;
-FailedService* failed_queue_front = NULL;
-FailedService* failed_queue_rear = NULL;
-BSTNode* service_bst = NULL;
-int failed_queue_size = 0;
+EventLog event_log = {0};
+RetryScheduler failed_scheduler = {0};
+ServiceIndex service_index = {0};
+ServiceTable service_table = {0};
+StringPool service_names = { .reclaimable = 1 };
+StringPool service_descriptions = { .reclaimable = 1 };
+
+// Per-type node pools backing the lists above
+NodePool service_pool = POOL_INITIALIZER(Service, 256);
+NodePool failed_pool = POOL_INITIALIZER(FailedService, 64);
+
+// Generation counter bumped on every refresh; units not seen in the
+// current generation have disappeared from the system
+static unsigned int refresh_generation = 0;
+
+// Record one transition in the change set, growing it as needed
+static void record_change(ServiceChangeSet* changes, const char* name, ChangeKind kind,
+                          ServiceStatus old_status, ServiceStatus new_status) {
+    if (changes == NULL) return;
+    
+    if (changes->count == changes->capacity) {
+        int new_capacity = changes->capacity ? changes->capacity * 2 : 16;
+        ServiceChange* grown = (ServiceChange*)realloc(changes->changes, 
+                                                       new_capacity * sizeof(ServiceChange));
+        if (grown == NULL) {
+            printf("Memory allocation failed!\n");
+            return;
+        }
+        changes->changes = grown;
+        changes->capacity = new_capacity;
+    }
+    
+    ServiceChange* change = &changes->changes[changes->count++];
+    strncpy(change->name, name, MAX_SERVICE_NAME - 1);
+    change->name[MAX_SERVICE_NAME - 1] = '\0';
+    change->kind = kind;
+    change->old_status = old_status;
+    change->new_status = new_status;
+}
+
+// Drop one reference to a service name. The last one removes it from the
+// pool: its flap record goes, and its string is freed once no published
+// snapshot can show it. Called with the service lock held.
+void release_service_name(uint32_t name_id) {
+    char* removed = string_pool_release(&service_names, name_id);
+    if (removed == NULL) return;
+    flap_forget(name_id);
+    snapshot_defer_free(removed);
+}
+
+// Release a failed queue entry together with its reference to the name
+static void release_failed_entry(FailedService* entry) {
+    release_service_name(entry->name_id);
+    pool_release(&failed_pool, entry);
+}
+
+// Set a service's unit details, moving its description reference when
+// the description changes
+void set_service_unit_info(Service* service, int source, const UnitRecord* unit, uint32_t description_id) {
+    uint32_t old_id = service_table.description_id[service->row];
+    if (description_id != old_id) {
+        string_pool_retain(&service_descriptions, description_id);
+        char* removed = string_pool_release(&service_descriptions, old_id);
+        if (removed != NULL) snapshot_defer_free(removed);
+    }
+    table_set_unit_info(&service_table, service->row, source, unit, description_id);
+}
+
+// Vacate a service's row, dropping the row's name and description references
+static void remove_service_row(int row) {
+    uint32_t name_id = service_table.name_id[row];
+    char* description = string_pool_release(&service_descriptions, service_table.description_id[row]);
+    if (description != NULL) snapshot_defer_free(description);
+    service_table.description_id[row] = STRING_ID_NONE;
+    table_remove_row(&service_table, row);
+    release_service_name(name_id);
+}
+
+// Reusable buffers for subprocess output, one per unit source
+static ExecBuffer command_outputs[SOURCE_MAX];
+
+// Unit listings for refreshes, which may run on the background refresher;
+// refresh_lock lets only one refresh use them at a time
+static ExecBuffer unit_listings[SOURCE_MAX];
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LISTING_MAX_ARGS 16
+
+// Run a systemctl listing (args follow the scope options) against every
+// source at once, so the enumeration takes as long as the slowest source.
+// Each source's exit code goes to results. Returns how many sources were
+// listed, i.e. exited with status 0; a failed systemctl (no bus, no
+// permission) prints nothing, and its empty output must not be taken as
+// a source without units.
+static int capture_listings(const char* const args[], ExecBuffer outs[], int results[]) {
+    const char* argv_storage[SOURCE_MAX][LISTING_MAX_ARGS];
+    const char* const* argvs[SOURCE_MAX];
+    int ids[SOURCE_MAX], codes[SOURCE_MAX];
+    int sources = source_count(), spawned = 0, listed = 0;
+    uint64_t started = metrics_now();
+    
+    for (int source = 0; source < sources; source++) {
+        results[source] = -1;
+        if (source_command(source, argv_storage[source], LISTING_MAX_ARGS, args) < 0) continue;
+        argvs[spawned] = argv_storage[source];
+        ids[spawned++] = source;
+    }
+    
+    exec_capture_all(argvs, outs, codes, spawned, COMMAND_TIMEOUT);
+    for (int i = 0; i < spawned; i++) {
+        results[ids[i]] = codes[i];
+        if (codes[i] == 0) listed++;
+    }
+    
+    metrics_count(METRIC_ENUMERATIONS, sources);
+    metrics_count(METRIC_ENUMERATION_FAILURES, sources - listed);
+    metrics_observe_since(LATENCY_ENUMERATE, started);
+    return listed;
+}
+
+// Table name of a listed unit: system units are matched straight from the
+// listing, others are qualified with their source into buffer. Returns
+// NULL if the qualified name does not fit.
+static const char* listed_unit_name(int source, const UnitRecord* unit, char* buffer, size_t* length) {
+    if (source == 0) {
+        *length = unit->name_length;
+        return unit->name;
+    }
+    int qualified = source_qualify(source, unit->name, unit->name_length, buffer, MAX_SERVICE_NAME);
+    if (qualified < 0) return NULL;
+    *length = (size_t)qualified;
+    return buffer;
+}
+
+// Apply one source's systemctl-formatted listing to the table. Existing
+// records are updated in place and new units are added. Returns the
+// number of transitions.
+static int reconcile_listing(int source, const char* data, size_t length, ServiceChangeSet* changes) {
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
+    int transitions = 0, parsed = 0;
+    
+    unit_tokenizer_init(&tokenizer, data, length);
+    while (unit_tokenizer_next(&tokenizer, &unit)) {
+        char qualified[MAX_SERVICE_NAME];
+        size_t name_length;
+        const char* name = listed_unit_name(source, &unit, qualified, &name_length);
+        if (name == NULL) continue;
+        parsed++;
+        
+        // Units already known are matched without copying; only a new
+        // unit's name is copied out
+        Service* service = index_find_bytes(&service_index, name, name_length);
+        if (service == NULL) {
+            char service_name[MAX_SERVICE_NAME];
+            if (name_length >= MAX_SERVICE_NAME) continue;
+            memcpy(service_name, name, name_length);
+            service_name[name_length] = '\0';
+            
+            service = add_service_to_list(service_name, unit.status, 0);
+            if (service == NULL) continue;
+            depgraph_invalidate(service_name);
+            record_change(changes, service_name, CHANGE_ADDED, unit.status, unit.status);
+            transitions++;
+        } else {
+            ServiceStatus old_status = service_status(service);
+            if (old_status != unit.status) {
+                record_change(changes, service->name, CHANGE_STATUS, old_status, unit.status);
+                set_service_status(service, unit.status);
+                transitions++;
+            }
+            service->seen_generation = refresh_generation;
+        }
+        
+        // Descriptions rarely change, so compare before interning
+        uint32_t description_id = service_table.description_id[service->row];
+        const char* description = string_pool_get(&service_descriptions, description_id);
+        if (description == NULL || strncmp(description, unit.description, unit.description_length) != 0 ||
+            description[unit.description_length] != '\0') {
+            description_id = intern_bytes(&service_descriptions, unit.description, unit.description_length);
+        }
+        set_service_unit_info(service, source, &unit, description_id);
+    }
+    
+    metrics_count(METRIC_PARSED_UNITS, parsed);
+    return transitions;
+}
+
+// Remove units of the listed sources (a bit per source id) that were not
+// reported in this generation. Units of sources that could not be listed
+// keep their last known state.
+static int sweep_unlisted(unsigned int listed_sources, ServiceChangeSet* changes) {
+    int transitions = 0;
+    Service** link = &service_list;
+    
+    while (*link != NULL) {
+        Service* service = *link;
+        if (service->seen_generation != refresh_generation &&
+            (listed_sources & (1u << service_table.source[service->row]))) {
+            ServiceStatus old_status = service_status(service);
+            record_change(changes, service->name, CHANGE_REMOVED, old_status, old_status);
+            depgraph_invalidate(service->name);
+            index_remove(&service_index, service->name);
+            remove_service_row(service->row);
+            resource_release_row(&resource_sampler, service->row);
+            *link = service->next;
+            pool_release(&service_pool, service);
+            transitions++;
+        } else {
+            link = &service->next;
+        }
+    }
+    return transitions;
+}
+
+// Reconcile the system manager's units with systemctl-formatted output in
+// data. Existing records are updated in place, new units are added and
+// system units that are no longer listed are removed. Returns the number
+// of transitions.
+int reconcile_services(const char* data, size_t length, ServiceChangeSet* changes) {
+    uint64_t started = metrics_now();
+    
+    refresh_generation++;
+    int transitions = reconcile_listing(0, data, length, changes);
+    transitions += sweep_unlisted(1u, changes);
+    
+    metrics_observe_since(LATENCY_PARSE, started);
+    return transitions;
+}
+
+// Refresh the service table from every unit source, collecting transitions
+// into changes, and publish the result. The listings are collected
+// concurrently without the service write lock, which is held only while
+// they are applied. A source that cannot be listed keeps its units and is
+// marked in changes->failed_sources; nothing is printed, since this also
+// runs on background threads, so callers report failures themselves.
+// Returns -1 if no source could be listed.
+int refresh_services_from_system(ServiceChangeSet* changes) {
+    // Get all services with more detailed status information
+    const char* args[] = { "list-units", "--type=service", "--all", "--no-pager", "--no-legend", NULL };
+    int results[SOURCE_MAX];
+    
+    pthread_mutex_lock(&refresh_lock);
+    if (capture_listings(args, unit_listings, results) == 0) {
+        pthread_mutex_unlock(&refresh_lock);
+        if (changes) changes->failed_sources = (1u << source_count()) - 1;
+        return -1;
+    }
+    
+    service_lock();
+    uint64_t started = metrics_now();
+    unsigned int listed = 0;
+    int transitions = 0;
+    
+    refresh_generation++;
+    for (int source = 0; source < source_count(); source++) {
+        if (results[source] != 0) {
+            if (changes) changes->failed_sources |= 1u << source;
+            continue;
+        }
+        listed |= 1u << source;
+        transitions += reconcile_listing(source, unit_listings[source].data, unit_listings[source].length, changes);
+    }
+    transitions += sweep_unlisted(listed, changes);
+    metrics_observe_since(LATENCY_PARSE, started);
+    if (listed == (1u << source_count()) - 1) state_file_mark_fresh();
+    
+    // Pick up main PIDs and resource use for the refreshed units; units
+    // seen running for the first time have their cgroups looked up after
+    resource_sample_all(&resource_sampler, &service_table);
+    snapshot_publish();
+    service_unlock();
+    if (resource_lookup_cgroups(&resource_sampler, &service_table) > 0) {
+        service_lock();
+        snapshot_publish();
+        service_unlock();
+    }
+    pthread_mutex_unlock(&refresh_lock);
+    return transitions;
+}
 
 // Load services from system using systemctl
 void load_services_from_system() {
-    FILE *fp;
-    char line[1024];
-    char service_name[MAX_SERVICE_NAME];
-    char load_state[64], active_state[64], sub_state[64];
+    ServiceChangeSet changes = {0};
     
     printf("Loading services from system...\n");
     
-    // Get all services with more detailed status information
-    fp = popen("systemctl list-units --type=service --all --no-pager --no-legend", "r");
-    if (fp == NULL) {
-        perror("Failed to load services");
+    int result = refresh_services_from_system(&changes);
+    report_failed_sources(stdout, changes.failed_sources);
+    if (result < 0) {
+        printf("Failed to load services.\n");
+        free_change_set(&changes);
         return;
     }
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        // Parse systemctl output format: UNIT LOAD ACTIVE SUB DESCRIPTION
-        int parsed = sscanf(line, "%255s %63s %63s %63s", 
-                           service_name, load_state, active_state, sub_state);
-        
-        if (parsed >= 4) {
-            // Remove .service suffix if present
-            char* dot = strstr(service_name, ".service");
-            if (dot) *dot = '\0';
-            
-            // Use the active state and sub-state for more accurate status
-            ServiceStatus status;
-            
-            if (strcmp(active_state, "active") == 0) {
-                if (strcmp(sub_state, "running") == 0) {
-                    status = STATUS_RUNNING;
-                } else {
-                    status = STATUS_ACTIVE;
-                }
-            } else if (strcmp(active_state, "inactive") == 0) {
-                status = STATUS_INACTIVE;
-            } else if (strcmp(active_state, "failed") == 0) {
-                status = STATUS_FAILED;
-            } else {
-                status = string_to_status(sub_state); // Fallback to string parsing
-            }
-            
-            add_service_to_list(service_name, status, 0);
+    int added = 0, removed = 0, changed = 0;
+    for (int i = 0; i < changes.count; i++) {
+        switch (changes.changes[i].kind) {
+            case CHANGE_ADDED: added++; break;
+            case CHANGE_REMOVED: removed++; break;
+            case CHANGE_STATUS: changed++; break;
+        }
+    }
+    free_change_set(&changes);
+    
+    printf("Services loaded successfully! (%d added, %d removed, %d changed)\n", 
+           added, removed, changed);
+}
+
+// Report the unit sources a refresh could not list (a bit per source id)
+void report_failed_sources(FILE* out, unsigned int failed_sources) {
+    for (int source = 0; source < source_count(); source++) {
+        if (failed_sources & (1u << source)) {
+            fprintf(out, "Failed to list units of source '%s'; keeping its last known state.\n", source_name(source));
         }
     }
-    pclose(fp);
+}
+
+// Display the transitions found by a refresh
+void display_service_changes(const ServiceChangeSet* changes) {
+    if (changes == NULL || changes->count == 0) {
+        printf("No service status changes.\n");
+        return;
+    }
+    
+    printf("%-40s %-10s %-12s %-12s\n", "SERVICE NAME", "CHANGE", "OLD STATUS", "NEW STATUS");
+    printf("--------------------------------------------------------------------------------\n");
+    
+    for (int i = 0; i < changes->count; i++) {
+        const ServiceChange* change = &changes->changes[i];
+        printf("%-40s %-10s %-12s %-12s\n", 
+               change->name,
+               change_kind_to_string(change->kind),
+               change->kind == CHANGE_ADDED ? "-" : status_to_string(change->old_status),
+               change->kind == CHANGE_REMOVED ? "-" : status_to_string(change->new_status));
+    }
+}
+
+// Release the storage held by a change set
+void free_change_set(ServiceChangeSet* changes) {
+    if (changes == NULL) return;
+    free(changes->changes);
+    changes->changes = NULL;
+    changes->count = changes->capacity = 0;
+    changes->failed_sources = 0;
+}
+
+const char* change_kind_to_string(ChangeKind kind) {
+    switch (kind) {
+        case CHANGE_ADDED: return "ADDED";
+        case CHANGE_REMOVED: return "REMOVED";
+        case CHANGE_STATUS: return "CHANGED";
+        default: return "UNKNOWN";
+    }
+}
+
+// Last /proc scan, reused between listings
+static ProcessTable process_table = {0};
+
+// Scan /proc (under $SERVICE_RESOURCE_ROOT, if set). Returns 0 on success.
+static int scan_processes() {
+    if (process_scan(&process_table, resource_root(), process_scan_threads()) < 0) {
+        perror("Failed to scan processes");
+        return -1;
+    }
+    return 0;
+}
+
+static const RenderColumn process_columns[] = {
+    { "USER", "user", 10 }, { "PID", "pid", 7 }, { "PPID", "ppid", 7 },
+    { "%CPU", "cpu_percent", 5 }, { "%MEM", "memory_percent", 5 },
+    { "VSZ", "vsize_bytes", 9 }, { "RSS", "rss_bytes", 9 }, { "S", "state", 1 },
+    { "THR", "threads", 4 }, { "SERVICE", "service", 24 }, { "COMMAND", "command", 0 }
+};
+
+static void render_process(Renderer* out, const ProcessInfo* info) {
+    char state[2] = { info->state, '\0' };
+    const char* service = string_pool_get(&service_names, info->service_id);
     
-    printf("Services loaded successfully!\n");
+    render_string(out, process_user_name(info->uid));
+    render_int(out, info->pid);
+    render_int(out, info->ppid);
+    render_double(out, process_cpu_percent(&process_table, info), 1);
+    render_double(out, process_memory_percent(&process_table, info), 1);
+    render_bytes(out, info->vsize_kb * 1024);
+    render_bytes(out, info->rss_kb * 1024);
+    render_string(out, state);
+    render_int(out, info->threads);
+    if (service) {
+        render_string(out, service);
+    } else {
+        render_missing(out);
+    }
+    render_string(out, info->command);
+    render_row_end(out);
 }
 
-// *** NEW FUNCTION: List all processes using ps aux ***
+// List every process, in pid order, with the service that owns it
 void list_all_processes() {
-    FILE *fp;
-    char line[1024];
+    Renderer out;
     
-    printf("\n=== All System Processes (ps aux) ===\n");
+    if (output_is_table()) printf("\n=== All System Processes ===\n");
+    if (scan_processes() < 0) return;
     
-    // Use 'ps aux' for a detailed list of all running processes
-    // --no-headers removes the redundant header if the user wants to pipe this
-    fp = popen("ps aux --no-headers", "r"); 
-    if (fp == NULL) {
-        perror("Failed to execute ps aux");
-        return;
+    render_begin(&out, process_columns, sizeof(process_columns) / sizeof(process_columns[0]));
+    for (int i = 0; i < process_table.count; i++) {
+        if (render_row_begin(&out)) render_process(&out, &process_table.processes[i]);
+    }
+    render_end(&out);
+    
+    if (output_is_table()) printf("Process listing complete (%d processes).\n", process_table.count);
+}
+
+// List the limit processes using the most CPU or memory
+void list_top_processes(ProcessSortKey key, int limit) {
+    Renderer out;
+    
+    if (output_is_table()) {
+        printf("\n=== Top %d Processes by %s ===\n", limit, key == PROCESS_SORT_CPU ? "CPU" : "Memory");
     }
+    if (limit <= 0 || scan_processes() < 0) return;
     
-    // Print header for ps aux output
-    printf("%-8s %-6s %-4s %-4s %-8s %-8s %-15s %-20s\n", 
-           "USER", "PID", "%CPU", "%MEM", "VSZ", "RSS", "STAT", "COMMAND");
-    printf("------------------------------------------------------------------------------------------------------------------\n");
+    int* rows = (int*)malloc(limit * sizeof(int));
+    if (rows == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
     
-    // Read and print the output line by line
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        printf("%s", line);
+    int count = process_top(&process_table, key, limit, rows);
+    render_begin(&out, process_columns, sizeof(process_columns) / sizeof(process_columns[0]));
+    for (int i = 0; i < count; i++) {
+        if (render_row_begin(&out)) render_process(&out, &process_table.processes[rows[i]]);
     }
+    render_end(&out);
+    free(rows);
     
-    pclose(fp);
-    printf("------------------------------------------------------------------------------------------------------------------\n");
-    printf("Process listing complete.\n");
+    if (output_is_table()) printf("\nShowing %d of %d processes\n", count, process_table.count);
 }
 // ******************************************************
 
-// Add service to linked list and BST
-void add_service_to_list(const char* name, ServiceStatus status, int pid) {
-    Service* new_service = (Service*)malloc(sizeof(Service));
+// Add service to linked list and index
+Service* add_service_to_list(const char* name, ServiceStatus status, int pid) {
+    Service* new_service = (Service*)pool_alloc(&service_pool);
     if (new_service == NULL) {
         printf("Memory allocation failed!\n");
-        return;
+        return NULL;
     }
     
-    strncpy(new_service->name, name, MAX_SERVICE_NAME - 1);
-    new_service->name[MAX_SERVICE_NAME - 1] = '\0';
-    new_service->status = status;
-    new_service->pid = pid;
+    // Intern the name and give the service a row in the table,
+    // with the current time as last started
+    uint32_t name_id = intern_string(&service_names, name);
+    int row = name_id == STRING_ID_NONE ? -1 :
+              table_add_row(&service_table, name_id, status, pid, time(NULL));
+    if (row < 0) {
+        printf("Memory allocation failed!\n");
+        pool_release(&service_pool, new_service);
+        return NULL;
+    }
     
-    // Set current time as last started
-    time_t now = time(NULL);
-    strftime(new_service->last_started, sizeof(new_service->last_started), 
-             "%Y-%m-%d %H:%M:%S", localtime(&now));
+    string_pool_retain(&service_names, name_id);
+    new_service->name = string_pool_get(&service_names, name_id);
+    new_service->row = row;
+    new_service->seen_generation = refresh_generation;
     
     // Add to linked list
     new_service->next = service_list;
     service_list = new_service;
     
-    // Add to BST for fast searching
-    service_bst = insert_bst(service_bst, new_service);
+    // Add to index for fast searching
+    if (index_insert(&service_index, new_service) < 0) {
+        service_list = new_service->next;
+        remove_service_row(row);
+        pool_release(&service_pool, new_service);
+        return NULL;
+    }
+    
+    return new_service;
 }
 
-// BST insertion
-BSTNode* insert_bst(BSTNode* node, Service* service) {
-    if (node == NULL) {
-        BSTNode* new_node = (BSTNode*)malloc(sizeof(BSTNode));
-        if (new_node == NULL) {
-            printf("Memory allocation failed!\n");
-            return NULL;
-        }
-        new_node->service = service;
-        new_node->left = new_node->right = NULL;
-        return new_node;
+// Add log entry to the bounded event log (oldest entries are overwritten)
+void add_log_entry(const char* service_name, LogAction action) {
+    uint32_t service_id = intern_string(&service_names, service_name);
+    if (service_id == STRING_ID_NONE) {
+        printf("Memory allocation failed!\n");
+        return;
     }
     
-    int cmp = strcmp(service->name, node->service->name);
-    if (cmp < 0) {
-        node->left = insert_bst(node->left, service);
-    } else if (cmp > 0) {
-        node->right = insert_bst(node->right, service);
+    time_t now = time(NULL);
+    uint32_t evicted;
+    if (event_log_append(&event_log, service_id, action, now, &evicted) < 0) {
+        printf("Memory allocation failed!\n");
+    } else {
+        string_pool_retain(&service_names, service_id);
+        release_service_name(evicted);
     }
+    metrics_count(METRIC_LOG_ENTRIES, 1);
+    journal_append(&service_journal, service_name, action, now);
     
-    return node;
+    char timestamp[64];
+    fprintf(output_message_stream(), "LOG: %s - %s - %s\n", format_timestamp(now, timestamp, sizeof(timestamp)), 
+            service_name, action_to_string(action));
 }
 
-// BST search
-Service* search_bst(BSTNode* node, const char* name) {
-    if (node == NULL) return NULL;
+// Display all services from the published snapshot. CPU% is what the last
+// refresh measured.
+void display_all_services() {
+    static const RenderColumn columns[] = {
+        { "SERVICE NAME", "name", 40 }, { "STATUS", "status", 12 }, { "PID", "pid", 8 },
+        { "CPU%", "cpu_percent", 7 }, { "MEMORY", "memory_bytes", 9 }, { "LAST STARTED", "last_started", 20 }
+    };
+    Renderer out;
     
-    int cmp = strcmp(name, node->service->name);
-    if (cmp == 0) {
-        return node->service;
-    } else if (cmp < 0) {
-        return search_bst(node->left, name);
-    } else {
-        return search_bst(node->right, name);
+    if (output_is_table()) printf("\n=== All Services (from internal list) ===\n");
+    
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    int services = snapshot ? snapshot->count : 0;
+    
+    render_begin(&out, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int i = 0; i < services; i++) {
+        const SnapshotEntry* entry = &snapshot->entries[i];
+        if (!render_row_begin(&out)) continue;
+        
+        render_string(&out, entry->name);
+        render_string(&out, status_to_string((ServiceStatus)entry->status));
+        render_int(&out, entry->pid);
+        if (entry->cpu_percent < 0) {
+            render_missing(&out);
+        } else {
+            render_double(&out, entry->cpu_percent, 1);
+        }
+        render_bytes(&out, entry->memory_bytes);
+        render_time(&out, entry->last_started);
+        render_row_end(&out);
+    }
+    int count = render_end(&out);
+    
+    if (output_is_table()) {
+        printf("\nTotal services: %d\n", count);
+        display_status_counts();
     }
+    snapshot_unpin(snapshot);
 }
 
-// Add log entry (stack implementation - LIFO)
-void add_log_entry(const char* service_name, const char* action) {
-    LogEntry* new_log = (LogEntry*)malloc(sizeof(LogEntry));
-    if (new_log == NULL) {
-        printf("Memory allocation failed!\n");
-        return;
+// Print how many services are in each status, from the snapshot's status groups
+void display_status_counts() {
+    static const ServiceStatus statuses[] = {
+        STATUS_ACTIVE, STATUS_INACTIVE, STATUS_FAILED,
+        STATUS_SUSPENDED, STATUS_RUNNING, STATUS_STOPPED
+    };
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    
+    for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+        const int* entries;
+        printf("%s%s: %d", i ? ", " : "", status_to_string(statuses[i]),
+               snapshot ? snapshot_status_entries(snapshot, statuses[i], &entries) : 0);
     }
+    printf("\n");
+    snapshot_unpin(snapshot);
+}
+
+// Display logs (most recent first)
+void display_logs() {
+    static const RenderColumn columns[] = {
+        { "TIMESTAMP", "time", 20 }, { "ACTION", "action", 30 }, { "SERVICE", "service", 40 }
+    };
+    Renderer out;
+    int count = event_log_size(&event_log);
     
-    strncpy(new_log->service_name, service_name, MAX_SERVICE_NAME - 1);
-    new_log->service_name[MAX_SERVICE_NAME - 1] = '\0';
-    strncpy(new_log->action, action, 63);
-    new_log->action[63] = '\0';
+    if (output_is_table()) printf("\n=== Service Logs (Most Recent First) ===\n");
     
-    // Add timestamp
-    time_t now = time(NULL);
-    strftime(new_log->timestamp, sizeof(new_log->timestamp), 
-             "%Y-%m-%d %H:%M:%S", localtime(&now));
+    render_begin(&out, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int i = 1; i <= count; i++) {
+        if (!render_row_begin(&out)) continue;
+        
+        int slot = (int)((event_log.next_seq - i) % LOG_CAPACITY);
+        render_time(&out, event_log.when[slot]);
+        render_string(&out, action_to_string((LogAction)event_log.action[slot]));
+        render_string(&out, string_pool_get(&service_names, event_log.service_id[slot]));
+        render_row_end(&out);
+    }
+    render_end(&out);
     
-    // Push to stack
-    new_log->next = log_stack;
-    log_stack = new_log;
+    if (!output_is_table()) return;
+    if (count == 0) {
+        printf("No logs available.\n");
+        return;
+    }
     
-    printf("LOG: %s - %s - %s\n", new_log->timestamp, service_name, action);
+    display_action_histogram();
 }
 
-// Display all services
-void display_all_services() {
-    printf("\n=== All Services (from internal list) ===\n");
-    printf("%-40s %-12s %-8s %-20s\n", "SERVICE NAME", "STATUS", "PID", "LAST STARTED");
+// Display the most recent events of the service with the given name id.
+// Only the thread that runs commands writes the event log, so this needs
+// no lock when called from that thread.
+static void print_service_history(uint32_t service_id, const char* service_name, int limit) {
+    int64_t seqs[LOG_CAPACITY];
+    
+    if (limit > LOG_CAPACITY) limit = LOG_CAPACITY;
+    int count = service_id == STRING_ID_NONE ? 0 :
+                event_log_recent_for_service(&event_log, service_id, seqs, limit);
+    
+    printf("\n=== Last %d Events for %s ===\n", limit, service_name);
+    printf("%-20s %-30s\n", "TIMESTAMP", "ACTION");
     printf("--------------------------------------------------------------------------------\n");
     
-    Service* current = service_list;
-    int count = 0;
+    char timestamp[64];
+    for (int i = 0; i < count; i++) {
+        int slot = (int)(seqs[i] % LOG_CAPACITY);
+        printf("%-20s %-30s\n", 
+               format_timestamp(event_log.when[slot], timestamp, sizeof(timestamp)), 
+               action_to_string((LogAction)event_log.action[slot]));
+    }
     
-    while (current != NULL) {
-        printf("%-40s %-12s %-8d %-20s\n", 
-               current->name, 
-               status_to_string(current->status),
-               current->pid,
-               current->last_started);
-        current = current->next;
-        count++;
+    if (count == 0) {
+        printf("No logs available.\n");
+    }
+}
+
+// Display the most recent events of one service
+void display_service_history(const char* service_name, int limit) {
+    print_service_history(string_pool_find(&service_names, service_name), service_name, limit);
+}
+
+// Display restart attempts per service within the last window_seconds
+void display_restart_counts(int window_seconds) {
+    time_t since = time(NULL) - window_seconds;
+    int shown = 0;
+    
+    printf("\n=== Restarts in the Last %d Seconds ===\n", window_seconds);
+    printf("%-40s %-8s\n", "SERVICE NAME", "RESTARTS");
+    printf("--------------------------------------------------------------------------------\n");
+    
+    // Only services that have any event in the ring have a chain to follow
+    for (int id = 0; id < event_log.service_capacity; id++) {
+        if (event_log.last_for_service[id] < 0) continue;
+        
+        int restarts = event_log_count_for_service(&event_log, (uint32_t)id, 
+                                                   LOG_RESTART_ACTIONS, since);
+        if (restarts > 0) {
+            printf("%-40s %-8d\n", string_pool_get(&service_names, (uint32_t)id), restarts);
+            shown++;
+        }
     }
     
-    printf("\nTotal services: %d\n", count);
+    if (shown == 0) {
+        printf("No restarts recorded.\n");
+    }
 }
 
-// Display logs (stack - most recent first)
-void display_logs() {
-    printf("\n=== Service Logs (Most Recent First) ===\n");
+// Display how many events of each action the log holds
+void display_action_histogram() {
+    printf("\n=== Events by Action ===\n");
+    for (int action = 0; action < ACTION_COUNT; action++) {
+        if (event_log.action_counts[action] > 0) {
+            printf("%-35s %d\n", action_to_string((LogAction)action), event_log.action_counts[action]);
+        }
+    }
+}
+
+// Print one journaled event
+static void print_journal_event(time_t when, const char* service_name, LogAction action, void* context) {
+    (void)context;
+    char timestamp[64];
+    printf("%-20s %-30s %-40s\n", 
+           format_timestamp(when, timestamp, sizeof(timestamp)), 
+           action_to_string(action),
+           service_name);
+}
+
+// Display journaled events from the last hours, for one service or (with an
+// empty name) for all services
+void display_journal_history(const char* service_name, int hours) {
+    time_t now = time(NULL);
+    time_t from = now - (time_t)hours * 60 * 60;
+    int count;
+    
+    if (service_name != NULL && *service_name) {
+        printf("\n=== Journal for %s, Last %d Hours (Most Recent First) ===\n", service_name, hours);
+    } else {
+        printf("\n=== Journal, Last %d Hours (Oldest First) ===\n", hours);
+    }
     printf("%-20s %-30s %-40s\n", "TIMESTAMP", "ACTION", "SERVICE");
     printf("--------------------------------------------------------------------------------\n");
     
-    LogEntry* current = log_stack;
-    int count = 0;
-    
-    while (current != NULL) {
-        printf("%-20s %-30s %-40s\n", 
-               current->timestamp, 
-               current->action,
-               current->service_name);
-        current = current->next;
-        count++;
+    if (service_name != NULL && *service_name) {
+        count = journal_query_service(&service_journal, service_name, from, now, print_journal_event, NULL);
+    } else {
+        count = journal_query_range(&service_journal, from, now, print_journal_event, NULL);
     }
     
     if (count == 0) {
-        printf("No logs available.\n");
+        printf("No journal entries in range.\n");
     }
 }
 
-// Search service by name using BST
-void search_service_by_name(const char* name) {
-    Service* found = search_bst(service_bst, name);
+// Search service by name in the published snapshot, without locking.
+// Returns 1 if the service exists.
+int search_service_by_name(const char* name) {
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    const SnapshotEntry* found = snapshot ? snapshot_find(snapshot, name) : NULL;
     
     if (found) {
+        char started[64];
         printf("\nService Found:\n");
         printf("Name: %s\n", found->name);
-        printf("Status: %s\n", status_to_string(found->status));
+        if (source_count() > 1) printf("Source: %s\n", source_name(found->source));
+        printf("Status: %s\n", status_to_string((ServiceStatus)found->status));
+        printf("Loaded: %s\n", unit_load_state_to_string((UnitLoadState)found->load_state));
+        printf("Active: %s (%s)\n", unit_active_state_to_string((UnitActiveState)found->active_state),
+               unit_sub_state_to_string((UnitSubState)found->sub_state));
+        if (found->description && *found->description) printf("Description: %s\n", found->description);
         printf("PID: %d\n", found->pid);
-        printf("Last Started: %s\n", found->last_started);
+        printf("Last Started: %s\n", 
+               format_timestamp(found->last_started, started, sizeof(started)));
+        print_service_history(found->name_id, found->name, 5);
     } else {
         printf("Service '%s' not found.\n", name);
+        search_services_by_prefix(name);
     }
+    
+    snapshot_unpin(snapshot);
+    return found != NULL;
 }
 
-// Filter services by status
-void filter_services_by_status(ServiceStatus status) {
-    printf("\n=== Services with Status: %s ===\n", status_to_string(status));
-    printf("%-40s %-8s %-20s\n", "SERVICE NAME", "PID", "LAST STARTED");
-    printf("--------------------------------------------------------------------------------\n");
+// List services whose names start with prefix, in name order
+void search_services_by_prefix(const char* prefix) {
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    int first = 0;
+    int count = snapshot ? snapshot_prefix_range(snapshot, prefix, &first) : 0;
     
-    Service* current = service_list;
-    int count = 0;
+    if (count == 0) {
+        snapshot_unpin(snapshot);
+        return;
+    }
     
-    while (current != NULL) {
-        if (current->status == status) {
-            printf("%-40s %-8d %-20s\n", 
-                   current->name, 
-                   current->pid,
-                   current->last_started);
-            count++;
-        }
-        current = current->next;
+    printf("\nServices starting with '%s':\n", prefix);
+    printf("%-40s %-12s %-8s\n", "SERVICE NAME", "STATUS", "PID");
+    printf("--------------------------------------------------------------------------------\n");
+    
+    for (int i = first; i < first + count; i++) {
+        const SnapshotEntry* entry = &snapshot->entries[i];
+        printf("%-40s %-12s %-8d\n", 
+               entry->name, 
+               status_to_string((ServiceStatus)entry->status),
+               entry->pid);
     }
     
-    printf("\nFound %d services with status '%s'\n", count, status_to_string(status));
+    printf("\nFound %d matching services\n", count);
+    snapshot_unpin(snapshot);
 }
 
-// Start a service
-void start_service(const char* service_name) {
-    Service* service = search_bst(service_bst, service_name);
+// Filter services by status from the published snapshot, without locking.
+// Returns how many services have the status.
+int filter_services_by_status(ServiceStatus status) {
+    return filter_services(status, -1);
+}
+
+// Filter services by status, limited to one unit source unless source is -1
+int filter_services(ServiceStatus status, int source) {
+    static const RenderColumn columns[] = {
+        { "SERVICE NAME", "name", 40 }, { "PID", "pid", 8 }, { "LAST STARTED", "last_started", 20 }
+    };
+    Renderer out;
     
-    if (service) {
-        char command[512];
-        snprintf(command, sizeof(command), "systemctl start %s.service", service_name);
-        
-        int result = system(command);
-        if (result == 0) {
-            service->status = STATUS_ACTIVE;
-            service->pid = getpid(); // Simplified - in real implementation, get actual PID
-            time_t now = time(NULL);
-            strftime(service->last_started, sizeof(service->last_started), 
-                     "%Y-%m-%d %H:%M:%S", localtime(&now));
-            
-            add_log_entry(service_name, "STARTED");
-            printf("Service '%s' started successfully.\n", service_name);
+    if (output_is_table()) {
+        if (source >= 0) {
+            printf("\n=== %s Services with Status: %s ===\n", source_name(source), status_to_string(status));
         } else {
-            service->status = STATUS_FAILED;
-            add_log_entry(service_name, "START FAILED");
-            add_to_failed_queue(service_name);
-            printf("Failed to start service '%s'.\n", service_name);
+            printf("\n=== Services with Status: %s ===\n", status_to_string(status));
         }
-    } else {
-        printf("Service '%s' not found.\n", service_name);
     }
+    
+    // The snapshot keeps each status's services together, in name order
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    const int* entries = NULL;
+    int listed = snapshot ? snapshot_status_entries(snapshot, status, &entries) : 0;
+    int count = 0;
+    
+    render_begin(&out, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int i = 0; i < listed; i++) {
+        const SnapshotEntry* entry = &snapshot->entries[entries[i]];
+        if (source >= 0 && entry->source != source) continue;
+        
+        count++;
+        if (!render_row_begin(&out)) continue;
+        render_string(&out, entry->name);
+        render_int(&out, entry->pid);
+        render_time(&out, entry->last_started);
+        render_row_end(&out);
+    }
+    render_end(&out);
+    snapshot_unpin(snapshot);
+    
+    if (output_is_table()) printf("\nFound %d services with status '%s'\n", count, status_to_string(status));
+    return count;
 }
 
-// Stop a service
-void stop_service(const char* service_name) {
-    Service* service = search_bst(service_bst, service_name);
+// List services whose restart circuit breaker is open or half-open,
+// limited to one unit source unless source is -1. Returns how many.
+int display_flapping_services(int source) {
+    static const RenderColumn columns[] = {
+        { "SERVICE NAME", "name", 40 }, { "BREAKER", "breaker", 10 }, { "FAILURES", "failures", 8 },
+        { "RESTARTS", "restarts", 8 }, { "HALF-OPENS AT", "half_open_at", 20 }
+    };
+    Renderer out;
+    time_t now = time(NULL);
+    int count = 0;
     
-    if (service) {
-        char command[512];
-        snprintf(command, sizeof(command), "systemctl stop %s.service", service_name);
+    if (output_is_table()) {
+        printf("\n=== Flapping Services (%d+ failures in %ds) ===\n", flap_threshold, flap_window);
+    }
+    
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    render_begin(&out, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int i = 0; snapshot && i < snapshot->count; i++) {
+        const SnapshotEntry* entry = &snapshot->entries[i];
+        FlapStatus flap;
+        if (source >= 0 && entry->source != source) continue;
+        if (!flap_status(entry->name_id, now, &flap) || flap.state == BREAKER_CLOSED) continue;
         
-        int result = system(command);
-        if (result == 0) {
-            service->status = STATUS_INACTIVE;
-            service->pid = 0;
-            add_log_entry(service_name, "STOPPED");
-            printf("Service '%s' stopped successfully.\n", service_name);
-        } else {
-            add_log_entry(service_name, "STOP FAILED");
-            printf("Failed to stop service '%s'.\n", service_name);
-        }
-    } else {
-        printf("Service '%s' not found.\n", service_name);
+        count++;
+        if (!render_row_begin(&out)) continue;
+        render_string(&out, entry->name);
+        render_string(&out, breaker_state_to_string(flap.state));
+        render_int(&out, flap.failures);
+        render_int(&out, flap.restarts);
+        render_time(&out, flap.half_open_at);
+        render_row_end(&out);
     }
+    render_end(&out);
+    snapshot_unpin(snapshot);
+    
+    if (output_is_table()) printf("\nFound %d flapping services\n", count);
+    return count;
 }
 
-// Restart a service
-void restart_service(const char* service_name) {
-    Service* service = search_bst(service_bst, service_name);
+// Run a query such as "status=failed,inactive name=app-* failures>3" and
+// list the matching services. Returns the match count, or -1 on a bad query.
+int query_services(const char* query_text) {
+    static const RenderColumn columns[] = {
+        { "SERVICE NAME", "name", 40 }, { "STATUS", "status", 12 }, { "PID", "pid", 8 },
+        { "FAILURES", "failures", 8 }, { "LAST STARTED", "last_started", 20 }
+    };
+    ServiceQuery query;
+    QueryPlan plan;
+    Renderer out;
     
-    if (service) {
-        char command[512];
-        snprintf(command, sizeof(command), "systemctl restart %s.service", service_name);
+    if (query_parse(query_text, &query) < 0) return -1;
+    
+    int* rows = (int*)malloc((service_table.rows ? service_table.rows : 1) * sizeof(int));
+    if (rows == NULL) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+    
+    int count = query_run(&query, rows, &plan);
+    
+    if (output_is_table()) printf("\n=== Query: %s ===\n", query_text);
+    render_begin(&out, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int i = 0; i < count; i++) {
+        if (!render_row_begin(&out)) continue;
         
-        int result = system(command);
-        if (result == 0) {
-            service->status = STATUS_ACTIVE;
-            service->pid = getpid(); // Simplified
-            time_t now = time(NULL);
-            strftime(service->last_started, sizeof(service->last_started), 
-                     "%Y-%m-%d %H:%M:%S", localtime(&now));
+        int row = rows[i];
+        render_string(&out, string_pool_get(&service_names, service_table.name_id[row]));
+        render_string(&out, status_to_string((ServiceStatus)service_table.status[row]));
+        render_int(&out, service_table.pid[row]);
+        render_int(&out, service_table.failures[row]);
+        render_time(&out, service_table.last_started[row]);
+        render_row_end(&out);
+    }
+    render_end(&out);
+    free(rows);
+    
+    if (output_is_table()) printf("\nFound %d matching services (%s)\n", count, query_plan_to_string(plan));
+    return count;
+}
+
+// Update the table, log and failed queue with the outcome of a manual
+// start/stop/restart job
+static void apply_control_result(const ControlJob* job, void* context) {
+    (void)context;
+    const char* service_name = job->service_name;
+    Service* service = index_find(&service_index, service_name);
+    
+    if (job->cancelled_by) {
+        add_log_entry(service_name, ACTION_CANCELLED);
+        fprintf(output_message_stream(), "Cancelled %s of '%s': required service '%s' failed.\n",
+                control_action_to_string(job->action), service_name, job->cancelled_by);
+        return;
+    }
+    
+    if (job->timed_out) {
+        fprintf(output_message_stream(), "Timed out waiting for '%s' to %s.\n", service_name, control_action_to_string(job->action));
+    }
+    if (job->action == CONTROL_RESTART) {
+        flap_record_restart(string_pool_find(&service_names, service_name), job->succeeded, time(NULL));
+    }
+    
+    switch (job->action) {
+        case CONTROL_START:
+        case CONTROL_RESTART:
+            if (job->succeeded) {
+                if (service) {
+                    set_service_status(service, STATUS_ACTIVE);
+                    set_service_last_started(service, time(NULL));
+                    resource_sample_row(&resource_sampler, &service_table, service->row);
+                }
+                
+                add_log_entry(service_name, job->action == CONTROL_START ? ACTION_STARTED : ACTION_RESTARTED);
+                remove_from_failed_queue(service_name);
+                fprintf(output_message_stream(), "Service '%s' %s successfully.\n", service_name, 
+                        job->action == CONTROL_START ? "started" : "restarted");
+            } else {
+                if (service) set_service_status(service, STATUS_FAILED);
+                add_log_entry(service_name, job->action == CONTROL_START ? ACTION_START_FAILED : ACTION_RESTART_FAILED);
+                add_to_failed_queue(service_name);
+                fprintf(output_message_stream(), "Failed to %s service '%s'.\n", control_action_to_string(job->action), service_name);
+            }
+            break;
             
-            add_log_entry(service_name, "RESTARTED");
-            printf("Service '%s' restarted successfully.\n", service_name);
-        } else {
-            service->status = STATUS_FAILED;
-            add_log_entry(service_name, "RESTART FAILED");
-            add_to_failed_queue(service_name);
-            printf("Failed to restart service '%s'.\n", service_name);
+        case CONTROL_STOP:
+            if (job->succeeded) {
+                if (service) {
+                    set_service_status(service, STATUS_INACTIVE);
+                    set_service_pid(service, 0);
+                }
+                add_log_entry(service_name, ACTION_STOPPED);
+                fprintf(output_message_stream(), "Service '%s' stopped successfully.\n", service_name);
+            } else {
+                add_log_entry(service_name, ACTION_STOP_FAILED);
+                fprintf(output_message_stream(), "Failed to stop service '%s'.\n", service_name);
+            }
+            break;
+    }
+}
+
+// Run one control action for a list of services as a single batch, in
+// dependency-ordered waves that each proceed in parallel. Unknown services
+// count as failures. Returns the number of services that did not complete
+// the action.
+int control_services(const char* const service_names[], int count, ControlAction action) {
+    ControlBatch batch = {0};
+    int failures = 0;
+    
+    for (int i = 0; i < count; i++) {
+        if (index_find(&service_index, service_names[i]) == NULL) {
+            fprintf(output_message_stream(), "Service '%s' not found.\n", service_names[i]);
+            failures++;
+        } else if (control_batch_add(&batch, service_names[i], action, NULL) < 0) {
+            failures++;
         }
-    } else {
-        printf("Service '%s' not found.\n", service_name);
     }
+    
+    if (batch.count > 0) {
+        failures += control_batch_run_ordered(&batch, apply_control_result, NULL);
+        snapshot_publish();
+    }
+    control_batch_free(&batch);
+    return failures;
+}
+
+// Start a service
+void start_service(const char* service_name) {
+    control_services(&service_name, 1, CONTROL_START);
+}
+
+// Stop a service
+void stop_service(const char* service_name) {
+    control_services(&service_name, 1, CONTROL_STOP);
+}
+
+// Restart a service
+void restart_service(const char* service_name) {
+    control_services(&service_name, 1, CONTROL_RESTART);
 }
 
-// Detect failed services
-void detect_failed_services() {
-    printf("Detecting failed/unresponsive services...\n");
+// Detect failed services across every unit source. Returns how many were
+// found, or -1 if no source could be listed.
+int detect_failed_services() {
+    fprintf(output_message_stream(), "Detecting failed/unresponsive services...\n");
     
-    FILE *fp = popen("systemctl list-units --type=service --state=failed --no-pager --no-legend", "r");
-    if (fp == NULL) {
-        perror("Failed to detect failed services");
-        return;
+    const char* args[] = { "list-units", "--type=service", "--state=failed", "--no-pager", "--no-legend", NULL };
+    int results[SOURCE_MAX];
+    if (capture_listings(args, command_outputs, results) == 0) {
+        fprintf(output_message_stream(), "Failed to detect failed services.\n");
+        return -1;
     }
     
-    char line[1024];
-    char service_name[MAX_SERVICE_NAME];
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
     int failed_count = 0;
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        if (sscanf(line, "%255s", service_name) == 1) {
-            // Remove .service suffix
-            char* dot = strstr(service_name, ".service");
-            if (dot) *dot = '\0';
+    for (int source = 0; source < source_count(); source++) {
+        if (results[source] != 0) {
+            fprintf(output_message_stream(), "Failed to list failed units of source '%s'.\n", source_name(source));
+            continue;
+        }
+        
+        unit_tokenizer_init(&tokenizer, command_outputs[source].data, command_outputs[source].length);
+        while (unit_tokenizer_next(&tokenizer, &unit)) {
+            char qualified[MAX_SERVICE_NAME];
+            size_t name_length;
+            const char* name = listed_unit_name(source, &unit, qualified, &name_length);
             
             // Update service status
-            Service* service = search_bst(service_bst, service_name);
+            Service* service = name ? index_find_bytes(&service_index, name, name_length) : NULL;
             if (service) {
-                service->status = STATUS_FAILED;
-                add_to_failed_queue(service_name);
+                set_service_status(service, STATUS_FAILED);
+                add_to_failed_queue(service->name);
                 failed_count++;
             }
         }
     }
-    pclose(fp);
     
-    printf("Detection complete. Found %d failed services.\n", failed_count);
+    if (failed_count > 0) snapshot_publish();
+    fprintf(output_message_stream(), "Detection complete. Found %d failed services.\n", failed_count);
+    return failed_count;
 }
 
-// Add to failed services queue
+// Add to failed services queue; a service already queued keeps its slot
+// and backoff instead of being queued again
 void add_to_failed_queue(const char* service_name) {
-    if (failed_queue_size >= MAX_FAILED_QUEUE) {
-        printf("Failed services queue is full!\n");
-        return;
+    if (schedule_failed_service(service_name) == 1) {
+        add_log_entry(service_name, ACTION_QUEUED_FAILED);
+    }
+}
+
+// Put a failed service on the retry schedule without logging it. A service
+// that is already queued has failed again before its retry, so its failure
+// count goes up and its next retry moves out to the longer backoff. Returns
+// 1 if it was queued, 0 if it already was, or -1 if it could not be.
+int schedule_failed_service(const char* service_name) {
+    uint32_t name_id = intern_string(&service_names, service_name);
+    if (name_id == STRING_ID_NONE) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+    
+    time_t now = time(NULL);
+    FailedService* queued = scheduler_find(&failed_scheduler, name_id);
+    if (queued != NULL) {
+        time_t next_retry = now + retry_backoff(queued->failure_count);
+        queued->last_failure = now;
+        queued->failure_count++;
+        if (next_retry > queued->next_retry) {
+            // Re-insert so the heap sees the later due time
+            scheduler_remove(&failed_scheduler, name_id);
+            queued->next_retry = next_retry;
+            if (scheduler_insert(&failed_scheduler, queued) < 0) {
+                printf("Memory allocation failed!\n");
+                release_failed_entry(queued);
+                return -1;
+            }
+        }
+        return 0;
     }
     
-    FailedService* new_failed = (FailedService*)malloc(sizeof(FailedService));
+    if (failed_scheduler.count >= MAX_FAILED_QUEUE) {
+        fprintf(output_message_stream(), "Failed services queue is full!\n");
+        return -1;
+    }
+    
+    FailedService* new_failed = (FailedService*)pool_alloc(&failed_pool);
     if (new_failed == NULL) {
         printf("Memory allocation failed!\n");
-        return;
+        return -1;
     }
     
-    strncpy(new_failed->name, service_name, MAX_SERVICE_NAME - 1);
-    new_failed->name[MAX_SERVICE_NAME - 1] = '\0';
+    new_failed->name = string_pool_get(&service_names, name_id);
+    new_failed->name_id = name_id;
     new_failed->failure_count = 1;
-    new_failed->last_failure = time(NULL);
-    new_failed->next = NULL;
+    new_failed->last_failure = now;
+    new_failed->next_retry = now;   // First retry is due right away
     
-    if (failed_queue_rear == NULL) {
-        failed_queue_front = failed_queue_rear = new_failed;
-    } else {
-        failed_queue_rear->next = new_failed;
-        failed_queue_rear = new_failed;
+    if (scheduler_insert(&failed_scheduler, new_failed) < 0) {
+        printf("Memory allocation failed!\n");
+        pool_release(&failed_pool, new_failed);
+        return -1;
     }
+    string_pool_retain(&service_names, name_id);
+    return 1;
+}
+
+// Drop a service from the failed queue, e.g. after a successful restart
+void remove_from_failed_queue(const char* service_name) {
+    uint32_t name_id = string_pool_find(&service_names, service_name);
+    if (name_id == STRING_ID_NONE) return;
     
-    failed_queue_size++;
-    add_log_entry(service_name, "ADDED TO FAILED QUEUE");
+    FailedService* entry = scheduler_remove(&failed_scheduler, name_id);
+    if (entry != NULL) {
+        release_failed_entry(entry);
+    }
 }
 
-// Process failed services queue
-void process_failed_services() {
-    printf("Processing failed services queue...\n");
+// Record the outcome of an automatic restart (job) in the table, the retry
+// schedule and the metrics: a restarted service is marked active and its
+// entry released, a failed one is rescheduled with a longer backoff.
+// A restart cancelled for a failed dependency waits out its current backoff
+// again without counting as a failure. Returns the seconds until the next
+// retry, or 0 if the restart succeeded.
+time_t finish_failed_retry(FailedService* entry, const ControlJob* job) {
+    if (job->cancelled_by) {
+        flap_release_trial(entry->name_id);
+        time_t delay = retry_backoff(entry->failure_count - 1);
+        entry->next_retry = time(NULL) + delay;
+        if (scheduler_insert(&failed_scheduler, entry) < 0) {
+            release_failed_entry(entry);
+        }
+        return delay;
+    }
     
-    if (failed_queue_front == NULL) {
-        printf("No failed services in queue.\n");
-        return;
+    metrics_count(METRIC_RESTART_ATTEMPTS, 1);
+    metrics_observe_since(LATENCY_RESTART_ATTEMPT, job->started_ns);
+    if (job->succeeded) {
+        Service* service = index_find(&service_index, entry->name);
+        if (service) {
+            set_service_status(service, STATUS_ACTIVE);
+        }
+        flap_record_restart(entry->name_id, 1, time(NULL));
+        release_failed_entry(entry);
+        return 0;
     }
     
-    FailedService* current = failed_queue_front;
-    int processed = 0;
+    metrics_count(METRIC_RESTART_FAILURES, 1);
+    flap_record_restart(entry->name_id, 0, time(NULL));
+    entry->last_failure = time(NULL);
+    entry->next_retry = entry->last_failure + retry_backoff(entry->failure_count);
+    entry->failure_count++;
+    time_t delay = entry->next_retry - entry->last_failure;
     
-    while (current != NULL) {
-        printf("Attempting to restart failed service: %s (Failure count: %d)\n", 
-               current->name, current->failure_count);
-        
-        // Attempt to restart
-        char command[512];
-        snprintf(command, sizeof(command), "systemctl restart %s.service", current->name);
-        
-        int result = system(command);
-        if (result == 0) {
-            printf("Successfully restarted: %s\n", current->name);
-            add_log_entry(current->name, "AUTO-RESTARTED FROM FAILED QUEUE");
-            
-            // Update service status
-            Service* service = search_bst(service_bst, current->name);
-            if (service) {
-                service->status = STATUS_ACTIVE;
-            }
-        } else {
-            printf("Failed to restart: %s\n", current->name);
-            current->failure_count++;
-            add_log_entry(current->name, "AUTO-RESTART FAILED");
-        }
-        
-        processed++;
-        current = current->next;
+    if (scheduler_insert(&failed_scheduler, entry) < 0) {
+        release_failed_entry(entry);
     }
+    return delay;
+}
+
+// Update the table, log and failed queue with the outcome of an automatic
+// restart; the job context is the FailedService entry being retried
+static void apply_retry_result(const ControlJob* job, void* context) {
+    FailedService* entry = (FailedService*)job->context;
+    uint32_t name_id = entry->name_id;
+    const char* service_name = entry->name;
+    (void)context;
     
-    printf("Processed %d failed services.\n", processed);
+    // Hold the name while reporting, since the entry may be released
+    string_pool_retain(&service_names, name_id);
+    time_t delay = finish_failed_retry(entry, job);
+    if (job->cancelled_by) {
+        fprintf(output_message_stream(), "Skipped restart of %s: required service %s failed (next retry in %lds)\n",
+                service_name, job->cancelled_by, (long)delay);
+        add_log_entry(service_name, ACTION_CANCELLED);
+    } else if (job->succeeded) {
+        fprintf(output_message_stream(), "Successfully restarted: %s\n", service_name);
+        add_log_entry(service_name, ACTION_AUTO_RESTARTED);
+    } else {
+        fprintf(output_message_stream(), "Failed to restart: %s%s (next retry in %lds)\n", service_name, 
+                job->timed_out ? " (timed out)" : "", (long)delay);
+        add_log_entry(service_name, ACTION_AUTO_RESTART_FAILED);
+    }
+    release_service_name(name_id);
+}
+
+// Hold back a due retry while its service's circuit breaker is open,
+// rescheduling the entry for when the breaker half-opens. Returns 0 if the
+// restart may run, else the seconds it is held; the entry then belongs to
+// the scheduler again. *first_hold is set the first time a breaker holds
+// a restart back, so it is reported once.
+time_t hold_flapping_retry(FailedService* entry, time_t now, int* first_hold) {
+    time_t hold = flap_hold_restart(entry->name_id, now, first_hold);
+    if (hold > 0) {
+        entry->next_retry = now + hold;
+        if (scheduler_insert(&failed_scheduler, entry) < 0) {
+            release_failed_entry(entry);
+        }
+    }
+    return hold;
 }
 
-// Monitor services with auto-refresh
-void monitor_services() {
-    printf("Starting service monitor (Auto-refresh every 5 seconds, press Ctrl+C to stop)...\n");
+// Process failed services queue: restart every entry that is due in
+// dependency order, up to control_concurrency at a time per wave. Returns
+// how many retries failed or were cancelled. Services that are flapping
+// wait for their circuit breaker instead.
+int process_failed_services() {
+    fprintf(output_message_stream(), "Processing failed services queue...\n");
     
-    for (int i = 0; i < 3; i++) { // Monitor for 3 cycles
-        printf("\n=== Monitor Cycle %d ===\n", i + 1);
-        printf("Time: %s\n", _TIME_);
-        
-        // Reload services to get current status
-        load_services_from_system();
-        display_all_services();
+    if (failed_scheduler.count == 0) {
+        fprintf(output_message_stream(), "No failed services in queue.\n");
+        return 0;
+    }
+    
+    time_t now = time(NULL);
+    FailedService* current;
+    ControlBatch batch = {0};
+    int held = 0;
+    
+    // Entries leave the heap while their job runs, so a failed retry that is
+    // re-queued cannot be picked up twice in one pass
+    while ((current = scheduler_pop_due(&failed_scheduler, now)) != NULL) {
+        uint32_t name_id = current->name_id;
+        const char* service_name = current->name;
+        int first_hold;
         
-        // Detect failed services
-        detect_failed_services();
+        // Hold the name while reporting, since the entry may be released
+        string_pool_retain(&service_names, name_id);
+        time_t hold = hold_flapping_retry(current, now, &first_hold);
+        if (hold > 0) {
+            fprintf(output_message_stream(), "Holding restart of flapping service: %s (circuit breaker half-opens in %lds)\n",
+                    service_name, (long)hold);
+            if (first_hold) add_log_entry(service_name, ACTION_FLAPPING);
+            release_service_name(name_id);
+            held++;
+            continue;
+        }
+        release_service_name(name_id);
         
-        if (i < 2) { // Don't sleep after last cycle
-            sleep(5); // Wait 5 seconds
+        fprintf(output_message_stream(), "Attempting to restart failed service: %s (Failure count: %d)\n", 
+                current->name, current->failure_count);
+        if (control_batch_add(&batch, current->name, CONTROL_RESTART, current) < 0) {
+            scheduler_insert(&failed_scheduler, current);
+            break;
         }
     }
     
-    printf("Monitoring completed.\n");
+    int processed = batch.count;
+    int failures = control_batch_run_ordered(&batch, apply_retry_result, NULL);
+    control_batch_free(&batch);
+    if (processed > 0) snapshot_publish();
+    
+    FailedService* retry_later = scheduler_peek(&failed_scheduler);
+    fprintf(output_message_stream(), "Processed %d failed services.\n", processed);
+    if (held > 0) fprintf(output_message_stream(), "%d flapping services held back.\n", held);
+    if (retry_later != NULL) {
+        fprintf(output_message_stream(), "%d services waiting; next retry (%s) in %lds.\n", failed_scheduler.count, 
+                retry_later->name, (long)(retry_later->next_retry - time(NULL)));
+    }
+    return failures;
 }
 
 // Redundant code
@@ -510,52 +1279,57 @@ ServiceStatus string_to_status(const char* status_str) {
 
 // Free allocated memory
 void free_memory() {
-    // Free service list
-    Service* service_current = service_list;
-    while (service_current != NULL) {
-        Service* temp = service_current;
-        service_current = service_current->next;
-        free(temp);
-    }
+    // Every record lives in a pool, so release whole slabs instead of
+    // walking the lists node by node
     service_list = NULL;
+    pool_destroy(&service_pool);
     
-    // Free log stack
-    LogEntry* log_current = log_stack;
-    while (log_current != NULL) {
-        LogEntry* temp = log_current;
-        log_current = log_current->next;
-        free(temp);
+    event_log_free(&event_log);
+    journal_close(&service_journal);
+    for (int source = 0; source < SOURCE_MAX; source++) {
+        exec_buffer_free(&command_outputs[source]);
+        exec_buffer_free(&unit_listings[source]);
     }
-    log_stack = NULL;
+    snapshot_free_all();
+    depgraph_free();
+    flap_free();
+    process_table_free(&process_table);
+    render_free();
     
-    // Free failed queue
-    FailedService* failed_current = failed_queue_front;
-    while (failed_current != NULL) {
-        FailedService* temp = failed_current;
-        failed_current = failed_current->next;
-        free(temp);
-    }
-    failed_queue_front = failed_queue_rear = NULL;
-    failed_queue_size = 0;
+    scheduler_free(&failed_scheduler);
+    pool_destroy(&failed_pool);
     
-    // Note: BST nodes point to Service objects that are already freed above
-    // so we don't need to free them separately
-    // A proper recursive free_bst function would be better in a production setting
-    service_bst = NULL; 
+    // The index only borrows the Service records released above
+    index_free(&service_index);
+    resource_sampler_free(&resource_sampler);
+    table_free(&service_table);
+    string_pool_free(&service_names);
+    string_pool_free(&service_descriptions);
 }
 
 
 // *** SAMPLE MAIN FUNCTION TO DEMONSTRATE THE CHOICE ***
+// main.c holds the real entry point; this menu is only compiled when
+// SERVICE_SAMPLE_MAIN is defined and main.c is left out of the build
+#ifdef SERVICE_SAMPLE_MAIN
 int main() {
     int choice = 0;
+    int seconds;
+    int sort_key, top_count;
+    
+    control_configure_from_env();
+    sources_configure_from_env();
+    flap_configure_from_env();
+    output_configure_from_env();
 
     while (1) {
         printf("\n============================================\n");
         printf("           Service Monitor Utility\n");
         printf("============================================\n");
         printf("1. View/Manage Services (Using Data Structures)\n");
-        printf("2. View All System Processes (ps aux - Real-time)\n");
+        printf("2. View All System Processes (Real-time)\n");
         printf("3. Monitor Services (Automatic Refresh)\n");
+        printf("4. Top Processes by CPU/Memory\n");
         printf("0. Exit\n");
         printf("Enter your choice: ");
         
@@ -581,7 +1355,22 @@ int main() {
                 list_all_processes();
                 break;
             case 3:
-                monitor_services();
+                printf("Monitor for how many seconds (0 = until Ctrl+C): ");
+                if (scanf("%d", &seconds) != 1) {
+                    printf("Invalid input. Please enter a number.\n");
+                    while (getchar() != '\n');
+                    break;
+                }
+                monitor_services(seconds);
+                break;
+            case 4:
+                printf("Sort by (1 = CPU, 2 = Memory) and how many: ");
+                if (scanf("%d %d", &sort_key, &top_count) != 2) {
+                    printf("Invalid input. Please enter two numbers.\n");
+                    while (getchar() != '\n');
+                    break;
+                }
+                list_top_processes(sort_key == 2 ? PROCESS_SORT_RSS : PROCESS_SORT_CPU, top_count);
                 break;
             case 0:
                 printf("Exiting utility. Freeing memory...\n");
@@ -594,3 +1383,4 @@ int main() {
     
     return 0;
 }
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -10,6 +11,11 @@
 #define MAX_SERVICE_NAME 256
 #define MAX_LOG_ENTRY 512
 #define MAX_FAILED_QUEUE 100
+#define LOG_CAPACITY 4096
+#define FAILED_RETRY_BASE 5         // Seconds before the first retry
+#define FAILED_RETRY_MAX 600        // Cap on the retry delay
+#define COMMAND_TIMEOUT 30          // Seconds allowed for listing commands
+#define SOURCE_MAX 16               // Service managers units are enumerated from
 
 // Service status enumeration
 typedef enum {
@@ -18,68 +24,847 @@ typedef enum {
     STATUS_FAILED,
     STATUS_SUSPENDED,
     STATUS_RUNNING,
-    STATUS_STOPPED
+    STATUS_STOPPED,
+    STATUS_COUNT
 } ServiceStatus;
 
-// Service structure
+#define STATUS_BIT(status) (1u << (status))
+
+// systemd ACTIVE column
+typedef enum {
+    UNIT_ACTIVE_UNKNOWN,
+    UNIT_ACTIVE_ACTIVE,
+    UNIT_ACTIVE_RELOADING,
+    UNIT_ACTIVE_INACTIVE,
+    UNIT_ACTIVE_FAILED,
+    UNIT_ACTIVE_ACTIVATING,
+    UNIT_ACTIVE_DEACTIVATING,
+    UNIT_ACTIVE_MAINTENANCE,
+    UNIT_ACTIVE_REFRESHING,
+    UNIT_ACTIVE_COUNT
+} UnitActiveState;
+
+// systemd SUB column (service states plus the common ones of other unit types)
+typedef enum {
+    UNIT_SUB_UNKNOWN,
+    UNIT_SUB_DEAD,
+    UNIT_SUB_CONDITION,
+    UNIT_SUB_START_PRE,
+    UNIT_SUB_START,
+    UNIT_SUB_START_POST,
+    UNIT_SUB_RUNNING,
+    UNIT_SUB_EXITED,
+    UNIT_SUB_RELOAD,
+    UNIT_SUB_RELOAD_SIGNAL,
+    UNIT_SUB_RELOAD_NOTIFY,
+    UNIT_SUB_STOP,
+    UNIT_SUB_STOP_WATCHDOG,
+    UNIT_SUB_STOP_SIGTERM,
+    UNIT_SUB_STOP_SIGKILL,
+    UNIT_SUB_STOP_POST,
+    UNIT_SUB_FINAL_WATCHDOG,
+    UNIT_SUB_FINAL_SIGTERM,
+    UNIT_SUB_FINAL_SIGKILL,
+    UNIT_SUB_FAILED,
+    UNIT_SUB_DEAD_BEFORE_AUTO_RESTART,
+    UNIT_SUB_FAILED_BEFORE_AUTO_RESTART,
+    UNIT_SUB_DEAD_RESOURCES_PINNED,
+    UNIT_SUB_AUTO_RESTART,
+    UNIT_SUB_AUTO_RESTART_QUEUED,
+    UNIT_SUB_CLEANING,
+    UNIT_SUB_LISTENING,
+    UNIT_SUB_WAITING,
+    UNIT_SUB_ELAPSED,
+    UNIT_SUB_MOUNTED,
+    UNIT_SUB_PLUGGED,
+    UNIT_SUB_ACTIVE,
+    UNIT_SUB_ABANDONED,
+    UNIT_SUB_TENTATIVE,
+    UNIT_SUB_MOUNTING,
+    UNIT_SUB_UNMOUNTING,
+    UNIT_SUB_COUNT
+} UnitSubState;
+
+// systemd LOAD column
+typedef enum {
+    UNIT_LOAD_UNKNOWN,
+    UNIT_LOAD_LOADED,
+    UNIT_LOAD_NOT_FOUND,
+    UNIT_LOAD_BAD_SETTING,
+    UNIT_LOAD_ERROR,
+    UNIT_LOAD_MASKED,
+    UNIT_LOAD_MERGED,
+    UNIT_LOAD_STUB,
+    UNIT_LOAD_COUNT
+} UnitLoadState;
+
+// Unit type, from the suffix of the unit name
+typedef enum {
+    UNIT_TYPE_UNKNOWN,
+    UNIT_TYPE_SERVICE,
+    UNIT_TYPE_SOCKET,
+    UNIT_TYPE_TARGET,
+    UNIT_TYPE_DEVICE,
+    UNIT_TYPE_MOUNT,
+    UNIT_TYPE_AUTOMOUNT,
+    UNIT_TYPE_SWAP,
+    UNIT_TYPE_TIMER,
+    UNIT_TYPE_PATH,
+    UNIT_TYPE_SLICE,
+    UNIT_TYPE_SCOPE,
+    UNIT_TYPE_COUNT
+} UnitType;
+
+// Status column value for a vacated table row
+#define STATUS_NONE 0xFF
+
+// Returned by intern_string() when the string could not be stored
+#define STRING_ID_NONE UINT32_MAX
+
+// Service structure: a handle onto one row of service_table
 typedef struct Service {
-    char name[MAX_SERVICE_NAME];
-    ServiceStatus status;
-    int pid;
-    char last_started[64];
+    const char* name;             // Interned in service_names
+    int row;                      // Row in service_table
+    unsigned int seen_generation; // Last refresh that reported this unit
     struct Service* next;
 } Service;
 
-// Log entry structure
-typedef struct LogEntry {
-    char service_name[MAX_SERVICE_NAME];
-    char action[64];
-    char timestamp[64];
-    struct LogEntry* next;
-} LogEntry;
+// Interned strings: each distinct string is stored once and named by an id
+typedef struct StringPool {
+    char** strings;         // Id -> string
+    int count;
+    int capacity;
+    uint32_t* slots;        // Hash slots holding id + 1 (0 = empty, UINT32_MAX = removed)
+    int slot_capacity;
+    int removed_slots;      // Slots marked removed
+    void* chunks;           // Arena the strings live in, unless reclaimable
+    int reclaimable;        // Strings are allocated one by one and counted, see string_pool_release()
+    uint32_t* refs;         // Reclaimable pools: holders per id
+    uint32_t* free_ids;     // Reclaimable pools: ids of released strings, reused first
+    int free_count;
+} StringPool;
+
+// Columnar service table: one array per field, indexed by row
+typedef struct ServiceTable {
+    uint32_t* name_id;
+    uint8_t* status;        // ServiceStatus, or STATUS_NONE for vacant rows
+    int* pid;
+    time_t* last_started;   // Formatted only when printed
+    float* cpu_percent;     // From the resource sampler, -1 until measured
+    uint64_t* memory_bytes;
+    uint32_t* failures;     // Times the service has entered STATUS_FAILED
+    uint8_t* load_state;    // UnitLoadState
+    uint8_t* active_state;  // UnitActiveState
+    uint8_t* sub_state;     // UnitSubState
+    uint8_t* unit_type;     // UnitType
+    uint8_t* source;        // Unit source id (sources.c)
+    uint32_t* description_id;   // In service_descriptions, or STRING_ID_NONE
+    int rows;               // Rows in use, including vacant ones
+    int capacity;
+    int live;
+    int* free_rows;         // Vacant rows waiting for reuse
+    int free_count;
+    int free_capacity;
+
+    // Secondary indexes, kept current by every row and status update.
+    // Membership links and heads hold row + 1 so that 0 ends a list.
+    int* status_next;
+    int* status_prev;
+    int status_head[STATUS_COUNT];
+    int status_count[STATUS_COUNT];
+    int* by_started;        // Live rows ordered by (last_started, row)
+} ServiceTable;
+
+// Actions recorded in the event log
+typedef enum {
+    ACTION_STARTED,
+    ACTION_START_FAILED,
+    ACTION_STOPPED,
+    ACTION_STOP_FAILED,
+    ACTION_RESTARTED,
+    ACTION_RESTART_FAILED,
+    ACTION_QUEUED_FAILED,
+    ACTION_AUTO_RESTARTED,
+    ACTION_AUTO_RESTART_FAILED,
+    ACTION_CANCELLED,       // Skipped because a required dependency failed
+    ACTION_FLAPPING,        // Restart circuit breaker opened; auto-restarts held
+    ACTION_COUNT
+} LogAction;
+
+#define LOG_ACTION_BIT(action) (1u << (action))
+#define LOG_ALL_ACTIONS (LOG_ACTION_BIT(ACTION_COUNT) - 1)
+#define LOG_RESTART_ACTIONS (LOG_ACTION_BIT(ACTION_RESTARTED) | LOG_ACTION_BIT(ACTION_RESTART_FAILED) | \
+                             LOG_ACTION_BIT(ACTION_AUTO_RESTARTED) | LOG_ACTION_BIT(ACTION_AUTO_RESTART_FAILED))
+
+// Bounded event log: ring of LOG_CAPACITY compact records stored as columns
+typedef struct EventLog {
+    uint32_t service_id[LOG_CAPACITY];      // Interned in service_names, one reference per record
+    uint8_t action[LOG_CAPACITY];           // LogAction
+    time_t when[LOG_CAPACITY];
+    int64_t prev_for_service[LOG_CAPACITY]; // Previous event of the same service, or -1
+    int64_t next_seq;                       // Events appended so far
+    int64_t* last_for_service;              // Newest event per service id, or -1
+    int service_capacity;
+    int action_counts[ACTION_COUNT];        // Per-action histogram of the ring
+} EventLog;
 
-// Failed service queue structure
+// Failed service waiting for an automatic restart
 typedef struct FailedService {
-    char name[MAX_SERVICE_NAME];
+    const char* name;       // Interned in service_names
+    uint32_t name_id;
     int failure_count;
     time_t last_failure;
-    struct FailedService* next;
+    time_t next_retry;
+    int heap_pos;           // Position in the scheduler heap, -1 if not queued
 } FailedService;
 
-// BST node for fast searching
-typedef struct BSTNode {
-    Service* service;
-    struct BSTNode* left;
-    struct BSTNode* right;
-} BSTNode;
+// Retry scheduler: min-heap by next retry time plus a dedup set by name id
+typedef struct RetryScheduler {
+    FailedService** heap;
+    int count;
+    int capacity;
+    FailedService** by_name;    // Indexed by interned name id
+    int by_name_capacity;
+} RetryScheduler;
+
+// Service index: hash table for exact lookups plus a sorted array
+// for ordered, range and prefix iteration
+typedef struct ServiceIndex {
+    Service** slots;        // Open-addressing table (linear probing)
+    int slot_capacity;      // Always a power of two
+    int slot_used;          // Live entries plus tombstones
+    Service** sorted;       // Same services ordered by name, see index_sort()
+    int count;
+    int sorted_count;       // Leading entries known to be in order
+    int sorted_capacity;
+} ServiceIndex;
+
+// Slab pool for one fixed-size record type
+typedef struct NodePool {
+    size_t object_size;
+    int objects_per_slab;
+    void* slabs;            // Chain of slabs, oldest first
+    void* current;          // Slab new objects are carved from
+    int current_used;       // Objects handed out from the current slab
+    void* free_list;        // Released objects waiting for reuse
+    int slab_count;
+    int live;               // Objects currently in use
+} NodePool;
+
+#define POOL_INITIALIZER(type, per_slab) { sizeof(type), (per_slab), NULL, NULL, 0, NULL, 0, 0 }
+
+// Persistent on-disk journal of log events
+typedef struct Journal {
+    char dir[512];
+    int active;             // Set once a segment is open for appending
+    int disabled;           // Never opened on first use, see journal_disable()
+    int fd;
+    unsigned int segment_number;
+    void* map;              // Active segment mapping
+    size_t map_size;
+    StringPool names;       // Service name -> index in the active segment
+    uint32_t unsynced;      // Records written since the last sync
+    time_t last_sync;
+} Journal;
+
+// Called once per event returned by a journal query
+typedef void (*JournalVisitor)(time_t when, const char* service_name, LogAction action, void* context);
+
+// Service control actions run through the control engine
+typedef enum {
+    CONTROL_START,
+    CONTROL_STOP,
+    CONTROL_RESTART
+} ControlAction;
+
+// One systemctl invocation
+typedef struct ControlJob {
+    char service_name[MAX_SERVICE_NAME];
+    ControlAction action;
+    void* context;          // Caller data handed back on completion
+    pid_t pid;
+    int pidfd;              // -1 when the kernel has no pidfd support
+    time_t started;
+    uint64_t started_ns;    // Monotonic, for the latency histograms
+    time_t deadline;
+    int timed_out;
+    int exit_code;
+    int succeeded;
+    const char* cancelled_by;   // Failed Requires= dependency that cancelled the job, or NULL
+} ControlJob;
+
+// Jobs run together with bounded concurrency
+typedef struct ControlBatch {
+    ControlJob* jobs;
+    int count;
+    int capacity;
+} ControlBatch;
+
+// Restart circuit breaker of one service (flap.c)
+typedef enum {
+    BREAKER_CLOSED,         // Restarts allowed
+    BREAKER_OPEN,           // Flapping: automatic restarts held back
+    BREAKER_HALF_OPEN       // Cooldown over: one trial restart allowed
+} BreakerState;
+
+// Flap counters of one service over the sliding window
+typedef struct FlapStatus {
+    BreakerState state;
+    int failures;
+    int restarts;
+    time_t half_open_at;    // When an open breaker half-opens, else 0
+} FlapStatus;
+
+// Waves a set of units is (re)started in, from the dependency graph
+typedef struct DependencyPlan {
+    int count;              // Units planned
+    int waves;
+    int* wave;              // Wave of each unit, from 0
+    int* required_first;    // Unit i Requires= units required[required_first[i] ..
+    int* required;          //   required_first[i + 1]), as plan indexes
+} DependencyPlan;
+
+// Called as each job of a batch finishes
+typedef void (*ControlDone)(const ControlJob* job, void* context);
+
+// One unit read from a systemctl listing. The text fields point into the
+// listing and are not NUL-terminated.
+typedef struct UnitRecord {
+    const char* name;       // Without a .service suffix
+    size_t name_length;     // At most MAX_SERVICE_NAME - 1
+    const char* description;
+    size_t description_length;
+    UnitType type;
+    UnitLoadState load_state;
+    UnitActiveState active_state;
+    UnitSubState sub_state;
+    ServiceStatus status;
+} UnitRecord;
+
+// Position in a listing being tokenized
+typedef struct UnitTokenizer {
+    const char* cursor;
+    const char* end;
+} UnitTokenizer;
+
+// Reusable buffer for captured subprocess output
+typedef struct ExecBuffer {
+    char* data;             // Always NUL-terminated after a capture
+    size_t length;
+    size_t capacity;
+} ExecBuffer;
+
+// Change-event source for the monitor: readable whenever units may have changed
+typedef struct MonitorSource {
+    const char* name;
+    int fd;
+    int keepalive_fd;       // FIFO write end held open, or -1
+    pid_t helper_pid;       // Helper process feeding fd, or -1
+} MonitorSource;
+
+// Cached files and last CPU reading for one service table row
+typedef struct ResourceSlot {
+    uint32_t name_id;       // Unit the files belong to, STRING_ID_NONE if unused
+    int procs_fd;           // cgroup.procs
+    int cpu_fd;             // cpu.stat (cgroup v2)
+    int memory_fd;          // memory.current (cgroup v2)
+    int stat_fd;            // /proc/<pid>/stat, opened only without cgroup v2 files
+    int stat_pid;
+    uint64_t cpu_usec;      // CPU time at the last sample
+    double sampled_at;      // Monotonic time of the last sample, 0 = never
+    double looked_up;       // Monotonic time the unit was last found without a cgroup, 0 = never
+} ResourceSlot;
+
+// Per-service PID, CPU and memory sampler over cgroups and /proc
+typedef struct ResourceSampler {
+    char root[512];         // Prefix for /sys/fs/cgroup and /proc
+    int configured;
+    ResourceSlot* slots;    // Indexed by service table row
+    int capacity;
+} ResourceSampler;
+
+// Combined predicates for a service query; every field that is set must match
+typedef struct ServiceQuery {
+    unsigned int status_mask;               // STATUS_BIT() of accepted statuses, 0 = any
+    char name_pattern[MAX_SERVICE_NAME];    // Glob (*, ?, [...]), "" = any
+    unsigned int min_failures;              // At least this many failures
+    int has_started_range;
+    time_t started_from;                    // Inclusive bounds on last started
+    time_t started_to;
+    int pid_present;                        // 1 = has a PID, 0 = has none, -1 = any
+    unsigned int source_mask;               // Bit per accepted source id, 0 = any
+} ServiceQuery;
+
+// Index that drove a query
+typedef enum {
+    QUERY_SCAN,
+    QUERY_BY_NAME,
+    QUERY_BY_STATUS,
+    QUERY_BY_STARTED
+} QueryPlan;
+
+// Output formats for listings
+typedef enum {
+    OUTPUT_TABLE,
+    OUTPUT_JSON,            // One JSON object per line
+    OUTPUT_CSV
+} OutputFormat;
+
+// How listings are rendered and which rows they show
+typedef struct OutputOptions {
+    OutputFormat format;
+    int offset;             // Rows to skip
+    int limit;              // Rows to show, 0 = all
+} OutputOptions;
+
+// One column of a rendered listing
+typedef struct RenderColumn {
+    const char* title;      // Table header
+    const char* key;        // JSON field and CSV header
+    int width;              // Table column width
+} RenderColumn;
+
+// State of one listing being rendered
+typedef struct Renderer {
+    OutputOptions options;
+    const RenderColumn* columns;
+    int column_count;
+    int field;              // Next column of the current row
+    int rows_seen;          // Rows offered, shown or not
+    int rows_shown;
+    int failed;
+} Renderer;
+
+// One process read from /proc
+typedef struct ProcessInfo {
+    int pid;
+    int ppid;
+    uid_t uid;
+    char state;
+    int threads;
+    char command[32];
+    uint64_t cpu_ticks;     // utime + stime
+    uint64_t start_ticks;   // Start time in clock ticks after boot
+    uint64_t vsize_kb;
+    uint64_t rss_kb;
+    uint32_t service_id;    // Owning service in service_names, or STRING_ID_NONE
+} ProcessInfo;
+
+// Result of a /proc scan, reused across scans
+typedef struct ProcessTable {
+    ProcessInfo* processes; // Sorted by pid
+    int count;
+    int capacity;
+    int* pids;              // Scratch list of /proc entries
+    int pid_capacity;
+    double uptime;          // Seconds since boot at scan time
+    uint64_t memory_total_kb;
+    long clock_ticks;
+} ProcessTable;
+
+// Ordering for top-N process listings
+typedef enum {
+    PROCESS_SORT_CPU,
+    PROCESS_SORT_RSS
+} ProcessSortKey;
+
+// Kind of transition reported by a refresh
+typedef enum {
+    CHANGE_ADDED,
+    CHANGE_REMOVED,
+    CHANGE_STATUS
+} ChangeKind;
+
+// One status transition found while reconciling with the system
+typedef struct ServiceChange {
+    char name[MAX_SERVICE_NAME];
+    ChangeKind kind;
+    ServiceStatus old_status;
+    ServiceStatus new_status;
+} ServiceChange;
+
+// One service as seen by snapshot readers
+typedef struct SnapshotEntry {
+    const char* name;       // Interned in service_names
+    uint32_t name_id;
+    uint8_t status;         // ServiceStatus
+    int pid;
+    time_t last_started;
+    float cpu_percent;      // -1 until measured
+    uint64_t memory_bytes;
+    uint32_t failures;
+    uint8_t load_state;     // UnitLoadState
+    uint8_t active_state;   // UnitActiveState
+    uint8_t sub_state;      // UnitSubState
+    uint8_t source;         // Unit source id
+    const char* description;    // Interned in service_descriptions, or NULL
+} SnapshotEntry;
+
+// Immutable copy of the service table published for lock-free readers
+typedef struct ServiceSnapshot {
+    uint64_t version;       // Increases with every publish
+    time_t built;
+    int count;
+    SnapshotEntry* entries; // Ordered by name
+    int* by_status;         // Entry numbers grouped by status, each group in name order
+    int status_first[STATUS_COUNT + 1];     // Start of each group in by_status
+    uint32_t* slots;        // Name hash slots holding entry + 1 (0 = empty)
+    unsigned int slot_mask;
+    struct ServiceSnapshot* retired_next;   // Writer-side list of replaced versions
+} ServiceSnapshot;
+
+// Depth and totals of one monitoring pipeline queue
+typedef struct PipelineQueueStats {
+    const char* name;
+    int depth;              // Events waiting now
+    int max_depth;
+    int capacity;
+    unsigned long long pushed;
+    unsigned long long stalls;  // Pushes that waited for space
+} PipelineQueueStats;
+
+// Event counters kept by the metrics module
+typedef enum {
+    METRIC_ENUMERATIONS,
+    METRIC_ENUMERATION_FAILURES,
+    METRIC_PARSED_UNITS,
+    METRIC_INDEX_INSERTS,
+    METRIC_INDEX_LOOKUPS,
+    METRIC_CONTROL_JOBS,
+    METRIC_CONTROL_FAILURES,
+    METRIC_CONTROL_CANCELLED,
+    METRIC_RESTART_ATTEMPTS,
+    METRIC_RESTART_FAILURES,
+    METRIC_RESTARTS_SUPPRESSED,
+    METRIC_LOG_ENTRIES,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+// Operations with a latency histogram
+typedef enum {
+    LATENCY_ENUMERATE,      // systemctl list-units, spawn to exit
+    LATENCY_PARSE,          // Reconciling one listing with the table
+    LATENCY_INDEX_INSERT,   // Sampled
+    LATENCY_INDEX_LOOKUP,   // Sampled
+    LATENCY_CONTROL_START,
+    LATENCY_CONTROL_STOP,
+    LATENCY_CONTROL_RESTART,
+    LATENCY_RESTART_ATTEMPT,    // Automatic restarts from the failed queue
+    LATENCY_COUNT
+} MetricLatency;
+
+// Growable set of transitions returned by a refresh
+typedef struct ServiceChangeSet {
+    ServiceChange* changes;
+    int count;
+    int capacity;
+    unsigned int failed_sources;    // Bit per source id whose listing failed
+} ServiceChangeSet;
 
 // Global variables
 extern Service* service_list;
-extern LogEntry* log_stack;
-extern FailedService* failed_queue_front;
-extern FailedService* failed_queue_rear;
-extern BSTNode* service_bst;
-extern int failed_queue_size;
+extern EventLog event_log;
+extern Journal service_journal;
+extern RetryScheduler failed_scheduler;
+extern ServiceIndex service_index;
+extern ServiceTable service_table;
+extern StringPool service_names;
+extern StringPool service_descriptions;
+extern int control_concurrency;
+extern int control_timeout;
+extern int flap_window;
+extern int flap_threshold;
+extern int flap_cooldown;
+extern NodePool service_pool;
+extern NodePool failed_pool;
+extern ResourceSampler resource_sampler;
+extern __thread OutputOptions output_options;
 
 // Function prototypes
 void load_services_from_system();
-void add_service_to_list(const char* name, ServiceStatus status, int pid);
-void add_log_entry(const char* service_name, const char* action);
+int refresh_services_from_system(ServiceChangeSet* changes);
+int reconcile_services(const char* data, size_t length, ServiceChangeSet* changes);
+void report_failed_sources(FILE* out, unsigned int failed_sources);
+void display_service_changes(const ServiceChangeSet* changes);
+void free_change_set(ServiceChangeSet* changes);
+const char* change_kind_to_string(ChangeKind kind);
+Service* add_service_to_list(const char* name, ServiceStatus status, int pid);
+void set_service_unit_info(Service* service, int source, const UnitRecord* unit, uint32_t description_id);
+void release_service_name(uint32_t name_id);
+void add_log_entry(const char* service_name, LogAction action);
 void display_all_services();
+void list_all_processes();
+void list_top_processes(ProcessSortKey key, int limit);
+void display_status_counts();
 void display_logs();
-void search_service_by_name(const char* name);
-void filter_services_by_status(ServiceStatus status);
+void display_service_history(const char* service_name, int limit);
+void display_restart_counts(int window_seconds);
+void display_action_histogram();
+void display_journal_history(const char* service_name, int hours);
+int search_service_by_name(const char* name);
+int filter_services_by_status(ServiceStatus status);
+int filter_services(ServiceStatus status, int source);
+int display_flapping_services(int source);
+int query_services(const char* query_text);
 void start_service(const char* service_name);
 void stop_service(const char* service_name);
 void restart_service(const char* service_name);
-void detect_failed_services();
+int control_services(const char* const service_names[], int count, ControlAction action);
+int detect_failed_services();
 void add_to_failed_queue(const char* service_name);
-void process_failed_services();
-void monitor_services();
-BSTNode* insert_bst(BSTNode* node, Service* service);
-Service* search_bst(BSTNode* node, const char* name);
+int schedule_failed_service(const char* service_name);
+time_t finish_failed_retry(FailedService* entry, const ControlJob* job);
+time_t hold_flapping_retry(FailedService* entry, time_t now, int* first_hold);
+void remove_from_failed_queue(const char* service_name);
+int process_failed_services();
+void monitor_services(int duration_seconds);
+void search_services_by_prefix(const char* prefix);
 const char* status_to_string(ServiceStatus status);
 ServiceStatus string_to_status(const char* status_str);
 void free_memory();
 
+// Service index (index.c)
+int index_insert(ServiceIndex* index, Service* service);
+Service* index_find(const ServiceIndex* index, const char* name);
+Service* index_find_bytes(const ServiceIndex* index, const char* name, size_t length);
+int index_remove(ServiceIndex* index, const char* name);
+int index_sort(ServiceIndex* index);
+int index_lower_bound(ServiceIndex* index, const char* name);
+int index_prefix_range(ServiceIndex* index, const char* prefix, int* first);
+int index_range(ServiceIndex* index, const char* from, const char* to, int* first);
+void index_free(ServiceIndex* index);
+unsigned int hash_string(const char* str);
+unsigned int hash_bytes(const char* data, size_t length);
+
+// Node pools (pool.c)
+void* pool_alloc(NodePool* pool);
+void pool_release(NodePool* pool, void* object);
+void pool_reset(NodePool* pool);
+void pool_destroy(NodePool* pool);
+
+// Columnar service table (table.c)
+uint32_t intern_string(StringPool* pool, const char* str);
+uint32_t intern_bytes(StringPool* pool, const char* data, size_t length);
+uint32_t string_pool_find(const StringPool* pool, const char* str);
+const char* string_pool_get(const StringPool* pool, uint32_t id);
+void string_pool_retain(StringPool* pool, uint32_t id);
+char* string_pool_release(StringPool* pool, uint32_t id);
+void string_pool_free(StringPool* pool);
+int table_add_row(ServiceTable* table, uint32_t name_id, ServiceStatus status,
+                  int pid, time_t last_started);
+void table_remove_row(ServiceTable* table, int row);
+int table_count_status(const ServiceTable* table, ServiceStatus status);
+void table_set_status(ServiceTable* table, int row, ServiceStatus status);
+void table_set_last_started(ServiceTable* table, int row, time_t when);
+void table_rebuild_started(ServiceTable* table);
+void table_set_unit_info(ServiceTable* table, int row, int source, const UnitRecord* unit, uint32_t description_id);
+int table_status_first(const ServiceTable* table, ServiceStatus status);
+int table_status_next(const ServiceTable* table, int row);
+int table_started_range(const ServiceTable* table, time_t from, time_t to, int* first);
+void table_free(ServiceTable* table);
+const char* format_timestamp(time_t when, char* buffer, size_t size);
+ServiceStatus service_status(const Service* service);
+void set_service_status(Service* service, ServiceStatus status);
+int service_pid(const Service* service);
+void set_service_pid(Service* service, int pid);
+time_t service_last_started(const Service* service);
+void set_service_last_started(Service* service, time_t when);
+float service_cpu_percent(const Service* service);
+uint64_t service_memory_bytes(const Service* service);
+uint32_t service_failures(const Service* service);
+
+// Event log (log.c)
+int event_log_append(EventLog* log, uint32_t service_id, LogAction action, time_t when, uint32_t* evicted);
+int event_log_size(const EventLog* log);
+int event_log_recent_for_service(const EventLog* log, uint32_t service_id, int64_t* seqs, int max);
+int event_log_count_for_service(const EventLog* log, uint32_t service_id,
+                                unsigned int action_mask, time_t since);
+void event_log_free(EventLog* log);
+const char* action_to_string(LogAction action);
+
+// Persistent journal (journal.c)
+int journal_open(Journal* journal, const char* dir);
+void journal_close(Journal* journal);
+void journal_append(Journal* journal, const char* service_name, LogAction action, time_t when);
+int journal_query_range(Journal* journal, time_t from, time_t to,
+                        JournalVisitor visit, void* context);
+int journal_query_service(Journal* journal, const char* service_name, time_t from, time_t to,
+                          JournalVisitor visit, void* context);
+const char* journal_directory();
+void journal_disable(Journal* journal);
+int make_directories(const char* path);
+
+// Failed service retry scheduler (scheduler.c)
+FailedService* scheduler_find(const RetryScheduler* scheduler, uint32_t name_id);
+int scheduler_insert(RetryScheduler* scheduler, FailedService* entry);
+FailedService* scheduler_peek(const RetryScheduler* scheduler);
+FailedService* scheduler_pop_due(RetryScheduler* scheduler, time_t now);
+FailedService* scheduler_remove(RetryScheduler* scheduler, uint32_t name_id);
+time_t retry_backoff(int failure_count);
+void scheduler_free(RetryScheduler* scheduler);
+
+// Control engine (control.c)
+const char* control_action_to_string(ControlAction action);
+void control_configure_from_env();
+int control_batch_add(ControlBatch* batch, const char* service_name, ControlAction action, void* context);
+int control_batch_run(ControlBatch* batch, ControlDone done, void* context);
+int control_batch_run_ordered(ControlBatch* batch, ControlDone done, void* context);
+void control_batch_free(ControlBatch* batch);
+
+// Shell-free subprocess execution (exec.c)
+int exec_spawn(const char* const argv[], int* stdout_fd, pid_t* pid);
+int exec_wait(pid_t pid);
+int exec_capture(const char* const argv[], ExecBuffer* out, int timeout_seconds);
+int exec_capture_all(const char* const* argvs[], ExecBuffer outs[], int exit_codes[], int count,
+                     int timeout_seconds);
+int exec_buffer_append(ExecBuffer* buffer, const void* data, size_t length);
+void exec_buffer_free(ExecBuffer* buffer);
+
+// Service managers units are enumerated from (sources.c)
+void sources_configure_from_env();
+int source_count();
+const char* source_name(int source);
+int source_find(const char* name);
+int source_of_unit(const char* name, const char** unit);
+int source_qualify(int source, const char* unit, size_t length, char* out, size_t size);
+int source_command(int source, const char** argv, int max, const char* const args[]);
+
+// Unit dependency graph and restart waves (depgraph.c)
+int depgraph_plan(const char* const names[], int count, DependencyPlan* plan);
+void depgraph_plan_free(DependencyPlan* plan);
+void depgraph_invalidate(const char* name);
+void depgraph_display_plan(const char* const names[], int count);
+void depgraph_free();
+
+// Flap detection and restart circuit breaker (flap.c)
+void flap_configure_from_env();
+const char* breaker_state_to_string(BreakerState state);
+void flap_record_failure(uint32_t name_id, time_t now);
+void flap_record_recovery(uint32_t name_id, time_t now);
+void flap_record_restart(uint32_t name_id, int succeeded, time_t now);
+time_t flap_hold_restart(uint32_t name_id, time_t now, int* first_hold);
+void flap_release_trial(uint32_t name_id);
+void flap_forget(uint32_t name_id);
+int flap_status(uint32_t name_id, time_t now, FlapStatus* status);
+void flap_free();
+
+// Event-driven monitor (monitor.c)
+int monitor_source_open_fifo(MonitorSource* source, const char* path);
+int monitor_source_open_systemd(MonitorSource* source);
+int monitor_source_open_default(MonitorSource* source);
+int monitor_source_drain(MonitorSource* source);
+void monitor_source_close(MonitorSource* source);
+void monitor_arm_timer(int fd, long ms, int periodic);
+void monitor_arm_settle(int fd, long ms);
+void monitor_queue_failed(const ServiceChangeSet* changes);
+
+// Per-service resource sampling (resource.c)
+const char* resource_root();
+void resource_sample_row(ResourceSampler* sampler, ServiceTable* table, int row);
+void resource_sample_all(ResourceSampler* sampler, ServiceTable* table);
+int resource_lookup_cgroups(ResourceSampler* sampler, ServiceTable* table);
+void resource_release_row(ResourceSampler* sampler, int row);
+void resource_sampler_free(ResourceSampler* sampler);
+const char* format_bytes(uint64_t bytes, char* buffer, size_t size);
+
+// Service query engine (query.c)
+void query_init(ServiceQuery* query);
+int query_parse(const char* text, ServiceQuery* query);
+int query_run(const ServiceQuery* query, int* rows_out, QueryPlan* plan_out);
+const char* query_plan_to_string(QueryPlan plan);
+
+// Buffered listing renderer (render.c)
+const char* output_format_to_string(OutputFormat format);
+int output_format_from_string(const char* text, OutputFormat* format);
+void output_configure_from_env();
+int output_is_table();
+FILE* output_message_stream();
+void render_begin(Renderer* renderer, const RenderColumn* columns, int column_count);
+int render_row_begin(Renderer* renderer);
+void render_string(Renderer* renderer, const char* text);
+void render_int(Renderer* renderer, long long value);
+void render_double(Renderer* renderer, double value, int precision);
+void render_missing(Renderer* renderer);
+void render_time(Renderer* renderer, time_t when);
+void render_bytes(Renderer* renderer, uint64_t bytes);
+void render_row_end(Renderer* renderer);
+int render_end(Renderer* renderer);
+void render_free();
+
+// Non-interactive command and script mode (batch.c)
+int batch_run_command(int argc, char** argv);
+int batch_run_script(FILE* script);
+int batch_main(int argc, char** argv);
+int batch_parse_options(int argc, char** argv, int* index);
+int batch_split_words(char* line, char** words, int max);
+int batch_refresh_services();
+int batch_load_saved_services(int reconcile);
+void batch_usage(const char* program);
+
+// Resident daemon and its client (daemon.c)
+const char* daemon_socket_path();
+int daemon_main(const char* socket_path);
+int client_main(const char* socket_path, int argc, char** argv);
+
+// Published table snapshots and the background refresher (snapshot.c)
+void service_lock();
+void service_unlock();
+int snapshot_publish();
+void snapshot_defer_free(void* memory);
+const ServiceSnapshot* snapshot_pin();
+void snapshot_unpin(const ServiceSnapshot* snapshot);
+const SnapshotEntry* snapshot_find(const ServiceSnapshot* snapshot, const char* name);
+int snapshot_prefix_range(const ServiceSnapshot* snapshot, const char* prefix, int* first);
+int snapshot_status_entries(const ServiceSnapshot* snapshot, ServiceStatus status, const int** entries);
+void snapshot_free_all();
+int snapshot_refresher_start(int notify_fd);
+void snapshot_refresher_request();
+int snapshot_refresher_take(ServiceChangeSet* changes);
+void snapshot_refresher_stop();
+
+// Multi-threaded monitoring pipeline (pipeline.c)
+int pipeline_start();
+void pipeline_trigger();
+void pipeline_stop();
+int pipeline_queue_stats(PipelineQueueStats* stats, int max);
+void display_pipeline_stats();
+
+// systemctl listing tokenizer (unitparse.c)
+void unit_tokenizer_init(UnitTokenizer* tokenizer, const char* data, size_t length);
+int unit_tokenizer_next(UnitTokenizer* tokenizer, UnitRecord* unit);
+const char* unit_active_state_to_string(UnitActiveState state);
+const char* unit_sub_state_to_string(UnitSubState state);
+const char* unit_load_state_to_string(UnitLoadState state);
+const char* unit_type_to_string(UnitType type);
+
+// Hot-path counters, latency histograms and Prometheus export (metrics.c)
+uint64_t metrics_now();
+void metrics_count(MetricCounter counter, uint64_t amount);
+void metrics_observe(MetricLatency latency, uint64_t nanoseconds);
+void metrics_observe_since(MetricLatency latency, uint64_t start);
+uint64_t metrics_sample_start();
+int metrics_write_prometheus(FILE* out);
+const char* metrics_file_path();
+int metrics_write_file(const char* path);
+void metrics_export();
+
+// Native process scanner (procscan.c)
+int process_scan_threads();
+int process_scan(ProcessTable* table, const char* root, int threads);
+double process_cpu_percent(const ProcessTable* table, const ProcessInfo* info);
+double process_memory_percent(const ProcessTable* table, const ProcessInfo* info);
+int process_top(const ProcessTable* table, ProcessSortKey key, int limit, int* rows_out);
+const char* process_user_name(uid_t uid);
+void process_table_free(ProcessTable* table);
+
+// Persisted state file and its background reconciliation (statefile.c)
+const char* state_file_path();
+int state_file_write(const char* path);
+int state_file_load(const char* path);
+void state_file_checkpoint(int force);
+void state_file_mark_fresh();
+time_t state_file_stale_since();
+int state_file_reconcile_start();
+int state_file_reconcile_finish(FILE* out, int wait);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,267 @@
+#include "func.h"
+
+// Service index: an open-addressing hash table (linear probing) for exact
+// name lookups plus a sorted array of the same records for ordered, range
+// and prefix iteration. Both hold borrowed pointers; the Service records
+// themselves are owned by service_list.
+//
+// An insert that does not sort after every entry is appended to an
+// unordered tail instead of being moved into place, so loading units in
+// any order (other sources' names interleave with system names) costs
+// O(1) each. index_sort() sorts the tail and merges it in one pass; the
+// ordered operations below call it first.
+
+#define INDEX_MIN_SLOTS 64
+
+// Marker left in a slot after a deletion so probe chains stay intact
+static char tombstone_marker;
+#define INDEX_TOMBSTONE ((Service*)&tombstone_marker)
+
+// FNV-1a hash of a string
+unsigned int hash_string(const char* str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a hash of length bytes; equal to hash_string() of the same text
+unsigned int hash_bytes(const char* data, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Find the slot holding name, or -1 if it is not in the table
+static int find_slot(const ServiceIndex* index, const char* name) {
+    if (index->slot_capacity == 0) return -1;
+
+    unsigned int mask = (unsigned int)index->slot_capacity - 1;
+    unsigned int slot = hash_string(name) & mask;
+
+    while (index->slots[slot] != NULL) {
+        if (index->slots[slot] != INDEX_TOMBSTONE &&
+            strcmp(index->slots[slot]->name, name) == 0) {
+            return (int)slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Place a service in the first free slot of its probe chain
+static void place_in_slots(Service** slots, int capacity, Service* service) {
+    unsigned int mask = (unsigned int)capacity - 1;
+    unsigned int slot = hash_string(service->name) & mask;
+
+    while (slots[slot] != NULL && slots[slot] != INDEX_TOMBSTONE) {
+        slot = (slot + 1) & mask;
+    }
+    slots[slot] = service;
+}
+
+// Rebuild the hash table with the given capacity, dropping tombstones
+static int rehash(ServiceIndex* index, int new_capacity) {
+    Service** slots = (Service**)calloc(new_capacity, sizeof(Service*));
+    if (slots == NULL) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+
+    for (int i = 0; i < index->count; i++) {
+        place_in_slots(slots, new_capacity, index->sorted[i]);
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->slot_capacity = new_capacity;
+    index->slot_used = index->count;
+    return 0;
+}
+
+static int compare_service_names(const void* a, const void* b) {
+    return strcmp((*(Service* const*)a)->name, (*(Service* const*)b)->name);
+}
+
+// Put the entries appended since the last sort into name order: the tail
+// is sorted on its own and merged with the ordered prefix. Returns 0, or
+// -1 if the merge buffer could not be allocated (the order is then
+// restored by sorting the whole array in place).
+int index_sort(ServiceIndex* index) {
+    int ordered = index->sorted_count, tail = index->count - ordered;
+    if (tail == 0) return 0;
+
+    qsort(index->sorted + ordered, tail, sizeof(Service*), compare_service_names);
+    if (ordered > 0 && strcmp(index->sorted[ordered - 1]->name, index->sorted[ordered]->name) > 0) {
+        Service** merged = (Service**)malloc(index->count * sizeof(Service*));
+        if (merged == NULL) {
+            qsort(index->sorted, index->count, sizeof(Service*), compare_service_names);
+            index->sorted_count = index->count;
+            return -1;
+        }
+        int a = 0, b = ordered, out = 0;
+        while (a < ordered && b < index->count) {
+            merged[out++] = strcmp(index->sorted[a]->name, index->sorted[b]->name) <= 0 ?
+                            index->sorted[a++] : index->sorted[b++];
+        }
+        while (a < ordered) merged[out++] = index->sorted[a++];
+        while (b < index->count) merged[out++] = index->sorted[b++];
+        memcpy(index->sorted, merged, index->count * sizeof(Service*));
+        free(merged);
+    }
+    index->sorted_count = index->count;
+    return 0;
+}
+
+// Position of the first name that is not less than name
+int index_lower_bound(ServiceIndex* index, const char* name) {
+    index_sort(index);
+    int low = 0, high = index->count;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(index->sorted[mid]->name, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Insert a service. Returns 0 on success, 1 if the name is already indexed
+// and -1 on allocation failure.
+int index_insert(ServiceIndex* index, Service* service) {
+    uint64_t started = metrics_sample_start();
+
+    metrics_count(METRIC_INDEX_INSERTS, 1);
+    if (find_slot(index, service->name) >= 0) return 1;
+
+    // Keep the load factor (including tombstones) under 3/4
+    if ((index->slot_used + 1) * 4 > index->slot_capacity * 3) {
+        int new_capacity = index->slot_capacity ? index->slot_capacity : INDEX_MIN_SLOTS;
+        while ((index->count + 1) * 2 > new_capacity) {
+            new_capacity *= 2;
+        }
+        if (rehash(index, new_capacity) < 0) return -1;
+    }
+
+    if (index->count == index->sorted_capacity) {
+        int new_capacity = index->sorted_capacity ? index->sorted_capacity * 2 : INDEX_MIN_SLOTS;
+        Service** grown = (Service**)realloc(index->sorted, new_capacity * sizeof(Service*));
+        if (grown == NULL) {
+            printf("Memory allocation failed!\n");
+            return -1;
+        }
+        index->sorted = grown;
+        index->sorted_capacity = new_capacity;
+    }
+
+    // systemctl lists units in sorted order, so this usually extends the
+    // ordered prefix; anything else waits in the tail for index_sort()
+    int pos = index->count;
+    if (index->sorted_count == pos &&
+        (pos == 0 || strcmp(index->sorted[pos - 1]->name, service->name) < 0)) {
+        index->sorted_count++;
+    }
+    index->sorted[pos] = service;
+    index->count++;
+
+    unsigned int mask = (unsigned int)index->slot_capacity - 1;
+    unsigned int slot = hash_string(service->name) & mask;
+    while (index->slots[slot] != NULL && index->slots[slot] != INDEX_TOMBSTONE) {
+        slot = (slot + 1) & mask;
+    }
+    if (index->slots[slot] == NULL) index->slot_used++;
+    index->slots[slot] = service;
+
+    metrics_observe_since(LATENCY_INDEX_INSERT, started);
+    return 0;
+}
+
+// Exact-name lookup
+Service* index_find(const ServiceIndex* index, const char* name) {
+    uint64_t started = metrics_sample_start();
+    int slot = find_slot(index, name);
+
+    metrics_count(METRIC_INDEX_LOOKUPS, 1);
+    metrics_observe_since(LATENCY_INDEX_LOOKUP, started);
+    return slot >= 0 ? index->slots[slot] : NULL;
+}
+
+// Exact-name lookup of the first length bytes of name, which need not be
+// NUL-terminated (a field of a listing being parsed)
+Service* index_find_bytes(const ServiceIndex* index, const char* name, size_t length) {
+    uint64_t started = metrics_sample_start();
+    Service* found = NULL;
+
+    metrics_count(METRIC_INDEX_LOOKUPS, 1);
+    if (index->slot_capacity > 0) {
+        unsigned int mask = (unsigned int)index->slot_capacity - 1;
+        unsigned int slot = hash_bytes(name, length) & mask;
+
+        for (; index->slots[slot] != NULL; slot = (slot + 1) & mask) {
+            const Service* service = index->slots[slot];
+            if (service != INDEX_TOMBSTONE && strncmp(service->name, name, length) == 0 &&
+                service->name[length] == '\0') {
+                found = index->slots[slot];
+                break;
+            }
+        }
+    }
+    metrics_observe_since(LATENCY_INDEX_LOOKUP, started);
+    return found;
+}
+
+// Remove a service by name. Returns 0 if it was removed, -1 if not found.
+int index_remove(ServiceIndex* index, const char* name) {
+    int slot = find_slot(index, name);
+    if (slot < 0) return -1;
+
+    index->slots[slot] = INDEX_TOMBSTONE;
+
+    int pos = index_lower_bound(index, name);
+    memmove(&index->sorted[pos], &index->sorted[pos + 1],
+            (index->count - pos - 1) * sizeof(Service*));
+    index->count--;
+    index->sorted_count--;
+
+    return 0;
+}
+
+// Find the run of sorted entries whose names start with prefix.
+// Stores the first position in *first and returns the number of matches.
+int index_prefix_range(ServiceIndex* index, const char* prefix, int* first) {
+    size_t length = strlen(prefix);
+    int start = index_lower_bound(index, prefix);
+    int end = start;
+
+    while (end < index->count && strncmp(index->sorted[end]->name, prefix, length) == 0) {
+        end++;
+    }
+
+    *first = start;
+    return end - start;
+}
+
+// Find the run of sorted entries with from <= name < to (to may be NULL for
+// "until the end"). Stores the first position in *first and returns the count.
+int index_range(ServiceIndex* index, const char* from, const char* to, int* first) {
+    int start = from ? index_lower_bound(index, from) : 0;
+    int end = to ? index_lower_bound(index, to) : index->count;
+
+    *first = start;
+    return end > start ? end - start : 0;
+}
+
+// Release the index storage (not the services it points to)
+void index_free(ServiceIndex* index) {
+    free(index->slots);
+    free(index->sorted);
+    memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,543 @@
+#include "func.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Persistent journal: every event given to add_log_entry() is also appended
+// to a memory-mapped segment file on disk. A segment is laid out as
+//
+//   [header][sparse time index][service name table][name text][records...]
+//
+// Records are fixed size and written in time order. Every
+// JOURNAL_INDEX_STRIDE-th record is noted in the sparse time index, and each
+// record links to the previous record of the same service, whose newest
+// record is kept in the name table. Time-range and per-service queries
+// therefore touch only the records they return. Full segments are truncated
+// to their used size and a new one is started; old segments are deleted by
+// count and age.
+//
+// The journal is opened when the first event is appended, so commands that
+// only read (listings, queries, daemon clients) never create or touch it.
+// Queries read the segment files directly and work whether or not it is open.
+
+#define JOURNAL_MAGIC "SVCJRNL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define JOURNAL_MAX_NAMES 16384
+#define JOURNAL_NAME_TEXT_SIZE (1024 * 1024)
+#define JOURNAL_INDEX_STRIDE 256
+#define JOURNAL_SYNC_BATCH 64          // Records between syncs
+#define JOURNAL_SYNC_INTERVAL 5        // Seconds between syncs
+#define JOURNAL_MAX_SEGMENT_AGE (24 * 60 * 60)
+#define JOURNAL_MAX_SEGMENTS 16
+#define JOURNAL_RETENTION (7 * 24 * 60 * 60)
+
+typedef struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;
+    uint32_t name_count;
+    uint32_t time_index_count;
+    uint32_t name_text_used;
+    uint32_t reserved;
+    int64_t created;
+    int64_t first_time;
+    int64_t last_time;
+} JournalHeader;
+
+typedef struct JournalTimeIndex {
+    int64_t when;
+    uint32_t record;
+    uint32_t reserved;
+} JournalTimeIndex;
+
+typedef struct JournalName {
+    uint32_t last_record;       // Newest record of this service + 1, 0 = none
+    uint32_t record_count;
+    uint32_t text_offset;       // NUL-terminated name in the name text region
+    uint32_t reserved;
+} JournalName;
+
+typedef struct JournalRecord {
+    int64_t when;
+    uint32_t name_index;
+    uint32_t prev_for_service;  // Previous record of the same service + 1, 0 = none
+    uint8_t action;
+    uint8_t reserved[7];
+} JournalRecord;
+
+#define JOURNAL_HEADER_SIZE 4096
+#define JOURNAL_TIME_INDEX_MAX (JOURNAL_SEGMENT_SIZE / sizeof(JournalRecord) / JOURNAL_INDEX_STRIDE + 1)
+#define JOURNAL_NAMES_OFFSET (JOURNAL_HEADER_SIZE + JOURNAL_TIME_INDEX_MAX * sizeof(JournalTimeIndex))
+#define JOURNAL_NAME_TEXT_OFFSET (JOURNAL_NAMES_OFFSET + JOURNAL_MAX_NAMES * sizeof(JournalName))
+#define JOURNAL_RECORDS_OFFSET (JOURNAL_NAME_TEXT_OFFSET + JOURNAL_NAME_TEXT_SIZE)
+#define JOURNAL_MAX_RECORDS ((JOURNAL_SEGMENT_SIZE - JOURNAL_RECORDS_OFFSET) / sizeof(JournalRecord))
+
+// Views onto the regions of a mapped segment
+#define SEGMENT_HEADER(map) ((JournalHeader*)(map))
+#define SEGMENT_TIME_INDEX(map) ((JournalTimeIndex*)((char*)(map) + JOURNAL_HEADER_SIZE))
+#define SEGMENT_NAMES(map) ((JournalName*)((char*)(map) + JOURNAL_NAMES_OFFSET))
+#define SEGMENT_NAME_TEXT(map) ((char*)(map) + JOURNAL_NAME_TEXT_OFFSET)
+#define SEGMENT_RECORDS(map) ((JournalRecord*)((char*)(map) + JOURNAL_RECORDS_OFFSET))
+
+Journal service_journal = {0};
+
+// Directory the journal's segments live in, opened or not
+static const char* segment_dir(const Journal* journal) {
+    return journal->dir[0] ? journal->dir : journal_directory();
+}
+
+static void segment_path(const Journal* journal, unsigned int number, char* path, size_t size) {
+    snprintf(path, size, "%s/segment-%08u.jnl", segment_dir(journal), number);
+}
+
+static int parse_segment_name(const char* name, unsigned int* number) {
+    char tail[8];
+    return sscanf(name, "segment-%8u.%7s", number, tail) == 2 && strcmp(tail, "jnl") == 0;
+}
+
+// List existing segment numbers in ascending order. Returns the count,
+// storing a malloc'd array in *numbers.
+static int list_segments(const Journal* journal, unsigned int** numbers) {
+    DIR* dir = opendir(segment_dir(journal));
+    int count = 0, capacity = 0;
+
+    *numbers = NULL;
+    if (dir == NULL) return 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int number;
+        if (!parse_segment_name(entry->d_name, &number)) continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned int* grown = (unsigned int*)realloc(*numbers, capacity * sizeof(unsigned int));
+            if (grown == NULL) break;
+            *numbers = grown;
+        }
+        (*numbers)[count++] = number;
+    }
+    closedir(dir);
+
+    // Insertion sort; there are only a handful of segments
+    for (int i = 1; i < count; i++) {
+        unsigned int key = (*numbers)[i];
+        int j = i - 1;
+        while (j >= 0 && (*numbers)[j] > key) {
+            (*numbers)[j + 1] = (*numbers)[j];
+            j--;
+        }
+        (*numbers)[j + 1] = key;
+    }
+    return count;
+}
+
+// Flush written records to disk
+static void journal_sync(Journal* journal) {
+    if (journal->map == NULL || journal->unsynced == 0) return;
+
+    msync(journal->map, journal->map_size, MS_SYNC);
+    journal->unsynced = 0;
+    journal->last_sync = time(NULL);
+}
+
+// Unmap the active segment and shrink the file to the part actually used
+static void seal_segment(Journal* journal) {
+    if (journal->map == NULL) return;
+
+    JournalHeader* header = SEGMENT_HEADER(journal->map);
+    off_t used = JOURNAL_RECORDS_OFFSET + (off_t)header->record_count * sizeof(JournalRecord);
+
+    journal_sync(journal);
+    munmap(journal->map, journal->map_size);
+    if (ftruncate(journal->fd, used) != 0) {
+        perror("Failed to compact journal segment");
+    }
+    close(journal->fd);
+
+    journal->map = NULL;
+    journal->fd = -1;
+    string_pool_free(&journal->names);
+}
+
+// Map segment number for appending, creating it if needed
+static int open_segment(Journal* journal, unsigned int number) {
+    char path[600];
+    segment_path(journal, number, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Failed to open journal segment");
+        return -1;
+    }
+
+    struct stat st;
+    int fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+
+    if (!fresh) {
+        JournalHeader existing;
+        if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+            memcmp(existing.magic, JOURNAL_MAGIC, sizeof(existing.magic)) != 0 ||
+            existing.version != JOURNAL_VERSION) {
+            printf("Journal segment %s is not a valid journal file.\n", path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Sealed segments were truncated; grow them back for appending
+    if (ftruncate(fd, JOURNAL_SEGMENT_SIZE) != 0) {
+        perror("Failed to size journal segment");
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map journal segment");
+        close(fd);
+        return -1;
+    }
+
+    JournalHeader* header = SEGMENT_HEADER(map);
+    if (fresh) {
+        memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+        header->version = JOURNAL_VERSION;
+        header->created = time(NULL);
+    }
+
+    journal->fd = fd;
+    journal->map = map;
+    journal->map_size = JOURNAL_SEGMENT_SIZE;
+    journal->segment_number = number;
+
+    // Rebuild the name lookup; interning in table order keeps ids equal to
+    // name table positions
+    JournalName* names = SEGMENT_NAMES(map);
+    for (uint32_t i = 0; i < header->name_count; i++) {
+        intern_string(&journal->names, SEGMENT_NAME_TEXT(map) + names[i].text_offset);
+    }
+    return 0;
+}
+
+// Delete segments beyond the count limit or past the retention period
+static void prune_segments(Journal* journal) {
+    unsigned int* numbers;
+    int count = list_segments(journal, &numbers);
+    time_t cutoff = time(NULL) - JOURNAL_RETENTION;
+
+    for (int i = 0; i < count; i++) {
+        if (numbers[i] == journal->segment_number) continue;
+
+        char path[600];
+        segment_path(journal, numbers[i], path, sizeof(path));
+
+        int expired = count - i > JOURNAL_MAX_SEGMENTS;
+        if (!expired) {
+            JournalHeader header;
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) continue;
+            expired = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                      header.record_count > 0 && header.last_time < cutoff;
+            close(fd);
+        }
+
+        if (expired) unlink(path);
+    }
+    free(numbers);
+}
+
+// Seal the active segment and start the next one
+static int rotate_segment(Journal* journal) {
+    unsigned int next = journal->segment_number + 1;
+    seal_segment(journal);
+    if (open_segment(journal, next) < 0) return -1;
+    prune_segments(journal);
+    return 0;
+}
+
+// Open the journal in dir, continuing its newest segment
+int journal_open(Journal* journal, const char* dir) {
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    snprintf(journal->dir, sizeof(journal->dir), "%s", dir);
+
+    if (make_directories(dir) < 0) {
+        perror("Failed to create journal directory");
+        return -1;
+    }
+
+    unsigned int* numbers;
+    int count = list_segments(journal, &numbers);
+    unsigned int number = count > 0 ? numbers[count - 1] : 0;
+    free(numbers);
+
+    if (open_segment(journal, number) < 0) return -1;
+    journal->active = 1;
+    journal->last_sync = time(NULL);
+    prune_segments(journal);
+    return 0;
+}
+
+// Sync and seal the active segment
+void journal_close(Journal* journal) {
+    if (!journal->active) return;
+    seal_segment(journal);
+    journal->active = 0;
+}
+
+// Keep a journal from being opened on first use
+void journal_disable(Journal* journal) {
+    journal->disabled = 1;
+}
+
+// Append one event to the active segment, opening the journal in
+// journal_directory() if it has never been opened. A journal that failed
+// to open is not retried.
+void journal_append(Journal* journal, const char* service_name, LogAction action, time_t when) {
+    if (!journal->active) {
+        if (journal->disabled || journal->dir[0] || journal_open(journal, journal_directory()) < 0) return;
+    }
+
+    JournalHeader* header = SEGMENT_HEADER(journal->map);
+    uint32_t name_index = intern_string(&journal->names, service_name);
+    if (name_index == STRING_ID_NONE) return;
+
+    // Rotate when full or too old; a name that does not fit the name table
+    // also starts a new segment
+    size_t name_length = strlen(service_name) + 1;
+    int new_name = name_index == header->name_count;
+    if (header->record_count >= JOURNAL_MAX_RECORDS ||
+        (new_name && (name_index >= JOURNAL_MAX_NAMES ||
+                      header->name_text_used + name_length > JOURNAL_NAME_TEXT_SIZE)) ||
+        (header->record_count > 0 && when - header->created > JOURNAL_MAX_SEGMENT_AGE)) {
+        if (rotate_segment(journal) < 0) {
+            journal->active = 0;
+            return;
+        }
+        header = SEGMENT_HEADER(journal->map);
+        name_index = intern_string(&journal->names, service_name);
+        if (name_index == STRING_ID_NONE) return;
+        new_name = name_index == header->name_count;
+    }
+
+    JournalName* name = &SEGMENT_NAMES(journal->map)[name_index];
+    if (new_name) {
+        memcpy(SEGMENT_NAME_TEXT(journal->map) + header->name_text_used, service_name, name_length);
+        name->text_offset = header->name_text_used;
+        header->name_text_used += name_length;
+        name->last_record = 0;
+        name->record_count = 0;
+        header->name_count++;
+    }
+
+    uint32_t number = header->record_count;
+    JournalRecord* record = &SEGMENT_RECORDS(journal->map)[number];
+    record->when = when;
+    record->name_index = name_index;
+    record->prev_for_service = name->last_record;
+    record->action = (uint8_t)action;
+
+    if (number % JOURNAL_INDEX_STRIDE == 0) {
+        JournalTimeIndex* entry = &SEGMENT_TIME_INDEX(journal->map)[header->time_index_count++];
+        entry->when = when;
+        entry->record = number;
+    }
+
+    name->last_record = number + 1;
+    name->record_count++;
+    if (number == 0) header->first_time = when;
+    header->last_time = when;
+    header->record_count = number + 1;
+
+    // Batch syncs by record count and elapsed time
+    journal->unsynced++;
+    if (journal->unsynced >= JOURNAL_SYNC_BATCH || when - journal->last_sync >= JOURNAL_SYNC_INTERVAL) {
+        journal_sync(journal);
+    }
+}
+
+// Map one segment read-only; the active segment is read through its live mapping
+static const void* map_segment(Journal* journal, unsigned int number, size_t* size) {
+    if (journal->map != NULL && number == journal->segment_number) {
+        *size = 0;
+        return journal->map;
+    }
+
+    char path[600];
+    segment_path(journal, number, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)JOURNAL_RECORDS_OFFSET) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const JournalHeader* header = SEGMENT_HEADER(map);
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != JOURNAL_VERSION ||
+        JOURNAL_RECORDS_OFFSET + (size_t)header->record_count * sizeof(JournalRecord) > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return map;
+}
+
+static void unmap_segment(const void* map, size_t size) {
+    if (size > 0) munmap((void*)map, size);
+}
+
+// First record that may be at or after from, using the sparse time index
+static uint32_t seek_time(const void* map, time_t from) {
+    const JournalHeader* header = SEGMENT_HEADER(map);
+    const JournalTimeIndex* index = SEGMENT_TIME_INDEX(map);
+    const JournalRecord* records = SEGMENT_RECORDS(map);
+
+    // Last index entry strictly before from
+    int low = 0, high = (int)header->time_index_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (index[mid].when < from) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    uint32_t record = low > 0 ? index[low - 1].record : 0;
+    while (record < header->record_count && records[record].when < from) record++;
+    return record;
+}
+
+// Visit every journaled event with from <= time <= to, oldest first.
+// Returns the number of events visited.
+int journal_query_range(Journal* journal, time_t from, time_t to,
+                        JournalVisitor visit, void* context) {
+    unsigned int* numbers;
+    int count = list_segments(journal, &numbers);
+    int visited = 0;
+
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        const void* map = map_segment(journal, numbers[i], &size);
+        if (map == NULL) continue;
+
+        const JournalHeader* header = SEGMENT_HEADER(map);
+        if (header->record_count > 0 && header->first_time <= to && header->last_time >= from) {
+            const JournalRecord* records = SEGMENT_RECORDS(map);
+            const JournalName* names = SEGMENT_NAMES(map);
+            const char* text = SEGMENT_NAME_TEXT(map);
+
+            for (uint32_t r = seek_time(map, from); r < header->record_count && records[r].when <= to; r++) {
+                visit(records[r].when, text + names[records[r].name_index].text_offset,
+                      (LogAction)records[r].action, context);
+                visited++;
+            }
+        }
+        unmap_segment(map, size);
+    }
+
+    free(numbers);
+    return visited;
+}
+
+// Visit one service's journaled events with from <= time <= to, newest
+// first, following the per-service record chain. Returns the number visited.
+int journal_query_service(Journal* journal, const char* service_name, time_t from, time_t to,
+                          JournalVisitor visit, void* context) {
+    unsigned int* numbers;
+    int count = list_segments(journal, &numbers);
+    int visited = 0;
+
+    for (int i = count - 1; i >= 0; i--) {
+        size_t size;
+        const void* map = map_segment(journal, numbers[i], &size);
+        if (map == NULL) continue;
+
+        const JournalHeader* header = SEGMENT_HEADER(map);
+        int done = header->record_count > 0 && header->last_time < from;
+
+        if (!done && header->record_count > 0 && header->first_time <= to) {
+            const JournalName* names = SEGMENT_NAMES(map);
+            const JournalRecord* records = SEGMENT_RECORDS(map);
+            const char* text = SEGMENT_NAME_TEXT(map);
+
+            for (uint32_t n = 0; n < header->name_count; n++) {
+                if (strcmp(text + names[n].text_offset, service_name) != 0) continue;
+
+                uint32_t link = names[n].last_record;
+                while (link != 0 && link <= header->record_count) {
+                    const JournalRecord* record = &records[link - 1];
+                    if (record->when < from) break;
+                    if (record->when <= to) {
+                        visit(record->when, service_name, (LogAction)record->action, context);
+                        visited++;
+                    }
+                    link = record->prev_for_service;
+                }
+                break;
+            }
+        }
+        unmap_segment(map, size);
+
+        if (done) break;
+    }
+
+    free(numbers);
+    return visited;
+}
+
+static char default_directory[512];
+static pthread_once_t default_directory_once = PTHREAD_ONCE_INIT;
+
+// Per-user state directory, or the system one when running as root
+static void find_default_directory() {
+    const char* state_home = getenv("XDG_STATE_HOME");
+    const char* home = getenv("HOME");
+
+    if (state_home && *state_home == '/') {
+        snprintf(default_directory, sizeof(default_directory), "%s/service_manager", state_home);
+    } else if (geteuid() != 0 && home && *home == '/') {
+        snprintf(default_directory, sizeof(default_directory), "%s/.local/state/service_manager", home);
+    } else {
+        snprintf(default_directory, sizeof(default_directory), "/var/lib/service_manager");
+    }
+}
+
+// Journal directory: $SERVICE_JOURNAL_DIR, else $XDG_STATE_HOME/service_manager,
+// ~/.local/state/service_manager, or /var/lib/service_manager for root
+const char* journal_directory() {
+    const char* dir = getenv("SERVICE_JOURNAL_DIR");
+    if (dir && *dir) return dir;
+    pthread_once(&default_directory_once, find_default_directory);
+    return default_directory;
+}
+
+// mkdir -p: create path and any missing parents. Returns 0, or -1 with errno set.
+int make_directories(const char* path) {
+    char partial[512];
+    if (snprintf(partial, sizeof(partial), "%s", path) >= (int)sizeof(partial)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (char* slash = strchr(partial + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) *slash = '\0';
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST) return -1;
+        if (slash == NULL) return 0;
+        *slash = '/';
+    }
+}
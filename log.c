@@ -0,0 +1,109 @@
+#include "func.h"
+
+// Bounded event log: a fixed-size ring of compact records (service name id,
+// action, time) stored as columns. Each record links to the previous event
+// of the same service, so per-service queries follow that chain instead of
+// scanning the whole ring. Appending never allocates except when a service
+// name is seen for the first time.
+
+// Make sure the per-service head array covers service_id
+static int ensure_service_slot(EventLog* log, uint32_t service_id) {
+    if ((int)service_id < log->service_capacity) return 0;
+
+    int new_capacity = log->service_capacity ? log->service_capacity : 256;
+    while ((int)service_id >= new_capacity) new_capacity *= 2;
+
+    int64_t* grown = (int64_t*)realloc(log->last_for_service, new_capacity * sizeof(int64_t));
+    if (grown == NULL) return -1;
+
+    for (int i = log->service_capacity; i < new_capacity; i++) grown[i] = -1;
+    log->last_for_service = grown;
+    log->service_capacity = new_capacity;
+    return 0;
+}
+
+// Is seq still held in the ring?
+static int event_is_live(const EventLog* log, int64_t seq) {
+    return seq >= 0 && seq < log->next_seq && seq >= log->next_seq - LOG_CAPACITY;
+}
+
+// Append one event, overwriting the oldest once the ring is full.
+// *evicted is set to the service id of the overwritten record, or
+// STRING_ID_NONE. Returns 0, or -1 if the event could not be stored.
+int event_log_append(EventLog* log, uint32_t service_id, LogAction action, time_t when, uint32_t* evicted) {
+    *evicted = STRING_ID_NONE;
+    if (ensure_service_slot(log, service_id) < 0) return -1;
+
+    int slot = (int)(log->next_seq % LOG_CAPACITY);
+    if (log->next_seq >= LOG_CAPACITY) {
+        log->action_counts[log->action[slot]]--;
+        *evicted = log->service_id[slot];
+    }
+
+    log->service_id[slot] = service_id;
+    log->action[slot] = (uint8_t)action;
+    log->when[slot] = when;
+    log->prev_for_service[slot] = log->last_for_service[service_id];
+    log->last_for_service[service_id] = log->next_seq;
+    log->action_counts[action]++;
+    log->next_seq++;
+    return 0;
+}
+
+// Number of events currently held
+int event_log_size(const EventLog* log) {
+    return log->next_seq < LOG_CAPACITY ? (int)log->next_seq : LOG_CAPACITY;
+}
+
+// Collect up to max sequence numbers of the most recent events for one
+// service, newest first. Returns how many were written to seqs.
+int event_log_recent_for_service(const EventLog* log, uint32_t service_id, int64_t* seqs, int max) {
+    if ((int)service_id >= log->service_capacity) return 0;
+
+    int count = 0;
+    int64_t seq = log->last_for_service[service_id];
+    while (count < max && event_is_live(log, seq)) {
+        seqs[count++] = seq;
+        seq = log->prev_for_service[seq % LOG_CAPACITY];
+    }
+    return count;
+}
+
+// Count events for one service at or after since whose action is in
+// action_mask (a set of LOG_ACTION_BIT values)
+int event_log_count_for_service(const EventLog* log, uint32_t service_id,
+                                unsigned int action_mask, time_t since) {
+    if ((int)service_id >= log->service_capacity) return 0;
+
+    int count = 0;
+    int64_t seq = log->last_for_service[service_id];
+    while (event_is_live(log, seq)) {
+        int slot = (int)(seq % LOG_CAPACITY);
+        if (log->when[slot] < since) break;
+        if (action_mask & LOG_ACTION_BIT(log->action[slot])) count++;
+        seq = log->prev_for_service[slot];
+    }
+    return count;
+}
+
+void event_log_free(EventLog* log) {
+    free(log->last_for_service);
+    memset(log, 0, sizeof(*log));
+}
+
+const char* action_to_string(LogAction action) {
+    switch (action) {
+        case ACTION_STARTED: return "STARTED";
+        case ACTION_START_FAILED: return "START FAILED";
+        case ACTION_STOPPED: return "STOPPED";
+        case ACTION_STOP_FAILED: return "STOP FAILED";
+        case ACTION_RESTARTED: return "RESTARTED";
+        case ACTION_RESTART_FAILED: return "RESTART FAILED";
+        case ACTION_QUEUED_FAILED: return "ADDED TO FAILED QUEUE";
+        case ACTION_AUTO_RESTARTED: return "AUTO-RESTARTED FROM FAILED QUEUE";
+        case ACTION_AUTO_RESTART_FAILED: return "AUTO-RESTART FAILED";
+        case ACTION_CANCELLED: return "CANCELLED (DEPENDENCY FAILED)";
+        case ACTION_FLAPPING: return "FLAPPING (AUTO-RESTARTS SUSPENDED)";
+        default: return "UNKNOWN";
+    }
+}
@@ -1,14 +1,39 @@
 #include "func.h"
 
-int main() {
+int main(int argc, char** argv) {
     int choice;
     char service_name[MAX_SERVICE_NAME];
     int filter_choice;
+    int hours;
+    int seconds;
+    char query_text[1024];
+    
+    control_configure_from_env();
+    sources_configure_from_env();
+    flap_configure_from_env();
+    output_configure_from_env();
+    
+    // Any arguments select batch mode instead of the menu
+    if (argc > 1) {
+        int status = batch_main(argc, argv);
+        state_file_checkpoint(1);
+        free_memory();
+        return status;
+    }
     
     printf("=== Advanced Service Management System ===\n");
-    load_services_from_system();
+    
+    // Saved state answers at once; it is reconciled in the background
+    if (batch_load_saved_services(1) == 0) {
+        printf("Loaded %d saved services; reconciling with the system in the background...\n",
+               service_table.live);
+    } else {
+        load_services_from_system();
+    }
     
     while (1) {
+        state_file_reconcile_finish(stdout, 0);
+        
         printf("\n=== Main Menu ===\n");
         printf("1. Display All Services and Their Status\n");
         printf("2. Search Service by Name\n");
@@ -20,7 +45,9 @@ int main() {
         printf("8. Process Failed Services Queue\n");
         printf("9. View Service Logs and History\n");
         printf("10. Monitor Services (Auto-refresh)\n");
-        printf("11. Exit\n");
+        printf("11. Query Journal History\n");
+        printf("12. Query Services\n");
+        printf("13. Exit\n");
         printf("Enter your choice: ");
         
         if (scanf("%d", &choice) != 1) {
@@ -30,6 +57,12 @@ int main() {
         }
         getchar(); // Consume newline
         
+        // The reconciliation may apply changes at any time until collected,
+        // so calls that write or read the table run under the write lock,
+        // as in batch mode. Listing, search and filter read the published
+        // snapshot and take no lock. Input is read first so the lock is
+        // never held while waiting on the user; the monitor takes the lock
+        // itself from its own threads.
         switch (choice) {
             case 1:
                 display_all_services();
@@ -44,7 +77,7 @@ int main() {
                 
             case 3:
                 printf("Filter by status:\n");
-                printf("1. Active\n2. Inactive\n3. Failed\n4. Running\n5. Stopped\n");
+                printf("1. Active\n2. Inactive\n3. Failed\n4. Running\n5. Stopped\n6. Flapping\n");
                 printf("Enter choice: ");
                 if (scanf("%d", &filter_choice) != 1) {
                     printf("Invalid input!\n");
@@ -59,6 +92,7 @@ int main() {
                     case 3: filter_services_by_status(STATUS_FAILED); break;
                     case 4: filter_services_by_status(STATUS_RUNNING); break;
                     case 5: filter_services_by_status(STATUS_STOPPED); break;
+                    case 6: display_flapping_services(-1); break;
                     default: printf("Invalid choice!\n");
                 }
                 break;
@@ -67,40 +101,88 @@ int main() {
                 printf("Enter service name to start: ");
                 fgets(service_name, sizeof(service_name), stdin);
                 service_name[strcspn(service_name, "\n")] = 0;
+                service_lock();
                 start_service(service_name);
+                service_unlock();
                 break;
                 
             case 5:
                 printf("Enter service name to stop: ");
                 fgets(service_name, sizeof(service_name), stdin);
                 service_name[strcspn(service_name, "\n")] = 0;
+                service_lock();
                 stop_service(service_name);
+                service_unlock();
                 break;
                 
             case 6:
                 printf("Enter service name to restart: ");
                 fgets(service_name, sizeof(service_name), stdin);
                 service_name[strcspn(service_name, "\n")] = 0;
+                service_lock();
                 restart_service(service_name);
+                service_unlock();
                 break;
                 
             case 7:
+                service_lock();
                 detect_failed_services();
+                service_unlock();
                 break;
                 
             case 8:
+                service_lock();
                 process_failed_services();
+                service_unlock();
                 break;
                 
             case 9:
+                service_lock();
                 display_logs();
+                service_unlock();
                 break;
                 
             case 10:
-                monitor_services();
+                printf("Monitor for how many seconds (0 = until Ctrl+C): ");
+                if (scanf("%d", &seconds) != 1) {
+                    printf("Invalid input!\n");
+                    while (getchar() != '\n');
+                    break;
+                }
+                getchar();
+                state_file_reconcile_finish(stdout, 1);
+                monitor_services(seconds);
                 break;
                 
             case 11:
+                printf("Enter service name (empty for all): ");
+                fgets(service_name, sizeof(service_name), stdin);
+                service_name[strcspn(service_name, "\n")] = 0;
+                printf("Hours to look back: ");
+                if (scanf("%d", &hours) != 1) {
+                    printf("Invalid input!\n");
+                    while (getchar() != '\n');
+                    break;
+                }
+                getchar();
+                service_lock();
+                display_journal_history(service_name, hours);
+                service_unlock();
+                break;
+                
+            case 12:
+                printf("Terms: status=failed,inactive name=app-* failures>3 started>=-1d pid=yes|no\n");
+                printf("Enter query: ");
+                fgets(query_text, sizeof(query_text), stdin);
+                query_text[strcspn(query_text, "\n")] = 0;
+                service_lock();
+                query_services(query_text);
+                service_unlock();
+                break;
+                
+            case 13:
+                state_file_reconcile_finish(stdout, 1);
+                state_file_checkpoint(1);
                 free_memory();
                 printf("Exiting... Goodbye!\n");
                 return 0;
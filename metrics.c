@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Hot-path metrics: event counters and latency histograms kept per thread,
+// plus gauges read from the table when exporting. Each thread records into
+// its own shard, so recording is a plain load and store on a cache line no
+// other thread writes; exporting sums the shards. A shard outlives its
+// thread and is handed to the next thread that starts, so totals only grow.
+//
+// Histograms are log-linear in the manner of HDR histograms: every power
+// of two of nanoseconds is split into 16 buckets, so any recorded value is
+// known to within 1/16 of itself from 1ns up to about 18 minutes. Index
+// inserts and lookups are too quick to time every call; one call in
+// METRIC_SAMPLE_EVERY is timed, and every call is counted.
+//
+// Everything is exported in the Prometheus text format, through the
+// `metrics` command (and so over the daemon socket) or into the file named
+// by $SERVICE_METRICS_FILE, which is replaced atomically after each refresh.
+
+#define METRIC_SUB_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_MAX_EXPONENT 39          // Values of 2^40ns and up share the last bucket
+#define METRIC_BUCKETS ((METRIC_MAX_EXPONENT - METRIC_SUB_BITS + 2) * METRIC_SUB_BUCKETS)
+#define METRIC_MAX_THREADS 64           // Threads with a private shard; the rest share one
+#define METRIC_SAMPLE_EVERY 64
+#define METRIC_CACHE_LINE 64
+
+typedef struct MetricShard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    _Atomic uint64_t sums[LATENCY_COUNT];
+    _Atomic uint64_t buckets[LATENCY_COUNT][METRIC_BUCKETS];
+    atomic_int claimed;
+} __attribute__((aligned(METRIC_CACHE_LINE))) MetricShard;
+
+// The last shard is shared by threads that found no free private one and
+// is updated with atomic read-modify-writes
+static MetricShard shards[METRIC_MAX_THREADS + 1];
+#define SHARED_SHARD (&shards[METRIC_MAX_THREADS])
+
+static __thread MetricShard* local_shard = NULL;
+static __thread unsigned int sample_tick = 0;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    { "enumerations_total", "Unit listings requested from systemctl" },
+    { "enumeration_failures_total", "Unit listings that could not be collected" },
+    { "parsed_units_total", "Unit lines parsed from listings" },
+    { "index_inserts_total", "Service index inserts" },
+    { "index_lookups_total", "Service index lookups by name" },
+    { "control_jobs_total", "systemctl start/stop/restart jobs run" },
+    { "control_failures_total", "Control jobs that failed or timed out" },
+    { "control_cancelled_total", "Control jobs cancelled because a required dependency failed" },
+    { "restart_attempts_total", "Automatic restarts attempted from the failed queue" },
+    { "restart_failures_total", "Automatic restarts that failed" },
+    { "restarts_suppressed_total", "Automatic restarts held back by an open circuit breaker" },
+    { "log_entries_total", "Event log entries written" },
+};
+
+static const char* latency_names[LATENCY_COUNT] = {
+    "enumerate", "parse", "index_insert", "index_lookup",
+    "control_start", "control_stop", "control_restart", "restart_attempt"
+};
+
+// Bucket upper bounds for the exported histogram, in seconds
+static const double export_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120
+};
+
+#define EXPORT_BOUND_COUNT (int)(sizeof(export_bounds) / sizeof(export_bounds[0]))
+
+static const double export_quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+#define EXPORT_QUANTILE_COUNT (int)(sizeof(export_quantiles) / sizeof(export_quantiles[0]))
+
+// Give a thread's shard back when the thread exits; its totals stay
+static void release_shard(void* shard) {
+    atomic_store(&((MetricShard*)shard)->claimed, 0);
+}
+
+static void create_shard_key() {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static MetricShard* claim_shard() {
+    pthread_once(&shard_key_once, create_shard_key);
+
+    for (int i = 0; i < METRIC_MAX_THREADS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shards[i].claimed, &expected, 1)) {
+            pthread_setspecific(shard_key, &shards[i]);
+            return local_shard = &shards[i];
+        }
+    }
+    return local_shard = SHARED_SHARD;
+}
+
+static inline MetricShard* this_shard() {
+    return local_shard ? local_shard : claim_shard();
+}
+
+// Add to a shard value; only the owning thread writes a private shard
+static inline void shard_add(MetricShard* shard, _Atomic uint64_t* value, uint64_t amount) {
+    if (shard == SHARED_SHARD) {
+        atomic_fetch_add_explicit(value, amount, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount,
+                              memory_order_relaxed);
+    }
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < METRIC_SUB_BUCKETS) return (int)value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRIC_MAX_EXPONENT) return METRIC_BUCKETS - 1;
+    return (exponent - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS +
+           (int)((value >> (exponent - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_upper(int index) {
+    if (index < METRIC_SUB_BUCKETS) return (uint64_t)index;
+
+    int exponent = index / METRIC_SUB_BUCKETS + METRIC_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index % METRIC_SUB_BUCKETS);
+    return ((METRIC_SUB_BUCKETS + sub + 1) << (exponent - METRIC_SUB_BITS)) - 1;
+}
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void metrics_count(MetricCounter counter, uint64_t amount) {
+    MetricShard* shard = this_shard();
+    shard_add(shard, &shard->counters[counter], amount);
+}
+
+void metrics_observe(MetricLatency latency, uint64_t nanoseconds) {
+    MetricShard* shard = this_shard();
+    shard_add(shard, &shard->buckets[latency][bucket_index(nanoseconds)], 1);
+    shard_add(shard, &shard->sums[latency], nanoseconds);
+}
+
+// Record the time since start, a metrics_now() or metrics_sample_start()
+// value; a start of 0 (not sampled) records nothing
+void metrics_observe_since(MetricLatency latency, uint64_t start) {
+    if (start != 0) metrics_observe(latency, metrics_now() - start);
+}
+
+// Start time for a sampled measurement: the clock on one call in
+// METRIC_SAMPLE_EVERY on this thread, else 0
+uint64_t metrics_sample_start() {
+    return sample_tick++ % METRIC_SAMPLE_EVERY == 0 ? metrics_now() : 0;
+}
+
+// One histogram summed over every shard
+static void collect_histogram(MetricLatency latency, uint64_t* buckets, uint64_t* sum, uint64_t* total) {
+    memset(buckets, 0, METRIC_BUCKETS * sizeof(uint64_t));
+    *sum = 0;
+    *total = 0;
+
+    for (int s = 0; s <= METRIC_MAX_THREADS; s++) {
+        *sum += atomic_load_explicit(&shards[s].sums[latency], memory_order_relaxed);
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            uint64_t count = atomic_load_explicit(&shards[s].buckets[latency][b], memory_order_relaxed);
+            buckets[b] += count;
+            *total += count;
+        }
+    }
+}
+
+static uint64_t collect_counter(MetricCounter counter) {
+    uint64_t total = 0;
+    for (int s = 0; s <= METRIC_MAX_THREADS; s++) {
+        total += atomic_load_explicit(&shards[s].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+static void write_histograms(FILE* out) {
+    uint64_t (*buckets)[METRIC_BUCKETS] = malloc(LATENCY_COUNT * sizeof(*buckets));
+    uint64_t sums[LATENCY_COUNT], totals[LATENCY_COUNT];
+
+    if (buckets == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+
+    for (int l = 0; l < LATENCY_COUNT; l++) {
+        collect_histogram((MetricLatency)l, buckets[l], &sums[l], &totals[l]);
+    }
+
+    fprintf(out, "# HELP service_manager_operation_duration_seconds Time spent in hot-path operations "
+                 "(index operations sampled 1 in %d)\n", METRIC_SAMPLE_EVERY);
+    fprintf(out, "# TYPE service_manager_operation_duration_seconds histogram\n");
+    for (int l = 0; l < LATENCY_COUNT; l++) {
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int i = 0; i < EXPORT_BOUND_COUNT; i++) {
+            uint64_t bound_ns = (uint64_t)(export_bounds[i] * 1e9);
+            while (b < METRIC_BUCKETS && bucket_upper(b) <= bound_ns) cumulative += buckets[l][b++];
+            fprintf(out, "service_manager_operation_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                    latency_names[l], export_bounds[i], (unsigned long long)cumulative);
+        }
+        fprintf(out, "service_manager_operation_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                latency_names[l], (unsigned long long)totals[l]);
+        fprintf(out, "service_manager_operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                latency_names[l], sums[l] / 1e9);
+        fprintf(out, "service_manager_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+                latency_names[l], (unsigned long long)totals[l]);
+    }
+
+    // Quantiles straight from the fine buckets, which the fixed export
+    // buckets above cannot resolve
+    fprintf(out, "# HELP service_manager_operation_duration_quantile_seconds Latency quantiles "
+                 "(upper bound of the bucket holding the quantile)\n");
+    fprintf(out, "# TYPE service_manager_operation_duration_quantile_seconds gauge\n");
+    for (int l = 0; l < LATENCY_COUNT; l++) {
+        if (totals[l] == 0) continue;
+        for (int q = 0; q < EXPORT_QUANTILE_COUNT; q++) {
+            uint64_t rank = (uint64_t)(export_quantiles[q] * totals[l] + 0.999999);
+            uint64_t cumulative = 0;
+            int b = 0;
+            if (rank == 0) rank = 1;
+            while (b < METRIC_BUCKETS - 1 && (cumulative += buckets[l][b]) < rank) b++;
+            fprintf(out, "service_manager_operation_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+                    latency_names[l], export_quantiles[q], bucket_upper(b) / 1e9);
+        }
+    }
+    free(buckets);
+}
+
+static void write_gauge(FILE* out, const char* name, const char* help, long long value) {
+    fprintf(out, "# HELP service_manager_%s %s\n", name, help);
+    fprintf(out, "# TYPE service_manager_%s gauge\n", name);
+    fprintf(out, "service_manager_%s %lld\n", name, value);
+}
+
+static void write_gauges(FILE* out) {
+    service_lock();
+    fprintf(out, "# HELP service_manager_services Services in the table by status\n");
+    fprintf(out, "# TYPE service_manager_services gauge\n");
+    for (int status = 0; status < STATUS_COUNT; status++) {
+        fprintf(out, "service_manager_services{status=\"%s\"} %d\n", status_to_string((ServiceStatus)status),
+                table_count_status(&service_table, (ServiceStatus)status));
+    }
+    write_gauge(out, "table_rows", "Rows allocated in the service table", service_table.rows);
+    write_gauge(out, "index_entries", "Services in the name index", service_index.count);
+    write_gauge(out, "index_slots", "Hash slots in the name index", service_index.slot_capacity);
+    write_gauge(out, "interned_names", "Strings in the name pool", service_names.count);
+    write_gauge(out, "event_log_entries", "Events held in the in-memory log", event_log_size(&event_log));
+    write_gauge(out, "failed_queue_depth", "Services waiting for an automatic restart", failed_scheduler.count);
+    service_unlock();
+
+    PipelineQueueStats stats[8];
+    int count = pipeline_queue_stats(stats, 8);
+    fprintf(out, "# HELP service_manager_pipeline_queue_depth Events waiting in a monitoring pipeline queue\n");
+    fprintf(out, "# TYPE service_manager_pipeline_queue_depth gauge\n");
+    for (int i = 0; i < count; i++) {
+        if (stats[i].name == NULL) continue;
+        fprintf(out, "service_manager_pipeline_queue_depth{queue=\"%s\"} %d\n", stats[i].name, stats[i].depth);
+    }
+    fprintf(out, "# HELP service_manager_pipeline_queue_max_depth Deepest a monitoring pipeline queue has been\n");
+    fprintf(out, "# TYPE service_manager_pipeline_queue_max_depth gauge\n");
+    for (int i = 0; i < count; i++) {
+        if (stats[i].name == NULL) continue;
+        fprintf(out, "service_manager_pipeline_queue_max_depth{queue=\"%s\"} %d\n", stats[i].name,
+                stats[i].max_depth);
+    }
+    fprintf(out, "# HELP service_manager_pipeline_queue_stalls_total Pushes that waited for queue space\n");
+    fprintf(out, "# TYPE service_manager_pipeline_queue_stalls_total counter\n");
+    for (int i = 0; i < count; i++) {
+        if (stats[i].name == NULL) continue;
+        fprintf(out, "service_manager_pipeline_queue_stalls_total{queue=\"%s\"} %llu\n", stats[i].name,
+                stats[i].stalls);
+    }
+
+    int threads = 0;
+    for (int i = 0; i < METRIC_MAX_THREADS; i++) threads += atomic_load(&shards[i].claimed);
+    write_gauge(out, "metric_threads", "Threads holding a private metrics shard", threads);
+}
+
+// Write every metric in the Prometheus text format. Returns 0, or -1 if
+// the stream reported an error.
+int metrics_write_prometheus(FILE* out) {
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+        fprintf(out, "# HELP service_manager_%s %s\n", counter_info[c].name, counter_info[c].help);
+        fprintf(out, "# TYPE service_manager_%s counter\n", counter_info[c].name);
+        fprintf(out, "service_manager_%s %llu\n", counter_info[c].name,
+                (unsigned long long)collect_counter((MetricCounter)c));
+    }
+    write_histograms(out);
+    write_gauges(out);
+    return ferror(out) ? -1 : 0;
+}
+
+// Metrics file: $SERVICE_METRICS_FILE, or NULL when none is wanted
+const char* metrics_file_path() {
+    const char* path = getenv("SERVICE_METRICS_FILE");
+    return path && *path ? path : NULL;
+}
+
+// Replace path with the current metrics: written to a temporary file in the
+// same directory and renamed over it, so a scraper never sees half a file
+int metrics_write_file(const char* path) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE* out = fopen(temp_path, "w");
+    if (out == NULL) {
+        perror("Failed to write metrics");
+        return -1;
+    }
+
+    int failed = metrics_write_prometheus(out) < 0 || fflush(out) != 0 || fsync(fileno(out)) < 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(temp_path, path) < 0) {
+        perror("Failed to write metrics");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Refresh the metrics file if one is configured
+void metrics_export() {
+    const char* path = metrics_file_path();
+    if (path != NULL) metrics_write_file(path);
+}
@@ -0,0 +1,243 @@
+#include "func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+// Event-driven monitor: an epoll loop over a change-event source, timerfds
+// for the periodic backstop refresh, the settle delay and the run duration,
+// and a signalfd so Ctrl+C ends the loop cleanly. A source is anything that
+// becomes readable when units may have changed: on a real host a
+// `busctl monitor` subscription to systemd's PropertiesChanged signals, in
+// tests a FIFO that fixtures write to.
+
+#define MONITOR_SETTLE_MS 100           // Longest a change event waits for its refresh
+#define MONITOR_BACKSTOP_INTERVAL 30    // Full refresh even without events
+#define MONITOR_POLL_INTERVAL 5         // Refresh interval with no event source
+
+enum { EVENT_SOURCE, EVENT_SETTLE, EVENT_TICK, EVENT_END, EVENT_SIGNAL };
+
+// Event source fed by a FIFO; every line written to it is a change hint
+int monitor_source_open_fifo(MonitorSource* source, const char* path) {
+    memset(source, 0, sizeof(*source));
+    source->name = "fifo";
+    source->fd = source->keepalive_fd = -1;
+    source->helper_pid = -1;
+
+    if (mkfifo(path, 0600) != 0 && errno != EEXIST) {
+        perror("Failed to create monitor FIFO");
+        return -1;
+    }
+
+    source->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (source->fd < 0) {
+        perror("Failed to open monitor FIFO");
+        return -1;
+    }
+
+    // Hold a write end open so the FIFO never reports EOF between writers
+    source->keepalive_fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    return 0;
+}
+
+// Event source fed by systemd's unit PropertiesChanged signals
+int monitor_source_open_systemd(MonitorSource* source) {
+    const char* argv[] = {
+        "busctl", "monitor", "--system",
+        "--match", "type='signal',sender='org.freedesktop.systemd1',"
+                   "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
+                   "path_namespace='/org/freedesktop/systemd1/unit'",
+        NULL
+    };
+
+    memset(source, 0, sizeof(*source));
+    source->name = "systemd";
+    source->fd = source->keepalive_fd = -1;
+    source->helper_pid = -1;
+
+    if (exec_spawn(argv, &source->fd, &source->helper_pid) < 0) {
+        source->fd = -1;
+        return -1;
+    }
+    fcntl(source->fd, F_SETFL, fcntl(source->fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+// Read everything pending on the source. Returns -1 once it has closed.
+int monitor_source_drain(MonitorSource* source) {
+    char buffer[4096];
+
+    for (;;) {
+        ssize_t got = read(source->fd, buffer, sizeof(buffer));
+        if (got > 0) continue;
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && errno == EAGAIN) return 0;
+        return -1;
+    }
+}
+
+void monitor_source_close(MonitorSource* source) {
+    if (source->fd >= 0) close(source->fd);
+    if (source->keepalive_fd >= 0) close(source->keepalive_fd);
+    if (source->helper_pid > 0) {
+        kill(source->helper_pid, SIGTERM);
+        exec_wait(source->helper_pid);
+    }
+    source->fd = source->keepalive_fd = -1;
+    source->helper_pid = -1;
+}
+
+// Open the event source monitoring should use: the FIFO named by
+// $SERVICE_MONITOR_FIFO if set, else systemd's unit change signals
+int monitor_source_open_default(MonitorSource* source) {
+    const char* fifo = getenv("SERVICE_MONITOR_FIFO");
+    return fifo && *fifo ? monitor_source_open_fifo(source, fifo) : monitor_source_open_systemd(source);
+}
+
+// Arm a timerfd to fire once after ms (0 disarms), or every ms if periodic
+void monitor_arm_timer(int fd, long ms, int periodic) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (periodic) spec.it_interval = spec.it_value;
+    timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// Start the settle delay unless it is already running. Events that arrive
+// while it runs join the pending refresh instead of pushing it back, so a
+// steady stream of events still refreshes within ms of the first one.
+void monitor_arm_settle(int fd, long ms) {
+    struct itimerspec current;
+    if (timerfd_gettime(fd, &current) == 0 &&
+        (current.it_value.tv_sec != 0 || current.it_value.tv_nsec != 0)) {
+        return;
+    }
+    monitor_arm_timer(fd, ms, 0);
+}
+
+static int add_watch(int epoll_fd, int fd, int tag) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = (uint32_t)tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Queue every unit a refresh found newly failed for an automatic restart
+void monitor_queue_failed(const ServiceChangeSet* changes) {
+    for (int i = 0; i < changes->count; i++) {
+        if (changes->changes[i].kind != CHANGE_REMOVED &&
+            changes->changes[i].new_status == STATUS_FAILED) {
+            add_to_failed_queue(changes->changes[i].name);
+        }
+    }
+}
+
+// Watch services until duration_seconds have passed (0 = until Ctrl+C).
+// Changes are picked up from the event source as they happen, with a full
+// refresh every so often as a backstop. $SERVICE_MONITOR_FIFO selects a FIFO
+// event source instead of systemd. This thread only waits for events; the
+// refreshes, failure detection, automatic restarts and output run on the
+// monitoring pipeline.
+void monitor_services(int duration_seconds) {
+    MonitorSource source;
+    int have_source = monitor_source_open_default(&source) == 0;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int settle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    int tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    int end_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    // Take SIGINT through a signalfd so Ctrl+C stops the monitor, not the program
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    if (epoll_fd < 0 || settle_fd < 0 || tick_fd < 0 || end_fd < 0 || signal_fd < 0) {
+        perror("Failed to set up service monitor");
+        goto cleanup;
+    }
+
+    add_watch(epoll_fd, settle_fd, EVENT_SETTLE);
+    add_watch(epoll_fd, tick_fd, EVENT_TICK);
+    add_watch(epoll_fd, end_fd, EVENT_END);
+    add_watch(epoll_fd, signal_fd, EVENT_SIGNAL);
+    if (have_source) add_watch(epoll_fd, source.fd, EVENT_SOURCE);
+
+    int interval = have_source ? MONITOR_BACKSTOP_INTERVAL : MONITOR_POLL_INTERVAL;
+    monitor_arm_timer(tick_fd, interval * 1000L, 1);
+    if (duration_seconds > 0) monitor_arm_timer(end_fd, duration_seconds * 1000L, 0);
+
+    printf("Starting service monitor (%s events, full refresh every %d seconds, press Ctrl+C to stop)...\n",
+           have_source ? source.name : "no", interval);
+
+    // Start from a current table; on first load only the totals are shown.
+    // Units already failed by then are queued as the pipeline starts.
+    int first_load = service_table.live == 0;
+    if (first_load) load_services_from_system();
+    if (pipeline_start() < 0) goto cleanup;
+    if (!first_load) pipeline_trigger();
+
+    int running = 1;
+    while (running) {
+        struct epoll_event events[8];
+        int ready = epoll_wait(epoll_fd, events, 8, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Service monitor failed");
+            break;
+        }
+
+        int refresh = 0;
+        for (int i = 0; i < ready; i++) {
+            uint64_t expirations;
+            switch (events[i].data.u32) {
+                case EVENT_SOURCE:
+                    if (monitor_source_drain(&source) < 0) {
+                        // Source went away; keep going on the backstop timer
+                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source.fd, NULL);
+                        printf("Event source closed; falling back to periodic refresh.\n");
+                        monitor_arm_timer(tick_fd, MONITOR_POLL_INTERVAL * 1000L, 1);
+                    }
+                    monitor_arm_settle(settle_fd, MONITOR_SETTLE_MS);
+                    break;
+                case EVENT_SETTLE:
+                    if (read(settle_fd, &expirations, sizeof(expirations)) > 0) refresh = 1;
+                    break;
+                case EVENT_TICK:
+                    if (read(tick_fd, &expirations, sizeof(expirations)) > 0) refresh = 1;
+                    break;
+                case EVENT_SIGNAL: {
+                    struct signalfd_siginfo info;
+                    if (read(signal_fd, &info, sizeof(info)) > 0) running = 0;
+                    break;
+                }
+                case EVENT_END:
+                    running = 0;
+                    break;
+            }
+        }
+
+        if (running && refresh) pipeline_trigger();
+    }
+
+    pipeline_stop();
+    printf("Monitoring completed.\n");
+    display_pipeline_stats();
+    metrics_export();
+
+cleanup:
+    if (have_source) monitor_source_close(&source);
+    if (signal_fd >= 0) close(signal_fd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (end_fd >= 0) close(end_fd);
+    if (tick_fd >= 0) close(tick_fd);
+    if (settle_fd >= 0) close(settle_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+}
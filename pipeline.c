@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+// Monitoring pipeline: the monitor's work split into four stages, each on
+// its own thread, so a slow stage only ever holds up its own queue.
+//
+//   collector   enumerates units and samples resources on each trigger
+//   detector    turns status transitions into failures and recoveries
+//   remediator  keeps the retry schedule and runs the automatic restarts
+//   sink        writes the event log and all monitor output
+//
+// Stages are joined by bounded ring queues. Producers claim a slot with an
+// atomic increment and publish it with a per-slot flag, so several stages
+// can feed the sink; each queue has a single consumer. Two semaphores
+// count free slots and filled slots: a producer facing a full queue waits
+// for space (backpressure) and a consumer facing an empty one sleeps.
+// A restart that takes the full control timeout therefore stalls only the
+// remediator, while the collector and detector keep reporting failures.
+// No stage pushes to a queue while holding the service write lock, since
+// the sink may need that lock to drain its queue.
+
+#define PIPELINE_QUEUE_CAPACITY 256     // Events per queue; a power of two
+#define PIPELINE_MESSAGE_MAX 160
+
+typedef enum {
+    PIPE_SOURCES_FAILED,    // A refresh could not list some unit sources
+    PIPE_BATCH,             // A refresh found count changes; they follow
+    PIPE_CHANGE,            // One transition
+    PIPE_FAILED,            // A unit entered STATUS_FAILED
+    PIPE_RECOVERED,         // A unit left STATUS_FAILED on its own
+    PIPE_LOG,               // Append an event log entry
+    PIPE_MESSAGE,           // Print a line
+    PIPE_STOP               // The producer has finished
+} PipelineEventKind;
+
+typedef struct PipelineEvent {
+    PipelineEventKind kind;
+    int count;                          // PIPE_BATCH
+    unsigned int failed_sources;        // PIPE_SOURCES_FAILED: source id bits
+    LogAction action;                   // PIPE_LOG
+    ServiceChange change;               // Unit name for every per-unit event
+    char text[PIPELINE_MESSAGE_MAX];    // PIPE_MESSAGE
+} PipelineEvent;
+
+typedef struct PipelineSlot {
+    atomic_int full;        // Set once the event is written, cleared once read
+    PipelineEvent event;
+} PipelineSlot;
+
+typedef struct PipelineQueue {
+    const char* name;
+    PipelineSlot slots[PIPELINE_QUEUE_CAPACITY];
+    _Alignas(64) atomic_size_t tail;    // Next slot a producer claims
+    _Alignas(64) atomic_size_t head;    // Next slot the consumer reads
+    sem_t space;            // Free slots
+    sem_t items;            // Published events
+    atomic_int max_depth;
+    atomic_ullong pushed;
+    atomic_ullong stalls;   // Pushes that had to wait for space
+} PipelineQueue;
+
+enum { QUEUE_DETECT, QUEUE_REMEDIATE, QUEUE_SINK, QUEUE_COUNT };
+
+static PipelineQueue queues[QUEUE_COUNT];
+static const char* const queue_names[QUEUE_COUNT] = {
+    "collector->detector", "detector->remediator", "detector+remediator->sink"
+};
+
+static pthread_t stage_threads[4];
+static int pipeline_running = 0;
+static atomic_int stopping = 0;
+static atomic_int collect_pending = 0;
+static sem_t collect_wake;
+
+static void queue_init(PipelineQueue* queue, const char* name) {
+    memset(queue, 0, sizeof(*queue));
+    queue->name = name;
+    sem_init(&queue->space, 0, PIPELINE_QUEUE_CAPACITY);
+    sem_init(&queue->items, 0, 0);
+}
+
+static void queue_destroy(PipelineQueue* queue) {
+    sem_destroy(&queue->space);
+    sem_destroy(&queue->items);
+}
+
+static int queue_depth(PipelineQueue* queue) {
+    return (int)(atomic_load(&queue->tail) - atomic_load(&queue->head));
+}
+
+static void queue_push(PipelineQueue* queue, const PipelineEvent* event) {
+    if (sem_trywait(&queue->space) != 0) {
+        atomic_fetch_add(&queue->stalls, 1);
+        while (sem_wait(&queue->space) != 0 && errno == EINTR) {}
+    }
+
+    // Holding a space token guarantees the claimed slot has been read
+    size_t position = atomic_fetch_add(&queue->tail, 1);
+    PipelineSlot* slot = &queue->slots[position & (PIPELINE_QUEUE_CAPACITY - 1)];
+    slot->event = *event;
+    atomic_store_explicit(&slot->full, 1, memory_order_release);
+
+    int depth = queue_depth(queue);
+    int max_depth = atomic_load(&queue->max_depth);
+    while (depth > max_depth && !atomic_compare_exchange_weak(&queue->max_depth, &max_depth, depth)) {}
+    atomic_fetch_add(&queue->pushed, 1);
+    sem_post(&queue->items);
+}
+
+// Take the next event. With a deadline (a CLOCK_REALTIME time, or NULL to
+// wait indefinitely) returns -1 if none arrived in time, else 0.
+static int queue_pop(PipelineQueue* queue, PipelineEvent* event, const struct timespec* deadline) {
+    for (;;) {
+        int result = deadline ? sem_timedwait(&queue->items, deadline) : sem_wait(&queue->items);
+        if (result == 0) break;
+        if (errno != EINTR) return -1;
+    }
+
+    // Producers can finish out of order; the one at head is mid-copy
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    PipelineSlot* slot = &queue->slots[position & (PIPELINE_QUEUE_CAPACITY - 1)];
+    while (!atomic_load_explicit(&slot->full, memory_order_acquire)) sched_yield();
+
+    *event = slot->event;
+    atomic_store_explicit(&slot->full, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, position + 1, memory_order_release);
+    sem_post(&queue->space);
+    return 0;
+}
+
+static void push_simple(int queue, PipelineEventKind kind, const char* service_name) {
+    PipelineEvent event;
+    event.kind = kind;
+    if (service_name != NULL) snprintf(event.change.name, sizeof(event.change.name), "%s", service_name);
+    queue_push(&queues[queue], &event);
+}
+
+static void sink_log(const char* service_name, LogAction action) {
+    PipelineEvent event;
+    event.kind = PIPE_LOG;
+    event.action = action;
+    snprintf(event.change.name, sizeof(event.change.name), "%s", service_name);
+    queue_push(&queues[QUEUE_SINK], &event);
+}
+
+static void sink_message(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+static void sink_message(const char* format, ...) {
+    PipelineEvent event;
+    va_list arguments;
+
+    event.kind = PIPE_MESSAGE;
+    va_start(arguments, format);
+    vsnprintf(event.text, sizeof(event.text), format, arguments);
+    va_end(arguments);
+    queue_push(&queues[QUEUE_SINK], &event);
+}
+
+// Collector: one refresh per trigger; triggers that arrive during a
+// refresh fold into a single follow-up
+static void* collector_main(void* argument) {
+    (void)argument;
+
+    for (;;) {
+        while (sem_wait(&collect_wake) != 0 && errno == EINTR) {}
+        if (atomic_load(&stopping)) break;
+        atomic_store(&collect_pending, 0);
+
+        ServiceChangeSet changes = {0};
+        int result = refresh_services_from_system(&changes);
+        PipelineEvent event;
+        if (changes.failed_sources != 0) {
+            event.kind = PIPE_SOURCES_FAILED;
+            event.failed_sources = changes.failed_sources;
+            queue_push(&queues[QUEUE_DETECT], &event);
+        }
+        if (result >= 0 && changes.count > 0) {
+            event.kind = PIPE_BATCH;
+            event.count = changes.count;
+            queue_push(&queues[QUEUE_DETECT], &event);
+
+            event.kind = PIPE_CHANGE;
+            for (int i = 0; i < changes.count; i++) {
+                event.change = changes.changes[i];
+                queue_push(&queues[QUEUE_DETECT], &event);
+            }
+        }
+        free_change_set(&changes);
+    }
+
+    push_simple(QUEUE_DETECT, PIPE_STOP, NULL);
+    return NULL;
+}
+
+// Detector: passes every transition on for reporting and tells the
+// remediator which units failed and which recovered by themselves
+static void* detector_main(void* argument) {
+    PipelineEvent event;
+    (void)argument;
+
+    for (;;) {
+        queue_pop(&queues[QUEUE_DETECT], &event, NULL);
+        if (event.kind == PIPE_STOP) break;
+
+        queue_push(&queues[QUEUE_SINK], &event);
+        if (event.kind != PIPE_CHANGE) continue;
+
+        const ServiceChange* change = &event.change;
+        if (change->kind != CHANGE_REMOVED && change->new_status == STATUS_FAILED) {
+            push_simple(QUEUE_REMEDIATE, PIPE_FAILED, change->name);
+        } else if (change->kind == CHANGE_STATUS && change->old_status == STATUS_FAILED) {
+            push_simple(QUEUE_REMEDIATE, PIPE_RECOVERED, change->name);
+        }
+    }
+
+    push_simple(QUEUE_REMEDIATE, PIPE_STOP, NULL);
+    push_simple(QUEUE_SINK, PIPE_STOP, NULL);
+    return NULL;
+}
+
+// Outcome of one automatic restart; runs as each job finishes
+static void remediation_done(const ControlJob* job, void* context) {
+    FailedService* entry = (FailedService*)job->context;
+    uint32_t name_id = entry->name_id;
+    const char* service_name = entry->name;
+    (void)context;
+
+    // Hold the name while reporting, since the entry may be released
+    service_lock();
+    string_pool_retain(&service_names, name_id);
+    time_t delay = finish_failed_retry(entry, job);
+    service_unlock();
+
+    if (job->cancelled_by) {
+        sink_message("Skipped restart of %s: required service %s failed (next retry in %lds)",
+                     service_name, job->cancelled_by, (long)delay);
+        sink_log(service_name, ACTION_CANCELLED);
+    } else if (job->succeeded) {
+        sink_message("Successfully restarted: %s", service_name);
+        sink_log(service_name, ACTION_AUTO_RESTARTED);
+    } else {
+        sink_message("Failed to restart: %s%s (next retry in %lds)", service_name,
+                     job->timed_out ? " (timed out)" : "", (long)delay);
+        sink_log(service_name, ACTION_AUTO_RESTART_FAILED);
+    }
+
+    service_lock();
+    release_service_name(name_id);
+    service_unlock();
+}
+
+// Restart every queued service whose retry is due, in dependency order
+static void run_due_restarts() {
+    ControlBatch batch = {0};
+    FailedService* entry;
+    time_t now = time(NULL);
+    const char* held[MAX_FAILED_QUEUE];
+    uint32_t held_ids[MAX_FAILED_QUEUE];
+    time_t held_for[MAX_FAILED_QUEUE];
+    int held_first[MAX_FAILED_QUEUE];
+    int held_count = 0;
+
+    // Flapping services go back on the schedule until their breaker half-opens
+    service_lock();
+    while ((entry = scheduler_pop_due(&failed_scheduler, now)) != NULL) {
+        const char* service_name = entry->name;
+        uint32_t name_id = entry->name_id;
+        int first_hold;
+
+        // Hold the name for the report, since the entry may be released
+        string_pool_retain(&service_names, name_id);
+        time_t hold = hold_flapping_retry(entry, now, &first_hold);
+        if (hold > 0 && held_count < MAX_FAILED_QUEUE) {
+            held[held_count] = service_name;
+            held_ids[held_count] = name_id;
+            held_for[held_count] = hold;
+            held_first[held_count++] = first_hold;
+            continue;
+        }
+        release_service_name(name_id);
+        if (hold > 0) continue;
+        if (control_batch_add(&batch, entry->name, CONTROL_RESTART, entry) < 0) {
+            scheduler_insert(&failed_scheduler, entry);
+            break;
+        }
+    }
+    service_unlock();
+
+    for (int i = 0; i < held_count; i++) {
+        sink_message("Holding restart of flapping service: %s (circuit breaker half-opens in %lds)",
+                     held[i], (long)held_for[i]);
+        if (held_first[i]) sink_log(held[i], ACTION_FLAPPING);
+    }
+    if (held_count > 0) {
+        service_lock();
+        for (int i = 0; i < held_count; i++) release_service_name(held_ids[i]);
+        service_unlock();
+    }
+
+    // Popped entries belong to this thread until their restart finishes
+    for (int i = 0; i < batch.count; i++) {
+        entry = (FailedService*)batch.jobs[i].context;
+        sink_message("Attempting to restart failed service: %s (Failure count: %d)",
+                     entry->name, entry->failure_count);
+    }
+
+    // The restarts themselves run without the lock
+    if (batch.count > 0) {
+        control_batch_run_ordered(&batch, remediation_done, NULL);
+        service_lock();
+        snapshot_publish();
+        service_unlock();
+    }
+    control_batch_free(&batch);
+}
+
+// Remediator: owns the failed queue while the pipeline runs. It sleeps
+// until the next event or the next due retry, whichever comes first.
+static void* remediator_main(void* argument) {
+    PipelineEvent event;
+    (void)argument;
+
+    for (;;) {
+        service_lock();
+        FailedService* next = scheduler_peek(&failed_scheduler);
+        struct timespec deadline = { next ? next->next_retry : 0, 0 };
+        service_unlock();
+
+        if (queue_pop(&queues[QUEUE_REMEDIATE], &event, next ? &deadline : NULL) == 0) {
+            if (event.kind == PIPE_STOP) break;
+
+            int queued = 0;
+            service_lock();
+            if (event.kind == PIPE_FAILED) {
+                queued = schedule_failed_service(event.change.name) == 1;
+            } else if (event.kind == PIPE_RECOVERED) {
+                remove_from_failed_queue(event.change.name);
+            }
+            service_unlock();
+            if (queued) sink_log(event.change.name, ACTION_QUEUED_FAILED);
+        }
+        run_due_restarts();
+    }
+
+    push_simple(QUEUE_SINK, PIPE_STOP, NULL);
+    return NULL;
+}
+
+// Sink: the only stage that logs or prints. Changes are collected per
+// refresh and shown as one block.
+static void* sink_main(void* argument) {
+    PipelineEvent event;
+    ServiceChangeSet batch = {0};
+    int expected = 0;
+    int producers = 2;      // Detector and remediator
+    (void)argument;
+
+    while (producers > 0) {
+        queue_pop(&queues[QUEUE_SINK], &event, NULL);
+
+        switch (event.kind) {
+            case PIPE_STOP:
+                producers--;
+                break;
+            case PIPE_SOURCES_FAILED:
+                report_failed_sources(stdout, event.failed_sources);
+                break;
+            case PIPE_BATCH:
+                batch.count = 0;
+                expected = event.count;
+                if (batch.capacity < expected) {
+                    ServiceChange* grown = (ServiceChange*)realloc(batch.changes, expected * sizeof(ServiceChange));
+                    if (grown != NULL) {
+                        batch.changes = grown;
+                        batch.capacity = expected;
+                    }
+                }
+                break;
+            case PIPE_CHANGE:
+                if (batch.count < batch.capacity) batch.changes[batch.count++] = event.change;
+                if (--expected == 0) {
+                    char timestamp[64];
+                    printf("\n[%s] %d change(s)\n", format_timestamp(time(NULL), timestamp, sizeof(timestamp)),
+                           batch.count);
+                    display_service_changes(&batch);
+                    metrics_export();
+                    state_file_checkpoint(0);
+                }
+                break;
+            case PIPE_LOG:
+                service_lock();
+                add_log_entry(event.change.name, event.action);
+                service_unlock();
+                break;
+            case PIPE_MESSAGE:
+                printf("%s\n", event.text);
+                break;
+            default:
+                break;
+        }
+        fflush(stdout);
+    }
+
+    free_change_set(&batch);
+    return NULL;
+}
+
+// Hand the remediator every unit that is already failed. Those produce no
+// transition, so the detector would never report them.
+static void queue_failed_services() {
+    service_lock();
+    int count = service_table.status_count[STATUS_FAILED];
+    char (*names)[MAX_SERVICE_NAME] = count > 0 ? malloc(count * sizeof(*names)) : NULL;
+    int found = 0;
+    if (names != NULL) {
+        for (int row = table_status_first(&service_table, STATUS_FAILED); row >= 0 && found < count;
+             row = table_status_next(&service_table, row)) {
+            snprintf(names[found++], MAX_SERVICE_NAME, "%s",
+                     string_pool_get(&service_names, service_table.name_id[row]));
+        }
+    }
+    service_unlock();
+
+    if (count > 0 && names == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+    for (int i = 0; i < found; i++) push_simple(QUEUE_REMEDIATE, PIPE_FAILED, names[i]);
+    free(names);
+}
+
+// Start the four stages. Returns 0, or -1 if a thread could not be started.
+int pipeline_start() {
+    static void* (*const stages[4])(void*) = { sink_main, remediator_main, detector_main, collector_main };
+
+    if (pipeline_running) return 0;
+
+    for (int i = 0; i < QUEUE_COUNT; i++) queue_init(&queues[i], queue_names[i]);
+    sem_init(&collect_wake, 0, 0);
+    atomic_store(&stopping, 0);
+    atomic_store(&collect_pending, 0);
+
+    // Consumers start before their producers
+    for (int i = 0; i < 4; i++) {
+        if (pthread_create(&stage_threads[i], NULL, stages[i], NULL) != 0) {
+            printf("Failed to start the monitoring pipeline.\n");
+            // The stages started so far are all waiting in sem_wait(),
+            // which is a cancellation point
+            for (int j = i - 1; j >= 0; j--) pthread_cancel(stage_threads[j]);
+            for (int j = i - 1; j >= 0; j--) pthread_join(stage_threads[j], NULL);
+            sem_destroy(&collect_wake);
+            for (int j = 0; j < QUEUE_COUNT; j++) queue_destroy(&queues[j]);
+            return -1;
+        }
+    }
+    pipeline_running = 1;
+    queue_failed_services();
+    return 0;
+}
+
+// Ask the collector for a refresh
+void pipeline_trigger() {
+    if (!pipeline_running) return;
+    if (atomic_exchange(&collect_pending, 1) == 0) sem_post(&collect_wake);
+}
+
+// Stop the stages in order, letting queued events and restarts in
+// progress finish
+void pipeline_stop() {
+    if (!pipeline_running) return;
+
+    atomic_store(&stopping, 1);
+    sem_post(&collect_wake);
+    for (int i = 3; i >= 0; i--) pthread_join(stage_threads[i], NULL);
+
+    sem_destroy(&collect_wake);
+    for (int i = 0; i < QUEUE_COUNT; i++) queue_destroy(&queues[i]);
+    pipeline_running = 0;
+}
+
+// Current depth and totals of each queue. Returns how many were written.
+int pipeline_queue_stats(PipelineQueueStats* stats, int max) {
+    int count = 0;
+
+    for (int i = 0; i < QUEUE_COUNT && count < max; i++, count++) {
+        PipelineQueue* queue = &queues[i];
+        stats[count].name = queue->name;
+        stats[count].depth = queue_depth(queue);
+        stats[count].max_depth = atomic_load(&queue->max_depth);
+        stats[count].capacity = PIPELINE_QUEUE_CAPACITY;
+        stats[count].pushed = atomic_load(&queue->pushed);
+        stats[count].stalls = atomic_load(&queue->stalls);
+    }
+    return count;
+}
+
+void display_pipeline_stats() {
+    PipelineQueueStats stats[QUEUE_COUNT];
+    int count = pipeline_queue_stats(stats, QUEUE_COUNT);
+
+    printf("%-28s %-6s %-6s %-8s %-10s %-8s\n", "QUEUE", "DEPTH", "MAX", "CAPACITY", "EVENTS", "STALLS");
+    for (int i = 0; i < count; i++) {
+        printf("%-28s %-6d %-6d %-8d %-10llu %-8llu\n", stats[i].name, stats[i].depth, stats[i].max_depth,
+               stats[i].capacity, (unsigned long long)stats[i].pushed, (unsigned long long)stats[i].stalls);
+    }
+}
@@ -0,0 +1,90 @@
+#include "func.h"
+
+// Fixed-size node pools: records are carved out of large slabs, freed
+// records go on a free list for reuse, and a whole pool can be emptied in
+// O(1) by rewinding to its first slab.
+
+// Objects start this far into a slab so they stay suitably aligned
+#define POOL_HEADER_SIZE 16
+#define POOL_ALIGN 16
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+// Free-list link stored in the first bytes of a released object
+typedef struct PoolFreeNode {
+    struct PoolFreeNode* next;
+} PoolFreeNode;
+
+static size_t pool_stride(const NodePool* pool) {
+    size_t size = pool->object_size;
+    if (size < sizeof(PoolFreeNode)) size = sizeof(PoolFreeNode);
+    return (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+}
+
+static unsigned char* slab_object(const NodePool* pool, PoolSlab* slab, int i) {
+    return (unsigned char*)slab + POOL_HEADER_SIZE + (size_t)i * pool_stride(pool);
+}
+
+// Get one object, reusing released objects before carving new ones
+void* pool_alloc(NodePool* pool) {
+    if (pool->free_list != NULL) {
+        PoolFreeNode* node = (PoolFreeNode*)pool->free_list;
+        pool->free_list = node->next;
+        pool->live++;
+        return node;
+    }
+
+    if (pool->current == NULL || pool->current_used == pool->objects_per_slab) {
+        // Move on to an already allocated slab left over from a reset
+        PoolSlab* next = pool->current ? ((PoolSlab*)pool->current)->next : (PoolSlab*)pool->slabs;
+        if (next == NULL) {
+            next = (PoolSlab*)malloc(POOL_HEADER_SIZE + pool->objects_per_slab * pool_stride(pool));
+            if (next == NULL) return NULL; // Callers report the failure
+            next->next = NULL;
+            if (pool->current) {
+                ((PoolSlab*)pool->current)->next = next;
+            } else {
+                pool->slabs = next;
+            }
+            pool->slab_count++;
+        }
+        pool->current = next;
+        pool->current_used = 0;
+    }
+
+    pool->live++;
+    return slab_object(pool, (PoolSlab*)pool->current, pool->current_used++);
+}
+
+// Return one object to the pool's free list
+void pool_release(NodePool* pool, void* object) {
+    if (object == NULL) return;
+
+    PoolFreeNode* node = (PoolFreeNode*)object;
+    node->next = (PoolFreeNode*)pool->free_list;
+    pool->free_list = node;
+    pool->live--;
+}
+
+// Drop every object at once but keep the slabs for reuse
+void pool_reset(NodePool* pool) {
+    pool->free_list = NULL;
+    pool->current = NULL;
+    pool->current_used = 0;
+    pool->live = 0;
+}
+
+// Give all slabs back to the system
+void pool_destroy(NodePool* pool) {
+    PoolSlab* slab = (PoolSlab*)pool->slabs;
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool_reset(pool);
+}
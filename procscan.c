@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+
+// Native process scanner: walks /proc with getdents64 and reads each
+// process's stat, statm, status and cgroup files through openat on the
+// /proc directory fd. Fields are parsed in place from stack buffers, so a
+// scan allocates nothing per process. Large pid lists are split across
+// worker threads that each fill their own slice of the result.
+
+#define PROCESS_DIRENT_BUFFER 65536
+#define PROCESS_PARALLEL_MIN 512    // Fewer pids than this are scanned inline
+#define PROCESS_MAX_THREADS 8
+#define PROCESS_USER_CACHE 64
+
+// One worker's share of a scan
+typedef struct ScanWorker {
+    int proc_fd;
+    const int* pids;
+    int first;
+    int last;
+    ProcessInfo* out;
+} ScanWorker;
+
+// Worker threads for a scan: $SERVICE_SCAN_THREADS, else one per CPU up
+// to PROCESS_MAX_THREADS
+int process_scan_threads() {
+    const char* configured = getenv("SERVICE_SCAN_THREADS");
+    if (configured && atoi(configured) > 0) return atoi(configured);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > PROCESS_MAX_THREADS ? PROCESS_MAX_THREADS : (int)cpus;
+}
+
+// Read <pid>/<file> relative to the /proc fd into buffer (NUL-terminated)
+static ssize_t read_proc_file(int proc_fd, int pid, const char* file, char* buffer, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "%d/%s", pid, file);
+
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t got;
+    do {
+        got = read(fd, buffer, size - 1);
+    } while (got < 0 && errno == EINTR);
+    close(fd);
+
+    buffer[got > 0 ? got : 0] = '\0';
+    return got;
+}
+
+// Skip spaces, parse an unsigned number and leave cursor after it
+static uint64_t next_number(const char** cursor) {
+    const char* c = *cursor;
+    uint64_t value = 0;
+
+    while (*c == ' ') c++;
+    while (*c >= '0' && *c <= '9') value = value * 10 + (uint64_t)(*c++ - '0');
+    *cursor = c;
+    return value;
+}
+
+static void skip_fields(const char** cursor, int fields) {
+    const char* c = *cursor;
+    while (fields-- > 0) {
+        while (*c == ' ') c++;
+        while (*c != ' ' && *c != '\0') c++;
+    }
+    *cursor = c;
+}
+
+// pid (comm) state ppid ... utime stime ... starttime: comm may contain
+// spaces and parentheses, so parse from the last ')'
+static int parse_stat(const char* buffer, ProcessInfo* info) {
+    const char* open_paren = strchr(buffer, '(');
+    const char* close_paren = strrchr(buffer, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren) return -1;
+
+    size_t length = close_paren - open_paren - 1;
+    if (length >= sizeof(info->command)) length = sizeof(info->command) - 1;
+    memcpy(info->command, open_paren + 1, length);
+    info->command[length] = '\0';
+
+    const char* cursor = close_paren + 1;
+    while (*cursor == ' ') cursor++;
+    info->state = *cursor ? *cursor++ : '?';
+
+    info->ppid = (int)next_number(&cursor);     // Field 4
+    skip_fields(&cursor, 9);                    // Fields 5-13
+    info->cpu_ticks = next_number(&cursor);     // utime (14)
+    info->cpu_ticks += next_number(&cursor);    // stime (15)
+    skip_fields(&cursor, 6);                    // Fields 16-21
+    info->start_ticks = next_number(&cursor);   // starttime (22)
+    return 0;
+}
+
+// statm: size resident ... in pages
+static void parse_statm(const char* buffer, ProcessInfo* info, uint64_t page_kb) {
+    const char* cursor = buffer;
+    info->vsize_kb = next_number(&cursor) * page_kb;
+    info->rss_kb = next_number(&cursor) * page_kb;
+}
+
+// status: real uid from "Uid:" and the thread count from "Threads:"
+static void parse_status(const char* buffer, ProcessInfo* info) {
+    const char* line = strstr(buffer, "\nUid:");
+    if (line != NULL) {
+        const char* cursor = line + 5;
+        while (*cursor == '\t') cursor++;
+        info->uid = (uid_t)next_number(&cursor);
+    }
+
+    line = strstr(buffer, "\nThreads:");
+    if (line != NULL) {
+        const char* cursor = line + 9;
+        while (*cursor == '\t') cursor++;
+        info->threads = (int)next_number(&cursor);
+    }
+}
+
+// cgroup: map ".../system.slice/<unit>.service" to a loaded service
+static uint32_t parse_cgroup_service(const char* buffer) {
+    const char* suffix = NULL;
+    for (const char* found = strstr(buffer, ".service"); found; found = strstr(found + 1, ".service")) {
+        suffix = found;
+    }
+    if (suffix == NULL) return STRING_ID_NONE;
+
+    const char* start = suffix;
+    while (start > buffer && start[-1] != '/' && start[-1] != '\n') start--;
+
+    char name[MAX_SERVICE_NAME];
+    size_t length = suffix - start;
+    if (length == 0 || length >= sizeof(name)) return STRING_ID_NONE;
+    memcpy(name, start, length);
+    name[length] = '\0';
+
+    Service* service = index_find(&service_index, name);
+    return service ? service_table.name_id[service->row] : STRING_ID_NONE;
+}
+
+// Fill out[first, last) for the worker's pids; processes that exit
+// mid-scan are left with pid 0
+static void* scan_range(void* argument) {
+    ScanWorker* worker = (ScanWorker*)argument;
+    uint64_t page_kb = (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+    char buffer[4096];
+
+    for (int i = worker->first; i < worker->last; i++) {
+        ProcessInfo* info = &worker->out[i];
+        int pid = worker->pids[i];
+
+        memset(info, 0, sizeof(*info));
+        info->service_id = STRING_ID_NONE;
+
+        if (read_proc_file(worker->proc_fd, pid, "stat", buffer, sizeof(buffer)) <= 0 ||
+            parse_stat(buffer, info) < 0) {
+            continue;
+        }
+        if (read_proc_file(worker->proc_fd, pid, "statm", buffer, sizeof(buffer)) > 0) {
+            parse_statm(buffer, info, page_kb);
+        }
+        if (read_proc_file(worker->proc_fd, pid, "status", buffer, sizeof(buffer)) > 0) {
+            parse_status(buffer, info);
+        }
+        if (read_proc_file(worker->proc_fd, pid, "cgroup", buffer, sizeof(buffer)) > 0) {
+            info->service_id = parse_cgroup_service(buffer);
+        }
+        info->pid = pid;
+    }
+    return NULL;
+}
+
+// Collect the numeric entries of /proc
+static int list_pids(int proc_fd, int** pids_out, int* capacity) {
+    char buffer[PROCESS_DIRENT_BUFFER];
+    int count = 0;
+
+    for (;;) {
+        ssize_t got = getdents64(proc_fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) break;
+
+        for (ssize_t offset = 0; offset < got; ) {
+            struct dirent64* entry = (struct dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+
+            const char* c = entry->d_name;
+            int pid = 0;
+            while (*c >= '0' && *c <= '9') pid = pid * 10 + (*c++ - '0');
+            if (*c != '\0' || pid == 0) continue;
+
+            if (count == *capacity) {
+                int new_capacity = *capacity ? *capacity * 2 : 1024;
+                int* grown = (int*)realloc(*pids_out, new_capacity * sizeof(int));
+                if (grown == NULL) return -1;
+                *pids_out = grown;
+                *capacity = new_capacity;
+            }
+            (*pids_out)[count++] = pid;
+        }
+    }
+    return count;
+}
+
+static int compare_pids(const void* a, const void* b) {
+    int left = *(const int*)a, right = *(const int*)b;
+    return (left > right) - (left < right);
+}
+
+// Uptime and total memory, for turning raw counters into percentages
+static void read_system_totals(ProcessTable* table, const char* root) {
+    char path[600], buffer[4096];
+    FILE* file;
+
+    table->uptime = 0;
+    snprintf(path, sizeof(path), "%s/proc/uptime", root);
+    if ((file = fopen(path, "r")) != NULL) {
+        if (fscanf(file, "%lf", &table->uptime) != 1) table->uptime = 0;
+        fclose(file);
+    }
+
+    table->memory_total_kb = 0;
+    snprintf(path, sizeof(path), "%s/proc/meminfo", root);
+    if ((file = fopen(path, "r")) != NULL) {
+        while (fgets(buffer, sizeof(buffer), file)) {
+            if (strncmp(buffer, "MemTotal:", 9) == 0) {
+                const char* cursor = buffer + 9;
+                table->memory_total_kb = next_number(&cursor);
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    table->clock_ticks = sysconf(_SC_CLK_TCK);
+}
+
+// Scan <root>/proc into table (replacing its contents), sorted by pid and
+// split across up to threads workers. Returns the process count or -1.
+int process_scan(ProcessTable* table, const char* root, int threads) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/proc", root);
+
+    int proc_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd < 0) return -1;
+
+    int count = list_pids(proc_fd, &table->pids, &table->pid_capacity);
+    if (count < 0) {
+        close(proc_fd);
+        return -1;
+    }
+    qsort(table->pids, count, sizeof(int), compare_pids);
+
+    if (count > table->capacity) {
+        ProcessInfo* grown = (ProcessInfo*)realloc(table->processes, count * sizeof(ProcessInfo));
+        if (grown == NULL) {
+            close(proc_fd);
+            return -1;
+        }
+        table->processes = grown;
+        table->capacity = count;
+    }
+
+    if (threads < 1 || count < PROCESS_PARALLEL_MIN) threads = 1;
+    if (threads > PROCESS_MAX_THREADS) threads = PROCESS_MAX_THREADS;
+
+    ScanWorker workers[PROCESS_MAX_THREADS];
+    pthread_t handles[PROCESS_MAX_THREADS];
+    int started[PROCESS_MAX_THREADS] = {0};
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].proc_fd = proc_fd;
+        workers[i].pids = table->pids;
+        workers[i].first = (int)((long)count * i / threads);
+        workers[i].last = (int)((long)count * (i + 1) / threads);
+        workers[i].out = table->processes;
+    }
+
+    // The calling thread takes the first share; a worker that cannot be
+    // started has its share scanned inline afterwards
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&handles[i], NULL, scan_range, &workers[i]) == 0;
+    }
+    scan_range(&workers[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(handles[i], NULL);
+        } else {
+            scan_range(&workers[i]);
+        }
+    }
+    close(proc_fd);
+
+    // Drop processes that exited during the scan
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (table->processes[i].pid != 0) table->processes[kept++] = table->processes[i];
+    }
+    table->count = kept;
+
+    read_system_totals(table, root);
+    return kept;
+}
+
+// Average CPU use over the process lifetime, as ps reports it
+double process_cpu_percent(const ProcessTable* table, const ProcessInfo* info) {
+    if (table->clock_ticks <= 0) return 0;
+
+    double running = table->uptime - (double)info->start_ticks / table->clock_ticks;
+    if (running <= 0) return 0;
+    return (double)info->cpu_ticks / table->clock_ticks / running * 100.0;
+}
+
+double process_memory_percent(const ProcessTable* table, const ProcessInfo* info) {
+    if (table->memory_total_kb == 0) return 0;
+    return (double)info->rss_kb / table->memory_total_kb * 100.0;
+}
+
+static double process_key(const ProcessTable* table, int index, ProcessSortKey key) {
+    const ProcessInfo* info = &table->processes[index];
+    return key == PROCESS_SORT_CPU ? process_cpu_percent(table, info) : (double)info->rss_kb;
+}
+
+// Restore the min-heap below pos (heap holds process indices)
+static void top_sift_down(const ProcessTable* table, ProcessSortKey key, int* heap, int size, int pos) {
+    for (;;) {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = left + 1;
+
+        if (left < size && process_key(table, heap[left], key) < process_key(table, heap[smallest], key))
+            smallest = left;
+        if (right < size && process_key(table, heap[right], key) < process_key(table, heap[smallest], key))
+            smallest = right;
+        if (smallest == pos) break;
+
+        int tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+// The limit processes with the highest key, largest first, written to
+// rows_out as indices into table->processes. Keeps a min-heap of the best
+// candidates so far, so the cost is O(n log limit). Returns the count.
+int process_top(const ProcessTable* table, ProcessSortKey key, int limit, int* rows_out) {
+    int size = 0;
+
+    if (limit <= 0) return 0;
+
+    for (int i = 0; i < table->count; i++) {
+        if (size < limit) {
+            // Sift the new entry up
+            int pos = size++;
+            rows_out[pos] = i;
+            while (pos > 0) {
+                int parent = (pos - 1) / 2;
+                if (process_key(table, rows_out[parent], key) <= process_key(table, rows_out[pos], key)) break;
+                int tmp = rows_out[parent];
+                rows_out[parent] = rows_out[pos];
+                rows_out[pos] = tmp;
+                pos = parent;
+            }
+        } else if (process_key(table, i, key) > process_key(table, rows_out[0], key)) {
+            rows_out[0] = i;
+            top_sift_down(table, key, rows_out, size, 0);
+        }
+    }
+
+    // Pop the smallest to the back until the heap is empty: largest first
+    for (int end = size - 1; end > 0; end--) {
+        int tmp = rows_out[0];
+        rows_out[0] = rows_out[end];
+        rows_out[end] = tmp;
+        top_sift_down(table, key, rows_out, end, 0);
+    }
+    return size;
+}
+
+// User name for a uid, cached since the same few uids own most processes
+const char* process_user_name(uid_t uid) {
+    static struct { uid_t uid; char name[32]; } cache[PROCESS_USER_CACHE];
+    static int cached = 0;
+
+    for (int i = 0; i < cached; i++) {
+        if (cache[i].uid == uid) return cache[i].name;
+    }
+
+    int slot = cached < PROCESS_USER_CACHE ? cached++ : (int)(uid % PROCESS_USER_CACHE);
+    struct passwd* entry = getpwuid(uid);
+    cache[slot].uid = uid;
+    if (entry != NULL) {
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%s", entry->pw_name);
+    } else {
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%u", (unsigned int)uid);
+    }
+    return cache[slot].name;
+}
+
+void process_table_free(ProcessTable* table) {
+    free(table->processes);
+    free(table->pids);
+    memset(table, 0, sizeof(*table));
+}
@@ -0,0 +1,253 @@
+#include "func.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <strings.h>
+
+// Query engine: combines status, name glob, failure count, last-started
+// range and PID predicates. Each query is driven from whichever index gives
+// the fewest candidates: the name index for a glob with a literal prefix,
+// the per-status membership lists, or the last-started order. Every
+// candidate is then checked against the remaining predicates.
+
+void query_init(ServiceQuery* query) {
+    memset(query, 0, sizeof(*query));
+    query->pid_present = -1;
+}
+
+const char* query_plan_to_string(QueryPlan plan) {
+    switch (plan) {
+        case QUERY_SCAN: return "full scan";
+        case QUERY_BY_NAME: return "name index";
+        case QUERY_BY_STATUS: return "status index";
+        case QUERY_BY_STARTED: return "last-started index";
+        default: return "unknown";
+    }
+}
+
+// Parse a point in time: seconds since the epoch, YYYY-MM-DD[THH:MM[:SS]]
+// in local time, or an offset back from now such as -30m, -2h or -7d
+static int parse_time(const char* text, time_t* when) {
+    if (text[0] == '-' && isdigit((unsigned char)text[1])) {
+        char* unit;
+        long amount = strtol(text + 1, &unit, 10);
+        long scale = *unit == 's' || *unit == '\0' ? 1 : *unit == 'm' ? 60 :
+                     *unit == 'h' ? 3600 : *unit == 'd' ? 86400 : 0;
+        if (scale == 0) return -1;
+        *when = time(NULL) - amount * scale;
+        return 0;
+    }
+
+    struct tm parts;
+    memset(&parts, 0, sizeof(parts));
+    int fields = sscanf(text, "%d-%d-%dT%d:%d:%d", &parts.tm_year, &parts.tm_mon, &parts.tm_mday,
+                        &parts.tm_hour, &parts.tm_min, &parts.tm_sec);
+    if (fields >= 3) {
+        parts.tm_year -= 1900;
+        parts.tm_mon -= 1;
+        parts.tm_isdst = -1;
+        *when = mktime(&parts);
+        return 0;
+    }
+
+    char* end;
+    long long seconds = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0') return -1;
+    *when = (time_t)seconds;
+    return 0;
+}
+
+// Status names separated by ',' or '|', matched without regard to case
+static int parse_status_list(const char* text, unsigned int* mask) {
+    char list[128];
+    char* rest;
+    snprintf(list, sizeof(list), "%s", text);
+
+    for (char* name = strtok_r(list, ",|", &rest); name != NULL; name = strtok_r(NULL, ",|", &rest)) {
+        int status;
+        for (status = 0; status < STATUS_COUNT; status++) {
+            if (strcasecmp(name, status_to_string((ServiceStatus)status)) == 0) break;
+        }
+        if (status == STATUS_COUNT) return -1;
+        *mask |= STATUS_BIT(status);
+    }
+    return *mask != 0 ? 0 : -1;
+}
+
+// Source names separated by ',' or '|'
+static int parse_source_list(const char* text, unsigned int* mask) {
+    char list[256];
+    char* rest;
+    snprintf(list, sizeof(list), "%s", text);
+
+    for (char* name = strtok_r(list, ",|", &rest); name != NULL; name = strtok_r(NULL, ",|", &rest)) {
+        int source = source_find(name);
+        if (source < 0) return -1;
+        *mask |= 1u << source;
+    }
+    return *mask != 0 ? 0 : -1;
+}
+
+// Parse space-separated terms into query:
+//   status=failed,inactive  name=app-*  failures>3  failures>=3
+//   started>=2024-05-01  started<-1h  pid=yes|no  source=system,user
+// Returns 0, or -1 after reporting the first bad term.
+int query_parse(const char* text, ServiceQuery* query) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    query_init(query);
+
+    char* save;
+    for (char* term = strtok_r(buffer, " \t\n", &save); term != NULL; term = strtok_r(NULL, " \t\n", &save)) {
+        char* op = strpbrk(term, "=<>");
+        int ok = op != NULL;
+
+        if (ok) {
+            size_t key_length = op - term;
+            const char* value = op + (op[1] == '=' ? 2 : 1);
+            int inclusive = op[0] == '=' || op[1] == '=';
+
+            if (key_length == 6 && strncmp(term, "status", 6) == 0 && op[0] == '=') {
+                ok = parse_status_list(value, &query->status_mask) == 0;
+            } else if (key_length == 4 && strncmp(term, "name", 4) == 0 && op[0] == '=') {
+                snprintf(query->name_pattern, sizeof(query->name_pattern), "%s", value);
+            } else if (key_length == 8 && strncmp(term, "failures", 8) == 0 && op[0] != '<') {
+                char* end;
+                long count = strtol(value, &end, 10);
+                ok = *value != '\0' && *end == '\0' && count >= 0;
+                query->min_failures = (unsigned int)(count + (inclusive ? 0 : 1));
+            } else if (key_length == 7 && strncmp(term, "started", 7) == 0 && op[0] != '=') {
+                time_t when;
+                ok = parse_time(value, &when) == 0;
+                if (ok && !query->has_started_range) {
+                    query->has_started_range = 1;
+                    query->started_from = 0;
+                    query->started_to = (time_t)INT64_MAX;
+                }
+                if (ok && op[0] == '>') query->started_from = inclusive ? when : when + 1;
+                if (ok && op[0] == '<') query->started_to = inclusive ? when : when - 1;
+            } else if (key_length == 3 && strncmp(term, "pid", 3) == 0 && op[0] == '=') {
+                ok = strcmp(value, "yes") == 0 || strcmp(value, "no") == 0;
+                query->pid_present = strcmp(value, "yes") == 0;
+            } else if (key_length == 6 && strncmp(term, "source", 6) == 0 && op[0] == '=') {
+                ok = parse_source_list(value, &query->source_mask) == 0;
+            } else {
+                ok = 0;
+            }
+        }
+
+        if (!ok) {
+            printf("Invalid query term '%s'\n", term);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Literal characters of a glob before its first wildcard
+static size_t literal_prefix(const char* pattern, char* prefix, size_t size) {
+    size_t length = strcspn(pattern, "*?[\\");
+    if (length >= size) length = size - 1;
+    memcpy(prefix, pattern, length);
+    prefix[length] = '\0';
+    return length;
+}
+
+// Check every predicate against one row
+static int row_matches(const ServiceQuery* query, int row) {
+    const ServiceTable* table = &service_table;
+    uint8_t status = table->status[row];
+
+    if (status == STATUS_NONE) return 0;
+    if (query->status_mask && !(query->status_mask & STATUS_BIT(status))) return 0;
+    if (table->failures[row] < query->min_failures) return 0;
+    if (query->pid_present >= 0 && (table->pid[row] > 0) != query->pid_present) return 0;
+    if (query->source_mask && !(query->source_mask & (1u << table->source[row]))) return 0;
+    if (query->has_started_range &&
+        (table->last_started[row] < query->started_from || table->last_started[row] > query->started_to)) {
+        return 0;
+    }
+    if (query->name_pattern[0] &&
+        fnmatch(query->name_pattern, string_pool_get(&service_names, table->name_id[row]), 0) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+static int compare_rows_by_name(const void* a, const void* b) {
+    return strcmp(string_pool_get(&service_names, service_table.name_id[*(const int*)a]),
+                  string_pool_get(&service_names, service_table.name_id[*(const int*)b]));
+}
+
+// Run a query into rows_out (sized for service_table.rows entries), in name
+// order. Returns the number of matches; *plan_out, if given, says which
+// index drove the query.
+int query_run(const ServiceQuery* query, int* rows_out, QueryPlan* plan_out) {
+    const ServiceTable* table = &service_table;
+    QueryPlan plan = QUERY_SCAN;
+    int best = table->rows;
+    int count = 0;
+
+    // Estimate candidates from each usable index
+    char prefix[MAX_SERVICE_NAME];
+    int name_first = 0, name_count = -1;
+    if (query->name_pattern[0] && literal_prefix(query->name_pattern, prefix, sizeof(prefix)) > 0) {
+        name_count = index_prefix_range(&service_index, prefix, &name_first);
+        if (name_count < best) {
+            best = name_count;
+            plan = QUERY_BY_NAME;
+        }
+    }
+
+    if (query->status_mask) {
+        int status_count = 0;
+        for (int status = 0; status < STATUS_COUNT; status++) {
+            if (query->status_mask & STATUS_BIT(status)) status_count += table_count_status(table, status);
+        }
+        if (status_count < best) {
+            best = status_count;
+            plan = QUERY_BY_STATUS;
+        }
+    }
+
+    int started_first = 0, started_count = -1;
+    if (query->has_started_range) {
+        started_count = table_started_range(table, query->started_from, query->started_to, &started_first);
+        if (started_count < best) {
+            best = started_count;
+            plan = QUERY_BY_STARTED;
+        }
+    }
+
+    switch (plan) {
+        case QUERY_BY_NAME:
+            // The sorted index is already in name order
+            for (int i = name_first; i < name_first + name_count; i++) {
+                int row = service_index.sorted[i]->row;
+                if (row_matches(query, row)) rows_out[count++] = row;
+            }
+            break;
+        case QUERY_BY_STATUS:
+            for (int status = 0; status < STATUS_COUNT; status++) {
+                if (!(query->status_mask & STATUS_BIT(status))) continue;
+                for (int row = table_status_first(table, status); row >= 0; row = table_status_next(table, row)) {
+                    if (row_matches(query, row)) rows_out[count++] = row;
+                }
+            }
+            break;
+        case QUERY_BY_STARTED:
+            for (int i = started_first; i < started_first + started_count; i++) {
+                int row = table->by_started[i];
+                if (row_matches(query, row)) rows_out[count++] = row;
+            }
+            break;
+        case QUERY_SCAN:
+            for (int row = 0; row < table->rows; row++) {
+                if (row_matches(query, row)) rows_out[count++] = row;
+            }
+            break;
+    }
+
+    if (plan != QUERY_BY_NAME) qsort(rows_out, count, sizeof(int), compare_rows_by_name);
+    if (plan_out) *plan_out = plan;
+    return count;
+}
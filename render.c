@@ -0,0 +1,305 @@
+#include "func.h"
+#include <errno.h>
+
+// Bulk renderer for listings: rows are formatted into one large reusable
+// buffer and handed to the kernel with write(2) only when it fills up or
+// the listing ends, instead of one stdio call per field. Listings can be
+// rendered as an aligned table, JSON lines or CSV, and paged with an
+// offset and limit.
+
+#define RENDER_BUFFER_SIZE (256 * 1024)
+#define RENDER_FIELD_MAX 1024       // Longest text kept from one field
+#define RENDER_FIELD_RESERVE (RENDER_FIELD_MAX * 6 + 64)
+
+// Per thread, so daemon workers can each render a request with its own options
+__thread OutputOptions output_options = { OUTPUT_TABLE, 0, 0 };
+
+static __thread char* render_buffer = NULL;
+static __thread size_t render_length = 0;
+
+const char* output_format_to_string(OutputFormat format) {
+    switch (format) {
+        case OUTPUT_TABLE: return "table";
+        case OUTPUT_JSON: return "json";
+        case OUTPUT_CSV: return "csv";
+        default: return "unknown";
+    }
+}
+
+int output_format_from_string(const char* text, OutputFormat* format) {
+    for (int i = 0; i <= OUTPUT_CSV; i++) {
+        if (strcmp(text, output_format_to_string((OutputFormat)i)) == 0) {
+            *format = (OutputFormat)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Apply $SERVICE_OUTPUT_FORMAT, $SERVICE_OUTPUT_OFFSET and
+// $SERVICE_OUTPUT_LIMIT if set
+void output_configure_from_env() {
+    const char* format = getenv("SERVICE_OUTPUT_FORMAT");
+    const char* offset = getenv("SERVICE_OUTPUT_OFFSET");
+    const char* limit = getenv("SERVICE_OUTPUT_LIMIT");
+
+    if (format && output_format_from_string(format, &output_options.format) < 0) {
+        printf("Unknown output format '%s', using table.\n", format);
+    }
+    if (offset && atoi(offset) > 0) output_options.offset = atoi(offset);
+    if (limit && atoi(limit) > 0) output_options.limit = atoi(limit);
+}
+
+// Human-oriented text (titles, summaries) only belongs in table output
+int output_is_table() {
+    return output_options.format == OUTPUT_TABLE;
+}
+
+// Where progress and result messages go: stdout next to tables, stderr when
+// stdout carries JSON or CSV records
+FILE* output_message_stream() {
+    return output_is_table() ? stdout : stderr;
+}
+
+// Hand everything buffered so far to the kernel
+static void render_flush() {
+    size_t done = 0;
+
+    // A stdout without a descriptor (the daemon's per-request capture)
+    // takes the bytes through stdio
+    if (fileno(stdout) < 0) {
+        fwrite(render_buffer, 1, render_length, stdout);
+        render_length = 0;
+        return;
+    }
+
+    while (done < render_length) {
+        ssize_t written = write(STDOUT_FILENO, render_buffer + done, render_length - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        done += written;
+    }
+    render_length = 0;
+}
+
+// Make room for one field's worth of output
+static int render_reserve() {
+    if (render_buffer == NULL) {
+        render_buffer = (char*)malloc(RENDER_BUFFER_SIZE);
+        if (render_buffer == NULL) return -1;
+    }
+    if (render_length + RENDER_FIELD_RESERVE > RENDER_BUFFER_SIZE) render_flush();
+    return 0;
+}
+
+static void append(const char* text, size_t length) {
+    memcpy(render_buffer + render_length, text, length);
+    render_length += length;
+}
+
+static void append_padding(int count) {
+    if (count <= 0) return;
+    memset(render_buffer + render_length, ' ', count);
+    render_length += count;
+}
+
+// Start a listing with the current output_options. Anything printed with
+// stdio so far is flushed first so the two streams stay in order.
+void render_begin(Renderer* renderer, const RenderColumn* columns, int column_count) {
+    memset(renderer, 0, sizeof(*renderer));
+    renderer->options = output_options;
+    renderer->columns = columns;
+    renderer->column_count = column_count;
+
+    fflush(stdout);
+    if (render_reserve() < 0) {
+        renderer->failed = 1;
+        printf("Memory allocation failed!\n");
+        return;
+    }
+
+    if (renderer->options.format == OUTPUT_JSON) return;
+
+    int total = 0;
+    for (int i = 0; i < column_count; i++) {
+        const char* title = renderer->options.format == OUTPUT_CSV ? columns[i].key : columns[i].title;
+        size_t length = strlen(title);
+        if (i > 0) append(renderer->options.format == OUTPUT_CSV ? "," : " ", 1);
+        append(title, length);
+        if (renderer->options.format == OUTPUT_TABLE && i < column_count - 1) {
+            append_padding(columns[i].width - (int)length);
+        }
+        total += columns[i].width + 1;
+    }
+    append("\n", 1);
+
+    if (renderer->options.format == OUTPUT_TABLE) {
+        if (total < 80) total = 80;
+        memset(render_buffer + render_length, '-', total);
+        render_length += total;
+        append("\n", 1);
+    }
+}
+
+// Offer the next row. Returns 1 if it falls inside the requested page and
+// should be rendered, 0 if it should be skipped.
+int render_row_begin(Renderer* renderer) {
+    int index = renderer->rows_seen++;
+
+    if (renderer->failed || index < renderer->options.offset) return 0;
+    if (renderer->options.limit > 0 && renderer->rows_shown >= renderer->options.limit) return 0;
+
+    renderer->rows_shown++;
+    renderer->field = 0;
+    if (renderer->options.format == OUTPUT_JSON) {
+        render_reserve();
+        append("{", 1);
+    }
+    return 1;
+}
+
+// Separator, key or padding ahead of the next field
+static void field_prefix(Renderer* renderer) {
+    render_reserve();
+    if (renderer->field > 0) {
+        append(renderer->options.format == OUTPUT_TABLE ? " " : ",", 1);
+    }
+    if (renderer->options.format == OUTPUT_JSON) {
+        const char* key = renderer->columns[renderer->field].key;
+        append("\"", 1);
+        append(key, strlen(key));
+        append("\":", 2);
+    }
+}
+
+// Pad a table field out to its column width
+static void field_suffix(Renderer* renderer, size_t length) {
+    if (renderer->options.format == OUTPUT_TABLE && renderer->field < renderer->column_count - 1) {
+        append_padding(renderer->columns[renderer->field].width - (int)length);
+    }
+    renderer->field++;
+}
+
+static void append_json_string(const char* text, size_t length) {
+    append("\"", 1);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            append(escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[8];
+            append(escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", c));
+        } else {
+            append((const char*)&c, 1);
+        }
+    }
+    append("\"", 1);
+}
+
+static void append_csv_string(const char* text, size_t length) {
+    if (strcspn(text, ",\"\n") >= length) {
+        append(text, length);
+        return;
+    }
+    append("\"", 1);
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '"') append("\"", 1);
+        append(&text[i], 1);
+    }
+    append("\"", 1);
+}
+
+void render_string(Renderer* renderer, const char* text) {
+    if (text == NULL) text = "";
+    size_t length = strnlen(text, RENDER_FIELD_MAX);
+
+    field_prefix(renderer);
+    switch (renderer->options.format) {
+        case OUTPUT_TABLE: append(text, length); break;
+        case OUTPUT_JSON: append_json_string(text, length); break;
+        case OUTPUT_CSV: append_csv_string(text, length); break;
+    }
+    field_suffix(renderer, length);
+}
+
+// Emit already-formatted number text, unquoted in JSON
+static void render_number_text(Renderer* renderer, const char* text, int length) {
+    field_prefix(renderer);
+    append(text, length);
+    field_suffix(renderer, length);
+}
+
+void render_int(Renderer* renderer, long long value) {
+    char text[32];
+    render_number_text(renderer, text, snprintf(text, sizeof(text), "%lld", value));
+}
+
+void render_double(Renderer* renderer, double value, int precision) {
+    char text[64];
+    render_number_text(renderer, text, snprintf(text, sizeof(text), "%.*f", precision, value));
+}
+
+// A missing value: "-" in a table, null in JSON, empty in CSV
+void render_missing(Renderer* renderer) {
+    switch (renderer->options.format) {
+        case OUTPUT_TABLE: render_number_text(renderer, "-", 1); break;
+        case OUTPUT_JSON: render_number_text(renderer, "null", 4); break;
+        case OUTPUT_CSV: render_number_text(renderer, "", 0); break;
+    }
+}
+
+// A timestamp: formatted in tables and CSV, seconds since the epoch in JSON
+void render_time(Renderer* renderer, time_t when) {
+    char text[64];
+
+    if (when == 0) {
+        render_missing(renderer);
+    } else if (renderer->options.format == OUTPUT_JSON) {
+        render_int(renderer, (long long)when);
+    } else {
+        render_string(renderer, format_timestamp(when, text, sizeof(text)));
+    }
+}
+
+// A byte count: scaled in tables, exact elsewhere
+void render_bytes(Renderer* renderer, uint64_t bytes) {
+    char text[32];
+
+    if (bytes == 0) {
+        render_missing(renderer);
+    } else if (renderer->options.format == OUTPUT_TABLE) {
+        render_string(renderer, format_bytes(bytes, text, sizeof(text)));
+    } else {
+        render_int(renderer, (long long)bytes);
+    }
+}
+
+void render_row_end(Renderer* renderer) {
+    render_reserve();
+    if (renderer->options.format == OUTPUT_JSON) append("}", 1);
+    append("\n", 1);
+}
+
+// Finish the listing and flush it. Table output notes the page shown when
+// only part of the listing was requested. Returns the rows offered.
+int render_end(Renderer* renderer) {
+    if (renderer->failed) return renderer->rows_seen;
+
+    if (renderer->options.format == OUTPUT_TABLE &&
+        (renderer->options.offset > 0 || renderer->options.limit > 0)) {
+        char note[128];
+        int first = renderer->rows_shown ? renderer->options.offset + 1 : 0;
+        render_reserve();
+        append(note, snprintf(note, sizeof(note), "(showing rows %d-%d of %d)\n",
+                              first, renderer->options.offset + renderer->rows_shown, renderer->rows_seen));
+    }
+    render_flush();
+    return renderer->rows_seen;
+}
+
+void render_free() {
+    free(render_buffer);
+    render_buffer = NULL;
+    render_length = 0;
+}
@@ -0,0 +1,506 @@
+#include "func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+// Resource sampler: resolves each unit's main PID from its cgroup and
+// samples CPU and memory use. On cgroup v2 hosts everything comes from the
+// unit's cgroup (cgroup.procs, cpu.stat, memory.current); otherwise CPU time
+// and RSS fall back to /proc/<pid>/stat of the main process. Files are
+// opened once per unit and re-read with pread, so a sample costs a few
+// reads rather than a round of open/read/close.
+//
+// A unit's cgroup is its ControlGroup property, read with one
+// `systemctl show` for all the units whose files are not open yet, outside
+// the service lock (see resource_lookup_cgroups()). Units
+// the command does not describe (no systemctl, fixtures) fall back to the
+// default location under system.slice.
+//
+// Each running unit keeps a few files open. The open file limit is left
+// alone unless $SERVICE_RAISE_NOFILE is set, which raises the soft limit to
+// the hard one; running out of descriptors is reported once.
+
+#define RESOURCE_MIN_INTERVAL 0.5   // Seconds between CPU% samples of a unit
+#define RESOURCE_READ_SIZE 4096
+#define RESOURCE_MAX_CANDIDATES 64  // cgroup.procs entries considered for the main PID
+#define RESOURCE_PATH_SIZE 768
+#define RESOURCE_LOOKUP_RETRY 10.0  // Seconds before a unit without a cgroup is looked up again
+
+ResourceSampler resource_sampler = { "", 0, NULL, 0 };
+
+// Prefix for /sys/fs/cgroup and /proc: $SERVICE_RESOURCE_ROOT, so a fixture
+// tree can stand in for the host, or "" for the real filesystem
+const char* resource_root() {
+    const char* root = getenv("SERVICE_RESOURCE_ROOT");
+    return root ? root : "";
+}
+
+static double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void close_fd(int* fd) {
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+}
+
+// Close a slot's cached files and forget its readings
+static void slot_reset(ResourceSlot* slot, uint32_t name_id) {
+    close_fd(&slot->procs_fd);
+    close_fd(&slot->cpu_fd);
+    close_fd(&slot->memory_fd);
+    close_fd(&slot->stat_fd);
+    slot->name_id = name_id;
+    slot->stat_pid = 0;
+    slot->cpu_usec = 0;
+    slot->sampled_at = 0;
+    slot->looked_up = 0;
+}
+
+// First use: pick up the root and, if asked to, make room for a few cached
+// files per unit
+static void sampler_configure(ResourceSampler* sampler) {
+    const char* raise = getenv("SERVICE_RAISE_NOFILE");
+    snprintf(sampler->root, sizeof(sampler->root), "%s", resource_root());
+
+    struct rlimit limit;
+    if (raise && *raise && strcmp(raise, "0") != 0 &&
+        getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        rlim_t previous = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            fprintf(stderr, "Raised the open file limit from %llu to %llu.\n",
+                    (unsigned long long)previous, (unsigned long long)limit.rlim_cur);
+        }
+    }
+    sampler->configured = 1;
+}
+
+// Make sure there is a slot for every table row
+static int sampler_reserve(ResourceSampler* sampler, int rows) {
+    if (rows <= sampler->capacity) return 0;
+
+    int new_capacity = sampler->capacity ? sampler->capacity : 256;
+    while (new_capacity < rows) new_capacity *= 2;
+
+    ResourceSlot* grown = (ResourceSlot*)realloc(sampler->slots, new_capacity * sizeof(ResourceSlot));
+    if (grown == NULL) return -1;
+
+    for (int i = sampler->capacity; i < new_capacity; i++) {
+        grown[i].procs_fd = grown[i].cpu_fd = grown[i].memory_fd = grown[i].stat_fd = -1;
+        slot_reset(&grown[i], STRING_ID_NONE);
+    }
+    sampler->slots = grown;
+    sampler->capacity = new_capacity;
+    return 0;
+}
+
+// Write the unit's default cgroup directory into path. Template instances
+// live in a per-template slice: getty@tty1 -> system-getty.slice/getty@tty1.service.
+static void default_cgroup_path(const ResourceSampler* sampler, const char* unit, char* path, size_t size) {
+    const char* at = strchr(unit, '@');
+    int used = snprintf(path, size, "%s/sys/fs/cgroup/system.slice/", sampler->root);
+
+    if (at != NULL && used > 0 && (size_t)used < size) {
+        // Dashes in the template name are escaped in the slice name
+        used += snprintf(path + used, size - used, "system-");
+        for (const char* c = unit; c < at && (size_t)used < size; c++) {
+            used += *c == '-' ? snprintf(path + used, size - used, "\\x2d")
+                              : snprintf(path + used, size - used, "%c", *c);
+        }
+        if ((size_t)used < size) used += snprintf(path + used, size - used, ".slice/");
+    }
+    if (used > 0 && (size_t)used < size) snprintf(path + used, size - used, "%s.service", unit);
+}
+
+// Re-read a cached file from the start; NUL-terminates buffer
+static ssize_t read_cached(int fd, char* buffer, size_t size) {
+    ssize_t got;
+    do {
+        got = pread(fd, buffer, size - 1, 0);
+    } while (got < 0 && errno == EINTR);
+
+    buffer[got > 0 ? got : 0] = '\0';
+    return got;
+}
+
+// Read /proc/<pid>/stat through fd and pick out the fields we use. The
+// command name may hold spaces, so fields are counted after its ')'.
+static int parse_proc_stat(int fd, int* ppid, uint64_t* cpu_ticks, uint64_t* rss_pages) {
+    char buffer[1024];
+    if (read_cached(fd, buffer, sizeof(buffer)) <= 0) return -1;
+
+    const char* cursor = strrchr(buffer, ')');
+    if (cursor == NULL) return -1;
+    cursor++;
+
+    // Field 3 (state) is token 0 here: ppid is 1, utime 11, stime 12, rss 21
+    uint64_t utime = 0, stime = 0, rss = 0;
+    long parent = 0;
+    for (int token = 0; token <= 21; token++) {
+        while (*cursor == ' ') cursor++;
+        if (*cursor == '\0') return -1;
+
+        if (token == 1) parent = strtol(cursor, NULL, 10);
+        else if (token == 11) utime = strtoull(cursor, NULL, 10);
+        else if (token == 12) stime = strtoull(cursor, NULL, 10);
+        else if (token == 21) rss = strtoull(cursor, NULL, 10);
+        while (*cursor != ' ' && *cursor != '\0') cursor++;
+    }
+
+    if (ppid) *ppid = (int)parent;
+    if (cpu_ticks) *cpu_ticks = utime + stime;
+    if (rss_pages) *rss_pages = rss;
+    return 0;
+}
+
+static int open_proc_stat(const ResourceSampler* sampler, int pid) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/proc/%d/stat", sampler->root, pid);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Parse cgroup.procs into pids. A partial last entry (output cut at the
+// buffer size) is dropped.
+static int parse_pids(char* buffer, ssize_t length, int* pids, int max) {
+    int count = 0;
+    char* cursor = buffer;
+    char* end = buffer + length;
+
+    while (cursor < end && count < max) {
+        char* newline = memchr(cursor, '\n', end - cursor);
+        if (newline == NULL && length == RESOURCE_READ_SIZE - 1) break;
+        int pid = atoi(cursor);
+        if (pid > 0) pids[count++] = pid;
+        cursor = newline ? newline + 1 : end;
+    }
+    return count;
+}
+
+// The main PID is the process in the cgroup whose parent is outside it:
+// the one systemd started. Keep the current one while it is still there.
+static int resolve_main_pid(const ResourceSampler* sampler, const int* pids, int count, int current) {
+    for (int i = 0; i < count; i++) {
+        if (pids[i] == current) return current;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int fd = open_proc_stat(sampler, pids[i]);
+        if (fd < 0) continue;
+
+        int ppid = 0;
+        int ok = parse_proc_stat(fd, &ppid, NULL, NULL) == 0;
+        close(fd);
+        if (!ok) continue;
+
+        int inside = 0;
+        for (int j = 0; j < count && !inside; j++) inside = pids[j] == ppid;
+        if (!inside) return pids[i];
+    }
+    return count > 0 ? pids[0] : 0;
+}
+
+// Fill paths[i] with the cgroup directory of units[i] from their
+// ControlGroup property, or "" for a unit that has none (not running).
+// Units the command does not describe get their default directory.
+static void resolve_cgroup_paths(const ResourceSampler* sampler, const char* const units[], int count,
+                                 char (*paths)[RESOURCE_PATH_SIZE]) {
+    char (*unit_names)[MAX_SERVICE_NAME + 16] = malloc(count * sizeof(*unit_names));
+    const char** args = (const char**)malloc((count + 5) * sizeof(char*));
+    const char** argv = (const char**)malloc((count + 8) * sizeof(char*));
+    char* described = (char*)calloc(count, 1);
+    ExecBuffer output = {0};
+
+    if (unit_names != NULL && args != NULL && argv != NULL && described != NULL) {
+        int arg_count = 0;
+        args[arg_count++] = "show";
+        args[arg_count++] = "-p";
+        args[arg_count++] = "Id,ControlGroup";
+        args[arg_count++] = "--";
+        for (int i = 0; i < count; i++) {
+            snprintf(unit_names[i], sizeof(unit_names[i]), "%s.service", units[i]);
+            args[arg_count++] = unit_names[i];
+        }
+        args[arg_count] = NULL;
+
+        if (source_command(0, argv, count + 8, args) >= 0 && exec_capture(argv, &output, COMMAND_TIMEOUT) == 0) {
+            // Blocks of Id= and ControlGroup= lines, Id first
+            int current = -1;
+            for (char* line = output.data; line != NULL && *line; ) {
+                char* newline = strchr(line, '\n');
+                if (newline) *newline = '\0';
+                if (strncmp(line, "Id=", 3) == 0) {
+                    current = -1;
+                    for (int i = 0; i < count && current < 0; i++) {
+                        if (strcmp(line + 3, unit_names[i]) == 0) current = i;
+                    }
+                } else if (strncmp(line, "ControlGroup=", 13) == 0 && current >= 0) {
+                    paths[current][0] = '\0';
+                    if (line[13] == '/') {
+                        snprintf(paths[current], RESOURCE_PATH_SIZE, "%s/sys/fs/cgroup%s", sampler->root, line + 13);
+                    }
+                    described[current] = 1;
+                }
+                line = newline ? newline + 1 : NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (described == NULL || !described[i]) default_cgroup_path(sampler, units[i], paths[i], RESOURCE_PATH_SIZE);
+    }
+    free(unit_names);
+    free(args);
+    free(argv);
+    free(described);
+    exec_buffer_free(&output);
+}
+
+// Open a file in the unit's cgroup directory, or -1 if it has none
+static int open_cgroup_file(const char* dir, const char* file) {
+    static int reported = 0;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE) && !reported) {
+        fprintf(stderr, "Out of file descriptors; some units are not sampled "
+                        "(set SERVICE_RAISE_NOFILE=1 to raise the limit).\n");
+        reported = 1;
+    }
+    return fd;
+}
+
+// Find "usage_usec N" in cpu.stat
+static int parse_cpu_usage(const char* buffer, uint64_t* usec) {
+    const char* field = strstr(buffer, "usage_usec ");
+    if (field == NULL) return -1;
+    *usec = strtoull(field + strlen("usage_usec "), NULL, 10);
+    return 0;
+}
+
+// Clear a row's readings, e.g. once its unit has stopped
+static void clear_row(ServiceTable* table, int row) {
+    table->pid[row] = 0;
+    table->cpu_percent[row] = -1.0f;
+    table->memory_bytes[row] = 0;
+}
+
+// Slot of a table row, reset if it last belonged to another unit. Rows
+// that are not sampled get NULL, with their readings cleared.
+static ResourceSlot* row_slot(ResourceSampler* sampler, ServiceTable* table, int row) {
+    if (!sampler->configured) sampler_configure(sampler);
+    if (table->status[row] == STATUS_NONE || sampler_reserve(sampler, table->rows) < 0) return NULL;
+
+    // Only system units are sampled; the cgroups of machine sources are
+    // inside their containers
+    if (table->source[row] != 0) {
+        clear_row(table, row);
+        return NULL;
+    }
+
+    ResourceSlot* slot = &sampler->slots[row];
+    if (slot->name_id != table->name_id[row]) slot_reset(slot, table->name_id[row]);
+    return slot;
+}
+
+// Open a slot's files in its unit's cgroup directory ("" if it has none)
+static void open_slot(ResourceSlot* slot, const char* dir) {
+    slot->procs_fd = *dir ? open_cgroup_file(dir, "cgroup.procs") : -1;
+    if (slot->procs_fd < 0) {
+        slot->looked_up = monotonic_seconds();
+        return;
+    }
+    slot->cpu_fd = open_cgroup_file(dir, "cpu.stat");
+    slot->memory_fd = open_cgroup_file(dir, "memory.current");
+}
+
+// Look up the cgroups of the units of rows[] and open their files
+static void open_slots(ResourceSampler* sampler, ServiceTable* table, const int* rows, int count) {
+    const char** units = (const char**)malloc(count * sizeof(char*));
+    char (*paths)[RESOURCE_PATH_SIZE] = malloc(count * sizeof(*paths));
+    if (units == NULL || paths == NULL) {
+        free(units);
+        free(paths);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) units[i] = string_pool_get(&service_names, table->name_id[rows[i]]);
+    resolve_cgroup_paths(sampler, units, count, paths);
+    for (int i = 0; i < count; i++) open_slot(&sampler->slots[rows[i]], paths[i]);
+    free(units);
+    free(paths);
+}
+
+// Resolve a row's main PID and refresh CPU% and memory from its open
+// files. A unit without a cgroup (not running) has its readings cleared.
+static void sample_slot(ResourceSampler* sampler, ResourceSlot* slot, ServiceTable* table, int row) {
+    if (slot->procs_fd < 0) {
+        clear_row(table, row);
+        return;
+    }
+
+    char buffer[RESOURCE_READ_SIZE];
+    int pids[RESOURCE_MAX_CANDIDATES];
+    ssize_t got = read_cached(slot->procs_fd, buffer, sizeof(buffer));
+    if (got < 0) {
+        // The cgroup was removed when the unit stopped
+        slot_reset(slot, slot->name_id);
+        clear_row(table, row);
+        return;
+    }
+
+    int count = parse_pids(buffer, got, pids, RESOURCE_MAX_CANDIDATES);
+    int pid = resolve_main_pid(sampler, pids, count, table->pid[row]);
+    table->pid[row] = pid;
+
+    // /proc/<pid>/stat is only needed where the cgroup lacks the v2 files
+    uint64_t cpu_ticks = 0, rss_pages = 0;
+    int have_stat = 0;
+    if (pid > 0 && (slot->cpu_fd < 0 || slot->memory_fd < 0)) {
+        if (slot->stat_pid != pid) {
+            close_fd(&slot->stat_fd);
+            slot->stat_fd = open_proc_stat(sampler, pid);
+            slot->stat_pid = pid;
+        }
+        have_stat = slot->stat_fd >= 0 &&
+                    parse_proc_stat(slot->stat_fd, NULL, &cpu_ticks, &rss_pages) == 0;
+    }
+
+    uint64_t memory = 0;
+    if (slot->memory_fd >= 0 && read_cached(slot->memory_fd, buffer, sizeof(buffer)) > 0) {
+        memory = strtoull(buffer, NULL, 10);
+    } else if (have_stat) {
+        memory = rss_pages * (uint64_t)sysconf(_SC_PAGESIZE);
+    }
+    table->memory_bytes[row] = memory;
+
+    // CPU time is cgroup-wide where cpu.stat exists, else the main process's
+    uint64_t usec = 0;
+    int have_cpu = slot->cpu_fd >= 0 && read_cached(slot->cpu_fd, buffer, sizeof(buffer)) > 0 &&
+                   parse_cpu_usage(buffer, &usec) == 0;
+    if (!have_cpu && have_stat) {
+        usec = cpu_ticks * 1000000ULL / (uint64_t)sysconf(_SC_CLK_TCK);
+        have_cpu = 1;
+    }
+    if (!have_cpu) {
+        table->cpu_percent[row] = -1.0f;
+        slot->sampled_at = 0;
+        return;
+    }
+
+    // CPU% is the usage delta over the wall-clock delta since the last
+    // sample; back-to-back samples keep the previous figure
+    double now = monotonic_seconds();
+    double elapsed = now - slot->sampled_at;
+    if (slot->sampled_at > 0 && elapsed < RESOURCE_MIN_INTERVAL) return;
+
+    if (slot->sampled_at > 0 && usec >= slot->cpu_usec) {
+        table->cpu_percent[row] = (float)((usec - slot->cpu_usec) / (elapsed * 1e6) * 100.0);
+    }
+    slot->cpu_usec = usec;
+    slot->sampled_at = now;
+}
+
+// Sample one table row, looking its cgroup up now if its files are not open
+void resource_sample_row(ResourceSampler* sampler, ServiceTable* table, int row) {
+    ResourceSlot* slot = row_slot(sampler, table, row);
+    if (slot == NULL) return;
+    if (slot->procs_fd < 0) open_slots(sampler, table, &row, 1);
+    sample_slot(sampler, slot, table, row);
+}
+
+// Sample every live row of the table from the files already open; units
+// still waiting for resource_lookup_cgroups() read as not running
+void resource_sample_all(ResourceSampler* sampler, ServiceTable* table) {
+    for (int row = 0; row < table->rows; row++) {
+        ResourceSlot* slot = row_slot(sampler, table, row);
+        if (slot != NULL) sample_slot(sampler, slot, table, row);
+    }
+}
+
+// Look up the cgroups of live units whose files are not open yet, with one
+// `systemctl show` run outside the service lock, then open and sample
+// them. A unit found without a cgroup is looked up again only after
+// RESOURCE_LOOKUP_RETRY seconds. Returns how many units were opened.
+int resource_lookup_cgroups(ResourceSampler* sampler, ServiceTable* table) {
+    service_lock();
+    double now = monotonic_seconds();
+    int capacity = table->rows > 0 ? table->rows : 1;
+    int* rows = (int*)malloc(capacity * sizeof(int));
+    char (*names)[MAX_SERVICE_NAME] = malloc(capacity * sizeof(*names));
+    int count = 0;
+
+    for (int row = 0; row < table->rows && rows != NULL && names != NULL; row++) {
+        // Stopped and failed units have no cgroup to find
+        ResourceSlot* slot = row_slot(sampler, table, row);
+        int running = table->status[row] == STATUS_RUNNING || table->status[row] == STATUS_ACTIVE;
+        if (slot != NULL && running && slot->procs_fd < 0 &&
+            (slot->looked_up == 0 || now - slot->looked_up >= RESOURCE_LOOKUP_RETRY)) {
+            snprintf(names[count], MAX_SERVICE_NAME, "%s", string_pool_get(&service_names, table->name_id[row]));
+            rows[count++] = row;
+        }
+    }
+    service_unlock();
+
+    const char** units = (const char**)malloc(capacity * sizeof(char*));
+    char (*paths)[RESOURCE_PATH_SIZE] = malloc(capacity * sizeof(*paths));
+    int opened = 0;
+    if (count > 0 && units != NULL && paths != NULL) {
+        for (int i = 0; i < count; i++) units[i] = names[i];
+        resolve_cgroup_paths(sampler, units, count, paths);
+
+        // Rows may have changed hands while the lock was released
+        service_lock();
+        for (int i = 0; i < count; i++) {
+            int row = rows[i];
+            const char* name = row < table->rows && table->status[row] != STATUS_NONE ?
+                               string_pool_get(&service_names, table->name_id[row]) : NULL;
+            ResourceSlot* slot = name && strcmp(name, names[i]) == 0 ? row_slot(sampler, table, row) : NULL;
+            if (slot == NULL || slot->procs_fd >= 0) continue;
+
+            open_slot(slot, paths[i]);
+            if (slot->procs_fd >= 0) {
+                sample_slot(sampler, slot, table, row);
+                opened++;
+            }
+        }
+        service_unlock();
+    }
+    free(rows);
+    free(names);
+    free(units);
+    free(paths);
+    return opened;
+}
+
+// Drop the cached files of a row whose unit has gone away
+void resource_release_row(ResourceSampler* sampler, int row) {
+    if (row < sampler->capacity) slot_reset(&sampler->slots[row], STRING_ID_NONE);
+}
+
+void resource_sampler_free(ResourceSampler* sampler) {
+    for (int i = 0; i < sampler->capacity; i++) slot_reset(&sampler->slots[i], STRING_ID_NONE);
+    free(sampler->slots);
+    memset(sampler, 0, sizeof(*sampler));
+}
+
+// Format a byte count for display ("-" when unknown)
+const char* format_bytes(uint64_t bytes, char* buffer, size_t size) {
+    static const char* units[] = { "B", "K", "M", "G", "T" };
+    double value = (double)bytes;
+    int unit = 0;
+
+    if (bytes == 0) {
+        snprintf(buffer, size, "-");
+        return buffer;
+    }
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buffer, size, unit == 0 ? "%.0f%s" : "%.1f%s", value, units[unit]);
+    return buffer;
+}
@@ -0,0 +1,139 @@
+#include "func.h"
+
+// Retry scheduler for failed services: a min-heap ordered by next retry
+// time, plus a set indexed by interned name id so each service is queued at
+// most once. Retry delays back off exponentially with random jitter.
+
+static void heap_swap(RetryScheduler* scheduler, int a, int b) {
+    FailedService* tmp = scheduler->heap[a];
+    scheduler->heap[a] = scheduler->heap[b];
+    scheduler->heap[b] = tmp;
+    scheduler->heap[a]->heap_pos = a;
+    scheduler->heap[b]->heap_pos = b;
+}
+
+static void sift_up(RetryScheduler* scheduler, int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (scheduler->heap[parent]->next_retry <= scheduler->heap[pos]->next_retry) break;
+        heap_swap(scheduler, pos, parent);
+        pos = parent;
+    }
+}
+
+static void sift_down(RetryScheduler* scheduler, int pos) {
+    for (;;) {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = left + 1;
+
+        if (left < scheduler->count &&
+            scheduler->heap[left]->next_retry < scheduler->heap[smallest]->next_retry) smallest = left;
+        if (right < scheduler->count &&
+            scheduler->heap[right]->next_retry < scheduler->heap[smallest]->next_retry) smallest = right;
+        if (smallest == pos) break;
+
+        heap_swap(scheduler, pos, smallest);
+        pos = smallest;
+    }
+}
+
+// Take the entry at pos out of the heap
+static void heap_remove_at(RetryScheduler* scheduler, int pos) {
+    int last = --scheduler->count;
+    if (pos != last) {
+        heap_swap(scheduler, pos, last);
+        sift_down(scheduler, pos);
+        sift_up(scheduler, pos);
+    }
+    scheduler->heap[last]->heap_pos = -1;
+}
+
+// Is this name id already queued?
+FailedService* scheduler_find(const RetryScheduler* scheduler, uint32_t name_id) {
+    if ((int)name_id >= scheduler->by_name_capacity) return NULL;
+    return scheduler->by_name[name_id];
+}
+
+// Queue an entry for entry->next_retry. Returns -1 on allocation failure.
+int scheduler_insert(RetryScheduler* scheduler, FailedService* entry) {
+    if ((int)entry->name_id >= scheduler->by_name_capacity) {
+        int new_capacity = scheduler->by_name_capacity ? scheduler->by_name_capacity : 256;
+        while ((int)entry->name_id >= new_capacity) new_capacity *= 2;
+
+        FailedService** grown = (FailedService**)realloc(scheduler->by_name,
+                                                         new_capacity * sizeof(FailedService*));
+        if (grown == NULL) return -1;
+        memset(grown + scheduler->by_name_capacity, 0,
+               (new_capacity - scheduler->by_name_capacity) * sizeof(FailedService*));
+        scheduler->by_name = grown;
+        scheduler->by_name_capacity = new_capacity;
+    }
+
+    if (scheduler->count == scheduler->capacity) {
+        int new_capacity = scheduler->capacity ? scheduler->capacity * 2 : 64;
+        FailedService** grown = (FailedService**)realloc(scheduler->heap,
+                                                         new_capacity * sizeof(FailedService*));
+        if (grown == NULL) return -1;
+        scheduler->heap = grown;
+        scheduler->capacity = new_capacity;
+    }
+
+    scheduler->by_name[entry->name_id] = entry;
+    entry->heap_pos = scheduler->count;
+    scheduler->heap[scheduler->count++] = entry;
+    sift_up(scheduler, entry->heap_pos);
+    return 0;
+}
+
+// Entry with the earliest retry time, or NULL if nothing is queued
+FailedService* scheduler_peek(const RetryScheduler* scheduler) {
+    return scheduler->count > 0 ? scheduler->heap[0] : NULL;
+}
+
+// Remove and return the earliest entry if it is due at now, else NULL.
+// The entry leaves both the heap and the dedup set.
+FailedService* scheduler_pop_due(RetryScheduler* scheduler, time_t now) {
+    FailedService* top = scheduler_peek(scheduler);
+    if (top == NULL || top->next_retry > now) return NULL;
+
+    heap_remove_at(scheduler, 0);
+    scheduler->by_name[top->name_id] = NULL;
+    return top;
+}
+
+// Remove a queued entry by name id and return it (NULL if it was not queued)
+FailedService* scheduler_remove(RetryScheduler* scheduler, uint32_t name_id) {
+    FailedService* entry = scheduler_find(scheduler, name_id);
+    if (entry == NULL) return NULL;
+
+    heap_remove_at(scheduler, entry->heap_pos);
+    scheduler->by_name[name_id] = NULL;
+    return entry;
+}
+
+// Delay before the next retry after failure_count failures: doubles from
+// FAILED_RETRY_BASE up to FAILED_RETRY_MAX, then +/-25% jitter so units
+// that failed together do not retry in lockstep
+time_t retry_backoff(int failure_count) {
+    static unsigned int seed = 0;
+    if (seed == 0) seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+    time_t delay = FAILED_RETRY_BASE;
+    for (int i = 1; i < failure_count && delay < FAILED_RETRY_MAX; i++) {
+        delay *= 2;
+    }
+    if (delay > FAILED_RETRY_MAX) delay = FAILED_RETRY_MAX;
+
+    time_t spread = delay / 2;
+    if (spread > 0) {
+        delay += (time_t)(rand_r(&seed) % (spread + 1)) - spread / 2;
+    }
+    return delay > 0 ? delay : 1;
+}
+
+// Release the scheduler arrays (entries themselves live in failed_pool)
+void scheduler_free(RetryScheduler* scheduler) {
+    free(scheduler->heap);
+    free(scheduler->by_name);
+    memset(scheduler, 0, sizeof(*scheduler));
+}
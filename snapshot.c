@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include "func.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Published snapshots of the service table. The table, its indexes and the
+// name pool are mutable and belong to whichever thread holds the service
+// write lock. After each batch of changes the writer copies what readers
+// need into an immutable snapshot and publishes it with one atomic pointer
+// swap. Readers pin the current snapshot without taking any lock and see a
+// consistent version for as long as they hold it, however long a refresh
+// runs in the meantime.
+//
+// Replaced snapshots are reclaimed with hazard pointers: each reader thread
+// owns a slot announcing the snapshot it has pinned, and a retired
+// snapshot is freed once no slot names it. Memory that snapshots point
+// into, such as the strings of released names, is handed to
+// snapshot_defer_free() and freed once every snapshot that could show it
+// has been.
+//
+// A background refresher thread runs the slow systemctl enumeration off
+// the thread serving commands and holds the write lock only while the
+// result is applied to the table.
+
+#define SNAPSHOT_MAX_READERS 64         // Reader threads that can hold a pin at once
+#define SNAPSHOT_CACHE_LINE 64
+
+// Per-thread announcement of the pinned snapshot, one cache line each so
+// readers never write to a line another reader uses
+typedef struct HazardSlot {
+    _Atomic(ServiceSnapshot*) pointer;
+    atomic_int claimed;
+} __attribute__((aligned(SNAPSHOT_CACHE_LINE))) HazardSlot;
+
+static _Atomic(ServiceSnapshot*) current_snapshot = NULL;
+static HazardSlot hazards[SNAPSHOT_MAX_READERS];
+
+// Writer side: retired snapshots waiting for their readers to move on
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static ServiceSnapshot* retired = NULL;
+static uint64_t published_version = 0;
+
+// Memory to free once no snapshot up to version can be read
+typedef struct DeferredFree {
+    void* memory;
+    uint64_t version;
+    struct DeferredFree* next;
+} DeferredFree;
+
+static DeferredFree* deferred = NULL;
+
+// Serializes everything that touches the mutable table; recursive so a
+// command holding it can call code that takes it again
+static pthread_mutex_t service_write_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// This thread's hazard slot and pin nesting
+static __thread int hazard_index = -1;
+static __thread int pin_depth = 0;
+static __thread ServiceSnapshot* pinned = NULL;
+
+static pthread_key_t hazard_key;
+static pthread_once_t hazard_key_once = PTHREAD_ONCE_INIT;
+
+void service_lock() {
+    pthread_mutex_lock(&service_write_lock);
+}
+
+void service_unlock() {
+    pthread_mutex_unlock(&service_write_lock);
+}
+
+// Give a thread's hazard slot back when the thread exits
+static void release_hazard_slot(void* slot) {
+    atomic_store(&((HazardSlot*)slot)->pointer, NULL);
+    atomic_store(&((HazardSlot*)slot)->claimed, 0);
+}
+
+static void create_hazard_key() {
+    pthread_key_create(&hazard_key, release_hazard_slot);
+}
+
+static int claim_hazard_slot() {
+    pthread_once(&hazard_key_once, create_hazard_key);
+
+    for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&hazards[i].claimed, &expected, 1)) {
+            hazard_index = i;
+            pthread_setspecific(hazard_key, &hazards[i]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Copy the live services into one allocation: entries in name order, entry
+// numbers grouped by status, and a hash table over the names
+static ServiceSnapshot* snapshot_build() {
+    index_sort(&service_index);
+    int count = service_index.count;
+    int slot_capacity = 16;
+    while (slot_capacity < count * 2) slot_capacity *= 2;
+
+    size_t size = sizeof(ServiceSnapshot) + count * sizeof(SnapshotEntry) +
+                  count * sizeof(int) + slot_capacity * sizeof(uint32_t);
+    ServiceSnapshot* snapshot = (ServiceSnapshot*)malloc(size);
+    if (snapshot == NULL) return NULL;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->count = count;
+    snapshot->built = time(NULL);
+    snapshot->entries = (SnapshotEntry*)(snapshot + 1);
+    snapshot->by_status = (int*)(snapshot->entries + count);
+    snapshot->slots = (uint32_t*)(snapshot->by_status + count);
+    snapshot->slot_mask = (unsigned int)slot_capacity - 1;
+    memset(snapshot->slots, 0, slot_capacity * sizeof(uint32_t));
+
+    for (int i = 0; i < count; i++) {
+        const Service* service = service_index.sorted[i];
+        int row = service->row;
+        SnapshotEntry* entry = &snapshot->entries[i];
+
+        // Names and descriptions are borrowed from their pools; one that is
+        // released goes through snapshot_defer_free(), which keeps it until
+        // no reader pins this version
+        entry->name = service->name;
+        entry->name_id = service_table.name_id[row];
+        entry->status = service_table.status[row];
+        entry->pid = service_table.pid[row];
+        entry->last_started = service_table.last_started[row];
+        entry->cpu_percent = service_table.cpu_percent[row];
+        entry->memory_bytes = service_table.memory_bytes[row];
+        entry->failures = service_table.failures[row];
+        entry->load_state = service_table.load_state[row];
+        entry->active_state = service_table.active_state[row];
+        entry->sub_state = service_table.sub_state[row];
+        entry->source = service_table.source[row];
+        entry->description = string_pool_get(&service_descriptions, service_table.description_id[row]);
+        snapshot->status_first[entry->status + 1]++;
+
+        unsigned int slot = hash_string(entry->name) & snapshot->slot_mask;
+        while (snapshot->slots[slot] != 0) slot = (slot + 1) & snapshot->slot_mask;
+        snapshot->slots[slot] = (uint32_t)i + 1;
+    }
+
+    // Counting sort by status keeps each group in name order
+    int next[STATUS_COUNT];
+    for (int status = 0; status < STATUS_COUNT; status++) {
+        snapshot->status_first[status + 1] += snapshot->status_first[status];
+        next[status] = snapshot->status_first[status];
+    }
+    for (int i = 0; i < count; i++) {
+        snapshot->by_status[next[snapshot->entries[i].status]++] = i;
+    }
+    return snapshot;
+}
+
+// Free every retired snapshot that no reader has pinned. Called with
+// publish_lock held.
+static void reclaim_retired() {
+    ServiceSnapshot* in_use[SNAPSHOT_MAX_READERS];
+    int in_use_count = 0;
+
+    for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+        ServiceSnapshot* pointer = atomic_load(&hazards[i].pointer);
+        if (pointer != NULL) in_use[in_use_count++] = pointer;
+    }
+
+    ServiceSnapshot** link = &retired;
+    while (*link != NULL) {
+        ServiceSnapshot* snapshot = *link;
+        int held = 0;
+        for (int i = 0; i < in_use_count && !held; i++) held = in_use[i] == snapshot;
+
+        if (held) {
+            link = &snapshot->retired_next;
+        } else {
+            *link = snapshot->retired_next;
+            free(snapshot);
+        }
+    }
+
+    // Deferred memory goes once the oldest snapshot still readable is newer
+    ServiceSnapshot* current = atomic_load(&current_snapshot);
+    uint64_t oldest = current ? current->version : published_version + 1;
+    for (ServiceSnapshot* snapshot = retired; snapshot != NULL; snapshot = snapshot->retired_next) {
+        if (snapshot->version < oldest) oldest = snapshot->version;
+    }
+
+    DeferredFree** pending = &deferred;
+    while (*pending != NULL) {
+        DeferredFree* entry = *pending;
+        if (entry->version < oldest) {
+            *pending = entry->next;
+            free(entry->memory);
+            free(entry);
+        } else {
+            pending = &entry->next;
+        }
+    }
+}
+
+// Free memory that published snapshots may still point into, once the
+// snapshots that could show it are gone. The caller holds the service
+// write lock and has already unlinked the memory from the table.
+void snapshot_defer_free(void* memory) {
+    DeferredFree* entry = (DeferredFree*)malloc(sizeof(DeferredFree));
+    if (entry == NULL) return;     // Leaked rather than freed under a reader
+
+    pthread_mutex_lock(&publish_lock);
+    entry->memory = memory;
+    entry->version = published_version;
+    entry->next = deferred;
+    deferred = entry;
+    pthread_mutex_unlock(&publish_lock);
+}
+
+// Publish the current state of the table as a new snapshot. The caller
+// must hold the service write lock (or be the only thread). Returns 0, or
+// -1 if the snapshot could not be allocated; readers then keep the
+// previous version.
+int snapshot_publish() {
+    ServiceSnapshot* next = snapshot_build();
+    if (next == NULL) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&publish_lock);
+    next->version = ++published_version;
+    ServiceSnapshot* previous = atomic_exchange(&current_snapshot, next);
+    if (previous != NULL) {
+        previous->retired_next = retired;
+        retired = previous;
+    }
+    reclaim_retired();
+    pthread_mutex_unlock(&publish_lock);
+    return 0;
+}
+
+// Pin the current snapshot; it stays valid until snapshot_unpin(). Pins
+// nest within a thread and return the same snapshot. Returns NULL if no
+// snapshot has been published yet or every reader slot is taken.
+const ServiceSnapshot* snapshot_pin() {
+    if (pin_depth > 0) {
+        pin_depth++;
+        return pinned;
+    }
+    if (hazard_index < 0 && claim_hazard_slot() < 0) return NULL;
+
+    // Announce the pointer, then confirm it is still current; otherwise the
+    // writer may already have scanned the slots and freed it
+    HazardSlot* slot = &hazards[hazard_index];
+    ServiceSnapshot* snapshot;
+    do {
+        snapshot = atomic_load(&current_snapshot);
+        atomic_store(&slot->pointer, snapshot);
+    } while (snapshot != atomic_load(&current_snapshot));
+
+    if (snapshot != NULL) {
+        pin_depth = 1;
+        pinned = snapshot;
+    }
+    return snapshot;
+}
+
+void snapshot_unpin(const ServiceSnapshot* snapshot) {
+    if (snapshot == NULL || --pin_depth > 0) return;
+
+    atomic_store_explicit(&hazards[hazard_index].pointer, NULL, memory_order_release);
+    pinned = NULL;
+}
+
+// Find a service by exact name
+const SnapshotEntry* snapshot_find(const ServiceSnapshot* snapshot, const char* name) {
+    unsigned int slot = hash_string(name) & snapshot->slot_mask;
+
+    while (snapshot->slots[slot] != 0) {
+        const SnapshotEntry* entry = &snapshot->entries[snapshot->slots[slot] - 1];
+        if (strcmp(entry->name, name) == 0) return entry;
+        slot = (slot + 1) & snapshot->slot_mask;
+    }
+    return NULL;
+}
+
+// Entries whose names start with prefix: returns how many and sets *first
+// to where they begin in entries
+int snapshot_prefix_range(const ServiceSnapshot* snapshot, const char* prefix, int* first) {
+    size_t length = strlen(prefix);
+    int low = 0, high = snapshot->count;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(snapshot->entries[mid].name, prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *first = low;
+
+    // From there on, names sharing the prefix come first
+    high = snapshot->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strncmp(snapshot->entries[mid].name, prefix, length) == 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - *first;
+}
+
+// Entries with the given status, in name order: returns how many and sets
+// *entries to their entry numbers
+int snapshot_status_entries(const ServiceSnapshot* snapshot, ServiceStatus status, const int** entries) {
+    if ((unsigned int)status >= STATUS_COUNT) return 0;
+    *entries = snapshot->by_status + snapshot->status_first[status];
+    return snapshot->status_first[status + 1] - snapshot->status_first[status];
+}
+
+// Free the current and every retired snapshot; no reader may hold a pin
+void snapshot_free_all() {
+    pthread_mutex_lock(&publish_lock);
+    ServiceSnapshot* current = atomic_exchange(&current_snapshot, NULL);
+    if (current != NULL) {
+        current->retired_next = retired;
+        retired = current;
+    }
+    while (retired != NULL) {
+        ServiceSnapshot* next = retired->retired_next;
+        free(retired);
+        retired = next;
+    }
+    while (deferred != NULL) {
+        DeferredFree* next = deferred->next;
+        free(deferred->memory);
+        free(deferred);
+        deferred = next;
+    }
+    pthread_mutex_unlock(&publish_lock);
+}
+
+// Background refresher: a thread that refreshes the table whenever asked,
+// collecting the transitions until the owner takes them
+static pthread_t refresher_thread;
+static pthread_mutex_t refresher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresher_wake = PTHREAD_COND_INITIALIZER;
+static int refresher_running = 0;
+static int refresher_requested = 0;
+static int refresher_stopping = 0;
+static int refresher_notify_fd = -1;
+static ServiceChangeSet refresher_changes = {0};
+
+// Add a refresh's transitions to the pending set. Called with
+// refresher_lock held.
+static void keep_changes(ServiceChangeSet* changes) {
+    unsigned int failed_sources = refresher_changes.failed_sources | changes->failed_sources;
+
+    if (refresher_changes.count == 0) {
+        free_change_set(&refresher_changes);
+        changes->failed_sources = failed_sources;
+        refresher_changes = *changes;
+        memset(changes, 0, sizeof(*changes));
+        return;
+    }
+
+    refresher_changes.failed_sources = failed_sources;
+    int needed = refresher_changes.count + changes->count;
+    if (needed > refresher_changes.capacity) {
+        ServiceChange* grown = (ServiceChange*)realloc(refresher_changes.changes, needed * sizeof(ServiceChange));
+        if (grown == NULL) return;
+        refresher_changes.changes = grown;
+        refresher_changes.capacity = needed;
+    }
+    memcpy(refresher_changes.changes + refresher_changes.count, changes->changes,
+           changes->count * sizeof(ServiceChange));
+    refresher_changes.count = needed;
+}
+
+static void* refresher_main(void* argument) {
+    (void)argument;
+
+    pthread_mutex_lock(&refresher_lock);
+    for (;;) {
+        while (!refresher_requested && !refresher_stopping) {
+            pthread_cond_wait(&refresher_wake, &refresher_lock);
+        }
+        if (refresher_stopping) break;
+        refresher_requested = 0;
+        pthread_mutex_unlock(&refresher_lock);
+
+        // Requests arriving meanwhile are folded into one more pass
+        ServiceChangeSet changes = {0};
+        refresh_services_from_system(&changes);
+
+        pthread_mutex_lock(&refresher_lock);
+        keep_changes(&changes);
+        free_change_set(&changes);
+        if (refresher_notify_fd >= 0) {
+            uint64_t one = 1;
+            if (write(refresher_notify_fd, &one, sizeof(one)) < 0) {
+                // The counter is already non-zero; the owner will wake anyway
+            }
+        }
+    }
+    pthread_mutex_unlock(&refresher_lock);
+    return NULL;
+}
+
+// Start the refresher. notify_fd (an eventfd, or -1) is written after each
+// refresh. Returns 0, or -1 if the thread could not be started.
+int snapshot_refresher_start(int notify_fd) {
+    if (refresher_running) return 0;
+
+    refresher_notify_fd = notify_fd;
+    refresher_stopping = 0;
+    refresher_requested = 0;
+    if (pthread_create(&refresher_thread, NULL, refresher_main, NULL) != 0) {
+        printf("Failed to start the refresher thread.\n");
+        return -1;
+    }
+    refresher_running = 1;
+    return 0;
+}
+
+// Ask for a refresh; requests made while one is running coalesce
+void snapshot_refresher_request() {
+    pthread_mutex_lock(&refresher_lock);
+    refresher_requested = 1;
+    pthread_cond_signal(&refresher_wake);
+    pthread_mutex_unlock(&refresher_lock);
+}
+
+// Move the transitions found since the last call into changes (which must
+// be empty). Returns how many there are.
+int snapshot_refresher_take(ServiceChangeSet* changes) {
+    pthread_mutex_lock(&refresher_lock);
+    *changes = refresher_changes;
+    memset(&refresher_changes, 0, sizeof(refresher_changes));
+    pthread_mutex_unlock(&refresher_lock);
+    return changes->count;
+}
+
+// Stop the refresher, waiting for a refresh in progress to finish
+void snapshot_refresher_stop() {
+    if (!refresher_running) return;
+
+    pthread_mutex_lock(&refresher_lock);
+    refresher_stopping = 1;
+    pthread_cond_signal(&refresher_wake);
+    pthread_mutex_unlock(&refresher_lock);
+
+    pthread_join(refresher_thread, NULL);
+    refresher_running = 0;
+    free_change_set(&refresher_changes);
+}
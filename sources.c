@@ -0,0 +1,166 @@
+#include "func.h"
+
+// Unit sources: the service managers units are enumerated from. The system
+// manager is always source 0 and its units keep their bare names; units of
+// every other source are named "<source>/<unit>" ("user/foo", "web1/nginx").
+// Unit names cannot contain '/', so that one name keys a unit by (source,
+// unit) everywhere a name is used: the table and index, snapshots, queries,
+// control and the failed queue.
+//
+// $SERVICE_SOURCES adds sources as a comma-separated list of:
+//
+//   user              the calling user's manager (systemctl --user)
+//   machine:NAME      a container's manager (systemctl -M NAME), source NAME
+//   NAME=COMMAND      a source NAME whose listing and control commands run
+//                     COMMAND in place of systemctl (for stand-in scripts)
+//
+// "system" may be listed too, and "system=COMMAND" replaces the system
+// manager's command. $SERVICE_SYSTEMCTL replaces systemctl for every source
+// without its own command.
+
+#define SOURCE_NAME_MAX 32
+#define SOURCE_COMMAND_MAX 256
+
+typedef struct UnitSource {
+    char name[SOURCE_NAME_MAX];
+    char command[SOURCE_COMMAND_MAX];   // "" = systemctl
+    const char* scope[2];               // Manager selection arguments
+    char machine[SOURCE_NAME_MAX];
+} UnitSource;
+
+static UnitSource sources[SOURCE_MAX] = { { "system", "", { NULL, NULL }, "" } };
+static int sources_configured = 0;
+static int source_total = 1;
+
+// Add or update the source described by spec. Returns 0, or -1 if the
+// spec is malformed or there are too many sources.
+static int add_source(const char* spec) {
+    UnitSource source;
+    const char* equals = strchr(spec, '=');
+    size_t name_length = equals ? (size_t)(equals - spec) : strlen(spec);
+
+    memset(&source, 0, sizeof(source));
+    if (strncmp(spec, "machine:", 8) == 0 && equals == NULL) {
+        snprintf(source.machine, sizeof(source.machine), "%s", spec + 8);
+        snprintf(source.name, sizeof(source.name), "%s", spec + 8);
+        source.scope[0] = "-M";
+    } else {
+        if (name_length == 0 || name_length >= SOURCE_NAME_MAX) return -1;
+        memcpy(source.name, spec, name_length);
+        source.name[name_length] = '\0';
+        if (equals) {
+            snprintf(source.command, sizeof(source.command), "%s", equals + 1);
+        } else if (strcmp(source.name, "user") == 0) {
+            source.scope[0] = "--user";
+        } else if (strcmp(source.name, "system") != 0) {
+            return -1;
+        }
+    }
+    if (source.name[0] == '\0' || strchr(source.name, '/') != NULL) return -1;
+
+    int id = source_find(source.name);
+    if (id < 0) {
+        if (source_total == SOURCE_MAX) return -1;
+        id = source_total++;
+    }
+    sources[id] = source;
+    if (source.scope[0] && source.scope[0][1] == 'M') sources[id].scope[1] = sources[id].machine;
+    return 0;
+}
+
+// Read $SERVICE_SOURCES; bad entries are reported and skipped
+void sources_configure_from_env() {
+    const char* text = getenv("SERVICE_SOURCES");
+    char list[1024];
+
+    sources_configured = 1;
+    if (text == NULL || *text == '\0') return;
+
+    snprintf(list, sizeof(list), "%s", text);
+    char* save;
+    for (char* spec = strtok_r(list, ",", &save); spec != NULL; spec = strtok_r(NULL, ",", &save)) {
+        if (add_source(spec) < 0) fprintf(stderr, "Ignoring unit source '%s'\n", spec);
+    }
+}
+
+static void ensure_configured() {
+    if (!sources_configured) sources_configure_from_env();
+}
+
+int source_count() {
+    ensure_configured();
+    return source_total;
+}
+
+const char* source_name(int source) {
+    ensure_configured();
+    return source >= 0 && source < source_total ? sources[source].name : "unknown";
+}
+
+// Source id for a source name, or -1
+int source_find(const char* name) {
+    ensure_configured();
+    for (int i = 0; i < source_total; i++) {
+        if (strcmp(sources[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Source of a unit name, with *unit set to the name within that source.
+// Returns -1 for a "<source>/" prefix that is not configured.
+int source_of_unit(const char* name, const char** unit) {
+    const char* slash = strchr(name, '/');
+
+    ensure_configured();
+    *unit = name;
+    if (slash == NULL) return 0;
+
+    for (int i = 1; i < source_total; i++) {
+        size_t length = strlen(sources[i].name);
+        if ((size_t)(slash - name) == length && strncmp(name, sources[i].name, length) == 0) {
+            *unit = slash + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Write the table name of a source's unit (length bytes, not necessarily
+// NUL-terminated) into out. Returns its length, or -1 if it does not fit.
+int source_qualify(int source, const char* unit, size_t length, char* out, size_t size) {
+    size_t prefix = source == 0 ? 0 : strlen(sources[source].name) + 1;
+
+    if (prefix + length + 1 > size) return -1;
+    if (prefix) {
+        memcpy(out, sources[source].name, prefix - 1);
+        out[prefix - 1] = '/';
+    }
+    memcpy(out + prefix, unit, length);
+    out[prefix + length] = '\0';
+    return (int)(prefix + length);
+}
+
+// Build the argv that runs systemctl against a source with the given
+// NULL-terminated arguments. Returns the argument count, or -1 if it does
+// not fit in max entries.
+int source_command(int source, const char** argv, int max, const char* const args[]) {
+    const char* systemctl = getenv("SERVICE_SYSTEMCTL");
+    int count = 0;
+
+    ensure_configured();
+    if (source < 0 || source >= source_total) return -1;
+
+    argv[count++] = sources[source].command[0] ? sources[source].command :
+                    systemctl && *systemctl ? systemctl : "systemctl";
+    for (int i = 0; i < 2 && sources[source].scope[i]; i++) {
+        if (count == max) return -1;
+        argv[count++] = sources[source].scope[i];
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        if (count == max) return -1;
+        argv[count++] = args[i];
+    }
+    if (count == max) return -1;
+    argv[count] = NULL;
+    return count;
+}
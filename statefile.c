@@ -0,0 +1,485 @@
+#include "func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Persisted state: the service table, in name order, and the failed queue
+// with its backoff are saved to a versioned binary file on exit and every
+// STATE_FILE_INTERVAL seconds while monitoring. The next launch maps the
+// file and rebuilds the table, index and queue from it without waiting
+// for systemctl, so the first query is answered at once. That state is
+// marked stale until a background refresh has reconciled it with the
+// system; the units it changed are reported then.
+//
+// The file is a fixed header followed by 8-byte aligned sections: source
+// names, service records, failed-queue records and a string area that the
+// records point into by offset. Everything is in host byte order; a file
+// with another magic, version or header size is ignored. It is written to
+// a temporary file and renamed into place, so readers never see half of
+// one.
+//
+// The path comes from $SERVICE_STATE_FILE ("" or "off" disables it) and
+// defaults to services.state in the journal directory.
+
+#define STATE_FILE_MAGIC "SVCSTATE"
+#define STATE_FILE_VERSION 1
+#define STATE_FILE_NAME "services.state"
+#define STATE_FILE_INTERVAL 60
+#define STATE_NO_STRING UINT32_MAX
+
+typedef struct StateFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(StateFileHeader) of the writer
+    int64_t written;
+    uint64_t file_size;
+    uint32_t source_count;
+    uint32_t service_count;
+    uint32_t failed_count;
+    uint32_t reserved;
+    uint64_t sources_offset;    // uint32_t string offsets, indexed by source id
+    uint64_t services_offset;   // StateServiceRecord, ordered by name
+    uint64_t failed_offset;     // StateFailedRecord
+    uint64_t strings_offset;    // NUL-terminated strings
+    uint64_t strings_size;
+} StateFileHeader;
+
+typedef struct StateServiceRecord {
+    uint32_t name;              // Offsets into the string area
+    uint32_t description;       // Or STATE_NO_STRING
+    int64_t last_started;
+    int32_t pid;
+    uint32_t failures;
+    uint8_t status;
+    uint8_t load_state;
+    uint8_t active_state;
+    uint8_t sub_state;
+    uint8_t unit_type;
+    uint8_t source;
+    uint8_t padding[2];
+} StateServiceRecord;
+
+typedef struct StateFailedRecord {
+    uint32_t name;
+    int32_t failure_count;
+    int64_t last_failure;
+    int64_t next_retry;
+} StateFailedRecord;
+
+// String area being built for a write
+typedef struct StateStrings {
+    char* data;
+    size_t length;
+    size_t capacity;
+} StateStrings;
+
+// Written under service_lock; stale_since is also read without it
+static _Atomic time_t stale_since = 0;  // Written time of the loaded state, 0 once reconciled
+static int state_known = 0;         // The table holds loaded or refreshed state worth saving
+static time_t last_checkpoint = 0;
+
+// One-shot background reconciliation started after a load
+static pthread_t reconcile_thread;
+static int reconcile_started = 0;   // Owned by the thread that started it
+static atomic_int reconcile_done = 0;
+static int reconcile_result = -1;
+static ServiceChangeSet reconcile_changes = {0};
+
+// Path of the state file, or NULL if persistence is disabled
+const char* state_file_path() {
+    static char path[4096];
+    const char* configured = getenv("SERVICE_STATE_FILE");
+
+    if (configured != NULL) {
+        return *configured && strcmp(configured, "off") != 0 ? configured : NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s", journal_directory(), STATE_FILE_NAME);
+    return path;
+}
+
+static size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+// Append str to the string area. Returns its offset, or STATE_NO_STRING.
+static uint32_t add_string(StateStrings* strings, const char* str) {
+    if (str == NULL) return STATE_NO_STRING;
+
+    size_t length = strlen(str) + 1;
+    if (strings->length + length >= STATE_NO_STRING) return STATE_NO_STRING;
+    if (strings->length + length > strings->capacity) {
+        size_t new_capacity = strings->capacity ? strings->capacity * 2 : 65536;
+        while (new_capacity < strings->length + length) new_capacity *= 2;
+        char* grown = (char*)realloc(strings->data, new_capacity);
+        if (grown == NULL) return STATE_NO_STRING;
+        strings->data = grown;
+        strings->capacity = new_capacity;
+    }
+    memcpy(strings->data + strings->length, str, length);
+    strings->length += length;
+    return (uint32_t)(strings->length - length);
+}
+
+static int write_all(int fd, const void* data, size_t length) {
+    const char* cursor = (const char*)data;
+    while (length > 0) {
+        ssize_t written = write(fd, cursor, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cursor += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Write every section at its offset, padding between them with zeros
+static int write_sections(int fd, const StateFileHeader* header, const uint32_t* sources,
+                          const StateServiceRecord* services, const StateFailedRecord* failed,
+                          const char* strings) {
+    static const char zeros[8] = {0};
+    const struct { uint64_t offset; const void* data; size_t length; } sections[] = {
+        { 0, header, sizeof(*header) },
+        { header->sources_offset, sources, header->source_count * sizeof(uint32_t) },
+        { header->services_offset, services, header->service_count * sizeof(StateServiceRecord) },
+        { header->failed_offset, failed, header->failed_count * sizeof(StateFailedRecord) },
+        { header->strings_offset, strings, header->strings_size },
+    };
+    uint64_t position = 0;
+
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (write_all(fd, zeros, sections[i].offset - position) < 0) return -1;
+        if (sections[i].length > 0 && write_all(fd, sections[i].data, sections[i].length) < 0) return -1;
+        position = sections[i].offset + sections[i].length;
+    }
+    return 0;
+}
+
+// Save the table and failed queue to path: copied out under the lock,
+// then written to a temporary file that is renamed over path. Returns 0,
+// or -1 on failure.
+int state_file_write(const char* path) {
+    StateFileHeader header;
+    StateStrings strings = {0};
+    uint32_t sources[SOURCE_MAX];
+    int result = -1;
+
+    service_lock();
+    index_sort(&service_index);
+    int service_count = service_index.count;
+    int failed_count = failed_scheduler.count;
+    StateServiceRecord* services = (StateServiceRecord*)calloc(service_count + 1, sizeof(StateServiceRecord));
+    StateFailedRecord* failed = (StateFailedRecord*)calloc(failed_count + 1, sizeof(StateFailedRecord));
+    uint32_t* description_offsets = (uint32_t*)malloc((service_descriptions.count + 1) * sizeof(uint32_t));
+    if (services == NULL || failed == NULL || description_offsets == NULL) {
+        service_unlock();
+        printf("Memory allocation failed!\n");
+        goto done;
+    }
+    memset(description_offsets, 0xff, (service_descriptions.count + 1) * sizeof(uint32_t));
+
+    for (int source = 0; source < source_count(); source++) {
+        sources[source] = add_string(&strings, source_name(source));
+    }
+
+    // Descriptions are shared by id, so each is stored once
+    for (int i = 0; i < service_count; i++) {
+        const Service* service = service_index.sorted[i];
+        int row = service->row;
+        uint32_t description_id = service_table.description_id[row];
+        StateServiceRecord* record = &services[i];
+
+        record->name = add_string(&strings, service->name);
+        if (description_id < (uint32_t)service_descriptions.count) {
+            if (description_offsets[description_id] == STATE_NO_STRING) {
+                description_offsets[description_id] =
+                    add_string(&strings, string_pool_get(&service_descriptions, description_id));
+            }
+            record->description = description_offsets[description_id];
+        } else {
+            record->description = STATE_NO_STRING;
+        }
+        record->last_started = service_table.last_started[row];
+        record->pid = service_table.pid[row];
+        record->failures = service_table.failures[row];
+        record->status = service_table.status[row];
+        record->load_state = service_table.load_state[row];
+        record->active_state = service_table.active_state[row];
+        record->sub_state = service_table.sub_state[row];
+        record->unit_type = service_table.unit_type[row];
+        record->source = service_table.source[row];
+    }
+
+    for (int i = 0; i < failed_count; i++) {
+        const FailedService* entry = failed_scheduler.heap[i];
+        failed[i].name = add_string(&strings, entry->name);
+        failed[i].failure_count = entry->failure_count;
+        failed[i].last_failure = entry->last_failure;
+        failed[i].next_retry = entry->next_retry;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_FILE_MAGIC, sizeof(header.magic));
+    header.version = STATE_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.written = time(NULL);
+    header.source_count = source_count();
+    header.service_count = service_count;
+    header.failed_count = failed_count;
+    service_unlock();
+
+    header.sources_offset = align8(sizeof(header));
+    header.services_offset = align8(header.sources_offset + header.source_count * sizeof(uint32_t));
+    header.failed_offset = align8(header.services_offset + header.service_count * sizeof(StateServiceRecord));
+    header.strings_offset = align8(header.failed_offset + header.failed_count * sizeof(StateFailedRecord));
+    header.strings_size = strings.length;
+    header.file_size = header.strings_offset + header.strings_size;
+
+    // The default directory is only created once something is saved there
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s", path);
+    char* slash = strrchr(temp_path, '/');
+    if (slash != NULL && slash != temp_path) {
+        *slash = '\0';
+        make_directories(temp_path);
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to write the state file");
+        goto done;
+    }
+    int failed_write = write_sections(fd, &header, sources, services, failed, strings.data) < 0 || fsync(fd) < 0;
+    failed_write |= close(fd) != 0;
+    if (failed_write || rename(temp_path, path) < 0) {
+        perror("Failed to write the state file");
+        unlink(temp_path);
+        goto done;
+    }
+    result = 0;
+
+done:
+    free(services);
+    free(failed);
+    free(description_offsets);
+    free(strings.data);
+    return result;
+}
+
+// Save the state if there is any worth saving and, unless force is set,
+// STATE_FILE_INTERVAL seconds have passed since the last save
+void state_file_checkpoint(int force) {
+    const char* path = state_file_path();
+    if (path == NULL) return;
+
+    time_t now = time(NULL);
+    service_lock();
+    int due = state_known && (force || now - last_checkpoint >= STATE_FILE_INTERVAL);
+    if (due) last_checkpoint = now;
+    service_unlock();
+
+    if (due) state_file_write(path);
+}
+
+// String at offset in the mapped string area, or NULL if it does not lie
+// wholly inside it
+static const char* mapped_string(const char* strings, uint64_t size, uint32_t offset) {
+    if (offset == STATE_NO_STRING || offset >= size) return NULL;
+    return memchr(strings + offset, '\0', size - offset) ? strings + offset : NULL;
+}
+
+static int header_valid(const StateFileHeader* header, uint64_t size) {
+    if (memcmp(header->magic, STATE_FILE_MAGIC, sizeof(header->magic)) != 0) return 0;
+    if (header->version != STATE_FILE_VERSION || header->header_size != sizeof(*header)) return 0;
+    if (header->file_size != size || header->source_count > SOURCE_MAX) return 0;
+
+    // Every section must be aligned and end inside the file
+    const uint64_t sections[][2] = {
+        { header->sources_offset, (uint64_t)header->source_count * sizeof(uint32_t) },
+        { header->services_offset, (uint64_t)header->service_count * sizeof(StateServiceRecord) },
+        { header->failed_offset, (uint64_t)header->failed_count * sizeof(StateFailedRecord) },
+        { header->strings_offset, header->strings_size },
+    };
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (sections[i][0] % 8 != 0 || sections[i][0] < sizeof(*header) ||
+            sections[i][0] > size || sections[i][1] > size - sections[i][0]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Rebuild the table, index and failed queue from a mapped state file.
+// Returns the number of services added.
+static int restore_state(const StateFileHeader* header, const char* base) {
+    const char* strings = base + header->strings_offset;
+    const uint32_t* source_names = (const uint32_t*)(base + header->sources_offset);
+    const StateServiceRecord* services = (const StateServiceRecord*)(base + header->services_offset);
+    const StateFailedRecord* failed = (const StateFailedRecord*)(base + header->failed_offset);
+    int source_ids[SOURCE_MAX];
+    int restored = 0;
+
+    // Source ids follow $SERVICE_SOURCES, which may have changed since the
+    // file was written; units of sources no longer configured are dropped
+    for (uint32_t i = 0; i < header->source_count; i++) {
+        const char* name = mapped_string(strings, header->strings_size, source_names[i]);
+        source_ids[i] = name ? source_find(name) : -1;
+    }
+
+    // Records are in name order, so the sorted index is appended to
+    for (uint32_t i = 0; i < header->service_count; i++) {
+        const StateServiceRecord* record = &services[i];
+        const char* name = mapped_string(strings, header->strings_size, record->name);
+        if (name == NULL || strlen(name) >= MAX_SERVICE_NAME || record->status >= STATUS_COUNT ||
+            record->source >= header->source_count || source_ids[record->source] < 0 ||
+            index_find(&service_index, name) != NULL) {
+            continue;
+        }
+
+        Service* service = add_service_to_list(name, (ServiceStatus)record->status, record->pid);
+        if (service == NULL) break;
+
+        const char* description = mapped_string(strings, header->strings_size, record->description);
+        UnitRecord unit = {0};
+        unit.type = record->unit_type < UNIT_TYPE_COUNT ? (UnitType)record->unit_type : UNIT_TYPE_SERVICE;
+        unit.load_state = record->load_state < UNIT_LOAD_COUNT ? (UnitLoadState)record->load_state : UNIT_LOAD_UNKNOWN;
+        unit.active_state = record->active_state < UNIT_ACTIVE_COUNT ?
+                            (UnitActiveState)record->active_state : UNIT_ACTIVE_UNKNOWN;
+        unit.sub_state = record->sub_state < UNIT_SUB_COUNT ? (UnitSubState)record->sub_state : UNIT_SUB_UNKNOWN;
+        set_service_unit_info(service, source_ids[record->source], &unit,
+                              description ? intern_string(&service_descriptions, description) : STRING_ID_NONE);
+        service_table.last_started[service->row] = (time_t)record->last_started;
+        service_table.failures[service->row] = record->failures;
+        restored++;
+    }
+    table_rebuild_started(&service_table);
+
+    for (uint32_t i = 0; i < header->failed_count && failed_scheduler.count < MAX_FAILED_QUEUE; i++) {
+        const char* name = mapped_string(strings, header->strings_size, failed[i].name);
+        uint32_t name_id = name ? intern_string(&service_names, name) : STRING_ID_NONE;
+        if (name_id == STRING_ID_NONE || scheduler_find(&failed_scheduler, name_id) != NULL) continue;
+
+        FailedService* entry = (FailedService*)pool_alloc(&failed_pool);
+        if (entry == NULL) break;
+        entry->name = string_pool_get(&service_names, name_id);
+        entry->name_id = name_id;
+        entry->failure_count = failed[i].failure_count;
+        entry->last_failure = (time_t)failed[i].last_failure;
+        entry->next_retry = (time_t)failed[i].next_retry;
+        if (scheduler_insert(&failed_scheduler, entry) < 0) {
+            pool_release(&failed_pool, entry);
+            break;
+        }
+        string_pool_retain(&service_names, name_id);
+    }
+    return restored;
+}
+
+// Map the state file at path and load it into an empty table, marking it
+// stale. Returns the number of services loaded, or -1 if there is no
+// usable state file.
+int state_file_load(const char* path) {
+    if (path == NULL) return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;  // Nothing saved yet
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(StateFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map the state file");
+        return -1;
+    }
+
+    const StateFileHeader* header = (const StateFileHeader*)map;
+    if (!header_valid(header, info.st_size)) {
+        printf("Ignoring state file %s: unknown format or version.\n", path);
+        munmap(map, info.st_size);
+        return -1;
+    }
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+    service_lock();
+    int restored = restore_state(header, (const char*)map);
+    stale_since = (time_t)header->written;
+    state_known = 1;
+    snapshot_publish();
+    service_unlock();
+
+    munmap(map, info.st_size);
+    return restored;
+}
+
+// Called under service_lock after every source has been listed
+void state_file_mark_fresh() {
+    stale_since = 0;
+    state_known = 1;
+}
+
+// When the state being served was saved, or 0 if it is current. Lock free,
+// so commands that read the snapshot never wait on a writer for it.
+time_t state_file_stale_since() {
+    return atomic_load(&stale_since);
+}
+
+static void* reconcile_main(void* argument) {
+    (void)argument;
+    reconcile_result = refresh_services_from_system(&reconcile_changes);
+    atomic_store(&reconcile_done, 1);
+    return NULL;
+}
+
+// Reconcile loaded state with the system on a background thread. If the
+// thread cannot be started the refresh runs here instead. Returns 0, or
+// -1 if that refresh failed.
+int state_file_reconcile_start() {
+    if (reconcile_started) return 0;
+
+    atomic_store(&reconcile_done, 0);
+    if (pthread_create(&reconcile_thread, NULL, reconcile_main, NULL) == 0) {
+        reconcile_started = 1;
+        return 0;
+    }
+    ServiceChangeSet changes = {0};
+    fprintf(output_message_stream(), "Failed to start the reconcile thread; refreshing now.\n");
+    int result = refresh_services_from_system(&changes);
+    report_failed_sources(output_message_stream(), changes.failed_sources);
+    free_change_set(&changes);
+    return result < 0 ? -1 : 0;
+}
+
+// Collect the background reconciliation, waiting for it if wait is set,
+// and report to out what it found. Returns 1 if it was collected, 0 if
+// none was started or it is still running.
+int state_file_reconcile_finish(FILE* out, int wait) {
+    if (!reconcile_started || (!wait && !atomic_load(&reconcile_done))) return 0;
+
+    pthread_join(reconcile_thread, NULL);
+    reconcile_started = 0;
+
+    report_failed_sources(out, reconcile_changes.failed_sources);
+    if (reconcile_result < 0) {
+        fprintf(out, "Could not reconcile the saved state with the system; it may be stale.\n");
+    } else {
+        fprintf(out, "Reconciled the saved state with the system: %d unit(s) changed.\n",
+                reconcile_changes.count);
+    }
+    for (int i = 0; i < reconcile_changes.count; i++) {
+        const ServiceChange* change = &reconcile_changes.changes[i];
+        fprintf(out, "  %-40s %-8s %s -> %s\n", change->name, change_kind_to_string(change->kind),
+                change->kind == CHANGE_ADDED ? "-" : status_to_string(change->old_status),
+                change->kind == CHANGE_REMOVED ? "-" : status_to_string(change->new_status));
+    }
+    free_change_set(&reconcile_changes);
+    return 1;
+}
@@ -0,0 +1,538 @@
+#include "func.h"
+#include <limits.h>
+
+// Columnar service table: one row per service with the hot fields stored
+// as separate arrays, and service names interned once in a string pool.
+// Pools whose strings come and go with the units (names, descriptions) are
+// reclaimable: holders count themselves, and a string nobody holds any
+// more is removed and its id reused, so template instances that come and
+// go do not grow the pool without bound.
+
+#define STRING_CHUNK_SIZE 65536
+
+// Arena chunk holding interned strings back to back
+typedef struct StringChunk {
+    struct StringChunk* next;
+    size_t used;
+    char data[];
+} StringChunk;
+
+// Copy length bytes of str into the pool's arena as a string; pointers stay valid until the pool is freed
+static char* arena_copy(StringPool* pool, const char* str, size_t length) {
+    StringChunk* chunk = (StringChunk*)pool->chunks;
+    size_t chunk_size = length + 1 > STRING_CHUNK_SIZE ? length + 1 : STRING_CHUNK_SIZE;
+
+    if (chunk == NULL || chunk->used + length + 1 > STRING_CHUNK_SIZE) {
+        chunk = (StringChunk*)malloc(sizeof(StringChunk) + chunk_size);
+        if (chunk == NULL) return NULL;
+        chunk->next = (StringChunk*)pool->chunks;
+        chunk->used = 0;
+        pool->chunks = chunk;
+    }
+
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+}
+
+#define STRING_SLOT_REMOVED UINT32_MAX
+
+// Rebuild the id hash slots at a new capacity, dropping removed slots
+static int string_pool_rehash(StringPool* pool, int new_capacity) {
+    uint32_t* slots = (uint32_t*)calloc(new_capacity, sizeof(uint32_t));
+    if (slots == NULL) return -1;
+
+    unsigned int mask = (unsigned int)new_capacity - 1;
+    for (int id = 0; id < pool->count; id++) {
+        if (pool->strings[id] == NULL) continue;
+        unsigned int slot = hash_string(pool->strings[id]) & mask;
+        while (slots[slot] != 0) slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t)id + 1;
+    }
+
+    free(pool->slots);
+    pool->slots = slots;
+    pool->slot_capacity = new_capacity;
+    pool->removed_slots = 0;
+    return 0;
+}
+
+// Grow the id arrays to hold at least one more string
+static int string_pool_grow(StringPool* pool) {
+    int new_capacity = pool->capacity ? pool->capacity * 2 : 256;
+    char** grown = (char**)realloc(pool->strings, new_capacity * sizeof(char*));
+    if (grown == NULL) return -1;
+    pool->strings = grown;
+
+    if (pool->reclaimable) {
+        uint32_t* refs = (uint32_t*)realloc(pool->refs, new_capacity * sizeof(uint32_t));
+        if (refs == NULL) return -1;
+        pool->refs = refs;
+        uint32_t* free_ids = (uint32_t*)realloc(pool->free_ids, new_capacity * sizeof(uint32_t));
+        if (free_ids == NULL) return -1;
+        pool->free_ids = free_ids;
+    }
+    pool->capacity = new_capacity;
+    return 0;
+}
+
+// Return the id of str, adding it to the pool if needed (STRING_ID_NONE on failure)
+uint32_t intern_string(StringPool* pool, const char* str) {
+    return intern_bytes(pool, str, strlen(str));
+}
+
+// intern_string() for the first length bytes of data, which need not be
+// NUL-terminated
+uint32_t intern_bytes(StringPool* pool, const char* data, size_t length) {
+    int live = pool->count - pool->free_count;
+    if ((live + 1) * 2 > pool->slot_capacity) {
+        int new_capacity = pool->slot_capacity ? pool->slot_capacity * 2 : 256;
+        if (string_pool_rehash(pool, new_capacity) < 0) return STRING_ID_NONE;
+    } else if ((live + pool->removed_slots + 1) * 2 > pool->slot_capacity) {
+        // Too many removed slots lengthen the probes; clear them out
+        if (string_pool_rehash(pool, pool->slot_capacity) < 0) return STRING_ID_NONE;
+    }
+
+    // Slots hold id + 1 so that 0 marks an empty slot
+    unsigned int mask = (unsigned int)pool->slot_capacity - 1;
+    unsigned int slot = hash_bytes(data, length) & mask;
+    int reuse = -1;
+    while (pool->slots[slot] != 0) {
+        if (pool->slots[slot] == STRING_SLOT_REMOVED) {
+            if (reuse < 0) reuse = (int)slot;
+        } else {
+            uint32_t id = pool->slots[slot] - 1;
+            if (strncmp(pool->strings[id], data, length) == 0 && pool->strings[id][length] == '\0') return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (pool->free_count == 0 && pool->count == pool->capacity && string_pool_grow(pool) < 0) {
+        return STRING_ID_NONE;
+    }
+
+    char* copy;
+    if (pool->reclaimable) {
+        copy = (char*)malloc(length + 1);
+        if (copy != NULL) {
+            memcpy(copy, data, length);
+            copy[length] = '\0';
+        }
+    } else {
+        copy = arena_copy(pool, data, length);
+    }
+    if (copy == NULL) return STRING_ID_NONE;
+
+    uint32_t id = pool->free_count > 0 ? pool->free_ids[--pool->free_count] : (uint32_t)pool->count++;
+    pool->strings[id] = copy;
+    if (pool->reclaimable) pool->refs[id] = 0;
+    if (reuse >= 0) {
+        slot = (unsigned int)reuse;
+        pool->removed_slots--;
+    }
+    pool->slots[slot] = id + 1;
+    return id;
+}
+
+// Id of an already interned string, or STRING_ID_NONE; never adds it
+uint32_t string_pool_find(const StringPool* pool, const char* str) {
+    if (pool->slot_capacity == 0) return STRING_ID_NONE;
+
+    size_t length = strlen(str);
+    unsigned int mask = (unsigned int)pool->slot_capacity - 1;
+    unsigned int slot = hash_bytes(str, length) & mask;
+    while (pool->slots[slot] != 0) {
+        uint32_t id = pool->slots[slot] - 1;
+        if (pool->slots[slot] != STRING_SLOT_REMOVED && strcmp(pool->strings[id], str) == 0) return id;
+        slot = (slot + 1) & mask;
+    }
+    return STRING_ID_NONE;
+}
+
+// Look up an interned string by id; NULL once it has been released
+const char* string_pool_get(const StringPool* pool, uint32_t id) {
+    return id < (uint32_t)pool->count ? pool->strings[id] : NULL;
+}
+
+// Count one more holder of id in a reclaimable pool
+void string_pool_retain(StringPool* pool, uint32_t id) {
+    if (pool->reclaimable && id < (uint32_t)pool->count && pool->strings[id] != NULL) pool->refs[id]++;
+}
+
+// Drop one holder of id. When the last one goes the string leaves the pool
+// and its id is reused by a later intern; the string itself is returned
+// for the caller to free once no reader can still see it. Returns NULL
+// while the string is still held.
+char* string_pool_release(StringPool* pool, uint32_t id) {
+    if (!pool->reclaimable || id >= (uint32_t)pool->count || pool->strings[id] == NULL) return NULL;
+    if (pool->refs[id] > 0 && --pool->refs[id] > 0) return NULL;
+
+    char* removed = pool->strings[id];
+    unsigned int mask = (unsigned int)pool->slot_capacity - 1;
+    unsigned int slot = hash_string(removed) & mask;
+    while (pool->slots[slot] != id + 1) slot = (slot + 1) & mask;
+    pool->slots[slot] = STRING_SLOT_REMOVED;
+    pool->removed_slots++;
+
+    pool->strings[id] = NULL;
+    pool->free_ids[pool->free_count++] = id;
+    return removed;
+}
+
+void string_pool_free(StringPool* pool) {
+    StringChunk* chunk = (StringChunk*)pool->chunks;
+    while (chunk != NULL) {
+        StringChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    if (pool->reclaimable) {
+        for (int id = 0; id < pool->count; id++) free(pool->strings[id]);
+    }
+    free(pool->strings);
+    free(pool->slots);
+    free(pool->refs);
+    free(pool->free_ids);
+
+    // Whether the pool reclaims strings is part of its definition, not its contents
+    int reclaimable = pool->reclaimable;
+    memset(pool, 0, sizeof(*pool));
+    pool->reclaimable = reclaimable;
+}
+
+// Grow every column to hold at least one more row
+static int table_grow(ServiceTable* table) {
+    int new_capacity = table->capacity ? table->capacity * 2 : 256;
+
+    uint32_t* name_id = (uint32_t*)realloc(table->name_id, new_capacity * sizeof(uint32_t));
+    if (name_id == NULL) return -1;
+    table->name_id = name_id;
+
+    uint8_t* status = (uint8_t*)realloc(table->status, new_capacity * sizeof(uint8_t));
+    if (status == NULL) return -1;
+    table->status = status;
+
+    int* pid = (int*)realloc(table->pid, new_capacity * sizeof(int));
+    if (pid == NULL) return -1;
+    table->pid = pid;
+
+    time_t* last_started = (time_t*)realloc(table->last_started, new_capacity * sizeof(time_t));
+    if (last_started == NULL) return -1;
+    table->last_started = last_started;
+
+    float* cpu_percent = (float*)realloc(table->cpu_percent, new_capacity * sizeof(float));
+    if (cpu_percent == NULL) return -1;
+    table->cpu_percent = cpu_percent;
+
+    uint64_t* memory_bytes = (uint64_t*)realloc(table->memory_bytes, new_capacity * sizeof(uint64_t));
+    if (memory_bytes == NULL) return -1;
+    table->memory_bytes = memory_bytes;
+
+    uint32_t* failures = (uint32_t*)realloc(table->failures, new_capacity * sizeof(uint32_t));
+    if (failures == NULL) return -1;
+    table->failures = failures;
+
+    uint8_t* load_state = (uint8_t*)realloc(table->load_state, new_capacity * sizeof(uint8_t));
+    if (load_state == NULL) return -1;
+    table->load_state = load_state;
+
+    uint8_t* active_state = (uint8_t*)realloc(table->active_state, new_capacity * sizeof(uint8_t));
+    if (active_state == NULL) return -1;
+    table->active_state = active_state;
+
+    uint8_t* sub_state = (uint8_t*)realloc(table->sub_state, new_capacity * sizeof(uint8_t));
+    if (sub_state == NULL) return -1;
+    table->sub_state = sub_state;
+
+    uint8_t* unit_type = (uint8_t*)realloc(table->unit_type, new_capacity * sizeof(uint8_t));
+    if (unit_type == NULL) return -1;
+    table->unit_type = unit_type;
+
+    uint8_t* source = (uint8_t*)realloc(table->source, new_capacity * sizeof(uint8_t));
+    if (source == NULL) return -1;
+    table->source = source;
+
+    uint32_t* description_id = (uint32_t*)realloc(table->description_id, new_capacity * sizeof(uint32_t));
+    if (description_id == NULL) return -1;
+    table->description_id = description_id;
+
+    int* status_next = (int*)realloc(table->status_next, new_capacity * sizeof(int));
+    if (status_next == NULL) return -1;
+    table->status_next = status_next;
+
+    int* status_prev = (int*)realloc(table->status_prev, new_capacity * sizeof(int));
+    if (status_prev == NULL) return -1;
+    table->status_prev = status_prev;
+
+    int* by_started = (int*)realloc(table->by_started, new_capacity * sizeof(int));
+    if (by_started == NULL) return -1;
+    table->by_started = by_started;
+
+    table->capacity = new_capacity;
+    return 0;
+}
+
+// Link a row at the head of its status's membership list
+static void status_link(ServiceTable* table, int row) {
+    int status = table->status[row];
+    int head = table->status_head[status];
+
+    table->status_prev[row] = 0;
+    table->status_next[row] = head;
+    if (head != 0) table->status_prev[head - 1] = row + 1;
+    table->status_head[status] = row + 1;
+    table->status_count[status]++;
+}
+
+static void status_unlink(ServiceTable* table, int row) {
+    int status = table->status[row];
+    int prev = table->status_prev[row], next = table->status_next[row];
+
+    if (prev != 0) {
+        table->status_next[prev - 1] = next;
+    } else {
+        table->status_head[status] = next;
+    }
+    if (next != 0) table->status_prev[next - 1] = prev;
+    table->status_count[status]--;
+}
+
+// Position of the first entry of by_started not ordered before (when, row)
+static int started_lower_bound(const ServiceTable* table, time_t when, int row) {
+    int low = 0, high = table->live;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        int other = table->by_started[mid];
+        time_t other_when = table->last_started[other];
+        if (other_when < when || (other_when == when && other < row)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Insert a row into by_started; table->live must not yet count it
+static void started_insert(ServiceTable* table, int row) {
+    int pos = started_lower_bound(table, table->last_started[row], row);
+    memmove(&table->by_started[pos + 1], &table->by_started[pos], (table->live - pos) * sizeof(int));
+    table->by_started[pos] = row;
+}
+
+// Remove a row from by_started; table->live must still count it
+static void started_remove(ServiceTable* table, int row) {
+    int pos = started_lower_bound(table, table->last_started[row], row);
+    if (pos < table->live && table->by_started[pos] == row) {
+        memmove(&table->by_started[pos], &table->by_started[pos + 1], (table->live - pos - 1) * sizeof(int));
+    }
+}
+
+// Add a row, reusing a vacated one if possible. Returns the row or -1.
+int table_add_row(ServiceTable* table, uint32_t name_id, ServiceStatus status,
+                  int pid, time_t last_started) {
+    int row;
+
+    if (table->free_count > 0) {
+        row = table->free_rows[--table->free_count];
+    } else {
+        if (table->rows == table->capacity && table_grow(table) < 0) return -1;
+        row = table->rows++;
+    }
+
+    table->name_id[row] = name_id;
+    table->status[row] = (uint8_t)status;
+    table->pid[row] = pid;
+    table->last_started[row] = last_started;
+    table->cpu_percent[row] = -1.0f;
+    table->memory_bytes[row] = 0;
+    table->failures[row] = status == STATUS_FAILED ? 1 : 0;
+    table->load_state[row] = UNIT_LOAD_UNKNOWN;
+    table->active_state[row] = UNIT_ACTIVE_UNKNOWN;
+    table->sub_state[row] = UNIT_SUB_UNKNOWN;
+    table->unit_type[row] = UNIT_TYPE_SERVICE;
+    table->source[row] = 0;
+    table->description_id[row] = STRING_ID_NONE;
+
+    status_link(table, row);
+    started_insert(table, row);
+    table->live++;
+    return row;
+}
+
+// Record the source, systemd states, type and description of a row's unit
+void table_set_unit_info(ServiceTable* table, int row, int source, const UnitRecord* unit, uint32_t description_id) {
+    table->source[row] = (uint8_t)source;
+    table->load_state[row] = (uint8_t)unit->load_state;
+    table->active_state[row] = (uint8_t)unit->active_state;
+    table->sub_state[row] = (uint8_t)unit->sub_state;
+    table->unit_type[row] = (uint8_t)unit->type;
+    table->description_id[row] = description_id;
+}
+
+// Vacate a row; its status becomes STATUS_NONE so scans skip it
+void table_remove_row(ServiceTable* table, int row) {
+    status_unlink(table, row);
+    started_remove(table, row);
+
+    if (table->free_count == table->free_capacity) {
+        int new_capacity = table->free_capacity ? table->free_capacity * 2 : 64;
+        int* grown = (int*)realloc(table->free_rows, new_capacity * sizeof(int));
+        if (grown == NULL) {
+            // Leave the row vacant without recycling it
+            table->status[row] = STATUS_NONE;
+            table->live--;
+            return;
+        }
+        table->free_rows = grown;
+        table->free_capacity = new_capacity;
+    }
+
+    table->status[row] = STATUS_NONE;
+    table->free_rows[table->free_count++] = row;
+    table->live--;
+}
+
+// Count rows with the given status from the maintained membership count
+int table_count_status(const ServiceTable* table, ServiceStatus status) {
+    return (unsigned int)status < STATUS_COUNT ? table->status_count[status] : 0;
+}
+
+// Change a row's status, moving it between membership lists. Entering
+// STATUS_FAILED counts as one more failure.
+void table_set_status(ServiceTable* table, int row, ServiceStatus status) {
+    if (table->status[row] == status) return;
+
+    status_unlink(table, row);
+    if (status == STATUS_FAILED) table->failures[row]++;
+    table->status[row] = (uint8_t)status;
+    status_link(table, row);
+}
+
+// Change a row's last started time, keeping by_started ordered
+void table_set_last_started(ServiceTable* table, int row, time_t when) {
+    if (table->last_started[row] == when) return;
+
+    started_remove(table, row);
+    table->live--;
+    table->last_started[row] = when;
+    started_insert(table, row);
+    table->live++;
+}
+
+static const ServiceTable* sort_table;
+
+static int compare_started(const void* a, const void* b) {
+    int row_a = *(const int*)a, row_b = *(const int*)b;
+    time_t when_a = sort_table->last_started[row_a], when_b = sort_table->last_started[row_b];
+    if (when_a != when_b) return when_a < when_b ? -1 : 1;
+    return (row_a > row_b) - (row_a < row_b);
+}
+
+// Re-sort by_started after last_started was written directly for many
+// rows at once, which is cheaper than moving each row into place
+void table_rebuild_started(ServiceTable* table) {
+    sort_table = table;
+    qsort(table->by_started, table->live, sizeof(int), compare_started);
+    sort_table = NULL;
+}
+
+// Walk the rows with a given status: first row, or -1 if there is none
+int table_status_first(const ServiceTable* table, ServiceStatus status) {
+    return (unsigned int)status < STATUS_COUNT ? table->status_head[status] - 1 : -1;
+}
+
+// Next row with the same status, or -1 at the end
+int table_status_next(const ServiceTable* table, int row) {
+    return table->status_next[row] - 1;
+}
+
+// Rows whose last started time is in [from, to]: returns how many and sets
+// *first to where they begin in by_started
+int table_started_range(const ServiceTable* table, time_t from, time_t to, int* first) {
+    int low = started_lower_bound(table, from, -1);
+    int high = started_lower_bound(table, to, INT_MAX);
+
+    *first = low;
+    return high > low ? high - low : 0;
+}
+
+void table_free(ServiceTable* table) {
+    free(table->name_id);
+    free(table->status);
+    free(table->pid);
+    free(table->last_started);
+    free(table->cpu_percent);
+    free(table->memory_bytes);
+    free(table->failures);
+    free(table->load_state);
+    free(table->active_state);
+    free(table->sub_state);
+    free(table->unit_type);
+    free(table->source);
+    free(table->description_id);
+    free(table->status_next);
+    free(table->status_prev);
+    free(table->by_started);
+    free(table->free_rows);
+    memset(table, 0, sizeof(*table));
+}
+
+// Format a timestamp for display only when it is actually printed
+const char* format_timestamp(time_t when, char* buffer, size_t size) {
+    if (when == 0) {
+        snprintf(buffer, size, "-");
+    } else {
+        struct tm local;
+        strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime_r(&when, &local));
+    }
+    return buffer;
+}
+
+// Field accessors for a Service handle
+ServiceStatus service_status(const Service* service) {
+    return (ServiceStatus)service_table.status[service->row];
+}
+
+// Entering and leaving FAILED also feed flap detection
+void set_service_status(Service* service, ServiceStatus status) {
+    ServiceStatus old_status = (ServiceStatus)service_table.status[service->row];
+    table_set_status(&service_table, service->row, status);
+
+    if (status == STATUS_FAILED && old_status != STATUS_FAILED) {
+        flap_record_failure(service_table.name_id[service->row], time(NULL));
+    } else if (old_status == STATUS_FAILED && status != STATUS_FAILED) {
+        flap_record_recovery(service_table.name_id[service->row], time(NULL));
+    }
+}
+
+int service_pid(const Service* service) {
+    return service_table.pid[service->row];
+}
+
+void set_service_pid(Service* service, int pid) {
+    service_table.pid[service->row] = pid;
+}
+
+time_t service_last_started(const Service* service) {
+    return service_table.last_started[service->row];
+}
+
+void set_service_last_started(Service* service, time_t when) {
+    table_set_last_started(&service_table, service->row, when);
+}
+
+float service_cpu_percent(const Service* service) {
+    return service_table.cpu_percent[service->row];
+}
+
+uint64_t service_memory_bytes(const Service* service) {
+    return service_table.memory_bytes[service->row];
+}
+
+uint32_t service_failures(const Service* service) {
+    return service_table.failures[service->row];
+}
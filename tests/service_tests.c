@@ -0,0 +1,695 @@
+#include "func.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Behaviour checks for the core modules, run by ctest. Each check runs in
+// its own process:
+//
+//   service_tests CHECK SERVICE_BENCH
+//
+// Listings come from `service_bench generate`, and systemctl is replaced
+// by stand-in scripts written to a scratch directory, selected through
+// $SERVICE_SYSTEMCTL and $SERVICE_SOURCES, or by a $SERVICE_DEPENDENCY_FIXTURE
+// file, so nothing touches the real service manager. Output produced by the code under test goes to
+// /dev/null; failed checks are reported on stderr.
+
+#define TEST_UNITS 2000             // More than a pipeline queue holds
+#define TEST_SEED "7"
+#define TEST_WAIT_SECONDS 30
+#define TEST_READERS 3
+#define TEST_PUBLISHES 200
+#define TEST_DESCRIPTION 128         // Longer than any generated description
+
+static int failures = 0;
+static const char* bench_path;
+static char scratch[256];
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+// ---- Fixtures and stand-ins ----
+
+// Generate count units with service_bench, sorted or shuffled. Returns 0,
+// or -1 if the generator failed.
+static int generate_listing(ExecBuffer* listing, int count, int shuffled) {
+    char units[16];
+    snprintf(units, sizeof(units), "%d", count);
+    const char* argv[] = { bench_path, "generate", units, shuffled ? "shuffled" : "sorted", TEST_SEED, NULL };
+
+    if (exec_capture(argv, listing, TEST_WAIT_SECONDS) != 0) {
+        fprintf(stderr, "Failed to generate a listing with %s\n", bench_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_file(const char* name, const char* data, size_t length) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", scratch, name);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return -1;
+    int failed = fwrite(data, 1, length, file) != length;
+    return fclose(file) != 0 || failed ? -1 : 0;
+}
+
+static void set_flag(const char* name, int set) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", scratch, name);
+    if (set) {
+        close(open(path, O_WRONLY | O_CREAT, 0644));
+    } else {
+        unlink(path);
+    }
+}
+
+// Write a stand-in systemctl named name: list-units prints name.list, or
+// fails while name.fail exists; every other call succeeds silently unless
+// name.refuse exists
+static int write_stand_in(const char* name) {
+    char script[1024], path[512];
+    int length = snprintf(script, sizeof(script),
+                          "#!/bin/sh\n"
+                          "case \"$1\" in\n"
+                          "  list-units) [ -e '%s/%s.fail' ] && exit 1; cat '%s/%s.list'; exit ;;\n"
+                          "esac\n"
+                          "[ ! -e '%s/%s.refuse' ]\n",
+                          scratch, name, scratch, name, scratch, name);
+    snprintf(path, sizeof(path), "%s/%s", scratch, name);
+    if (write_file(name, script, length) < 0 || chmod(path, 0755) != 0) return -1;
+    return write_file("empty.list", "", 0) < 0 ? -1 : 0;
+}
+
+// Scratch directory, stand-in environment and silenced stdout shared by
+// every check
+static int setup() {
+    const char* temp_dir = getenv("TMPDIR");
+    snprintf(scratch, sizeof(scratch), "%s/service_tests.XXXXXX", temp_dir && *temp_dir ? temp_dir : "/tmp");
+    if (mkdtemp(scratch) == NULL) {
+        perror("Failed to create scratch directory");
+        return -1;
+    }
+
+    char systemctl[512];
+    snprintf(systemctl, sizeof(systemctl), "%s/systemctl", scratch);
+    if (write_stand_in("systemctl") < 0 || write_file("systemctl.list", "", 0) < 0) {
+        perror("Failed to write stand-in systemctl");
+        return -1;
+    }
+    setenv("SERVICE_SYSTEMCTL", systemctl, 1);
+    setenv("SERVICE_SOURCES", "system", 0);
+    setenv("SERVICE_STATE_FILE", "off", 1);
+    setenv("SERVICE_RESOURCE_ROOT", scratch, 1);
+    unsetenv("SERVICE_DEPENDENCY_FIXTURE");
+    journal_disable(&service_journal);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("Failed to redirect output");
+        return -1;
+    }
+    close(null_fd);
+    return 0;
+}
+
+static void teardown() {
+    char command[600];
+    free_memory();
+    snprintf(command, sizeof(command), "rm -rf '%s'", scratch);
+    if (system(command) != 0) fprintf(stderr, "Failed to remove %s\n", scratch);
+}
+
+// Status the generator's state columns stand for, worked out separately
+// from the tokenizer's keyword tables
+static ServiceStatus expected_status(const char* active, const char* sub) {
+    if (strcmp(active, "active") == 0) return strcmp(sub, "running") == 0 ? STATUS_RUNNING : STATUS_ACTIVE;
+    if (strcmp(active, "failed") == 0) return STATUS_FAILED;
+    return STATUS_INACTIVE;
+}
+
+// Load a listing into the table as a refresh would, and publish it
+static void load_listing(const ExecBuffer* listing) {
+    ServiceChangeSet changes = {0};
+    service_lock();
+    reconcile_services(listing->data, listing->length, &changes);
+    snapshot_publish();
+    service_unlock();
+    free_change_set(&changes);
+}
+
+// ---- Checks ----
+
+static void check_tokenizer() {
+    ExecBuffer listing = {0};
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
+
+    // Every generated line comes back with the fields sscanf finds in it
+    if (generate_listing(&listing, TEST_UNITS, 1) < 0) {
+        failures++;
+        return;
+    }
+    const char* line = listing.data;
+    int count = 0;
+    unit_tokenizer_init(&tokenizer, listing.data, listing.length);
+    while (unit_tokenizer_next(&tokenizer, &unit)) {
+        char name[MAX_SERVICE_NAME], load[32], active[32], sub[32];
+        CHECK(sscanf(line, "%255s %31s %31s %31s", name, load, active, sub) == 4);
+        line = strchr(line, '\n') + 1;
+
+        *strstr(name, ".service") = '\0';
+        CHECK(unit.type == UNIT_TYPE_SERVICE);
+        CHECK(unit.name_length == strlen(name) && memcmp(unit.name, name, unit.name_length) == 0);
+        CHECK(strcmp(unit_load_state_to_string(unit.load_state), load) == 0);
+        CHECK(strcmp(unit_active_state_to_string(unit.active_state), active) == 0);
+        CHECK(strcmp(unit_sub_state_to_string(unit.sub_state), sub) == 0);
+        CHECK(unit.status == expected_status(active, sub));
+        CHECK(unit.description_length > 0 && memcmp(unit.description, "Synthetic unit ", 15) == 0);
+        count++;
+    }
+    CHECK(count == TEST_UNITS);
+    exec_buffer_free(&listing);
+
+    // Markers, other unit types, short lines, CRLF and a missing final newline
+    static const char edge[] =
+        "\xe2\x97\x8f db.service loaded failed failed  Database server  \n"
+        "* web.service loaded active running Web\r\n"
+        "timers.target loaded active active Timers\n"
+        "broken.service loaded\n"
+        "\n"
+        "tail.service not-found inactive dead";
+    unit_tokenizer_init(&tokenizer, edge, sizeof(edge) - 1);
+
+    CHECK(unit_tokenizer_next(&tokenizer, &unit));
+    CHECK(unit.name_length == 2 && memcmp(unit.name, "db", 2) == 0 && unit.status == STATUS_FAILED);
+    CHECK(unit.description_length == 15 && memcmp(unit.description, "Database server", 15) == 0);
+    CHECK(unit_tokenizer_next(&tokenizer, &unit));
+    CHECK(unit.name_length == 3 && memcmp(unit.name, "web", 3) == 0 && unit.status == STATUS_RUNNING);
+    CHECK(unit.description_length == 3);
+    CHECK(unit_tokenizer_next(&tokenizer, &unit));
+    CHECK(unit.type == UNIT_TYPE_TARGET && unit.name_length == 13);
+    CHECK(unit_tokenizer_next(&tokenizer, &unit));
+    CHECK(unit.name_length == 4 && memcmp(unit.name, "tail", 4) == 0);
+    CHECK(unit.load_state == UNIT_LOAD_NOT_FOUND && unit.status == STATUS_INACTIVE);
+    CHECK(unit.description_length == 0);
+    CHECK(!unit_tokenizer_next(&tokenizer, &unit));
+}
+
+typedef struct SnapshotReader {
+    const char* name;       // A service whose status the writer toggles
+    int count;              // Services every snapshot must hold
+    int checked;
+    int failed;
+} SnapshotReader;
+
+// Pin snapshots while the writer publishes: each must be complete, in name
+// order, and no older than the one before
+static void* snapshot_reader(void* argument) {
+    SnapshotReader* reader = (SnapshotReader*)argument;
+    uint64_t last_version = 0;
+
+    for (int round = 0; round < TEST_PUBLISHES * 4; round++) {
+        const ServiceSnapshot* snapshot = snapshot_pin();
+        if (snapshot == NULL || snapshot->count != reader->count || snapshot->version < last_version ||
+            snapshot_find(snapshot, reader->name) == NULL) {
+            reader->failed++;
+        } else {
+            last_version = snapshot->version;
+            for (int i = 1; i < snapshot->count; i += snapshot->count / 16 + 1) {
+                if (strcmp(snapshot->entries[i - 1].name, snapshot->entries[i].name) >= 0) reader->failed++;
+            }
+        }
+        snapshot_unpin(snapshot);
+        reader->checked++;
+    }
+    return NULL;
+}
+
+static void* pin_latest(void* argument) {
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    *(uint64_t*)argument = snapshot ? snapshot->version : 0;
+    snapshot_unpin(snapshot);
+    return NULL;
+}
+
+static void check_snapshot() {
+    ExecBuffer listing = {0};
+    if (generate_listing(&listing, TEST_UNITS, 1) < 0) {
+        failures++;
+        return;
+    }
+    load_listing(&listing);
+
+    // The published copy matches the listing, indexed by name and status
+    const ServiceSnapshot* pinned = snapshot_pin();
+    CHECK(pinned != NULL && pinned->count == TEST_UNITS);
+    if (pinned == NULL) return;
+
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
+    unit_tokenizer_init(&tokenizer, listing.data, listing.length);
+    while (unit_tokenizer_next(&tokenizer, &unit)) {
+        char name[MAX_SERVICE_NAME];
+        snprintf(name, sizeof(name), "%.*s", (int)unit.name_length, unit.name);
+        const SnapshotEntry* entry = snapshot_find(pinned, name);
+        CHECK(entry != NULL && entry->status == unit.status);
+    }
+    int grouped = 0;
+    for (int status = 0; status < STATUS_COUNT; status++) {
+        const int* entries;
+        int count = snapshot_status_entries(pinned, (ServiceStatus)status, &entries);
+        for (int i = 0; i < count; i++) CHECK(pinned->entries[entries[i]].status == status);
+        grouped += count;
+    }
+    CHECK(grouped == TEST_UNITS);
+    CHECK(snapshot_pin() == pinned);
+    snapshot_unpin(pinned);
+
+    // A pinned snapshot is unchanged by later publishes, which other
+    // threads see at once
+    const char* name = pinned->entries[0].name;
+    uint8_t old_status = pinned->entries[0].status;
+    uint64_t old_version = pinned->version, seen_version = 0;
+    pthread_t thread;
+
+    service_lock();
+    Service* service = index_find(&service_index, name);
+    set_service_status(service, old_status == STATUS_FAILED ? STATUS_RUNNING : STATUS_FAILED);
+    snapshot_publish();
+    service_unlock();
+
+    CHECK(pinned->entries[0].status == old_status && pinned->version == old_version);
+    CHECK(snapshot_find(pinned, name) == &pinned->entries[0]);
+    pthread_create(&thread, NULL, pin_latest, &seen_version);
+    pthread_join(thread, NULL);
+    CHECK(seen_version > old_version);
+    snapshot_unpin(pinned);
+
+    // Readers racing a writer only ever see whole snapshots
+    SnapshotReader readers[TEST_READERS];
+    pthread_t threads[TEST_READERS];
+    for (int i = 0; i < TEST_READERS; i++) {
+        readers[i] = (SnapshotReader){ name, TEST_UNITS, 0, 0 };
+        pthread_create(&threads[i], NULL, snapshot_reader, &readers[i]);
+    }
+    for (int i = 0; i < TEST_PUBLISHES; i++) {
+        service_lock();
+        set_service_status(service, i % 2 ? STATUS_FAILED : STATUS_RUNNING);
+        snapshot_publish();
+        service_unlock();
+    }
+    for (int i = 0; i < TEST_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(readers[i].checked == TEST_PUBLISHES * 4 && readers[i].failed == 0);
+    }
+    exec_buffer_free(&listing);
+}
+
+static void check_pipeline() {
+    ExecBuffer listing = {0};
+    PipelineQueueStats stats[3];
+
+    if (generate_listing(&listing, TEST_UNITS, 1) < 0 ||
+        write_file("systemctl.list", listing.data, listing.length) < 0) {
+        failures++;
+        return;
+    }
+    int failed_units = 0;
+    UnitTokenizer tokenizer;
+    UnitRecord unit;
+    unit_tokenizer_init(&tokenizer, listing.data, listing.length);
+    while (unit_tokenizer_next(&tokenizer, &unit)) failed_units += unit.status == STATUS_FAILED;
+
+    // One refresh of an empty table: a batch marker plus one change per
+    // unit, several times what a queue holds, through the detector to the
+    // sink, and every failed unit to the remediator. Restarts fail, so the
+    // failed units stay failed.
+    set_flag("systemctl.refuse", 1);
+    CHECK(pipeline_start() == 0);
+    pipeline_trigger();
+    int drained = 0;
+    for (int waited = 0; waited < TEST_WAIT_SECONDS * 100 && !drained; waited++) {
+        usleep(10000);
+        CHECK(pipeline_queue_stats(stats, 3) == 3);
+        drained = stats[0].pushed == TEST_UNITS + 1 && stats[2].pushed >= TEST_UNITS + 1 &&
+                  stats[0].depth == 0 && stats[2].depth == 0;
+    }
+    CHECK(drained);
+    CHECK(stats[0].pushed == TEST_UNITS + 1);
+    CHECK(stats[1].pushed == (unsigned long long)failed_units);
+    pipeline_stop();
+
+    CHECK(pipeline_queue_stats(stats, 3) == 3);
+    for (int i = 0; i < 3; i++) {
+        CHECK(stats[i].depth == 0);
+        CHECK(stats[i].max_depth > 0 && stats[i].max_depth <= stats[i].capacity);
+    }
+    CHECK(stats[0].pushed > (unsigned long long)stats[0].capacity);
+    CHECK(stats[2].pushed >= stats[0].pushed);
+    CHECK(service_table.live == TEST_UNITS);
+
+    // Starting again on a loaded table hands over the units already failed
+    CHECK(pipeline_start() == 0);
+    CHECK(pipeline_queue_stats(stats, 3) == 3);
+    CHECK(stats[0].pushed == 0 && stats[1].pushed == (unsigned long long)failed_units);
+    pipeline_stop();
+    exec_buffer_free(&listing);
+}
+
+static void check_breaker() {
+    const uint32_t id = 7;
+    const time_t start = 1000000;
+    FlapStatus status;
+    int first_hold;
+
+    flap_window = 100;
+    flap_threshold = 2;
+    flap_cooldown = 100;
+
+    CHECK(flap_status(id, start, &status) == 0);
+    flap_record_failure(id, start);
+    flap_status(id, start, &status);
+    CHECK(status.state == BREAKER_CLOSED && status.failures == 1);
+    flap_record_failure(id, start + 1);
+    flap_status(id, start + 1, &status);
+    CHECK(status.state == BREAKER_OPEN && status.half_open_at == start + 1 + flap_cooldown);
+
+    // Open: restarts are held, and the first hold is reported once
+    CHECK(flap_hold_restart(id, start + 2, &first_hold) > 0 && first_hold);
+    CHECK(flap_hold_restart(id, start + 3, &first_hold) > 0 && !first_hold);
+
+    // With the window no longer than the cooldown the failures have aged
+    // out by now, but only a trial may close the breaker
+    flap_status(id, start + 500, &status);
+    CHECK(status.state == BREAKER_HALF_OPEN && status.failures == 0);
+
+    // One trial at a time; a failed trial opens it again
+    CHECK(flap_hold_restart(id, start + 500, &first_hold) == 0);
+    CHECK(flap_hold_restart(id, start + 500, &first_hold) > 0);
+    flap_record_restart(id, 0, start + 501);
+    flap_status(id, start + 501, &status);
+    CHECK(status.state == BREAKER_OPEN);
+
+    // Any failure while half-open opens it, even with no trial running
+    flap_status(id, start + 700, &status);
+    CHECK(status.state == BREAKER_HALF_OPEN);
+    flap_record_failure(id, start + 700);
+    flap_status(id, start + 700, &status);
+    CHECK(status.state == BREAKER_OPEN);
+
+    // A successful trial closes it
+    CHECK(flap_hold_restart(id, start + 900, &first_hold) == 0);
+    flap_record_restart(id, 1, start + 901);
+    flap_status(id, start + 901, &status);
+    CHECK(status.state == BREAKER_CLOSED);
+
+    // So does the service recovering by itself, but only while half-open
+    flap_record_failure(id, start + 2000);
+    flap_record_failure(id, start + 2000);
+    flap_record_recovery(id, start + 2001);
+    flap_status(id, start + 2001, &status);
+    CHECK(status.state == BREAKER_OPEN);
+    flap_record_recovery(id, start + 2200);
+    flap_status(id, start + 2200, &status);
+    CHECK(status.state == BREAKER_CLOSED);
+
+    // A released trial lets the next restart through
+    flap_record_failure(id, start + 3000);
+    flap_record_failure(id, start + 3000);
+    CHECK(flap_hold_restart(id, start + 3200, &first_hold) == 0);
+    flap_release_trial(id);
+    CHECK(flap_hold_restart(id, start + 3200, &first_hold) == 0);
+}
+
+static void check_state_file() {
+    ExecBuffer listing = {0};
+    char path[512];
+    const char* failed[2] = { NULL, NULL };
+
+    if (generate_listing(&listing, TEST_UNITS, 0) < 0) {
+        failures++;
+        return;
+    }
+    load_listing(&listing);
+
+    // Queue two failed units, one of them twice
+    service_lock();
+    for (Service* service = service_list; service != NULL && failed[1] == NULL; service = service->next) {
+        if (service_status(service) != STATUS_FAILED) continue;
+        failed[failed[0] == NULL ? 0 : 1] = service->name;
+    }
+    CHECK(failed[1] != NULL);
+    if (failed[1] == NULL) {
+        service_unlock();
+        return;
+    }
+    CHECK(schedule_failed_service(failed[0]) == 1);
+    CHECK(schedule_failed_service(failed[1]) == 1);
+    CHECK(schedule_failed_service(failed[1]) == 0);
+    service_unlock();
+
+    // Keep what the snapshot says, write it out and start over
+    char (*names)[MAX_SERVICE_NAME] = malloc(TEST_UNITS * sizeof(*names));
+    char (*descriptions)[TEST_DESCRIPTION] = malloc(TEST_UNITS * sizeof(*descriptions));
+    SnapshotEntry* before = (SnapshotEntry*)malloc(TEST_UNITS * sizeof(SnapshotEntry));
+    char failed_names[2][MAX_SERVICE_NAME];
+    if (names == NULL || descriptions == NULL || before == NULL) {
+        free(names);
+        free(descriptions);
+        free(before);
+        failures++;
+        return;
+    }
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    for (int i = 0; i < snapshot->count; i++) {
+        before[i] = snapshot->entries[i];
+        snprintf(names[i], MAX_SERVICE_NAME, "%s", snapshot->entries[i].name);
+        snprintf(descriptions[i], TEST_DESCRIPTION, "%s", snapshot->entries[i].description ? snapshot->entries[i].description : "");
+    }
+    snapshot_unpin(snapshot);
+    for (int i = 0; i < 2; i++) snprintf(failed_names[i], MAX_SERVICE_NAME, "%s", failed[i]);
+
+    snprintf(path, sizeof(path), "%s/services.state", scratch);
+    CHECK(state_file_write(path) == 0);
+    free_memory();
+    CHECK(service_table.live == 0);
+
+    CHECK(state_file_load(path) == TEST_UNITS);
+    CHECK(state_file_stale_since() > 0);
+    snapshot = snapshot_pin();
+    CHECK(snapshot != NULL && snapshot->count == TEST_UNITS);
+    for (int i = 0; snapshot != NULL && i < TEST_UNITS; i++) {
+        const SnapshotEntry* entry = snapshot_find(snapshot, names[i]);
+        CHECK(entry != NULL);
+        if (entry == NULL) continue;
+        CHECK(entry->status == before[i].status && entry->pid == before[i].pid);
+        CHECK(entry->last_started == before[i].last_started);
+        CHECK(entry->load_state == before[i].load_state && entry->sub_state == before[i].sub_state);
+        CHECK(entry->description != NULL && strcmp(entry->description, descriptions[i]) == 0);
+    }
+    snapshot_unpin(snapshot);
+
+    service_lock();
+    FailedService* first = scheduler_find(&failed_scheduler, string_pool_find(&service_names, failed_names[0]));
+    FailedService* second = scheduler_find(&failed_scheduler, string_pool_find(&service_names, failed_names[1]));
+    CHECK(first != NULL && first->failure_count == 1);
+    CHECK(second != NULL && second->failure_count == 2);
+    CHECK(failed_scheduler.count == 2);
+    service_unlock();
+
+    // A file that is not a state file is refused
+    CHECK(write_file("bogus.state", "not a state file", 16) == 0);
+    snprintf(path, sizeof(path), "%s/bogus.state", scratch);
+    free_memory();
+    CHECK(state_file_load(path) < 0);
+
+    free(names);
+    free(descriptions);
+    free(before);
+    exec_buffer_free(&listing);
+}
+
+// Refresh with changes collected, returning the result and the change count
+// of one kind
+static int refresh(ServiceChangeSet* changes, ChangeKind kind, int* of_kind) {
+    free_change_set(changes);
+    int result = refresh_services_from_system(changes);
+    *of_kind = 0;
+    for (int i = 0; i < changes->count; i++) *of_kind += changes->changes[i].kind == kind;
+    return result;
+}
+
+static int has_service(const char* name) {
+    const ServiceSnapshot* snapshot = snapshot_pin();
+    int found = snapshot != NULL && snapshot_find(snapshot, name) != NULL;
+    snapshot_unpin(snapshot);
+    return found;
+}
+
+static void check_source_sweep() {
+    ExecBuffer listing = {0};
+    ServiceChangeSet changes = {0};
+    static const char extra_full[] =
+        "a.service loaded active running A\n"
+        "b.service loaded failed failed B\n"
+        "c.service loaded inactive dead C\n";
+    static const char extra_short[] = "a.service loaded active running A\n";
+    int count;
+
+    // A second source answered by its own stand-in
+    char sources_spec[600];
+    snprintf(sources_spec, sizeof(sources_spec), "system,extra=%s/extra", scratch);
+    setenv("SERVICE_SOURCES", sources_spec, 1);
+    sources_configure_from_env();
+    CHECK(source_count() == 2);
+
+    if (write_stand_in("extra") < 0 || write_file("extra.list", extra_full, sizeof(extra_full) - 1) < 0 ||
+        generate_listing(&listing, 300, 0) < 0 ||
+        write_file("systemctl.list", listing.data, listing.length) < 0) {
+        failures++;
+        return;
+    }
+
+    CHECK(refresh(&changes, CHANGE_ADDED, &count) == 303);
+    CHECK(count == 303 && changes.failed_sources == 0);
+    CHECK(service_table.live == 303 && has_service("extra/b"));
+
+    // The system listing drops its last 50 units while extra cannot be
+    // listed: only the system units are swept
+    const char* cut = listing.data;
+    for (int i = 0; i < 250; i++) cut = strchr(cut, '\n') + 1;
+    char last_name[MAX_SERVICE_NAME];
+    CHECK(sscanf(cut, "%255s", last_name) == 1);
+    *strstr(last_name, ".service") = '\0';
+    CHECK(has_service(last_name));
+
+    CHECK(write_file("systemctl.list", listing.data, cut - listing.data) == 0);
+    set_flag("extra.fail", 1);
+    CHECK(refresh(&changes, CHANGE_REMOVED, &count) == 50);
+    CHECK(count == 50 && changes.failed_sources == 1u << 1);
+    CHECK(service_table.live == 253 && !has_service(last_name));
+    CHECK(has_service("extra/a") && has_service("extra/b") && has_service("extra/c"));
+
+    // Once extra answers again, what it no longer lists goes
+    set_flag("extra.fail", 0);
+    CHECK(write_file("extra.list", extra_short, sizeof(extra_short) - 1) == 0);
+    CHECK(refresh(&changes, CHANGE_REMOVED, &count) == 2);
+    CHECK(count == 2 && changes.failed_sources == 0);
+    CHECK(service_table.live == 251 && has_service("extra/a") && !has_service("extra/b"));
+
+    // With no source answering nothing is swept and the refresh fails
+    set_flag("systemctl.fail", 1);
+    set_flag("extra.fail", 1);
+    CHECK(refresh(&changes, CHANGE_REMOVED, &count) < 0);
+    CHECK(changes.failed_sources == 3u && service_table.live == 251);
+
+    free_change_set(&changes);
+    exec_buffer_free(&listing);
+}
+
+// Units a plan lists unit i as requiring, as a bit per plan index
+static unsigned int required_set(const DependencyPlan* plan, int i) {
+    unsigned int set = 0;
+    for (int r = plan->required_first[i]; r < plan->required_first[i + 1]; r++) set |= 1u << plan->required[r];
+    return set;
+}
+
+static void check_dependencies() {
+    // After= orders a unit after another; Requires= only lets a failed
+    // requirement cancel it. Non-service targets are not followed.
+    static const char fixture[] =
+        "Id=db.service\n"
+        "After=network.target\n"
+        "\n"
+        "Id=cache.service\n"
+        "After=db.service\n"
+        "\n"
+        "Id=web.service\n"
+        "Requires=db.service cache.service\n"
+        "After=cache.service\n"
+        "\n"
+        "Id=worker.service\n"
+        "Requires=db.service\n"
+        "\n"
+        "Id=loop1.service\n"
+        "After=loop2.service\n"
+        "\n"
+        "Id=loop2.service\n"
+        "Requires=db.service\n"
+        "After=loop1.service\n";
+    enum { DB, CACHE, WEB, WORKER, LOOP1, LOOP2, LONE, UNITS };
+    const char* names[UNITS] = { "db", "cache", "web", "worker", "loop1", "loop2", "lone" };
+    char path[512];
+    DependencyPlan plan;
+
+    CHECK(write_file("deps.fixture", fixture, sizeof(fixture) - 1) == 0);
+    snprintf(path, sizeof(path), "%s/deps.fixture", scratch);
+    setenv("SERVICE_DEPENDENCY_FIXTURE", path, 1);
+
+    CHECK(depgraph_plan(names, UNITS, &plan) == 0);
+    if (plan.wave == NULL) {
+        failures++;
+        return;
+    }
+
+    // The ordering chain takes three waves and the cycle one more after it
+    CHECK(plan.count == UNITS && plan.waves == 4);
+    CHECK(plan.wave[DB] == 0 && plan.wave[CACHE] == 1 && plan.wave[WEB] == 2);
+    CHECK(plan.wave[WORKER] == 0 && plan.wave[LONE] == 0);
+    CHECK(plan.wave[LOOP1] == 3 && plan.wave[LOOP2] == 3);
+
+    // Only Requires= edges are listed for cancellation
+    CHECK(required_set(&plan, WEB) == (1u << DB | 1u << CACHE));
+    CHECK(required_set(&plan, WORKER) == 1u << DB);
+    CHECK(required_set(&plan, LOOP2) == 1u << DB);
+    CHECK(required_set(&plan, DB) == 0 && required_set(&plan, CACHE) == 0);
+    CHECK(required_set(&plan, LOOP1) == 0 && required_set(&plan, LONE) == 0);
+    depgraph_plan_free(&plan);
+
+    // Edges to units outside the plan are dropped
+    const char* subset[2] = { "web", "worker" };
+    CHECK(depgraph_plan(subset, 2, &plan) == 0);
+    CHECK(plan.waves == 1 && plan.wave[0] == 0 && plan.wave[1] == 0);
+    CHECK(plan.required_first != NULL && plan.required_first[2] == 0);
+    depgraph_plan_free(&plan);
+    depgraph_free();
+}
+
+static const struct {
+    const char* name;
+    void (*run)();
+} checks[] = {
+    { "tokenizer", check_tokenizer },
+    { "snapshot", check_snapshot },
+    { "pipeline", check_pipeline },
+    { "breaker", check_breaker },
+    { "statefile", check_state_file },
+    { "sweep", check_source_sweep },
+    { "deps", check_dependencies },
+};
+
+#define CHECK_COUNT (int)(sizeof(checks) / sizeof(checks[0]))
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s CHECK SERVICE_BENCH\n", argv[0]);
+        return 2;
+    }
+    bench_path = argv[2];
+
+    for (int i = 0; i < CHECK_COUNT; i++) {
+        if (strcmp(argv[1], checks[i].name) != 0) continue;
+        if (setup() < 0) return 1;
+        checks[i].run();
+        teardown();
+        if (failures) fprintf(stderr, "%s: %d check(s) failed\n", checks[i].name, failures);
+        return failures ? 1 : 0;
+    }
+    fprintf(stderr, "Unknown check '%s'\n", argv[1]);
+    return 2;
+}
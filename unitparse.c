@@ -0,0 +1,270 @@
+#include "func.h"
+
+// Streaming tokenizer for `systemctl list-units` output. Records are cut
+// straight out of the listing buffer as (pointer, length) fields, with no
+// per-line or per-field copies, and the state columns are mapped to enums
+// through perfect-hash keyword tables.
+//
+// Each keyword table is laid out ahead of time: a keyword's slot is
+//
+//   (first byte * a + last byte * b + middle byte * c + length) & mask
+//
+// with a, b and c chosen (by an offline search) so that no two keywords
+// of the table share a slot. A lookup is one hash, one length check and
+// one memcmp; text that is not a keyword fails the comparison.
+
+typedef struct Keyword {
+    const char* text;
+    uint8_t length;
+    uint8_t value;          // The enum value it maps to
+    uint8_t status;         // Sub states: status when the active state does not decide
+} Keyword;
+
+typedef struct KeywordTable {
+    const Keyword* slots;
+    unsigned int mask;
+    unsigned int a, b, c;
+} KeywordTable;
+
+static const Keyword active_slots[16] = {
+    [3] = { "activating", 10, UNIT_ACTIVE_ACTIVATING, 0 },
+    [4] = { "reloading", 9, UNIT_ACTIVE_RELOADING, 0 },
+    [5] = { "refreshing", 10, UNIT_ACTIVE_REFRESHING, 0 },
+    [6] = { "failed", 6, UNIT_ACTIVE_FAILED, 0 },
+    [10] = { "maintenance", 11, UNIT_ACTIVE_MAINTENANCE, 0 },
+    [11] = { "deactivating", 12, UNIT_ACTIVE_DEACTIVATING, 0 },
+    [13] = { "active", 6, UNIT_ACTIVE_ACTIVE, 0 },
+    [15] = { "inactive", 8, UNIT_ACTIVE_INACTIVE, 0 },
+};
+static const KeywordTable active_keywords = { active_slots, 15, 2, 1, 0 };
+
+static const Keyword sub_slots[64] = {
+    [1] = { "failed-before-auto-restart", 26, UNIT_SUB_FAILED_BEFORE_AUTO_RESTART, STATUS_FAILED },
+    [2] = { "exited", 6, UNIT_SUB_EXITED, STATUS_STOPPED },
+    [3] = { "final-watchdog", 14, UNIT_SUB_FINAL_WATCHDOG, STATUS_INACTIVE },
+    [4] = { "cleaning", 8, UNIT_SUB_CLEANING, STATUS_INACTIVE },
+    [5] = { "waiting", 7, UNIT_SUB_WAITING, STATUS_INACTIVE },
+    [8] = { "condition", 9, UNIT_SUB_CONDITION, STATUS_INACTIVE },
+    [12] = { "final-sigterm", 13, UNIT_SUB_FINAL_SIGTERM, STATUS_INACTIVE },
+    [16] = { "start", 5, UNIT_SUB_START, STATUS_INACTIVE },
+    [18] = { "reload-notify", 13, UNIT_SUB_RELOAD_NOTIFY, STATUS_INACTIVE },
+    [19] = { "dead-resources-pinned", 21, UNIT_SUB_DEAD_RESOURCES_PINNED, STATUS_INACTIVE },
+    [22] = { "unmounting", 10, UNIT_SUB_UNMOUNTING, STATUS_INACTIVE },
+    [23] = { "elapsed", 7, UNIT_SUB_ELAPSED, STATUS_INACTIVE },
+    [24] = { "stop-post", 9, UNIT_SUB_STOP_POST, STATUS_INACTIVE },
+    [25] = { "start-post", 10, UNIT_SUB_START_POST, STATUS_INACTIVE },
+    [26] = { "listening", 9, UNIT_SUB_LISTENING, STATUS_INACTIVE },
+    [27] = { "start-pre", 9, UNIT_SUB_START_PRE, STATUS_INACTIVE },
+    [31] = { "active", 6, UNIT_SUB_ACTIVE, STATUS_ACTIVE },
+    [33] = { "mounted", 7, UNIT_SUB_MOUNTED, STATUS_INACTIVE },
+    [34] = { "tentative", 9, UNIT_SUB_TENTATIVE, STATUS_INACTIVE },
+    [35] = { "reload", 6, UNIT_SUB_RELOAD, STATUS_INACTIVE },
+    [36] = { "reload-signal", 13, UNIT_SUB_RELOAD_SIGNAL, STATUS_INACTIVE },
+    [37] = { "stop-sigterm", 12, UNIT_SUB_STOP_SIGTERM, STATUS_INACTIVE },
+    [38] = { "final-sigkill", 13, UNIT_SUB_FINAL_SIGKILL, STATUS_INACTIVE },
+    [42] = { "stop-watchdog", 13, UNIT_SUB_STOP_WATCHDOG, STATUS_INACTIVE },
+    [43] = { "dead-before-auto-restart", 24, UNIT_SUB_DEAD_BEFORE_AUTO_RESTART, STATUS_INACTIVE },
+    [46] = { "auto-restart-queued", 19, UNIT_SUB_AUTO_RESTART_QUEUED, STATUS_INACTIVE },
+    [49] = { "stop", 4, UNIT_SUB_STOP, STATUS_INACTIVE },
+    [50] = { "failed", 6, UNIT_SUB_FAILED, STATUS_FAILED },
+    [51] = { "auto-restart", 12, UNIT_SUB_AUTO_RESTART, STATUS_INACTIVE },
+    [53] = { "abandoned", 9, UNIT_SUB_ABANDONED, STATUS_INACTIVE },
+    [54] = { "mounting", 8, UNIT_SUB_MOUNTING, STATUS_INACTIVE },
+    [55] = { "dead", 4, UNIT_SUB_DEAD, STATUS_INACTIVE },
+    [59] = { "running", 7, UNIT_SUB_RUNNING, STATUS_RUNNING },
+    [60] = { "plugged", 7, UNIT_SUB_PLUGGED, STATUS_INACTIVE },
+    [63] = { "stop-sigkill", 12, UNIT_SUB_STOP_SIGKILL, STATUS_INACTIVE },
+};
+static const KeywordTable sub_keywords = { sub_slots, 63, 8, 38, 27 };
+
+static const Keyword load_slots[16] = {
+    [1] = { "merged", 6, UNIT_LOAD_MERGED, 0 },
+    [2] = { "bad-setting", 11, UNIT_LOAD_BAD_SETTING, 0 },
+    [7] = { "stub", 4, UNIT_LOAD_STUB, 0 },
+    [8] = { "error", 5, UNIT_LOAD_ERROR, 0 },
+    [9] = { "masked", 6, UNIT_LOAD_MASKED, 0 },
+    [14] = { "loaded", 6, UNIT_LOAD_LOADED, 0 },
+    [15] = { "not-found", 9, UNIT_LOAD_NOT_FOUND, 0 },
+};
+static const KeywordTable load_keywords = { load_slots, 15, 1, 1, 6 };
+
+static const Keyword type_slots[16] = {
+    [0] = { "socket", 6, UNIT_TYPE_SOCKET, 0 },
+    [1] = { "scope", 5, UNIT_TYPE_SCOPE, 0 },
+    [2] = { "target", 6, UNIT_TYPE_TARGET, 0 },
+    [4] = { "path", 4, UNIT_TYPE_PATH, 0 },
+    [5] = { "timer", 5, UNIT_TYPE_TIMER, 0 },
+    [7] = { "automount", 9, UNIT_TYPE_AUTOMOUNT, 0 },
+    [9] = { "slice", 5, UNIT_TYPE_SLICE, 0 },
+    [11] = { "mount", 5, UNIT_TYPE_MOUNT, 0 },
+    [12] = { "device", 6, UNIT_TYPE_DEVICE, 0 },
+    [14] = { "swap", 4, UNIT_TYPE_SWAP, 0 },
+    [15] = { "service", 7, UNIT_TYPE_SERVICE, 0 },
+};
+static const KeywordTable type_keywords = { type_slots, 15, 2, 2, 4 };
+
+static const char* const active_names[UNIT_ACTIVE_COUNT] = {
+    "unknown", "active", "reloading", "inactive", "failed", "activating", "deactivating",
+    "maintenance", "refreshing"
+};
+
+static const char* const sub_names[UNIT_SUB_COUNT] = {
+    "unknown", "dead", "condition", "start-pre", "start", "start-post", "running", "exited",
+    "reload", "reload-signal", "reload-notify", "stop", "stop-watchdog", "stop-sigterm",
+    "stop-sigkill", "stop-post", "final-watchdog", "final-sigterm", "final-sigkill", "failed",
+    "dead-before-auto-restart", "failed-before-auto-restart", "dead-resources-pinned",
+    "auto-restart", "auto-restart-queued", "cleaning", "listening", "waiting", "elapsed",
+    "mounted", "plugged", "active", "abandoned", "tentative", "mounting", "unmounting"
+};
+
+static const char* const load_names[UNIT_LOAD_COUNT] = {
+    "unknown", "loaded", "not-found", "bad-setting", "error", "masked", "merged", "stub"
+};
+
+static const char* const type_names[UNIT_TYPE_COUNT] = {
+    "unknown", "service", "socket", "target", "device", "mount", "automount", "swap", "timer",
+    "path", "slice", "scope"
+};
+
+// Leading marker systemctl puts on failed and not-found units ("●" in UTF-8)
+static const char unit_bullet[] = "\xe2\x97\x8f";
+
+const char* unit_active_state_to_string(UnitActiveState state) {
+    return (unsigned int)state < UNIT_ACTIVE_COUNT ? active_names[state] : "unknown";
+}
+
+const char* unit_sub_state_to_string(UnitSubState state) {
+    return (unsigned int)state < UNIT_SUB_COUNT ? sub_names[state] : "unknown";
+}
+
+const char* unit_load_state_to_string(UnitLoadState state) {
+    return (unsigned int)state < UNIT_LOAD_COUNT ? load_names[state] : "unknown";
+}
+
+const char* unit_type_to_string(UnitType type) {
+    return (unsigned int)type < UNIT_TYPE_COUNT ? type_names[type] : "unknown";
+}
+
+static const Keyword* keyword_find(const KeywordTable* table, const char* text, size_t length) {
+    if (length == 0 || length > UINT8_MAX) return NULL;
+
+    const unsigned char* bytes = (const unsigned char*)text;
+    unsigned int slot = (bytes[0] * table->a + bytes[length - 1] * table->b +
+                         bytes[length / 2] * table->c + (unsigned int)length) & table->mask;
+    const Keyword* keyword = &table->slots[slot];
+
+    return keyword->length == length && memcmp(keyword->text, text, length) == 0 ? keyword : NULL;
+}
+
+static inline int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Cut the next blank-separated field out of [*cursor, end)
+static int next_field(const char** cursor, const char* end, const char** field, size_t* length) {
+    const char* p = *cursor;
+    while (p < end && is_blank(*p)) p++;
+    if (p == end) return 0;
+
+    const char* start = p;
+    while (p < end && !is_blank(*p)) p++;
+    *field = start;
+    *length = (size_t)(p - start);
+    *cursor = p;
+    return 1;
+}
+
+// Status for a unit from its active and sub states, matching what
+// string_to_status() gives for the sub state when the active state is not
+// one of active, inactive or failed
+static ServiceStatus unit_status(UnitActiveState active, const Keyword* sub, const char* sub_text, size_t sub_length) {
+    switch (active) {
+        case UNIT_ACTIVE_ACTIVE:
+            return sub && sub->value == UNIT_SUB_RUNNING ? STATUS_RUNNING : STATUS_ACTIVE;
+        case UNIT_ACTIVE_INACTIVE:
+            return STATUS_INACTIVE;
+        case UNIT_ACTIVE_FAILED:
+            return STATUS_FAILED;
+        default:
+            break;
+    }
+    if (sub) return (ServiceStatus)sub->status;
+
+    // A sub state this build does not know: fall back to string matching
+    char text[64];
+    if (sub_length >= sizeof(text)) sub_length = sizeof(text) - 1;
+    memcpy(text, sub_text, sub_length);
+    text[sub_length] = '\0';
+    return string_to_status(text);
+}
+
+void unit_tokenizer_init(UnitTokenizer* tokenizer, const char* data, size_t length) {
+    tokenizer->cursor = data;
+    tokenizer->end = data + length;
+}
+
+// Read the next unit. Lines without the four UNIT LOAD ACTIVE SUB columns
+// are skipped. Returns 1 with *unit filled in (its text fields point into
+// the listing), or 0 at the end of the listing.
+int unit_tokenizer_next(UnitTokenizer* tokenizer, UnitRecord* unit) {
+    while (tokenizer->cursor < tokenizer->end) {
+        const char* line = tokenizer->cursor;
+        const char* newline = memchr(line, '\n', tokenizer->end - line);
+        const char* line_end = newline ? newline : tokenizer->end;
+        tokenizer->cursor = newline ? newline + 1 : tokenizer->end;
+
+        const char* cursor = line;
+        const char *name, *load, *active, *sub;
+        size_t name_length, load_length, active_length, sub_length;
+
+        if (!next_field(&cursor, line_end, &name, &name_length)) continue;
+        if ((name_length == sizeof(unit_bullet) - 1 && memcmp(name, unit_bullet, name_length) == 0) ||
+            (name_length == 1 && *name == '*')) {
+            if (!next_field(&cursor, line_end, &name, &name_length)) continue;
+        }
+        if (!next_field(&cursor, line_end, &load, &load_length) ||
+            !next_field(&cursor, line_end, &active, &active_length) ||
+            !next_field(&cursor, line_end, &sub, &sub_length)) {
+            continue;
+        }
+
+        // The unit type is the suffix after the last dot; services are
+        // known by their bare name
+        unit->type = UNIT_TYPE_UNKNOWN;
+        const char* dot = NULL;
+        for (const char* p = name + name_length; p > name; p--) {
+            if (p[-1] == '.') {
+                dot = p - 1;
+                break;
+            }
+        }
+        if (dot) {
+            const Keyword* type = keyword_find(&type_keywords, dot + 1, name + name_length - dot - 1);
+            if (type) {
+                unit->type = (UnitType)type->value;
+                if (unit->type == UNIT_TYPE_SERVICE) name_length = (size_t)(dot - name);
+            }
+        }
+        if (name_length == 0) continue;
+        if (name_length > MAX_SERVICE_NAME - 1) name_length = MAX_SERVICE_NAME - 1;
+
+        const Keyword* load_keyword = keyword_find(&load_keywords, load, load_length);
+        const Keyword* active_keyword = keyword_find(&active_keywords, active, active_length);
+        const Keyword* sub_keyword = keyword_find(&sub_keywords, sub, sub_length);
+
+        unit->name = name;
+        unit->name_length = name_length;
+        unit->load_state = load_keyword ? (UnitLoadState)load_keyword->value : UNIT_LOAD_UNKNOWN;
+        unit->active_state = active_keyword ? (UnitActiveState)active_keyword->value : UNIT_ACTIVE_UNKNOWN;
+        unit->sub_state = sub_keyword ? (UnitSubState)sub_keyword->value : UNIT_SUB_UNKNOWN;
+        unit->status = unit_status(unit->active_state, sub_keyword, sub, sub_length);
+
+        // The description is the rest of the line, trimmed
+        while (cursor < line_end && is_blank(*cursor)) cursor++;
+        while (line_end > cursor && is_blank(line_end[-1])) line_end--;
+        unit->description = cursor;
+        unit->description_length = (size_t)(line_end - cursor);
+        return 1;
+    }
+    return 0;
+}